@@ -7,11 +7,12 @@
  *		picohrdl driver API functions for the PicoLog ADC-20 and ADC-24 
  *		High Resolution Data Loggers.
  *
- *  There are five examples:
+ *  There are six examples:
  *		Collect a block of samples immediately
  *		Collect a block of samples when a trigger event occurs
  *		Use windowing to collect a sequence of overlapped blocks
  *		Write a continuous stream of data to a disk file
+ *		Stream with a sampling interval that follows the signals
  *		Take individual readings
  *
  *	To build this application:-
@@ -45,6 +46,8 @@
  *
  ******************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #ifdef WIN32
@@ -61,6 +64,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "libpicohrdl-1.0/HRDL.h"
 
@@ -223,6 +227,173 @@ float AdcToMv (HRDL_INPUTS channel, int32_t raw)
 	}
 
 }
+
+/****************************************************************************
+*
+* CSV writer
+*
+* The rows from each block of readings are assembled in a buffer which is
+* written to the file with a single call, and readings are converted to text with integer arithmetic
+* instead of fprintf. Each channel is printed with just enough decimal places
+* to tell adjacent ADC counts apart, which is the shortest text that still
+* identifies the original reading.
+*
+****************************************************************************/
+#define CSV_BUFFER_SIZE	(256 * 1024)
+#define CSV_MAX_FIELD	32
+
+typedef struct tCsvWriter
+{
+	FILE *	fp;
+	char *	buffer;
+	size_t	length;
+} CSV_WRITER;
+
+typedef struct tCsvChannelFormat
+{
+	double	scale;			// Value of one ADC count multiplied by 10 ^ decimals
+	int16_t	decimals;
+} CSV_CHANNEL_FORMAT;
+
+int16_t CsvOpen (CSV_WRITER * writer, const char * fileName)
+{
+	writer->length = 0;
+	writer->buffer = (char *) malloc(CSV_BUFFER_SIZE);
+	fopen_s(&writer->fp, fileName, "w");
+
+	if (writer->buffer == NULL || writer->fp == NULL)
+	{
+		free(writer->buffer);
+		writer->buffer = NULL;
+
+		if (writer->fp != NULL)
+		{
+			fclose(writer->fp);
+			writer->fp = NULL;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+void CsvFlush (CSV_WRITER * writer)
+{
+	if (writer->length > 0)
+	{
+		fwrite(writer->buffer, 1, writer->length, writer->fp);
+		writer->length = 0;
+	}
+}
+
+void CsvClose (CSV_WRITER * writer)
+{
+	CsvFlush(writer);
+	fclose(writer->fp);
+	free(writer->buffer);
+	writer->fp = NULL;
+	writer->buffer = NULL;
+}
+
+void CsvPutString (CSV_WRITER * writer, const char * text)
+{
+	size_t length = strlen(text);
+
+	if (writer->length + length > CSV_BUFFER_SIZE)
+	{
+		CsvFlush(writer);
+	}
+
+	memcpy(&writer->buffer[writer->length], text, length);
+	writer->length += length;
+}
+
+// Writes value / 10 ^ decimals followed by a comma
+void CsvPutFixed (CSV_WRITER * writer, int64_t value, int16_t decimals)
+{
+	char digits[CSV_MAX_FIELD];
+	char * p;
+	int16_t count = 0;
+	uint64_t magnitude = (value < 0) ? (uint64_t) -value : (uint64_t) value;
+
+	if (writer->length + CSV_MAX_FIELD > CSV_BUFFER_SIZE)
+	{
+		CsvFlush(writer);
+	}
+
+	do
+	{
+		digits[count++] = (char) ('0' + magnitude % 10);
+		magnitude /= 10;
+	}
+	while (magnitude != 0 || count <= decimals);
+
+	p = &writer->buffer[writer->length];
+
+	if (value < 0)
+	{
+		*p++ = '-';
+	}
+
+	while (count > 0)
+	{
+		if (count == decimals)
+		{
+			*p++ = '.';
+		}
+
+		*p++ = digits[--count];
+	}
+
+	*p++ = ',';
+	writer->length = p - writer->buffer;
+}
+
+/****************************************************************************
+*
+* CsvSetChannelFormat
+*
+* Works out the scaling and number of decimal places for a channel once,
+* so that the driver does not need to be called for every reading
+*
+****************************************************************************/
+void CsvSetChannelFormat (CSV_CHANNEL_FORMAT * format, HRDL_INPUTS channel)
+{
+	int32_t maxAdc = 0;
+	int32_t minAdc = 0;
+	double countValue;
+
+	format->scale = 1.0;
+	format->decimals = 0;
+
+	if (!g_scaleTo_mv || channel < HRDL_ANALOG_IN_CHANNEL_1 || channel > HRDL_MAX_ANALOG_CHANNELS)
+	{
+		return;
+	}
+
+	// Without the ADC range the readings are left in counts
+	if (!HRDLGetMinMaxAdcCounts(g_device, &minAdc, &maxAdc, channel) || maxAdc <= 0)
+	{
+		return;
+	}
+
+	countValue = (2500.0 / pow(2.0, (double) g_channelSettings[channel].range)) / (double) maxAdc;
+	format->decimals = (int16_t) max(0, ceil(-log10(countValue)));
+	format->scale = countValue * pow(10.0, (double) format->decimals);
+}
+
+void CsvPutReading (CSV_WRITER * writer, const CSV_CHANNEL_FORMAT * format, int32_t raw)
+{
+	if (raw == -1)
+	{
+		CsvPutFixed(writer, -1, 0);		// No reading available
+	}
+	else
+	{
+		CsvPutFixed(writer, llround((double) raw * format->scale), format->decimals);
+	}
+}
 /****************************************************************************
 *
 * CollectBlockImmediate
@@ -556,12 +727,14 @@ void CollectStreaming (void)
 {
 	int32_t		i;
 	int32_t		blockNo;
-	FILE *		fp;
 	int32_t		nValues;
 	int16_t		channel;
 	int16_t		numberOfActiveChannels;
 	int8_t		strError[80];
+	char		header[32];
 	int16_t		status = 1;
+	CSV_WRITER	writer;
+	CSV_CHANNEL_FORMAT	formats[HRDL_MAX_ANALOG_CHANNELS + 1];
 
 	printf("Collect streaming...\n");
 	printf("Data is written to disk file (test.csv)\n");
@@ -611,14 +784,21 @@ void CollectStreaming (void)
 	// From here on, we can get data whenever we want...
 	//
 	blockNo = 0;
-	fopen_s(&fp, "test.csv", "w");
   
-	if (!fp)
+	if (!CsvOpen(&writer, "test.csv"))
 	{
 		printf("Error opening output file.");
 		return;
 	}
 
+	for (channel = HRDL_ANALOG_IN_CHANNEL_1; channel <= HRDL_MAX_ANALOG_CHANNELS; channel++)
+	{
+		if (g_channelSettings[channel].enabled)
+		{
+			CsvSetChannelFormat(&formats[channel], (HRDL_INPUTS) channel);
+		}
+	}
+
 	HRDLGetNumberOfEnabledChannels(g_device, &numberOfActiveChannels);
 	numberOfActiveChannels = numberOfActiveChannels + (int16_t)(g_channelSettings[HRDL_DIGITAL_CHANNELS].enabled);
   
@@ -636,11 +816,12 @@ void CollectStreaming (void)
 				//
 				if (nValues && channel == HRDL_DIGITAL_CHANNELS && g_channelSettings[channel].enabled)
 				{
-					fprintf (fp, "Digital IO (1 2 3 4):,");
+					CsvPutString (&writer, "Digital IO (1 2 3 4):,");
 				}
 				else if (nValues && g_channelSettings[channel].enabled)
 				{
-					fprintf (fp, "Channel %d:,", channel);
+					sprintf (header, "Channel %d:,", channel);
+					CsvPutString (&writer, header);
 				}
 
 				//
@@ -649,32 +830,35 @@ void CollectStreaming (void)
 
 				if (channel == HRDL_DIGITAL_CHANNELS && g_channelSettings[channel].enabled)
 				{
-					fprintf (fp, "%d %d %d %d,", 0x01 & (g_values [i]),
+					sprintf (header, "%d %d %d %d,", 0x01 & (g_values [i]),
 													0x01 & (g_values [i] >> 0x1),
 													0x01 & (g_values [i] >> 0x2),
 													0x01 & (g_values [i] >> 0x3));
+					CsvPutString (&writer, header);
 					i++;
 				}
 				else if (g_channelSettings[channel].enabled)
 				{
-					fprintf (fp, "%f,", AdcToMv ((HRDL_INPUTS) channel, g_values [i]));
+					CsvPutReading (&writer, &formats[channel], g_values [i]);
 					i++;
 				}
 			}
 
-			if (nValues && g_channelSettings[channel].enabled)
+			if (nValues)
 			{
-  				fprintf (fp, "\n");
+  				CsvPutString (&writer, "\n");
 			}
 		}
 
+		CsvFlush (&writer);
+
 		if ((blockNo++  % 20) == 0)
 		{
 			printf ("Press any key to stop\n");
 
 			if (nValues)
 			{
-				fprintf (fp, "\n");
+				CsvPutString (&writer, "\n");
 			}
 		
 			//
@@ -686,11 +870,445 @@ void CollectStreaming (void)
 
 	}
 
-	fclose (fp);
+	CsvClose (&writer);
 	HRDLStop(g_device);
 	_getch ();   
 }
 
+/****************************************************************************
+*
+* Adaptive sampling
+*
+* For long unattended runs the sampling interval follows the signals. Each
+* reading is compared with the one before it on every enabled channel. A
+* step larger than the deadband sends the logger straight to the fastest
+* interval, and once ADAPTIVE_CALM_READINGS readings in a row would have
+* stayed within half the deadband even at the next slower interval it moves
+* down one step. Slower intervals also get a longer conversion time, and so
+* more noise-free resolution.
+*
+* Changing the interval means stopping and restarting the logger, so a
+* change is only made while the time spent on them stays below
+* ADAPTIVE_MAX_OVERHEAD percent of the run.
+*
+****************************************************************************/
+#define ADAPTIVE_LEVELS				9
+#define ADAPTIVE_CALM_READINGS		20
+#define ADAPTIVE_MAX_OVERHEAD		5		// Percent of the time since collection started
+#define ADAPTIVE_POLL_MS			500
+
+int32_t	g_adaptiveIntervals[ADAPTIVE_LEVELS] = {100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000};	// ms
+int32_t	g_conversionTimes[HRDL_MAX_CONVERSION_TIMES] = {60, 100, 180, 340, 660};						// ms, by HRDL_CONVERSION_TIME
+
+typedef struct tAdaptiveState
+{
+	int16_t		level;
+	int16_t		fastest;								// First level the enabled channels can be converted in
+	int16_t		conversionTime[ADAPTIVE_LEVELS];		// HRDL_CONVERSION_TIME for each level, -1 if too short
+	int16_t		active;									// A step beyond the deadband since the interval was last set
+	uint32_t	calmReadings;
+	uint32_t	runReadings;							// Since the logger was last started
+	uint32_t	readings[ADAPTIVE_LEVELS];
+	uint32_t	changes;
+	uint32_t	deferred;								// Changes held back by the overhead limit
+	int64_t		startMs;
+	int64_t		runStartMs;
+	int64_t		hostOffsetMs;							// Wall clock less AdaptiveNowMs() at the start
+	int64_t		reconfigureMs;							// Total time spent changing the interval
+	int64_t		lastReconfigureMs;
+	FILE *		history;
+} ADAPTIVE_STATE;
+
+int64_t AdaptiveNowMs (void)
+{
+#ifdef WIN32
+	return (int64_t) GetTickCount64();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+// Wall clock time in ms since the epoch, the common timeline of data from different programs
+int64_t HostTimeMs (void)
+{
+#ifdef WIN32
+	FILETIME now;
+	ULARGE_INTEGER time;
+
+	GetSystemTimeAsFileTime(&now);
+	time.LowPart = now.dwLowDateTime;
+	time.HighPart = now.dwHighDateTime;
+
+	return (int64_t) (time.QuadPart / 10000) - 11644473600000LL;	// 100 ns units since 1601
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/****************************************************************************
+*
+* AdaptiveSetLevel
+*
+* Restarts the logger at the interval of a level and records the change in
+* the rate history
+*
+****************************************************************************/
+int16_t AdaptiveSetLevel (ADAPTIVE_STATE * state, int16_t level, const char * reason)
+{
+	int64_t	startMs = AdaptiveNowMs();
+	int16_t	conversionTime = state->conversionTime[level];
+
+	if (state->runStartMs)
+	{
+		HRDLStop(g_device);
+	}
+
+	if (!HRDLSetInterval(g_device, g_adaptiveIntervals[level], conversionTime) ||
+		!HRDLRun(g_device, BUFFER_SIZE, (int16_t) HRDL_BM_STREAM))
+	{
+		return 0;
+	}
+
+	state->runStartMs = AdaptiveNowMs();
+
+	while (!HRDLReady(g_device))
+	{
+		Sleep(10);
+	}
+
+	state->lastReconfigureMs = AdaptiveNowMs() - startMs;
+	state->level = level;
+	state->active = FALSE;
+	state->calmReadings = 0;
+	state->runReadings = 0;
+
+	if (strcmp(reason, "start") != 0)
+	{
+		state->reconfigureMs += state->lastReconfigureMs;
+		state->changes++;
+	}
+
+	fprintf(state->history, "%lld,%d,%d,%s,%lld\n",
+		(long long) (state->runStartMs - state->startMs),
+		g_adaptiveIntervals[level],
+		g_conversionTimes[conversionTime],
+		reason,
+		(long long) state->lastReconfigureMs);
+	fflush(state->history);
+
+	printf("%8.1f s: %5d ms interval, %3d ms conversion (%s)\n",
+		(state->runStartMs - state->startMs) / 1000.0,
+		g_adaptiveIntervals[level],
+		g_conversionTimes[conversionTime],
+		reason);
+
+	return 1;
+}
+
+/****************************************************************************
+*
+* CollectAdaptive
+*	This function demonstrates how to stream with a sampling interval that
+*	follows the activity of the signals.
+*
+* The readings are written to adaptive.csv, each with its time and the
+* interval it was taken at, and every change of interval is written to
+* adaptive_rates.csv with its reason.
+*
+* The first column is the host time of each reading: its nominal time from
+* the start, added to the wall clock at the start, so that the readings
+* line up with captures from other programs on the same computer.
+*
+****************************************************************************/
+void CollectAdaptive (void)
+{
+	int32_t		i;
+	int32_t		nValues;
+	int32_t		row;
+	int16_t		level;
+	int16_t		channel;
+	int16_t		conversionTime;
+	int16_t		numberOfActiveChannels;
+	int16_t		numberOfAnalogChannels;
+	int16_t		havePrevious = FALSE;
+	int8_t		strError[80];
+	char		field[32];
+	int16_t		status = 1;
+	int32_t		previous[HRDL_MAX_ANALOG_CHANNELS + 1];
+	double		unitsPerCount[HRDL_MAX_ANALOG_CHANNELS + 1];
+	double		deadband = 0.0;
+	double		step;
+	double		largest;
+	double		slowdown;
+	int64_t		elapsedMs;
+	uint32_t	total = 0;
+	const char *	reason;
+	ADAPTIVE_STATE	state;
+	CSV_WRITER	writer;
+	CSV_CHANNEL_FORMAT	formats[HRDL_MAX_ANALOG_CHANNELS + 1];
+
+	printf("Collect adaptive streaming...\n");
+	printf("Data is written to disk files (adaptive.csv, adaptive_rates.csv)\n");
+
+	for (i = HRDL_ANALOG_IN_CHANNEL_1; i <= g_maxNoOfChannels; i++)
+	{
+		status = HRDLSetAnalogInChannel(g_device,
+										(int16_t)i,
+										g_channelSettings[i].enabled, 
+										(int16_t) g_channelSettings[i].range,
+										g_channelSettings[i].singleEnded);
+
+		if (status == 0)
+		{
+			HRDLGetUnitInfo(g_device, strError, (int16_t) 80, HRDL_SETTINGS);
+			printf("Error occurred: %s\n\n", strError);
+			return;
+		}
+	}
+
+	HRDLGetNumberOfEnabledChannels(g_device, &numberOfAnalogChannels);
+	numberOfActiveChannels = numberOfAnalogChannels + (int16_t)(g_channelSettings[HRDL_DIGITAL_CHANNELS].enabled);
+
+	if (numberOfActiveChannels == 0)
+	{
+		printf("No channels are enabled\n");
+		return;
+	}
+
+	printf("Deadband between successive readings (%s): ", g_scaleTo_mv ? "mV" : "ADC counts");
+	scanf_s("%lf", &deadband);
+
+	//
+	// Give each interval the longest conversion time that fits all the
+	// enabled channels into it
+	//
+	memset(&state, 0, sizeof(state));
+	state.fastest = -1;
+
+	for (level = 0; level < ADAPTIVE_LEVELS; level++)
+	{
+		state.conversionTime[level] = -1;
+
+		for (conversionTime = HRDL_60MS; conversionTime < HRDL_MAX_CONVERSION_TIMES; conversionTime++)
+		{
+			if (g_conversionTimes[conversionTime] * max(numberOfAnalogChannels, 1) < g_adaptiveIntervals[level])
+			{
+				state.conversionTime[level] = conversionTime;
+			}
+		}
+
+		if (state.fastest < 0 && state.conversionTime[level] >= 0)
+		{
+			state.fastest = level;
+		}
+	}
+
+	if (state.fastest < 0)
+	{
+		printf("Too many channels are enabled to convert them all in %d ms\n", g_adaptiveIntervals[ADAPTIVE_LEVELS - 1]);
+		return;
+	}
+
+	for (channel = HRDL_ANALOG_IN_CHANNEL_1; channel <= HRDL_MAX_ANALOG_CHANNELS; channel++)
+	{
+		if (g_channelSettings[channel].enabled)
+		{
+			CsvSetChannelFormat(&formats[channel], (HRDL_INPUTS) channel);
+			unitsPerCount[channel] = formats[channel].scale / pow(10.0, formats[channel].decimals);
+		}
+	}
+
+	if (!CsvOpen(&writer, "adaptive.csv"))
+	{
+		printf("Error opening output file.");
+		return;
+	}
+
+	fopen_s(&state.history, "adaptive_rates.csv", "w");
+
+	if (state.history == NULL)
+	{
+		printf("Error opening output file.");
+		CsvClose(&writer);
+		return;
+	}
+
+	fprintf(state.history, "Time (ms),Interval (ms),Conversion (ms),Reason,Reconfiguration (ms)\n");
+
+	CsvPutString(&writer, "Host time (ms),Time (ms),Interval (ms),");
+
+	for (channel = HRDL_DIGITAL_CHANNELS; channel <= HRDL_MAX_ANALOG_CHANNELS; channel++)
+	{
+		if (channel == HRDL_DIGITAL_CHANNELS && g_channelSettings[channel].enabled)
+		{
+			CsvPutString(&writer, "Digital IO (1 2 3 4),");
+		}
+		else if (g_channelSettings[channel].enabled)
+		{
+			sprintf(field, "Channel %d,", channel);
+			CsvPutString(&writer, field);
+		}
+	}
+
+	CsvPutString(&writer, "\n");
+
+	printf("Press a key to start\n");
+	_getch();
+
+	printf("Starting data collection...\n");
+	state.startMs = AdaptiveNowMs();
+	state.hostOffsetMs = HostTimeMs() - state.startMs;
+
+	if (!AdaptiveSetLevel(&state, state.fastest, "start"))
+	{
+		HRDLGetUnitInfo(g_device, strError, (int16_t) 80, HRDL_SETTINGS);
+		printf("Error occurred: %s\n\n", strError);
+		CsvClose(&writer);
+		fclose(state.history);
+		return;
+	}
+
+	printf("Press any key to stop\n");
+
+	while (!_kbhit())
+	{
+		nValues = HRDLGetValues(g_device, g_values, NULL, BUFFER_SIZE / numberOfActiveChannels);
+
+		slowdown = state.level < ADAPTIVE_LEVELS - 1 ? (double) g_adaptiveIntervals[state.level + 1] / g_adaptiveIntervals[state.level] : 0.0;
+
+		for (row = 0, i = 0; row < nValues; row++)
+		{
+			state.runReadings++;
+
+			// Nominal time of the reading, from when the logger was started at this interval
+			CsvPutFixed(&writer, state.hostOffsetMs + state.runStartMs + (int64_t) state.runReadings * g_adaptiveIntervals[state.level], 0);
+			CsvPutFixed(&writer, state.runStartMs - state.startMs + (int64_t) state.runReadings * g_adaptiveIntervals[state.level], 0);
+			CsvPutFixed(&writer, g_adaptiveIntervals[state.level], 0);
+
+			largest = 0.0;
+
+			for (channel = HRDL_DIGITAL_CHANNELS; channel <= HRDL_MAX_ANALOG_CHANNELS; channel++)
+			{
+				if (!g_channelSettings[channel].enabled)
+				{
+					continue;
+				}
+
+				if (channel == HRDL_DIGITAL_CHANNELS)
+				{
+					sprintf(field, "%d %d %d %d,", 0x01 & (g_values [i]),
+												0x01 & (g_values [i] >> 0x1),
+												0x01 & (g_values [i] >> 0x2),
+												0x01 & (g_values [i] >> 0x3));
+					CsvPutString(&writer, field);
+
+					// Any change of a digital input counts as activity
+					step = havePrevious && g_values[i] != previous[channel] ? deadband * 2 + 1 : 0.0;
+				}
+				else
+				{
+					CsvPutReading(&writer, &formats[channel], g_values[i]);
+					step = havePrevious ? fabs((double) (g_values[i] - previous[channel]) * unitsPerCount[channel]) : 0.0;
+				}
+
+				largest = step > largest ? step : largest;
+				previous[channel] = g_values[i++];
+			}
+
+			CsvPutString(&writer, "\n");
+			havePrevious = TRUE;
+
+			if (largest > deadband)
+			{
+				state.active = TRUE;
+				state.calmReadings = 0;
+			}
+			else if (largest * slowdown <= deadband / 2)
+			{
+				state.calmReadings++;
+			}
+			else
+			{
+				state.calmReadings = 0;
+			}
+		}
+
+		state.readings[state.level] += nValues;
+		CsvFlush(&writer);
+
+		//
+		// Decide the next interval: straight to the fastest on activity, one
+		// step slower after a calm spell
+		//
+		level = state.level;
+		reason = NULL;
+
+		if (state.active && state.level > state.fastest)
+		{
+			level = state.fastest;
+			reason = "activity";
+		}
+		else if (state.calmReadings >= ADAPTIVE_CALM_READINGS && state.level < ADAPTIVE_LEVELS - 1)
+		{
+			level = state.level + 1;
+			reason = "steady";
+		}
+		else
+		{
+			state.active = FALSE;
+		}
+
+		elapsedMs = AdaptiveNowMs() - state.startMs;
+
+		if (reason != NULL && (state.reconfigureMs + state.lastReconfigureMs) * 100 > ADAPTIVE_MAX_OVERHEAD * elapsedMs)
+		{
+			state.deferred++;
+			reason = NULL;
+		}
+
+		if (reason != NULL && !AdaptiveSetLevel(&state, level, reason))
+		{
+			HRDLGetUnitInfo(g_device, strError, (int16_t) 80, HRDL_SETTINGS);
+			printf("Error occurred: %s\n\n", strError);
+			break;
+		}
+
+		Sleep(ADAPTIVE_POLL_MS);
+	}
+
+	CsvClose(&writer);
+	fclose(state.history);
+	HRDLStop(g_device);
+
+	elapsedMs = AdaptiveNowMs() - state.startMs;
+
+	printf("\nInterval (ms)  Readings\n");
+
+	for (level = state.fastest; level < ADAPTIVE_LEVELS; level++)
+	{
+		printf("%13d  %8lu\n", g_adaptiveIntervals[level], (unsigned long) state.readings[level]);
+		total += state.readings[level];
+	}
+
+	printf("\n%lu readings in %.1f s, against %lu at a fixed %d ms interval\n",
+		(unsigned long) total,
+		elapsedMs / 1000.0,
+		(unsigned long) (elapsedMs / g_adaptiveIntervals[state.fastest]),
+		g_adaptiveIntervals[state.fastest]);
+	printf("%lu interval changes took %.1f%% of the time, %lu were held back\n",
+		(unsigned long) state.changes,
+		elapsedMs ? state.reconfigureMs * 100.0 / elapsedMs : 0.0,
+		(unsigned long) state.deferred);
+
+	_getch();
+}
+
 /****************************************************************************
 *
 * CollectSingle using blocking Api Calls
@@ -1248,6 +1866,7 @@ void main (void)
 		printf("B - Immediate block\n");
 		printf("W - Windowed block\n");
 		printf("S - Streaming\n");
+		printf("L - Adaptive streaming\n");
 		printf("U - Single readings\n");
     printf("R - Single readings (blocking call)\n");
 		printf("A - Set analog channels \n");
@@ -1271,6 +1890,10 @@ void main (void)
 			CollectStreaming();
 			break;  
 
+			case 'L':
+			CollectAdaptive();
+			break;
+
 			case 'R':
 			CollectSingleBlocked();
 			break;
@@ -16,6 +16,7 @@
  *    Collect a block of samples when a trigger event occurs
  *    Use windowing to collect a sequence of overlapped blocks
  *    Write a continuous stream of data to a disk file
+ *    Stream with a sampling interval that follows the signals
  *    Take individual readings
  *	  Set PWM
  *	  Set digital outputs
@@ -59,6 +60,7 @@
 #include "pl1000Api.h"
 #include <windows.h>
 #include <stdlib.h>
+#include <string.h>
 #else
 #include <sys/types.h>
 #include <string.h>
@@ -67,6 +69,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <libpl1000-1.0/pl1000Api.h>
 #ifndef PICO_STATUS
@@ -577,6 +580,318 @@ void collect_streaming (void)
 	_getch();
 }
 
+/****************************************************************************
+ *
+ * Adaptive sampling
+ *
+ *  For long unattended runs the sampling interval follows the signals. Each
+ *  reading is compared with the one before it on every channel. A step
+ *  larger than the deadband sends the unit straight to the fastest interval,
+ *  and once ADAPTIVE_CALM_READINGS readings in a row would have stayed
+ *  within half the deadband even at the next slower interval it moves down
+ *  one step.
+ *
+ *  Changing the interval means stopping and restarting the unit, so a
+ *  change is only made while the time spent on them stays below
+ *  ADAPTIVE_MAX_OVERHEAD percent of the run.
+ *
+ ****************************************************************************/
+#define ADAPTIVE_LEVELS			13
+#define ADAPTIVE_CALM_READINGS	20
+#define ADAPTIVE_MAX_OVERHEAD	5		// Percent of the time since collection started
+#define ADAPTIVE_POLL_MS		100
+#define ADAPTIVE_BLOCK_SAMPLES	100		// Samples per channel pl1000SetInterval works out the interval over
+#define ADAPTIVE_MAX_READINGS	1000	// Readings per channel fetched in one call
+
+uint32_t adaptiveIntervalsUs[ADAPTIVE_LEVELS] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000};
+
+typedef struct tAdaptiveState
+{
+	int16_t		level;
+	int16_t		active;						// A step beyond the deadband since the interval was last set
+	uint32_t	intervalUs;					// As set by the driver
+	uint32_t	calmReadings;
+	uint32_t	runReadings;				// Since the unit was last started
+	uint32_t	readings[ADAPTIVE_LEVELS];
+	uint32_t	changes;
+	uint32_t	deferred;					// Changes held back by the overhead limit
+	int64_t		startMs;
+	int64_t		runStartMs;
+	int64_t		reconfigureMs;				// Total time spent changing the interval
+	int64_t		lastReconfigureMs;
+	int16_t		channels[PL1000_16_CHANNEL];
+	int16_t		nChannels;
+	FILE *		history;
+} ADAPTIVE_STATE;
+
+int64_t adaptive_now_ms (void)
+{
+#ifdef WIN32
+	return (int64_t) GetTickCount64();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/****************************************************************************
+ *
+ * adaptive_set_level()
+ *
+ *  Restarts the unit at the interval of a level and records the change in
+ *  the rate history
+ *
+ ****************************************************************************/
+PICO_STATUS adaptive_set_level (ADAPTIVE_STATE * state, int16_t level, const char * reason)
+{
+	int64_t		startMs = adaptive_now_ms();
+	uint32_t	usForBlock = adaptiveIntervalsUs[level] * ADAPTIVE_BLOCK_SAMPLES;
+
+	if (state->runStartMs)
+	{
+		pl1000Stop(g_handle);
+	}
+
+	status = pl1000SetInterval(g_handle, &usForBlock, ADAPTIVE_BLOCK_SAMPLES, state->channels, state->nChannels);
+
+	if (status == PICO_OK)
+	{
+		status = pl1000Run(g_handle, ADAPTIVE_MAX_READINGS * 10, BM_STREAM);
+	}
+
+	if (status != PICO_OK)
+	{
+		return status;
+	}
+
+	state->runStartMs = adaptive_now_ms();
+
+	isReady = 0;
+
+	while (isReady == 0 && pl1000Ready(g_handle, &isReady) == PICO_OK)
+	{
+		Sleep(1);
+	}
+
+	state->lastReconfigureMs = adaptive_now_ms() - startMs;
+	state->intervalUs = usForBlock / ADAPTIVE_BLOCK_SAMPLES;
+	state->level = level;
+	state->active = FALSE;
+	state->calmReadings = 0;
+	state->runReadings = 0;
+
+	if (strcmp(reason, "start") != 0)
+	{
+		state->reconfigureMs += state->lastReconfigureMs;
+		state->changes++;
+	}
+
+	fprintf(state->history, "%lld\t%u\t%s\t%lld\n",
+		(long long) (state->runStartMs - state->startMs) * 1000,
+		state->intervalUs,
+		reason,
+		(long long) state->lastReconfigureMs);
+	fflush(state->history);
+
+	printf("%8.1f s: %8u us interval (%s)\n", (state->runStartMs - state->startMs) / 1000.0, state->intervalUs, reason);
+
+	return PICO_OK;
+}
+
+/****************************************************************************
+ *
+ * collect_adaptive()
+ *
+ *  This function demonstrates how to stream every channel with a sampling
+ *  interval that follows the activity of the signals. The readings are
+ *  written to pl1000_adaptive.txt, each with its time and the interval it
+ *  was taken at, and every change of interval is written to
+ *  pl1000_rates.txt with its reason.
+ *
+ ****************************************************************************/
+void collect_adaptive (void)
+{
+	uint32_t	i = 0;
+	uint32_t	j = 0;
+	uint32_t	nSamplesCollected = 0;
+	uint16_t *	samples = (uint16_t *) calloc(ADAPTIVE_MAX_READINGS * PL1000_16_CHANNEL, sizeof(uint16_t));
+	uint16_t	overflow = 0;
+	uint32_t	triggerIndex = 0;
+	uint32_t	deadband = 0;
+	uint32_t	total = 0;
+	int32_t		value;
+	int32_t		step;
+	int32_t		largest;
+	int32_t		previous[PL1000_16_CHANNEL];
+	int16_t		havePrevious = FALSE;
+	int16_t		level;
+	int64_t		elapsedMs;
+	const char *	reason;
+	ADAPTIVE_STATE	state;
+	FILE *		fp;
+
+	printf ("Collect adaptive streaming...\n");
+	printf ("Data is written to disk files (pl1000_adaptive.txt, pl1000_rates.txt)\n");
+
+	printf ("Deadband between successive readings (%s): ", scale_to_mv ? "mV" : "ADC counts");
+	scanf_s ("%u", &deadband);
+
+	memset(&state, 0, sizeof(state));
+
+	for (state.nChannels = 0; state.nChannels < (int16_t) numDeviceChannels; state.nChannels++)
+	{
+		state.channels[state.nChannels] = (int16_t) PL1000_CHANNEL_1 + state.nChannels;
+	}
+
+	fopen_s(&fp, "pl1000_adaptive.txt", "w");
+	fopen_s(&state.history, "pl1000_rates.txt", "w");
+
+	if (fp == NULL || state.history == NULL || samples == NULL)
+	{
+		printf ("Error opening output files\n");
+
+		if (fp != NULL)
+		{
+			fclose(fp);
+		}
+
+		if (state.history != NULL)
+		{
+			fclose(state.history);
+		}
+
+		free(samples);
+		return;
+	}
+
+	fprintf (fp, "Time (us)\tInterval (us)\t");
+	printChannelsHeader(fp, state.channels, state.nChannels);
+	fprintf (state.history, "Time (us)\tInterval (us)\tReason\tReconfiguration (ms)\n");
+
+	printf ("Press a key to start\n");
+	_getch();
+
+	// Set the trigger (disabled)
+	status = pl1000SetTrigger(g_handle, FALSE, 0, 0, 0, 0, 0, 0, 0);
+
+	state.startMs = adaptive_now_ms();
+
+	if (adaptive_set_level(&state, 0, "start") != PICO_OK)
+	{
+		printf ("Unable to start streaming (status 0x%08lx)\n", (unsigned long) status);
+	}
+	else
+	{
+		printf ("Press any key to stop\n");
+	}
+
+	while (status == PICO_OK && !_kbhit())
+	{
+		nSamplesCollected = ADAPTIVE_MAX_READINGS;
+
+		status = pl1000GetValues(g_handle, samples, &nSamplesCollected, &overflow, &triggerIndex);
+
+		for (i = 0; i < nSamplesCollected && status == PICO_OK; i++)
+		{
+			state.runReadings++;
+
+			// Nominal time of the reading, from when the unit was started at this interval
+			fprintf (fp, "%lld\t%u\t", (long long) (state.runStartMs - state.startMs) * 1000 + (long long) state.runReadings * state.intervalUs, state.intervalUs);
+
+			largest = 0;
+
+			for (j = 0; j < (uint32_t) state.nChannels; j++)
+			{
+				value = adc_to_mv(samples[(i * state.nChannels) + j]);
+				fprintf (fp, "%d\t", value);
+
+				step = havePrevious ? abs(value - previous[j]) : 0;
+				largest = step > largest ? step : largest;
+				previous[j] = value;
+			}
+
+			fprintf (fp, "\n");
+			havePrevious = TRUE;
+
+			if ((uint32_t) largest > deadband)
+			{
+				state.active = TRUE;
+				state.calmReadings = 0;
+			}
+			else if (state.level == ADAPTIVE_LEVELS - 1 ||
+				(int64_t) largest * adaptiveIntervalsUs[state.level + 1] * 2 <= (int64_t) deadband * adaptiveIntervalsUs[state.level])
+			{
+				state.calmReadings++;
+			}
+			else
+			{
+				state.calmReadings = 0;
+			}
+		}
+
+		state.readings[state.level] += nSamplesCollected;
+
+		// Straight to the fastest interval on activity, one step slower after a calm spell
+		level = state.level;
+		reason = NULL;
+
+		if (state.active && state.level > 0)
+		{
+			level = 0;
+			reason = "activity";
+		}
+		else if (state.calmReadings >= ADAPTIVE_CALM_READINGS && state.level < ADAPTIVE_LEVELS - 1)
+		{
+			level = state.level + 1;
+			reason = "steady";
+		}
+		else
+		{
+			state.active = FALSE;
+		}
+
+		elapsedMs = adaptive_now_ms() - state.startMs;
+
+		if (reason != NULL && (state.reconfigureMs + state.lastReconfigureMs) * 100 > ADAPTIVE_MAX_OVERHEAD * elapsedMs)
+		{
+			state.deferred++;
+			reason = NULL;
+		}
+
+		if (reason != NULL && adaptive_set_level(&state, level, reason) != PICO_OK)
+		{
+			printf ("Unable to change the interval (status 0x%08lx)\n", (unsigned long) status);
+			break;
+		}
+
+		Sleep(ADAPTIVE_POLL_MS);
+	}
+
+	fclose(fp);
+	fclose(state.history);
+	free(samples);
+	pl1000Stop(g_handle);
+
+	elapsedMs = adaptive_now_ms() - state.startMs;
+
+	printf ("\nInterval (us)  Readings\n");
+
+	for (level = 0; level < ADAPTIVE_LEVELS; level++)
+	{
+		printf ("%13u  %8u\n", adaptiveIntervalsUs[level], state.readings[level]);
+		total += state.readings[level];
+	}
+
+	printf ("\n%u readings in %.1f s, against %lld at a fixed %u us interval\n",
+		total, elapsedMs / 1000.0, (long long) elapsedMs * 1000 / adaptiveIntervalsUs[0], adaptiveIntervalsUs[0]);
+	printf ("%u interval changes took %.1f%% of the time, %u were held back\n",
+		state.changes, elapsedMs ? state.reconfigureMs * 100.0 / elapsedMs : 0.0, state.deferred);
+
+	_getch();
+}
+
 /****************************************************************************
  *
  * collect_individual()
@@ -838,7 +1153,8 @@ void main (void)
 			printf ("T - Triggered block\t\tP - Set PWM\n");
 			printf ("W - Windowed block\t\tD - Display digital output states\n");
 			printf ("S - Streaming\t\t\t0,1,2,3 - Toggle digital output\n");
-			printf ("I - Individual reading\t\tX - exit\n");
+			printf ("I - Individual reading\t\tL - Adaptive streaming\n");
+			printf ("X - exit\n");
 			ch = toupper (_getch());
 			printf ("\n");
 
@@ -863,6 +1179,10 @@ void main (void)
 				case 'I':
 					collect_individual ();
 					break;
+
+				case 'L':
+					collect_adaptive ();
+					break;
 				
 				case 'P':
 					pwm();
@@ -16,6 +16,7 @@
  *    Collect a block of samples immediately
  *    Collect a block of samples when a trigger event occurs
  *	  Collect data in rapid block mode
+ *    Build a high sample rate waveform of a repetitive signal in software
  *    Collect a stream of data immediately
  *    Collect a stream of data when a trigger event occurs
  *    Set Signal Generator, using standard or custom signals
@@ -56,6 +57,7 @@
  ******************************************************************************/
 
 #include <stdio.h>
+#include <math.h>
 
 /* Headers for Windows */
 #ifdef _WIN32
@@ -1280,6 +1282,634 @@ void CollectRapidBlock(UNIT * unit)
 	free(rapidBuffers);
 }
 
+/****************************************************************************
+* Software equivalent time sampling
+*
+* The trigger is not synchronised with the sample clock, so captures of a
+* repetitive signal taken on successive triggers sample the waveform at
+* slightly different points. ps4000aGetValuesTriggerTimeOffsetBulk64
+* returns the sub-sample time between the trigger point and the trigger
+* event for each rapid block segment. Every sample of every capture is
+* placed on a common time axis using that offset and averaged into bins of
+* 1/interleave of a sample interval, giving one waveform at a higher
+* effective sample rate.
+*
+* The trigger delay counts whole sample intervals, so it cannot step by
+* part of a sample. It is swept in steps of (samples - SOFT_ETS_OVERLAP)
+* so that successive groups of captures lie end to end and the record can
+* be longer than one segment. The overlap covers the join between steps,
+* which moves by up to a sample with the trigger offset.
+*
+* Coherence checks:
+*  - the trigger offsets must spread over every phase bin
+*  - a capture whose RMS difference from the interleaved waveform is more
+*    than SOFT_ETS_REJECT_FACTOR times the median is rejected, as it was
+*    probably not triggered on the same part of the signal
+****************************************************************************/
+#define SOFT_ETS_MAX_INTERLEAVE		100
+#define SOFT_ETS_OVERLAP					2
+#define SOFT_ETS_REJECT_FACTOR		3.0
+#define SOFT_ETS_PASSES						4
+
+int8_t SoftEtsFile[20] = "softets.txt";
+
+/****************************************************************************
+* TimeToNs
+*
+* Converts a time in the given units to nanoseconds
+****************************************************************************/
+double TimeToNs(int64_t time, PS4000A_TIME_UNITS timeUnits)
+{
+	switch (timeUnits)
+	{
+		case PS4000A_FS:
+			return time / 1000000.0;
+
+		case PS4000A_PS:
+			return time / 1000.0;
+
+		case PS4000A_NS:
+			return (double) time;
+
+		case PS4000A_US:
+			return time * 1000.0;
+
+		case PS4000A_MS:
+			return time * 1000000.0;
+
+		case PS4000A_S:
+			return time * 1000000000.0;
+
+		default:
+			return 0.0;
+	}
+}
+
+/****************************************************************************
+* CompareDoubles - for qsort
+****************************************************************************/
+int CompareDoubles(const void * a, const void * b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/****************************************************************************
+* SoftEtsInterleave
+*
+* Averages every sample of every capture that has not been rejected into
+* bins of 1/interleave of a sample interval. Sample i of a capture taken
+* with a trigger delay of d samples lies (d + i - offset) sample intervals
+* after the trigger event; bin 0 is one sample interval before it, so that
+* negative offsets still fall inside the record.
+****************************************************************************/
+void SoftEtsInterleave(UNIT * unit, int16_t ** data, uint32_t nTotalCaptures, uint32_t nCaptures, uint32_t nSamples, uint32_t stepSamples,
+	double * offsetSamples, int16_t * rejected, int32_t interleave, double ** sums, uint32_t * counts, uint32_t nBins)
+{
+	int16_t ch;
+	uint32_t capture;
+	uint32_t i;
+	int64_t bin;
+	double position;
+
+	memset(counts, 0, nBins * sizeof(uint32_t));
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			memset(sums[ch], 0, nBins * sizeof(double));
+		}
+	}
+
+	for (capture = 0; capture < nTotalCaptures; capture++)
+	{
+		if (rejected[capture])
+		{
+			continue;
+		}
+
+		for (i = 0; i < nSamples; i++)
+		{
+			position = (double) (capture / nCaptures) * stepSamples + i - offsetSamples[capture];
+			bin = (int64_t) floor((position + 1.0) * interleave + 0.5);
+
+			if (bin < 0 || bin >= (int64_t) nBins)
+			{
+				continue;
+			}
+
+			for (ch = 0; ch < unit->channelCount; ch++)
+			{
+				if (unit->channelSettings[ch].enabled)
+				{
+					sums[ch][bin] += data[ch][(size_t) capture * nSamples + i];
+				}
+			}
+
+			counts[bin]++;
+		}
+	}
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			for (bin = 0; bin < (int64_t) nBins; bin++)
+			{
+				if (counts[bin] > 0)
+				{
+					sums[ch][bin] /= counts[bin];
+				}
+			}
+		}
+	}
+}
+
+/****************************************************************************
+* SoftEtsResidual
+*
+* Returns the RMS difference, in ADC counts, between one capture on the
+* given channel and the interleaved waveform
+****************************************************************************/
+double SoftEtsResidual(int16_t * samples, uint32_t nSamples, double delaySamples, double offsetSamples, int32_t interleave,
+	double * waveform, uint32_t * counts, uint32_t nBins)
+{
+	uint32_t i;
+	uint32_t n = 0;
+	int64_t bin;
+	double difference;
+	double sum = 0.0;
+
+	for (i = 0; i < nSamples; i++)
+	{
+		bin = (int64_t) floor((delaySamples + i - offsetSamples + 1.0) * interleave + 0.5);
+
+		if (bin >= 0 && bin < (int64_t) nBins && counts[bin] > 0)
+		{
+			difference = samples[i] - waveform[bin];
+			sum += difference * difference;
+			n++;
+		}
+	}
+
+	return n ? sqrt(sum / n) : 0.0;
+}
+
+/****************************************************************************
+* CollectBlockSoftEts
+*  this function demonstrates how to build a high effective sample rate
+*  waveform of a repetitive signal from rapid block captures, on units
+*  without hardware ETS
+****************************************************************************/
+void CollectBlockSoftEts(UNIT * unit)
+{
+	int16_t	triggerVoltage = mv_to_adc(1000, unit->channelSettings[PS4000A_CHANNEL_A].range, unit);
+	int16_t channel;
+	int16_t allocationFailed = FALSE;
+	int16_t changed = FALSE;
+	int16_t reject;
+	int16_t * data[PS4000A_MAX_CHANNELS];
+	int16_t * overflow = NULL;
+	int16_t * rejected = NULL;
+	int32_t interleave = 10;
+	int32_t nMaxSamples;
+	int32_t maxSamples;
+	int32_t timeIndisposed;
+	int32_t emptyPhases = 0;
+	uint32_t nCaptures = 50;
+	uint32_t nSteps = 1;
+	uint32_t nSamples = 1000;
+	uint32_t nValues;
+	uint32_t nTotalCaptures;
+	uint32_t nRejected = 0;
+	uint32_t nEmpty = 0;
+	uint32_t stepSamples;
+	uint32_t nBins;
+	uint32_t step;
+	uint32_t pass;
+	uint32_t capture;
+	uint32_t bin;
+	uint32_t i;
+	uint32_t * counts = NULL;
+	uint32_t * phaseCounts = NULL;
+	uint32_t previous;
+	uint32_t next;
+	float timeInterval;
+	double * sums[PS4000A_MAX_CHANNELS];
+	double * offsetSamples = NULL;
+	double * residuals = NULL;
+	double * sorted = NULL;
+	double medianResidual;
+	double weight;
+	int64_t * times = NULL;
+	PS4000A_TIME_UNITS * timeUnits = NULL;
+	FILE * fp = NULL;
+	PICO_STATUS status = PICO_OK;
+
+	struct tPS4000ATriggerChannelProperties sourceDetails = { triggerVoltage,
+		256 * 10,
+		triggerVoltage,
+		256 * 10,
+		PS4000A_CHANNEL_A,
+		PS4000A_LEVEL};
+
+	struct tPS4000ACondition conditions = { PS4000A_CHANNEL_A,	PS4000A_CONDITION_TRUE };
+
+	struct tPwq pulseWidth;
+
+	struct tPS4000ADirection directions;
+	directions.channel = conditions.source;
+	directions.direction = PS4000A_RISING;
+
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+	memset(data, 0, sizeof(data));
+	memset(sums, 0, sizeof(sums));
+
+	if (!unit->channelSettings[PS4000A_CHANNEL_A].enabled)
+	{
+		printf("CollectBlockSoftEts: Channel A must be enabled for the trigger.\n");
+		return;
+	}
+
+	printf("Collect software ETS block...\n");
+
+	printf("Collects when value rises past %d",	scaleVoltages?
+		adc_to_mv(sourceDetails.thresholdUpper, unit->channelSettings[PS4000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: sourceDetails.thresholdUpper);																// else print ADC Count
+
+	printf(scaleVoltages?"mV\n" : "ADC Counts\n");
+
+	printf("Interleave factor (2 - %d): ", SOFT_ETS_MAX_INTERLEAVE);
+	fflush(stdin);
+	scanf_s("%d", &interleave);
+
+	printf("Samples per capture: ");
+	scanf_s("%u", &nSamples);
+
+	printf("Captures per trigger delay step: ");
+	scanf_s("%u", &nCaptures);
+
+	printf("Trigger delay steps: ");
+	scanf_s("%u", &nSteps);
+
+	if (interleave < 2 || interleave > SOFT_ETS_MAX_INTERLEAVE || nSamples <= SOFT_ETS_OVERLAP || nCaptures == 0 || nSteps == 0)
+	{
+		printf("CollectBlockSoftEts: Invalid settings.\n");
+		return;
+	}
+
+	stepSamples = nSamples - SOFT_ETS_OVERLAP;
+	nTotalCaptures = nCaptures * nSteps;
+	nBins = ((nSteps - 1) * stepSamples + nSamples + 1) * interleave;
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			data[channel] = (int16_t *) calloc((size_t) nTotalCaptures * nSamples, sizeof(int16_t));
+			sums[channel] = (double *) calloc(nBins, sizeof(double));
+			allocationFailed |= (data[channel] == NULL || sums[channel] == NULL);
+		}
+	}
+
+	overflow = (int16_t *) calloc(nCaptures, sizeof(int16_t));
+	rejected = (int16_t *) calloc(nTotalCaptures, sizeof(int16_t));
+	times = (int64_t *) calloc(nTotalCaptures, sizeof(int64_t));
+	timeUnits = (PS4000A_TIME_UNITS *) calloc(nTotalCaptures, sizeof(PS4000A_TIME_UNITS));
+	offsetSamples = (double *) calloc(nTotalCaptures, sizeof(double));
+	residuals = (double *) calloc(nTotalCaptures, sizeof(double));
+	sorted = (double *) calloc(nTotalCaptures, sizeof(double));
+	counts = (uint32_t *) calloc(nBins, sizeof(uint32_t));
+	phaseCounts = (uint32_t *) calloc(interleave, sizeof(uint32_t));
+
+	if (allocationFailed || !overflow || !rejected || !times || !timeUnits || !offsetSamples || !residuals || !sorted || !counts || !phaseCounts)
+	{
+		printf("CollectBlockSoftEts: Not enough memory for %u captures of %u samples.\n", nTotalCaptures, nSamples);
+		status = PICO_MEMORY_FAIL;
+	}
+
+	if (status == PICO_OK)
+	{
+		SetDefaults(unit);
+
+		// Trigger enabled, the delay is set for each step below
+		SetTrigger(unit, &sourceDetails, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0, 0);
+
+		status = ps4000aMemorySegments(unit->handle, nCaptures, &nMaxSamples);
+
+		// Each capture can only hold nMaxSamples
+		if (status == PICO_OK && nSamples > (uint32_t) nMaxSamples)
+		{
+			printf("CollectBlockSoftEts: %u samples per capture do not fit in %u segments (%d samples each).\n", nSamples, nCaptures, nMaxSamples);
+			status = PICO_TOO_MANY_SAMPLES;
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		status = ps4000aSetNoOfCaptures(unit->handle, nCaptures);
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aSetNoOfCaptures ------ 0x%08x \n", status);
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		while ((status = ps4000aGetTimebase2(unit->handle, timebase, nSamples, &timeInterval, &maxSamples, 0)) == PICO_INVALID_TIMEBASE)
+		{
+			timebase++;
+		}
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aGetTimebase2 ------ 0x%08x \n", status);
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		printf("\nTimebase: %u  SampleInterval: %.1f ns  Effective interval: %.3f ns\n", timebase, timeInterval, timeInterval / interleave);
+		printf("Press any key to abort\n");
+	}
+
+	for (step = 0; step < nSteps && status == PICO_OK; step++)
+	{
+		status = ps4000aSetTriggerDelay(unit->handle, step * stepSamples);
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aSetTriggerDelay ------ 0x%08x \n", status);
+			break;
+		}
+
+		g_ready = FALSE;
+
+		status = ps4000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, CallBackBlock, NULL);
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aRunBlock ------ 0x%08x \n", status);
+			break;
+		}
+
+		while (!g_ready && !_kbhit())
+		{
+			Sleep(0);
+		}
+
+		if (!g_ready)
+		{
+			_getch();
+			printf("Software ETS capture aborted at delay step %u\n", step);
+			status = PICO_CANCELLED;
+			break;
+		}
+
+		for (channel = 0; channel < unit->channelCount; channel++)
+		{
+			if (unit->channelSettings[channel].enabled)
+			{
+				for (capture = 0; capture < nCaptures; capture++)
+				{
+					status = ps4000aSetDataBuffer(unit->handle, (PS4000A_CHANNEL) channel,
+						data[channel] + ((size_t) step * nCaptures + capture) * nSamples, nSamples, capture, PS4000A_RATIO_MODE_NONE);
+				}
+			}
+		}
+
+		nValues = nSamples;
+		status = ps4000aGetValuesBulk(unit->handle, &nValues, 0, nCaptures - 1, 1, PS4000A_RATIO_MODE_NONE, overflow);
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aGetValuesBulk ------ 0x%08x \n", status);
+			break;
+		}
+
+		status = ps4000aGetValuesTriggerTimeOffsetBulk64(unit->handle, times + step * nCaptures, timeUnits + step * nCaptures, 0, nCaptures - 1);
+
+		if (status != PICO_OK)
+		{
+			printf("CollectBlockSoftEts:ps4000aGetValuesTriggerTimeOffsetBulk64 ------ 0x%08x \n", status);
+			break;
+		}
+	}
+
+	ps4000aStop(unit->handle);
+	ps4000aSetTriggerDelay(unit->handle, 0);
+
+	if (status == PICO_OK)
+	{
+		// Check 1 - the trigger offsets must spread over every phase bin
+		for (capture = 0; capture < nTotalCaptures; capture++)
+		{
+			offsetSamples[capture] = TimeToNs(times[capture], timeUnits[capture]) / timeInterval;
+			phaseCounts[(int32_t) floor((offsetSamples[capture] - floor(offsetSamples[capture])) * interleave) % interleave]++;
+		}
+
+		for (i = 0; i < (uint32_t) interleave; i++)
+		{
+			emptyPhases += (phaseCounts[i] == 0);
+		}
+
+		if (emptyPhases == interleave - 1)
+		{
+			printf("All trigger offsets are in the same phase bin, so the captures cannot be interleaved.\n");
+			printf("The signal may be synchronised with the sample clock, or this unit may not report trigger offsets.\n");
+			status = PICO_CANCELLED;
+		}
+		else if (emptyPhases > 0)
+		{
+			printf("Coherence: %d of %d phase bins have no captures - use more captures or a lower interleave factor.\n", emptyPhases, interleave);
+		}
+		else
+		{
+			printf("Coherence: every phase bin has at least one capture.\n");
+		}
+	}
+
+	// Check 2 - reject captures that do not match the interleaved waveform on the trigger channel. Rejected captures
+	// distort the waveform they are compared with, so repeat with the captures kept until the set settles.
+	for (pass = 0; pass < SOFT_ETS_PASSES && status == PICO_OK; pass++)
+	{
+		SoftEtsInterleave(unit, data, nTotalCaptures, nCaptures, nSamples, stepSamples, offsetSamples, rejected, interleave, sums, counts, nBins);
+
+		for (capture = 0; capture < nTotalCaptures; capture++)
+		{
+			residuals[capture] = SoftEtsResidual(data[PS4000A_CHANNEL_A] + (size_t) capture * nSamples, nSamples,
+				(double) (capture / nCaptures) * stepSamples, offsetSamples[capture], interleave, sums[PS4000A_CHANNEL_A], counts, nBins);
+			sorted[capture] = residuals[capture];
+		}
+
+		qsort(sorted, nTotalCaptures, sizeof(double), CompareDoubles);
+		medianResidual = sorted[nTotalCaptures / 2];
+		changed = FALSE;
+		nRejected = 0;
+
+		for (capture = 0; capture < nTotalCaptures; capture++)
+		{
+			// Allow one ADC count of rounding on clean signals
+			reject = residuals[capture] > SOFT_ETS_REJECT_FACTOR * max(medianResidual, 1.0);
+			changed |= (reject != rejected[capture]);
+			rejected[capture] = reject;
+			nRejected += reject;
+		}
+
+		if (nRejected == nTotalCaptures)
+		{
+			status = PICO_CANCELLED;
+		}
+		else if (!changed)
+		{
+			break;
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		// Build the waveform from the final set of captures
+		if (changed)
+		{
+			SoftEtsInterleave(unit, data, nTotalCaptures, nCaptures, nSamples, stepSamples, offsetSamples, rejected, interleave, sums, counts, nBins);
+		}
+
+		printf("Coherence: median RMS difference from the waveform %.1f ADC counts, %u of %u captures rejected.\n",
+			medianResidual, nRejected, nTotalCaptures);
+	}
+	else if (status == PICO_CANCELLED && nRejected == nTotalCaptures)
+	{
+		printf("Coherence: no captures match each other - check that the signal is repetitive.\n");
+	}
+
+	if (status == PICO_OK)
+	{
+		// Fill any empty bins from their neighbours
+		for (bin = 0; bin < nBins; bin++)
+		{
+			if (counts[bin] > 0)
+			{
+				continue;
+			}
+
+			nEmpty++;
+
+			for (previous = bin; previous > 0 && counts[previous] == 0; previous--);
+			for (next = bin; next < nBins - 1 && counts[next] == 0; next++);
+
+			weight = (next > previous) ? (double) (bin - previous) / (next - previous) : 0.0;
+
+			for (channel = 0; channel < unit->channelCount; channel++)
+			{
+				if (unit->channelSettings[channel].enabled)
+				{
+					sums[channel][bin] = (counts[previous] ? sums[channel][previous] : sums[channel][next]) * (1.0 - weight) +
+						(counts[next] ? sums[channel][next] : sums[channel][previous]) * weight;
+				}
+			}
+		}
+
+		printf("%u points at %.3f ns, %u interpolated from their neighbours\n\n", nBins, timeInterval / interleave, nEmpty);
+
+		printf("Ten readings after trigger\n");
+		printf("Channel readings are in %s.\n\n", ( scaleVoltages ) ? ("mV") : ("ADC Counts"));
+
+		printf("Time (ns)  ");
+
+		for (channel = 0; channel < unit->channelCount; channel++)
+		{
+			if (unit->channelSettings[channel].enabled)
+			{
+				printf("Channel%c:    ", 'A' + channel);
+			}
+		}
+
+		printf("\n");
+
+		for (bin = interleave; bin < (uint32_t) interleave + 10 && bin < nBins; bin++)
+		{
+			printf("%8.3f   ", ((double) bin / interleave - 1.0) * timeInterval);
+
+			for (channel = 0; channel < unit->channelCount; channel++)
+			{
+				if (unit->channelSettings[channel].enabled)
+				{
+					printf("  %6d     ", scaleVoltages ?
+						adc_to_mv((int32_t) floor(sums[channel][bin] + 0.5), unit->channelSettings[channel].range, unit)	// If scaleVoltages, print mV value
+						: (int32_t) floor(sums[channel][bin] + 0.5));														// else print ADC Count
+				}
+			}
+
+			printf("\n");
+		}
+
+		fopen_s(&fp, SoftEtsFile, "w");
+
+		if (fp != NULL)
+		{
+			fprintf(fp, "Software ETS Data log\n\n");
+			fprintf(fp, "%u captures over %u trigger delay steps, %u rejected, interleave factor %d\n", nTotalCaptures, nSteps, nRejected, interleave);
+			fprintf(fp, "Time is from the trigger event. Results shown are ADC Count & mV for each enabled channel\n\n");
+
+			for (bin = 0; bin < nBins; bin++)
+			{
+				fprintf(fp, "%10.3f ", ((double) bin / interleave - 1.0) * timeInterval);
+
+				for (channel = 0; channel < unit->channelCount; channel++)
+				{
+					if (unit->channelSettings[channel].enabled)
+					{
+						fprintf(fp, "Ch%C  %8.1f = %+8.2fmV   ", 'A' + channel, sums[channel][bin],
+							sums[channel][bin] * inputRanges[unit->channelSettings[channel].range] / unit->maxADCValue);
+					}
+				}
+
+				fprintf(fp, "\n");
+			}
+
+			fclose(fp);
+			printf("\nData written to %s\n", SoftEtsFile);
+		}
+		else
+		{
+			printf(	"Cannot open the file %s for writing.\n"
+				"Please ensure that you have permission to access the file.\n", SoftEtsFile);
+		}
+	}
+
+	// Unregister the buffers before they are freed and go back to a single segment
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				ps4000aSetDataBuffer(unit->handle, (PS4000A_CHANNEL) channel, NULL, 0, capture, PS4000A_RATIO_MODE_NONE);
+			}
+		}
+
+		free(data[channel]);
+		free(sums[channel]);
+	}
+
+	ps4000aSetNoOfCaptures(unit->handle, 1);
+	ps4000aMemorySegments(unit->handle, 1, &nMaxSamples);
+
+	free(overflow);
+	free(rejected);
+	free(times);
+	free(timeUnits);
+	free(offsetSamples);
+	free(residuals);
+	free(sorted);
+	free(counts);
+	free(phaseCounts);
+}
+
 /****************************************************************************
 * Initialise unit' structure with Variant specific defaults
 ****************************************************************************/
@@ -2069,6 +2699,7 @@ void MainMenu(UNIT *unit)
 		}
 		
 		printf("R - Collect set of rapid captures\n");
+		printf("Q - Software ETS from rapid captures\n");
 		printf("S - Immediate streaming\n");
 		printf("W - Triggered streaming\n");
 		
@@ -2103,6 +2734,10 @@ void MainMenu(UNIT *unit)
 				CollectRapidBlock(unit);
 				break;
 
+			case 'Q':
+				CollectBlockSoftEts(unit);
+				break;
+
 			case 'S':
 				CollectStreamingImmediate(unit);
 				break;
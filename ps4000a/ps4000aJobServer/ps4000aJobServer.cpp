@@ -0,0 +1,1740 @@
+/*******************************************************************************
+ *
+ * Filename: ps4000aJobServer.cpp
+ *
+ * Description:
+ *   This is a console mode program that demonstrates how to share a rack of
+ *   PicoScope 4000 Series (ps4000a) devices between several users.
+ *
+ *   Run without arguments it is the job server: it opens every connected
+ *   device once, keeps them open, and accepts capture jobs on a local (Unix
+ *   domain) socket. Each job asks for a set of channels, their range and
+ *   coupling, a resolution, a sample interval, a duration and an output file,
+ *   and optionally a model or serial number.
+ *
+ *   Jobs wait in submission order. Whenever a device is free the first job
+ *   it can run is given to it, so a job can only be overtaken by jobs that
+ *   use devices it cannot. Of the free devices that can run a job the
+ *   server picks the one that needs the fewest settings changed, since the
+ *   settings each job leaves behind stay on the device, then the one with
+ *   the fewest channels. Every device runs its jobs on its own thread, so
+ *   jobs on different devices run at the same time.
+ *
+ *   Run with arguments it is a client of a running server:
+ *
+ *		ps4000aJobServer submit channels=AB range=5V interval=1 duration=2000 output=/data/run1.bin
+ *		ps4000aJobServer run channels=A range=500mV resolution=14 duration=500 output=/data/run2.bin
+ *		ps4000aJobServer wait 3
+ *		ps4000aJobServer cancel 3
+ *		ps4000aJobServer status
+ *
+ *   "run" submits the job and waits for it to finish. Any program can be a
+ *   client; the protocol is one line of text per request:
+ *
+ *		SUBMIT key=value ...	-> OK <job> | ERROR <reason>
+ *		WAIT <job>						-> DONE <job> <state> key=value ...
+ *		CANCEL <job>					-> OK <job> | ERROR <reason>
+ *		STATUS								-> device and job lines, then END
+ *
+ *   SUBMIT keys:
+ *
+ *		channels		Channels to capture, e.g. ABD (default A)
+ *		range				Range of every channel, 10mV..200V (default 5V)
+ *		rangeX			Range of channel X only, e.g. rangeB=500mV
+ *		coupling		AC or DC (default DC)
+ *		resolution	12 or 14 bits (default 12; 14 needs a PicoScope 4444)
+ *		interval		Sample interval in microseconds (default 1)
+ *		duration		Capture length in milliseconds (required)
+ *		output			File the samples are written to (required); a relative
+ *								path is relative to the server's working directory
+ *		model				Only run on this model, e.g. 4444
+ *		serial			Only run on the device with this serial number
+ *
+ *	Supported PicoScope models:
+ *
+ *		PicoScope 4225 & 4425
+ *		PicoScope 4444
+ *		PicoScope 4824
+ *
+ * Examples:
+ *
+ *	Share every connected device between the clients of one server
+ *	Reuse the open handle and settings of a device from one job to the next
+ *	Run jobs on different devices at the same time
+ *	Report the utilisation of each device and the start-up time of jobs
+ *
+ *	Output:
+ *
+ *		Each job writes one file: a JOB_FILE_HEADER followed by the samples of
+ *		its channels interleaved (A B D A B D ...) as int16 ADC counts.
+ *
+ *	To build this application:-
+ *
+ *		If Microsoft Visual Studio (including Express) is being used:
+ *
+ *			Select the solution configuration (Debug/Release) and platform (x86/x64)
+ *			Ensure that the 32-/64-bit ps4000a.lib can be located
+ *			Ensure that the ps4000aApi.h, PicoConnectProbes.h and PicoStatus.h
+ *			files can be located
+ *			Unix domain sockets need Windows 10 version 1803 or later
+ *
+ *		Otherwise:
+ *
+ *			 Set up a project for a 32-/64-bit console mode application
+ *			 Add this file to the project
+ *			 Add ps4000a.lib and ws2_32.lib to the project (Microsoft C only)
+ *			 Add ps4000aApi.h, PicoConnectProbes.h and PicoStatus.h to the project
+ *			 Build the project
+ *
+ *  Linux platforms:
+ *
+ *		Ensure that the libps4000a driver package has been installed using the
+ *		instructions from https://www.picotech.com/downloads/linux
+ *
+ *		Place this file in the same folder as the files from the linux-build-files
+ *		folder.
+ *		Edit the configure.ac and Makefile.am files as required (the program
+ *		needs C++11 and -pthread).
+ *		In a terminal window, use the following commands to build the application:
+ *
+ *			./autogen.sh <ENTER>
+ *			make <ENTER>
+ *
+ * Copyright (C) 2013-2018 Pico Technology Ltd. See LICENSE file for terms.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/* Headers for Windows */
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#include "windows.h"
+#include <conio.h>
+#include "ps4000aApi.h"
+
+#define MSG_NOSIGNAL 0
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+
+typedef int32_t socklen_t;
+#else
+#include <sys/types.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <strings.h>
+
+#include <libps4000a-1.0/ps4000aApi.h>
+#ifndef PICO_STATUS
+#include <libps4000a-1.0/PicoStatus.h>
+#endif
+
+#define Sleep(a) usleep(1000*a)
+#define scanf_s scanf
+#define closesocket close
+#define INVALID_SOCKET (-1)
+
+typedef int32_t SOCKET;
+
+typedef enum enBOOL{FALSE,TRUE} BOOL;
+
+/* A function to detect a keyboard press on Linux */
+int32_t _getch()
+{
+	struct termios oldt, newt;
+	int32_t ch;
+	int32_t bytesWaiting;
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~( ICANON | ECHO );
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	setbuf(stdin, NULL);
+	do {
+		ioctl(STDIN_FILENO, FIONREAD, &bytesWaiting);
+		if (bytesWaiting)
+			getchar();
+	} while (bytesWaiting);
+
+	ch = getchar();
+
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return ch;
+}
+
+int32_t fopen_s(FILE ** a, const char * b, const char * c)
+{
+	FILE * fp = fopen(b,c);
+	*a = fp;
+	return (fp != NULL)?0:-1;
+}
+#endif
+
+#define OCTO_SCOPE		8
+#define QUAD_SCOPE		4
+#define DUAL_SCOPE		2
+
+#define MAX_PICO_DEVICES	64
+#define MAX_CLIENTS				32
+
+#ifdef _WIN32
+#define JOB_SOCKET_PATH		"ps4000aJobServer.sock"
+#else
+#define JOB_SOCKET_PATH		"/tmp/ps4000aJobServer.sock"
+#endif
+
+#define JOB_TABLE_SIZE				1024						// Jobs remembered; a slot is reused once its job has finished
+#define JOB_LINE_LENGTH				1024
+#define JOB_OUTPUT_LENGTH			256
+#define JOB_BUFFER_SAMPLES		100000					// Driver buffer of each channel
+#define JOB_POLL_MS						1
+#define JOB_FILE_MAGIC				0x424F4A50			// "PJOB"
+#define JOB_FILE_VERSION			1
+#define JOB_MAX_DURATION_MS		(24 * 3600 * 1000)
+
+// Cost of a settings change when choosing between free devices
+#define COST_RESOLUTION				8
+#define COST_CHANNEL					1
+
+typedef enum
+{
+	MODEL_NONE = 0,
+	MODEL_PS4824 = 0x12d8,
+	MODEL_PS4225 = 0x1081,
+	MODEL_PS4425 = 0x1149,
+	MODEL_PS4444 = 0x115C
+} MODEL_TYPE;
+
+typedef struct
+{
+	int16_t DCcoupled;
+	int16_t range;
+	int16_t enabled;
+	float analogueOffset;
+}CHANNEL_SETTINGS;
+
+typedef struct
+{
+	int16_t						handle;
+	MODEL_TYPE				model;
+	int8_t						modelString[8];
+	int8_t						serial[11];
+	int16_t						channelCount;
+	int16_t						maxADCValue;
+	CHANNEL_SETTINGS	channelSettings[PS4000A_MAX_CHANNELS];
+}UNIT;
+
+// The settings a job asks for, and the settings a job leaves on a device
+typedef struct tJobConfig
+{
+	uint16_t									channelMask;
+	int16_t										range[PS4000A_MAX_CHANNELS];
+	int16_t										DCcoupled;
+	PS4000A_DEVICE_RESOLUTION	resolution;
+	uint32_t									sampleIntervalUs;
+} JOB_CONFIG;
+
+typedef enum
+{
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_CANCELLED
+} JOB_STATE;
+
+typedef struct tJob
+{
+	uint32_t		id;
+	JOB_STATE		state;
+	JOB_CONFIG	config;
+	MODEL_TYPE	model;														// MODEL_NONE for any model
+	int8_t			serial[11];												// Empty for any device
+	uint32_t		durationMs;
+	char				output[JOB_OUTPUT_LENGTH];
+	int16_t			cancel;
+	int32_t			device;
+	int64_t			submittedUs;
+	int64_t			startedUs;
+	int64_t			setupUs;													// From being given a device to streaming
+	int64_t			finishedUs;
+	int16_t			changes;													// Settings that had to be changed
+	uint64_t		samples;
+	PICO_STATUS	status;
+	char				error[JOB_OUTPUT_LENGTH + 64];
+} JOB;
+
+typedef struct tJobFileHeader
+{
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	headerBytes;
+	uint16_t	channelMask;												// Bit 0 = channel A
+	uint16_t	channels;
+	int16_t		maxADCValue;
+	uint16_t	resolutionBits;
+	uint32_t	sampleIntervalNs;
+	uint32_t	jobId;
+	int32_t		rangeMv[PS4000A_MAX_CHANNELS];			// Of each channel in the file, in file order
+	int8_t		model[8];
+	int8_t		serial[12];
+} JOB_FILE_HEADER;
+
+typedef struct tPoolDevice
+{
+	UNIT								unit;
+	int16_t							index;
+	JOB_CONFIG					warm;										// Settings the device has now
+	int16_t							configured;							// FALSE until the first job has set warm
+	JOB *								job;										// Job running or about to run, NULL when free
+	int16_t *						driverBuffers[PS4000A_MAX_CHANNELS];
+	int16_t *						interleaved;
+	FILE *							fp;
+	std::thread					thread;
+	std::condition_variable	wake;
+	uint32_t						jobs;
+	uint32_t						warmJobs;								// Jobs that changed no settings
+	int64_t							busyUs;
+	int64_t							setupUs;
+} POOL_DEVICE;
+
+typedef struct tPool
+{
+	std::mutex							mutex;
+	std::condition_variable	finished;							// A job has finished or been cancelled
+	POOL_DEVICE							devices[MAX_PICO_DEVICES];
+	uint16_t								nDevices;
+	JOB											jobs[JOB_TABLE_SIZE];
+	uint32_t								nextId;
+	int16_t									running;
+	int64_t									startedUs;
+	SOCKET									listener;
+	SOCKET									clients[MAX_CLIENTS];
+	uint16_t								nClients;
+} POOL;
+
+POOL g_pool;
+
+const char * rangeNames[PS4000A_MAX_RANGES] = { "10mV", "20mV", "50mV", "100mV", "200mV", "500mV", "1V", "2V", "5V", "10V", "20V", "50V", "100V", "200V" };
+int32_t inputRanges[PS4000A_MAX_RANGES] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000 };
+const char * stateNames[] = { "free", "queued", "running", "done", "failed", "cancelled" };
+
+/****************************************************************************
+* TimeNowUs
+****************************************************************************/
+int64_t TimeNowUs(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/****************************************************************************
+* SetDefaults - set up channel voltage scales, coupling and offset
+****************************************************************************/
+PICO_STATUS SetDefaults(UNIT * unit)
+{
+	PICO_STATUS status = PICO_OK;
+
+	for (int32_t ch = 0; ch < unit->channelCount && status == PICO_OK; ch++)
+	{
+		status = ps4000aSetChannel(unit->handle,
+			(PS4000A_CHANNEL)(PS4000A_CHANNEL_A + ch),
+			unit->channelSettings[PS4000A_CHANNEL_A + ch].enabled,
+			(PS4000A_COUPLING)unit->channelSettings[PS4000A_CHANNEL_A + ch].DCcoupled,
+			(PICO_CONNECT_PROBE_RANGE) unit->channelSettings[PS4000A_CHANNEL_A + ch].range,
+			unit->channelSettings[PS4000A_CHANNEL_A + ch].analogueOffset);
+
+		printf(status ? "SetDefaults:ps4000aSetChannel------ 0x%08lx for channel %i\n" : "", (unsigned long) status, ch);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* OpenDevice
+* Opens the next device not yet opened and enables all of its channels
+*
+* Returns
+* - PICO_STATUS to indicate success, or if an error occurred
+***************************************************************************/
+PICO_STATUS OpenDevice(UNIT * unit)
+{
+	PICO_STATUS status;
+	int8_t line[80];
+	int16_t requiredSize;
+
+	status = ps4000aOpenUnit(&unit->handle, NULL);
+
+	if (unit->handle <= 0)
+	{
+		return status;
+	}
+
+	// Run from USB power only if that's what the device is connected to
+	if (status == PICO_POWER_SUPPLY_NOT_CONNECTED || status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT)
+	{
+		status = ps4000aChangePowerSource(unit->handle, status);
+	}
+
+	if (status != PICO_OK)
+	{
+		ps4000aCloseUnit(unit->handle);
+		return status;
+	}
+
+	ps4000aGetUnitInfo(unit->handle, line, sizeof(line), &requiredSize, PICO_VARIANT_INFO);
+	memcpy(unit->modelString, line, sizeof(unit->modelString));
+	unit->modelString[sizeof(unit->modelString) - 1] = 0;
+
+	ps4000aGetUnitInfo(unit->handle, line, sizeof(line), &requiredSize, PICO_BATCH_AND_SERIAL);
+	memcpy(unit->serial, line, sizeof(unit->serial));
+	unit->serial[sizeof(unit->serial) - 1] = 0;
+
+	switch (atoi((char *) unit->modelString))
+	{
+		case MODEL_PS4824:
+			unit->model = MODEL_PS4824;
+			unit->channelCount = OCTO_SCOPE;
+			break;
+
+		case MODEL_PS4225:
+			unit->model = MODEL_PS4225;
+			unit->channelCount = DUAL_SCOPE;
+			break;
+
+		default:
+			unit->model = (MODEL_TYPE) atoi((char *) unit->modelString);
+			unit->channelCount = QUAD_SCOPE;
+			break;
+	}
+
+	for (int ch = 0; ch < unit->channelCount; ch++)
+	{
+		unit->channelSettings[ch].enabled = TRUE;
+		unit->channelSettings[ch].DCcoupled = TRUE;
+		unit->channelSettings[ch].range = PS4000A_5V;
+		unit->channelSettings[ch].analogueOffset = 0.0f;
+	}
+
+	ps4000aMaximumValue(unit->handle, &unit->maxADCValue);
+
+	return SetDefaults(unit);
+}
+
+/****************************************************************************
+* JobCanRun
+*
+* Whether a device can ever run a job, whether or not it is free
+****************************************************************************/
+int16_t JobCanRun(POOL_DEVICE * device, JOB * job)
+{
+	if (job->model != MODEL_NONE && job->model != device->unit.model)
+	{
+		return FALSE;
+	}
+
+	if (job->serial[0] != 0 && strcmp((char *) job->serial, (char *) device->unit.serial) != 0)
+	{
+		return FALSE;
+	}
+
+	if (job->config.channelMask >> device->unit.channelCount)
+	{
+		return FALSE;
+	}
+
+	// Only the PicoScope 4444 has a choice of resolution
+	return job->config.resolution == PS4000A_DR_12BIT || device->unit.model == MODEL_PS4444;
+}
+
+/****************************************************************************
+* ConfigCost
+*
+* How much of a device's present settings a job would have to change
+****************************************************************************/
+int32_t ConfigCost(POOL_DEVICE * device, JOB_CONFIG * config)
+{
+	int32_t cost = 0;
+	int16_t ch;
+	int16_t wanted;
+	int16_t present;
+
+	if (!device->configured)
+	{
+		return COST_RESOLUTION + device->unit.channelCount * COST_CHANNEL;
+	}
+
+	if (config->resolution != device->warm.resolution)
+	{
+		cost += COST_RESOLUTION;
+	}
+
+	for (ch = 0; ch < device->unit.channelCount; ch++)
+	{
+		wanted = (config->channelMask >> ch) & 1;
+		present = (device->warm.channelMask >> ch) & 1;
+
+		if (wanted != present || (wanted && (config->range[ch] != device->warm.range[ch] || config->DCcoupled != device->warm.DCcoupled)))
+		{
+			cost += COST_CHANNEL;
+		}
+	}
+
+	return cost;
+}
+
+/****************************************************************************
+* PoolSchedule
+*
+* Gives free devices the first queued jobs they can run. Called with the
+* pool locked whenever a job is queued or a device becomes free.
+****************************************************************************/
+void PoolSchedule(void)
+{
+	POOL_DEVICE * device;
+	POOL_DEVICE * best;
+	JOB * job;
+	int32_t cost;
+	int32_t bestCost;
+	uint32_t id;
+	uint32_t oldest;
+	uint16_t i;
+
+	oldest = g_pool.nextId > JOB_TABLE_SIZE ? g_pool.nextId - JOB_TABLE_SIZE : 0;
+
+	for (id = oldest; id < g_pool.nextId; id++)
+	{
+		job = &g_pool.jobs[id % JOB_TABLE_SIZE];
+
+		if (job->state != JOB_QUEUED || job->id != id)
+		{
+			continue;
+		}
+
+		best = NULL;
+		bestCost = 0;
+
+		for (i = 0; i < g_pool.nDevices; i++)
+		{
+			device = &g_pool.devices[i];
+
+			if (device->job != NULL || !JobCanRun(device, job))
+			{
+				continue;
+			}
+
+			cost = ConfigCost(device, &job->config);
+
+			if (best == NULL || cost < bestCost || (cost == bestCost && device->unit.channelCount < best->unit.channelCount))
+			{
+				best = device;
+				bestCost = cost;
+			}
+		}
+
+		if (best != NULL)
+		{
+			job->state = JOB_RUNNING;
+			job->device = best->index;
+			job->startedUs = TimeNowUs();
+			best->job = job;
+			best->wake.notify_one();
+		}
+	}
+}
+
+/****************************************************************************
+* ApplyConfig
+*
+* Changes only the settings of a device that differ from what a job needs.
+* Returns the number of settings changed.
+****************************************************************************/
+int16_t ApplyConfig(POOL_DEVICE * device, JOB_CONFIG * config, PICO_STATUS * status)
+{
+	UNIT * unit = &device->unit;
+	int16_t changes = 0;
+	int16_t ch;
+	int16_t enabled;
+
+	*status = PICO_OK;
+
+	if (unit->model == MODEL_PS4444 && (!device->configured || config->resolution != device->warm.resolution))
+	{
+		*status = ps4000aSetDeviceResolution(unit->handle, config->resolution);
+
+		if (*status != PICO_OK)
+		{
+			return changes;
+		}
+
+		ps4000aMaximumValue(unit->handle, &unit->maxADCValue);
+		changes++;
+	}
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		enabled = (config->channelMask >> ch) & 1;
+
+		if (device->configured && enabled == unit->channelSettings[ch].enabled &&
+			(!enabled || (config->range[ch] == unit->channelSettings[ch].range && config->DCcoupled == unit->channelSettings[ch].DCcoupled)))
+		{
+			continue;
+		}
+
+		unit->channelSettings[ch].enabled = enabled;
+
+		if (enabled)
+		{
+			unit->channelSettings[ch].range = config->range[ch];
+			unit->channelSettings[ch].DCcoupled = config->DCcoupled;
+		}
+
+		*status = ps4000aSetChannel(unit->handle, (PS4000A_CHANNEL) (PS4000A_CHANNEL_A + ch), unit->channelSettings[ch].enabled,
+			(PS4000A_COUPLING) unit->channelSettings[ch].DCcoupled, (PICO_CONNECT_PROBE_RANGE) unit->channelSettings[ch].range,
+			unit->channelSettings[ch].analogueOffset);
+
+		if (*status != PICO_OK)
+		{
+			device->configured = FALSE;
+			return changes;
+		}
+
+		changes++;
+	}
+
+	device->warm = *config;
+
+	for (ch = 0; ch < PS4000A_MAX_CHANNELS; ch++)
+	{
+		if (!((config->channelMask >> ch) & 1))
+		{
+			device->warm.range[ch] = unit->channelSettings[ch].range;
+		}
+	}
+
+	device->configured = TRUE;
+
+	return changes;
+}
+
+/****************************************************************************
+* Callback
+* Used by ps4000a data streaming collection calls, on receipt of data.
+*
+* Interleaves the new samples of the job's channels and writes them out
+****************************************************************************/
+void PREF4 CallBackJob
+(
+	int16_t handle,
+	int32_t noOfSamples,
+	uint32_t startIndex,
+	int16_t overflow,
+	uint32_t triggerAt,
+	int16_t triggered,
+	int16_t autoStop,
+	void * pParameter
+)
+{
+	POOL_DEVICE * device = (POOL_DEVICE *) pParameter;
+	JOB * job = device->job;
+	int16_t * samples = device->interleaved;
+	int16_t ch;
+	int32_t i;
+
+	for (i = 0; i < noOfSamples; i++)
+	{
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			if ((job->config.channelMask >> ch) & 1)
+			{
+				*samples++ = device->driverBuffers[ch][startIndex + i];
+			}
+		}
+	}
+
+	if (job->error[0] == 0 && fwrite(device->interleaved, sizeof(int16_t), samples - device->interleaved, device->fp) != (size_t) (samples - device->interleaved))
+	{
+		snprintf(job->error, sizeof(job->error), "cannot write %s", job->output);
+	}
+
+	job->samples += noOfSamples;
+}
+
+/****************************************************************************
+* JobCancelled
+****************************************************************************/
+int16_t JobCancelled(JOB * job)
+{
+	std::lock_guard<std::mutex> lock(g_pool.mutex);
+
+	return job->cancel;
+}
+
+/****************************************************************************
+* JobRun
+*
+* Configures the device for a job, streams for the job's duration and
+* writes the samples to its output file. Sets the job's error on failure.
+****************************************************************************/
+PICO_STATUS JobRun(POOL_DEVICE * device, JOB * job)
+{
+	JOB_FILE_HEADER header;
+	PICO_STATUS status;
+	uint32_t sampleInterval;
+	int16_t ch;
+	int64_t endUs;
+
+	job->changes = ApplyConfig(device, &job->config, &status);
+
+	if (status != PICO_OK)
+	{
+		snprintf(job->error, sizeof(job->error), "device settings rejected (0x%08lx)", (unsigned long) status);
+		return status;
+	}
+
+	for (ch = 0; ch < device->unit.channelCount; ch++)
+	{
+		ps4000aSetDataBuffer(device->unit.handle, (PS4000A_CHANNEL) ch, ((job->config.channelMask >> ch) & 1) ? device->driverBuffers[ch] : NULL,
+			JOB_BUFFER_SAMPLES, 0, PS4000A_RATIO_MODE_NONE);
+	}
+
+	fopen_s(&device->fp, job->output, "wb");
+
+	if (device->fp == NULL)
+	{
+		snprintf(job->error, sizeof(job->error), "cannot create %s", job->output);
+		return PICO_OK;
+	}
+
+	sampleInterval = job->config.sampleIntervalUs;
+	status = ps4000aRunStreaming(device->unit.handle, &sampleInterval, PS4000A_US, 0, JOB_BUFFER_SAMPLES, FALSE, 1, PS4000A_RATIO_MODE_NONE, JOB_BUFFER_SAMPLES);
+
+	if (status != PICO_OK)
+	{
+		snprintf(job->error, sizeof(job->error), "ps4000aRunStreaming 0x%08lx", (unsigned long) status);
+		fclose(device->fp);
+		device->fp = NULL;
+		return status;
+	}
+
+	job->setupUs = TimeNowUs() - job->startedUs;
+
+	// The driver may have chosen a different interval, so the header is written once streaming
+	memset(&header, 0, sizeof(JOB_FILE_HEADER));
+	header.magic = JOB_FILE_MAGIC;
+	header.version = JOB_FILE_VERSION;
+	header.headerBytes = sizeof(JOB_FILE_HEADER);
+	header.channelMask = job->config.channelMask;
+	header.maxADCValue = device->unit.maxADCValue;
+	header.resolutionBits = job->config.resolution == PS4000A_DR_14BIT ? 14 : 12;
+	header.sampleIntervalNs = sampleInterval * 1000;
+	header.jobId = job->id;
+	memcpy(header.model, device->unit.modelString, sizeof(header.model));
+	memcpy(header.serial, device->unit.serial, sizeof(device->unit.serial));
+
+	for (ch = 0; ch < device->unit.channelCount; ch++)
+	{
+		if ((job->config.channelMask >> ch) & 1)
+		{
+			header.rangeMv[header.channels++] = inputRanges[job->config.range[ch]];
+		}
+	}
+
+	fwrite(&header, sizeof(JOB_FILE_HEADER), 1, device->fp);
+
+	endUs = TimeNowUs() + (int64_t) job->durationMs * 1000;
+
+	while (TimeNowUs() < endUs && job->error[0] == 0 && !JobCancelled(job) && status == PICO_OK)
+	{
+		status = ps4000aGetStreamingLatestValues(device->unit.handle, CallBackJob, device);
+
+		if (status == PICO_BUSY)
+		{
+			status = PICO_OK;
+		}
+
+		Sleep(JOB_POLL_MS);
+	}
+
+	ps4000aStop(device->unit.handle);
+
+	if (status != PICO_OK)
+	{
+		snprintf(job->error, sizeof(job->error), "ps4000aGetStreamingLatestValues 0x%08lx", (unsigned long) status);
+	}
+
+	if (fclose(device->fp) != 0 && job->error[0] == 0)
+	{
+		snprintf(job->error, sizeof(job->error), "cannot write %s", job->output);
+	}
+
+	device->fp = NULL;
+
+	return status;
+}
+
+/****************************************************************************
+* DeviceThread
+*
+* Runs the jobs the scheduler gives a device, one after another
+****************************************************************************/
+void DeviceThread(POOL_DEVICE * device)
+{
+	std::unique_lock<std::mutex> lock(g_pool.mutex);
+	JOB * job;
+	PICO_STATUS status;
+	int64_t finishedUs;
+
+	while (TRUE)
+	{
+		device->wake.wait(lock, [device] { return device->job != NULL || !g_pool.running; });
+
+		if (device->job == NULL)
+		{
+			break;
+		}
+
+		job = device->job;
+		lock.unlock();
+
+		status = JobRun(device, job);
+		finishedUs = TimeNowUs();
+
+		lock.lock();
+		job->status = status;
+		job->finishedUs = finishedUs;
+		job->state = job->error[0] != 0 ? JOB_FAILED : job->cancel ? JOB_CANCELLED : JOB_DONE;
+
+		device->jobs++;
+		device->warmJobs += job->changes == 0;
+		device->busyUs += finishedUs - job->startedUs;
+		device->setupUs += job->setupUs;
+		device->job = NULL;
+
+		printf("Job %lu %s on %s (%s): %llu samples, %d settings changed, started in %lld us\n", (unsigned long) job->id, stateNames[job->state],
+			device->unit.serial, device->unit.modelString, (unsigned long long) job->samples, job->changes, (long long) job->setupUs);
+
+		PoolSchedule();
+		g_pool.finished.notify_all();
+	}
+}
+
+/****************************************************************************
+* ParseRange
+****************************************************************************/
+int16_t ParseRange(const char * text)
+{
+	int16_t i;
+
+	for (i = 0; i < PS4000A_MAX_RANGES; i++)
+	{
+		if (strcasecmp(text, rangeNames[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/****************************************************************************
+* ParseJob
+*
+* Fills in a job from the key=value pairs of a SUBMIT request. Returns
+* FALSE with a reason in error if the request is not valid.
+****************************************************************************/
+int16_t ParseJob(char * arguments, JOB * job, char * error, size_t errorLength)
+{
+	char * key;
+	char * value;
+	char * next;
+	int16_t range;
+	int16_t ch;
+	int16_t rangeSet[PS4000A_MAX_CHANNELS] = { FALSE };
+	int16_t defaultRange = PS4000A_5V;
+	int32_t number;
+
+	memset(job, 0, sizeof(JOB));
+	job->config.channelMask = 1;
+	job->config.DCcoupled = TRUE;
+	job->config.resolution = PS4000A_DR_12BIT;
+	job->config.sampleIntervalUs = 1;
+	job->model = MODEL_NONE;
+
+	for (key = arguments; *key != 0; key = next)
+	{
+		while (*key == ' ' || *key == '\t')
+		{
+			key++;
+		}
+
+		if (*key == 0)
+		{
+			break;
+		}
+
+		for (next = key; *next != 0 && *next != ' ' && *next != '\t'; next++)
+		{
+		}
+
+		if (*next != 0)
+		{
+			*next++ = 0;
+		}
+
+		value = strchr(key, '=');
+
+		if (value == NULL)
+		{
+			snprintf(error, errorLength, "expected key=value, not %s", key);
+			return FALSE;
+		}
+
+		*value++ = 0;
+		number = atoi(value);
+
+		if (strcasecmp(key, "channels") == 0)
+		{
+			job->config.channelMask = 0;
+
+			for (; *value != 0; value++)
+			{
+				ch = toupper(*value) - 'A';
+
+				if (ch < 0 || ch >= PS4000A_MAX_CHANNELS)
+				{
+					snprintf(error, errorLength, "no channel %c", *value);
+					return FALSE;
+				}
+
+				job->config.channelMask |= 1 << ch;
+			}
+		}
+		else if (strcasecmp(key, "range") == 0 || (strncasecmp(key, "range", 5) == 0 && strlen(key) == 6))
+		{
+			if ((range = ParseRange(value)) < 0)
+			{
+				snprintf(error, errorLength, "unknown range %s", value);
+				return FALSE;
+			}
+
+			if (key[5] == 0)
+			{
+				defaultRange = range;
+			}
+			else
+			{
+				ch = toupper(key[5]) - 'A';
+
+				if (ch < 0 || ch >= PS4000A_MAX_CHANNELS)
+				{
+					snprintf(error, errorLength, "no channel %c", key[5]);
+					return FALSE;
+				}
+
+				job->config.range[ch] = range;
+				rangeSet[ch] = TRUE;
+			}
+		}
+		else if (strcasecmp(key, "coupling") == 0)
+		{
+			if (strcasecmp(value, "AC") != 0 && strcasecmp(value, "DC") != 0)
+			{
+				snprintf(error, errorLength, "coupling must be AC or DC");
+				return FALSE;
+			}
+
+			job->config.DCcoupled = strcasecmp(value, "DC") == 0;
+		}
+		else if (strcasecmp(key, "resolution") == 0)
+		{
+			if (number != 12 && number != 14)
+			{
+				snprintf(error, errorLength, "resolution must be 12 or 14");
+				return FALSE;
+			}
+
+			job->config.resolution = number == 14 ? PS4000A_DR_14BIT : PS4000A_DR_12BIT;
+		}
+		else if (strcasecmp(key, "interval") == 0)
+		{
+			if (number < 1)
+			{
+				snprintf(error, errorLength, "interval must be at least 1 us");
+				return FALSE;
+			}
+
+			job->config.sampleIntervalUs = number;
+		}
+		else if (strcasecmp(key, "duration") == 0)
+		{
+			if (number < 1 || number > JOB_MAX_DURATION_MS)
+			{
+				snprintf(error, errorLength, "duration must be 1 to %d ms", JOB_MAX_DURATION_MS);
+				return FALSE;
+			}
+
+			job->durationMs = number;
+		}
+		else if (strcasecmp(key, "output") == 0)
+		{
+			if (strlen(value) >= sizeof(job->output))
+			{
+				snprintf(error, errorLength, "output path too long");
+				return FALSE;
+			}
+
+			strcpy(job->output, value);
+		}
+		else if (strcasecmp(key, "model") == 0)
+		{
+			job->model = (MODEL_TYPE) number;
+		}
+		else if (strcasecmp(key, "serial") == 0)
+		{
+			snprintf((char *) job->serial, sizeof(job->serial), "%s", value);
+		}
+		else
+		{
+			snprintf(error, errorLength, "unknown key %s", key);
+			return FALSE;
+		}
+	}
+
+	if (job->config.channelMask == 0 || job->durationMs == 0 || job->output[0] == 0)
+	{
+		snprintf(error, errorLength, "channels, duration and output are required");
+		return FALSE;
+	}
+
+	for (ch = 0; ch < PS4000A_MAX_CHANNELS; ch++)
+	{
+		if (!rangeSet[ch])
+		{
+			job->config.range[ch] = defaultRange;
+		}
+	}
+
+	return TRUE;
+}
+
+/****************************************************************************
+* PoolSubmit
+*
+* Queues a job. Returns FALSE if no device could ever run it or the job
+* table is full of unfinished jobs.
+****************************************************************************/
+int16_t PoolSubmit(JOB * request, uint32_t * id, char * error, size_t errorLength)
+{
+	std::lock_guard<std::mutex> lock(g_pool.mutex);
+	JOB * job;
+	uint16_t i;
+
+	for (i = 0; i < g_pool.nDevices && !JobCanRun(&g_pool.devices[i], request); i++)
+	{
+	}
+
+	if (i == g_pool.nDevices)
+	{
+		snprintf(error, errorLength, "no device can run this job");
+		return FALSE;
+	}
+
+	job = &g_pool.jobs[g_pool.nextId % JOB_TABLE_SIZE];
+
+	if (job->state == JOB_QUEUED || job->state == JOB_RUNNING)
+	{
+		snprintf(error, errorLength, "too many unfinished jobs");
+		return FALSE;
+	}
+
+	*job = *request;
+	job->id = *id = g_pool.nextId++;
+	job->state = JOB_QUEUED;
+	job->device = -1;
+	job->submittedUs = TimeNowUs();
+
+	PoolSchedule();
+
+	return TRUE;
+}
+
+/****************************************************************************
+* PoolFindJob
+*
+* Returns the job with an id, if it is still in the table. The pool must
+* be locked.
+****************************************************************************/
+JOB * PoolFindJob(uint32_t id)
+{
+	JOB * job = &g_pool.jobs[id % JOB_TABLE_SIZE];
+
+	return (id < g_pool.nextId && job->id == id && job->state != JOB_FREE) ? job : NULL;
+}
+
+/****************************************************************************
+* FormatResult
+*
+* The reply to WAIT for a finished job
+****************************************************************************/
+void FormatResult(JOB * job, char * reply, size_t length)
+{
+	POOL_DEVICE * device = job->device >= 0 ? &g_pool.devices[job->device] : NULL;
+
+	snprintf(reply, length, "DONE %lu %s samples=%llu device=%s queued=%lldms setup=%lldus changes=%d file=%s%s%s\n", (unsigned long) job->id,
+		stateNames[job->state], (unsigned long long) job->samples, device != NULL ? (char *) device->unit.serial : "-",
+		(long long) (((job->startedUs ? job->startedUs : job->finishedUs) - job->submittedUs) / 1000), (long long) job->setupUs, job->changes,
+		job->output, job->error[0] ? " error=" : "", job->error);
+}
+
+/****************************************************************************
+* FormatStatus
+*
+* The reply to STATUS: one line per device, then every unfinished job
+****************************************************************************/
+void FormatStatus(char * reply, size_t length)
+{
+	std::lock_guard<std::mutex> lock(g_pool.mutex);
+	POOL_DEVICE * device;
+	JOB * job;
+	size_t used = 0;
+	uint32_t id;
+	uint16_t i;
+	int64_t upUs = TimeNowUs() - g_pool.startedUs;
+
+	for (i = 0; i < g_pool.nDevices && used < length; i++)
+	{
+		device = &g_pool.devices[i];
+		used += snprintf(reply + used, length - used, "DEVICE %d %s %s channels=%d %s jobs=%lu warm=%lu busy=%.1f%% setup=%lldus\n", i,
+			device->unit.serial, device->unit.modelString, device->unit.channelCount,
+			device->job != NULL ? "running" : "free", (unsigned long) device->jobs, (unsigned long) device->warmJobs,
+			100.0 * (device->busyUs + (device->job != NULL ? TimeNowUs() - device->job->startedUs : 0)) / (upUs > 0 ? upUs : 1),
+			(long long) (device->jobs > 0 ? device->setupUs / device->jobs : 0));
+	}
+
+	for (id = g_pool.nextId > JOB_TABLE_SIZE ? g_pool.nextId - JOB_TABLE_SIZE : 0; id < g_pool.nextId && used < length; id++)
+	{
+		job = PoolFindJob(id);
+
+		if (job != NULL && (job->state == JOB_QUEUED || job->state == JOB_RUNNING))
+		{
+			used += snprintf(reply + used, length - used, "JOB %lu %s device=%d channels=0x%x duration=%lums output=%s\n", (unsigned long) job->id,
+				stateNames[job->state], job->device, job->config.channelMask, (unsigned long) job->durationMs, job->output);
+		}
+	}
+
+	if (used < length)
+	{
+		snprintf(reply + used, length - used, "END\n");
+	}
+}
+
+/****************************************************************************
+* HandleRequest
+*
+* Carries out one request line and writes the reply
+****************************************************************************/
+void HandleRequest(char * line, char * reply, size_t length)
+{
+	JOB request;
+	JOB * job;
+	char error[128];
+	uint32_t id;
+
+	if (strncasecmp(line, "SUBMIT", 6) == 0)
+	{
+		if (!ParseJob(line + 6, &request, error, sizeof(error)) || !PoolSubmit(&request, &id, error, sizeof(error)))
+		{
+			snprintf(reply, length, "ERROR %s\n", error);
+			return;
+		}
+
+		snprintf(reply, length, "OK %lu\n", (unsigned long) id);
+	}
+	else if (strncasecmp(line, "WAIT", 4) == 0)
+	{
+		std::unique_lock<std::mutex> lock(g_pool.mutex);
+
+		id = (uint32_t) strtoul(line + 4, NULL, 10);
+
+		if ((job = PoolFindJob(id)) == NULL)
+		{
+			snprintf(reply, length, "ERROR unknown job %lu\n", (unsigned long) id);
+			return;
+		}
+
+		g_pool.finished.wait(lock, [job] { return job->state != JOB_QUEUED && job->state != JOB_RUNNING; });
+		FormatResult(job, reply, length);
+	}
+	else if (strncasecmp(line, "CANCEL", 6) == 0)
+	{
+		std::lock_guard<std::mutex> lock(g_pool.mutex);
+
+		id = (uint32_t) strtoul(line + 6, NULL, 10);
+
+		if ((job = PoolFindJob(id)) == NULL || (job->state != JOB_QUEUED && job->state != JOB_RUNNING))
+		{
+			snprintf(reply, length, "ERROR job %lu is not queued or running\n", (unsigned long) id);
+			return;
+		}
+
+		// A running job stops at its next poll; a queued one never starts
+		job->cancel = TRUE;
+
+		if (job->state == JOB_QUEUED)
+		{
+			job->state = JOB_CANCELLED;
+			job->finishedUs = TimeNowUs();
+			g_pool.finished.notify_all();
+		}
+
+		snprintf(reply, length, "OK %lu\n", (unsigned long) id);
+	}
+	else if (strncasecmp(line, "STATUS", 6) == 0)
+	{
+		FormatStatus(reply, length);
+	}
+	else
+	{
+		snprintf(reply, length, "ERROR unknown request\n");
+	}
+}
+
+/****************************************************************************
+* SendAll
+****************************************************************************/
+int16_t SendAll(SOCKET s, const char * data, size_t length)
+{
+	int32_t sent;
+
+	while (length > 0)
+	{
+		sent = send(s, data, (int32_t) length, MSG_NOSIGNAL);
+
+		if (sent <= 0)
+		{
+			return FALSE;
+		}
+
+		data += sent;
+		length -= sent;
+	}
+
+	return TRUE;
+}
+
+/****************************************************************************
+* ClientThread
+*
+* Serves the requests of one client, one line at a time, until it
+* disconnects or the server stops
+****************************************************************************/
+void ClientThread(SOCKET s)
+{
+	char line[JOB_LINE_LENGTH];
+	char * reply = (char *) malloc(JOB_TABLE_SIZE * 128);
+	char * end;
+	size_t used = 0;
+	int32_t received;
+	uint16_t i;
+
+	while (reply != NULL && (received = recv(s, line + used, (int32_t) (sizeof(line) - 1 - used), 0)) > 0)
+	{
+		used += received;
+		line[used] = 0;
+
+		while ((end = strchr(line, '\n')) != NULL)
+		{
+			*end = 0;
+
+			if (end > line && end[-1] == '\r')
+			{
+				end[-1] = 0;
+			}
+
+			HandleRequest(line, reply, JOB_TABLE_SIZE * 128);
+
+			if (!SendAll(s, reply, strlen(reply)))
+			{
+				used = sizeof(line);
+				break;
+			}
+
+			used -= end + 1 - line;
+			memmove(line, end + 1, used + 1);
+		}
+
+		if (used >= sizeof(line) - 1)
+		{
+			break;		// Line too long, or the client has gone
+		}
+	}
+
+	free(reply);
+
+	std::lock_guard<std::mutex> lock(g_pool.mutex);
+
+	for (i = 0; i < g_pool.nClients && g_pool.clients[i] != s; i++)
+	{
+	}
+
+	if (i < g_pool.nClients)
+	{
+		g_pool.clients[i] = g_pool.clients[--g_pool.nClients];
+	}
+
+	closesocket(s);
+	g_pool.finished.notify_all();
+}
+
+/****************************************************************************
+* ListenThread
+*
+* Accepts clients until the listening socket is closed
+****************************************************************************/
+void ListenThread(void)
+{
+	SOCKET s;
+
+	while ((s = accept(g_pool.listener, NULL, NULL)) != INVALID_SOCKET)
+	{
+		std::lock_guard<std::mutex> lock(g_pool.mutex);
+
+		if (!g_pool.running || g_pool.nClients == MAX_CLIENTS)
+		{
+			SendAll(s, "ERROR server busy\n", 18);
+			closesocket(s);
+			continue;
+		}
+
+		g_pool.clients[g_pool.nClients++] = s;
+		std::thread(ClientThread, s).detach();
+	}
+}
+
+/****************************************************************************
+* SocketAddress
+****************************************************************************/
+void SocketAddress(const char * path, struct sockaddr_un * address)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	strncpy(address->sun_path, path, sizeof(address->sun_path) - 1);
+}
+
+/****************************************************************************
+* OpenListener
+*
+* Creates the server's socket. A socket file left by a server that is no
+* longer running is removed first.
+****************************************************************************/
+SOCKET OpenListener(const char * path)
+{
+	struct sockaddr_un address;
+	SOCKET s;
+#ifndef _WIN32
+	struct stat info;
+#endif
+
+	SocketAddress(path, &address);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	if (connect(s, (struct sockaddr *) &address, sizeof(address)) == 0)
+	{
+		printf("A job server is already running on %s\n", path);
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	closesocket(s);
+
+#ifndef _WIN32
+	if (stat(path, &info) == 0 && !S_ISSOCK(info.st_mode))
+	{
+		printf("%s exists and is not a socket\n", path);
+		return INVALID_SOCKET;
+	}
+#endif
+
+	remove(path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+		bind(s, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(s, MAX_CLIENTS) != 0)
+	{
+		printf("Cannot listen on %s\n", path);
+
+		if (s != INVALID_SOCKET)
+		{
+			closesocket(s);
+		}
+
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+/****************************************************************************
+* PrintUtilisation
+****************************************************************************/
+void PrintUtilisation(void)
+{
+	std::lock_guard<std::mutex> lock(g_pool.mutex);
+	POOL_DEVICE * device;
+	uint16_t i;
+	int64_t upUs = TimeNowUs() - g_pool.startedUs;
+
+	printf("\nDevice  Serial      Model  Jobs  Warm   Busy  Avg setup\n");
+
+	for (i = 0; i < g_pool.nDevices; i++)
+	{
+		device = &g_pool.devices[i];
+		printf("%6d  %-10s  %5s  %4lu  %4lu  %4.1f%%  %6lld us%s\n", i, device->unit.serial, device->unit.modelString, (unsigned long) device->jobs,
+			(unsigned long) device->warmJobs, 100.0 * device->busyUs / (upUs > 0 ? upUs : 1),
+			(long long) (device->jobs > 0 ? device->setupUs / device->jobs : 0), device->job != NULL ? "  (running)" : "");
+	}
+}
+
+/****************************************************************************
+* Serve
+*
+* Opens every connected device and serves jobs until X is pressed
+****************************************************************************/
+void Serve(const char * path)
+{
+	POOL_DEVICE * device;
+	PICO_STATUS status = PICO_OK;
+	std::thread listener;
+	uint32_t id;
+	uint16_t i;
+	int16_t ch;
+	int16_t allocationFailed;
+	int8_t key = ' ';
+
+	printf("Opening devices...\n");
+
+	while (g_pool.nDevices < MAX_PICO_DEVICES)
+	{
+		device = &g_pool.devices[g_pool.nDevices];
+		memset(&device->unit, 0, sizeof(UNIT));
+
+		if ((status = OpenDevice(&device->unit)) != PICO_OK)
+		{
+			break;
+		}
+
+		device->index = g_pool.nDevices;
+		allocationFailed = FALSE;
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			device->driverBuffers[ch] = (int16_t *) calloc(JOB_BUFFER_SAMPLES, sizeof(int16_t));
+			allocationFailed |= (device->driverBuffers[ch] == NULL);
+		}
+
+		device->interleaved = (int16_t *) calloc((size_t) JOB_BUFFER_SAMPLES * device->unit.channelCount, sizeof(int16_t));
+
+		// Leave the device out of the pool rather than serve jobs it cannot hold
+		if (allocationFailed || device->interleaved == NULL)
+		{
+			printf("Device %d: Not enough memory for its buffers, not used\n", g_pool.nDevices);
+
+			for (ch = 0; ch < device->unit.channelCount; ch++)
+			{
+				free(device->driverBuffers[ch]);
+				device->driverBuffers[ch] = NULL;
+			}
+
+			free(device->interleaved);
+			device->interleaved = NULL;
+			ps4000aCloseUnit(device->unit.handle);
+			break;
+		}
+
+		printf("Device %d: PicoScope %s, serial %s, %d channels\n", g_pool.nDevices, device->unit.modelString, device->unit.serial, device->unit.channelCount);
+		g_pool.nDevices++;
+	}
+
+	if (status != PICO_OK && status != PICO_NOT_FOUND)
+	{
+		printf("OpenDevice ------ 0x%08lx \n", (unsigned long) status);
+	}
+
+	if (g_pool.nDevices == 0)
+	{
+		printf("No devices found\n");
+		return;
+	}
+
+	g_pool.listener = OpenListener(path);
+
+	if (g_pool.listener != INVALID_SOCKET)
+	{
+		g_pool.running = TRUE;
+		g_pool.startedUs = TimeNowUs();
+
+		for (i = 0; i < g_pool.nDevices; i++)
+		{
+			g_pool.devices[i].thread = std::thread(DeviceThread, &g_pool.devices[i]);
+		}
+
+		listener = std::thread(ListenThread);
+
+		printf("\nServing %d devices on %s\n", g_pool.nDevices, path);
+
+		while (key != 'X')
+		{
+			printf("\nS - Status                                    X - Exit\n");
+			printf("Operation:");
+
+			key = toupper(_getch());
+
+			printf("\n");
+
+			if (key == 'S')
+			{
+				PrintUtilisation();
+			}
+		}
+
+		// Stop taking requests, cancel every job and wait for the devices to stop
+		{
+			std::lock_guard<std::mutex> lock(g_pool.mutex);
+
+			g_pool.running = FALSE;
+
+			for (id = 0; id < JOB_TABLE_SIZE; id++)
+			{
+				if (g_pool.jobs[id].state == JOB_QUEUED)
+				{
+					g_pool.jobs[id].state = JOB_CANCELLED;
+				}
+
+				g_pool.jobs[id].cancel = TRUE;
+			}
+
+			for (i = 0; i < g_pool.nDevices; i++)
+			{
+				g_pool.devices[i].wake.notify_one();
+			}
+
+			g_pool.finished.notify_all();
+		}
+
+		for (i = 0; i < g_pool.nDevices; i++)
+		{
+			g_pool.devices[i].thread.join();
+		}
+
+#ifdef _WIN32
+		closesocket(g_pool.listener);
+#else
+		shutdown(g_pool.listener, SHUT_RDWR);
+		closesocket(g_pool.listener);
+#endif
+		listener.join();
+		remove(path);
+
+		// Clients may still be waiting for replies; close them and let them finish
+		{
+			std::unique_lock<std::mutex> lock(g_pool.mutex);
+
+			for (i = 0; i < g_pool.nClients; i++)
+			{
+				shutdown(g_pool.clients[i], 2);
+			}
+
+			g_pool.finished.wait(lock, [] { return g_pool.nClients == 0; });
+		}
+
+		PrintUtilisation();
+	}
+
+	for (i = 0; i < g_pool.nDevices; i++)
+	{
+		device = &g_pool.devices[i];
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			ps4000aSetDataBuffer(device->unit.handle, (PS4000A_CHANNEL) ch, NULL, 0, 0, PS4000A_RATIO_MODE_NONE);
+			free(device->driverBuffers[ch]);
+		}
+
+		free(device->interleaved);
+		ps4000aCloseUnit(device->unit.handle);
+	}
+}
+
+/****************************************************************************
+* Request
+*
+* Sends one request to the server and prints the reply. Returns the first
+* line of the reply in firstLine, or FALSE if the server cannot be reached.
+****************************************************************************/
+int16_t Request(const char * path, const char * request, char * firstLine, size_t length)
+{
+	struct sockaddr_un address;
+	char reply[4096];
+	size_t used = 0;
+	int32_t received;
+	int16_t complete = FALSE;
+	SOCKET s;
+
+	SocketAddress(path, &address);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET || connect(s, (struct sockaddr *) &address, sizeof(address)) != 0)
+	{
+		printf("No job server on %s\n", path);
+
+		if (s != INVALID_SOCKET)
+		{
+			closesocket(s);
+		}
+
+		return FALSE;
+	}
+
+	SendAll(s, request, strlen(request));
+	firstLine[0] = 0;
+
+	// STATUS replies end with END, every other reply is one line
+	while (!complete && (received = recv(s, reply + used, (int32_t) (sizeof(reply) - 1 - used), 0)) > 0)
+	{
+		used += received;
+		reply[used] = 0;
+		complete = strncmp(request, "STATUS", 6) != 0 ? strchr(reply, '\n') != NULL : strstr(reply, "END\n") != NULL;
+
+		if (complete || used == sizeof(reply) - 1)
+		{
+			fputs(reply, stdout);
+
+			if (firstLine[0] == 0)
+			{
+				snprintf(firstLine, length, "%s", reply);
+			}
+
+			used = 0;
+		}
+	}
+
+	closesocket(s);
+
+	return complete;
+}
+
+/****************************************************************************
+* Client
+*
+* Sends the request on the command line to a running server
+****************************************************************************/
+int Client(const char * path, int argc, char * argv[])
+{
+	char request[JOB_LINE_LENGTH];
+	char reply[JOB_LINE_LENGTH];
+	size_t used;
+	int i;
+
+	if (strcmp(argv[0], "submit") == 0 || strcmp(argv[0], "run") == 0)
+	{
+		used = snprintf(request, sizeof(request), "SUBMIT");
+
+		for (i = 1; i < argc && used < sizeof(request); i++)
+		{
+			used += snprintf(request + used, sizeof(request) - used, " %s", argv[i]);
+		}
+
+		if (used >= sizeof(request) - 1)
+		{
+			printf("Request too long\n");
+			return 1;
+		}
+
+		strcat(request, "\n");
+
+		if (!Request(path, request, reply, sizeof(reply)) || strncmp(reply, "OK ", 3) != 0)
+		{
+			return 1;
+		}
+
+		if (strcmp(argv[0], "run") != 0)
+		{
+			return 0;
+		}
+
+		snprintf(request, sizeof(request), "WAIT %lu\n", strtoul(reply + 3, NULL, 10));
+	}
+	else if ((strcmp(argv[0], "wait") == 0 || strcmp(argv[0], "cancel") == 0) && argc == 2)
+	{
+		snprintf(request, sizeof(request), "%s %s\n", strcmp(argv[0], "wait") == 0 ? "WAIT" : "CANCEL", argv[1]);
+	}
+	else if (strcmp(argv[0], "status") == 0)
+	{
+		snprintf(request, sizeof(request), "STATUS\n");
+	}
+	else
+	{
+		printf("Usage: ps4000aJobServer [-s socket] [submit|run key=value ... | wait <job> | cancel <job> | status]\n");
+		return 1;
+	}
+
+	if (!Request(path, request, reply, sizeof(reply)))
+	{
+		return 1;
+	}
+
+	return strncmp(reply, "ERROR", 5) == 0 || (strncmp(reply, "DONE", 4) == 0 && strstr(reply, " done ") == NULL);
+}
+
+int main(int argc, char * argv[])
+{
+	const char * path = JOB_SOCKET_PATH;
+	int result = 0;
+
+#ifdef _WIN32
+	WSADATA wsaData;
+
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0)
+	{
+		path = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc > 1)
+	{
+		result = Client(path, argc - 1, argv + 1);
+	}
+	else
+	{
+		printf("PicoScope 4000 Series (ps4000a) Driver Job Server Example Program\n\n");
+		Serve(path);
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return result;
+}
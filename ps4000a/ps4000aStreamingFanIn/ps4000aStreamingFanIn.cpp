@@ -0,0 +1,3011 @@
+/*******************************************************************************
+ *
+ * Filename: ps4000aStreamingFanIn.cpp
+ *
+ * Description:
+ *   This is a console mode program that demonstrates how to stream data from
+ *   several PicoScope 4000 Series (ps4000a) devices at once into a shared
+ *   pool of worker threads.
+ *
+ *   Each device's streaming callback copies its samples into one of a fixed
+ *   number of chunk buffers owned by that device (its credits) and places a
+ *   descriptor for the chunk on a bounded lock-free multi-producer,
+ *   multi-consumer queue. Workers take descriptors off the queues in
+ *   batches, compress the samples, write them out and hand the chunk buffer
+ *   back to the device it came from.
+ *
+ *   A device can never have more chunks in flight than it has credits, so a
+ *   fast device cannot crowd the others out of the queues. When a device is
+ *   running low on credits it is flagged as under backpressure and polling
+ *   it backs off; if it runs out the chunk is dropped and counted.
+ *
+ *   All work runs on one pool, in three strict priority classes:
+ *
+ *		Acquisition	- polling each device (ps4000aGetStreamingLatestValues)
+ *		Persistence	- compressing and writing chunks
+ *		Analysis		- measurements on a copy of each chunk (best effort)
+ *
+ *   Every worker has a queue for each class and steals from the same class
+ *   of the other workers when its own is empty. A worker only starts work of
+ *   a class when no higher class has any waiting, and runs waiting
+ *   acquisition work between the chunks of a persistence batch. Analysis
+ *   works on its own copies of the data so it never holds a device's
+ *   credits.
+ *
+ *   When analysis falls behind a device by more than a set number of chunks
+ *   it is fed min/max pairs instead of raw samples, and further behind (or
+ *   whenever persistence or acquisition lag) only the minimum and maximum of
+ *   each chunk, which the writer finds as it compresses the chunk. Once
+ *   it has caught up it gets the next finer feed back. Every change is
+ *   logged with the sample it takes effect from (fanin_feed.txt), so the
+ *   resolution analysis saw is known for every sample.
+ *
+ *   Each device also keeps a snapshot of its latest state (the last
+ *   SNAPSHOT_SAMPLES samples of each channel, their minimum, maximum and
+ *   mean, the sample counts and the trigger state) in shared memory named
+ *   SNAPSHOT_NAME. The callback writes it under a sequence lock: the
+ *   sequence is odd while the copy is being made, and a reader that sees it
+ *   odd or changed simply copies again. Readers never block the callback,
+ *   and a read costs the same at any sample rate. Option L in a second
+ *   instance of this program shows the snapshots of a running stream.
+ *
+ *	Supported PicoScope models:
+ *
+ *		PicoScope 4225 & 4425
+ *		PicoScope 4444
+ *		PicoScope 4824
+ *
+ * Examples:
+ *
+ *	Stream every connected device into a shared pool of workers
+ *	Benchmark the queues and workers with up to 64 simulated devices
+ *	Report the waiting time of each priority class
+ *	Degrade and restore the analysis feed as analysis falls behind
+ *	Show the latest samples of a running stream from another process
+ *
+ *	Output:
+ *
+ *		Each worker thread writes its own file (fanin_writerNN.bin) holding a
+ *		sequence of FANIN_RECORD headers, each followed by its payload. The
+ *		payload is the chunk's channels one after the other, either as raw
+ *		int16 samples or, when compression is on, as zigzag encoded
+ *		differences between successive samples stored in 7-bit groups.
+ *		Records of one device may be spread across several files; sort them
+ *		by device and sequence number to rebuild each stream.
+ *
+ *	To build this application:-
+ *
+ *		If Microsoft Visual Studio (including Express) is being used:
+ *
+ *			Select the solution configuration (Debug/Release) and platform (x86/x64)
+ *			Ensure that the 32-/64-bit ps4000a.lib can be located
+ *			Ensure that the ps4000aApi.h, PicoConnectProbes.h and PicoStatus.h
+ *			files can be located
+ *
+ *		Otherwise:
+ *
+ *			 Set up a project for a 32-/64-bit console mode application
+ *			 Add this file to the project
+ *			 Add ps4000a.lib to the project (Microsoft C only)
+ *			 Add ps4000aApi.h, PicoConnectProbes.h and PicoStatus.h to the project
+ *			 Build the project
+ *
+ *  Linux platforms:
+ *
+ *		Ensure that the libps4000a driver package has been installed using the
+ *		instructions from https://www.picotech.com/downloads/linux
+ *
+ *		Place this file in the same folder as the files from the linux-build-files
+ *		folder.
+ *		Edit the configure.ac and Makefile.am files as required (the program
+ *		needs C++11 and -pthread, and -lrt for shm_open on older glibc).
+ *		In a terminal window, use the following commands to build the application:
+ *
+ *			./autogen.sh <ENTER>
+ *			make <ENTER>
+ *
+ * Copyright (C) 2013-2018 Pico Technology Ltd. See LICENSE file for terms.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/* Headers for Windows */
+#ifdef _WIN32
+#include "windows.h"
+#include <conio.h>
+#include "ps4000aApi.h"
+#else
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <libps4000a-1.0/ps4000aApi.h>
+#ifndef PICO_STATUS
+#include <libps4000a-1.0/PicoStatus.h>
+#endif
+
+#define Sleep(a) usleep(1000*a)
+#define scanf_s scanf
+
+typedef enum enBOOL{FALSE,TRUE} BOOL;
+
+/* A function to detect a keyboard press on Linux */
+int32_t _getch()
+{
+	struct termios oldt, newt;
+	int32_t ch;
+	int32_t bytesWaiting;
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~( ICANON | ECHO );
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	setbuf(stdin, NULL);
+	do {
+		ioctl(STDIN_FILENO, FIONREAD, &bytesWaiting);
+		if (bytesWaiting)
+			getchar();
+	} while (bytesWaiting);
+
+	ch = getchar();
+
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return ch;
+}
+
+int32_t _kbhit()
+{
+	struct termios oldt, newt;
+	int32_t bytesWaiting;
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~( ICANON | ECHO );
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	setbuf(stdin, NULL);
+	ioctl(STDIN_FILENO, FIONREAD, &bytesWaiting);
+
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return bytesWaiting;
+}
+
+int32_t fopen_s(FILE ** a, const char * b, const char * c)
+{
+	FILE * fp = fopen(b,c);
+	*a = fp;
+	return (fp != NULL)?0:-1;
+}
+#endif
+
+#define OCTO_SCOPE		8
+#define QUAD_SCOPE		4
+#define DUAL_SCOPE		2
+
+#define MAX_PICO_DEVICES	64
+#define MAX_WORKERS				16
+
+#define FANIN_CREDITS				32																		// Chunk buffers owned by each device (bits of freeCredits)
+#define FANIN_HIGH_WATER		24																		// Chunks in flight before a device is under backpressure
+#define FANIN_QUEUE_SIZE		(MAX_PICO_DEVICES * FANIN_CREDITS)		// Power of two, large enough for every credit of every device
+#define FANIN_BATCH					32																		// Descriptors a worker takes off a queue at once
+#define FANIN_CHUNK_SAMPLES	8192																	// Samples per channel in one chunk
+#define FANIN_IDLE_SPINS		64																		// Empty polls before a worker sleeps
+#define FANIN_RECORD_MAGIC	0x4E494146														// "FAIN"
+
+#define SCHED_TICK_MS							1													// Interval at which idle devices are polled
+#define SCHED_LAG_BACKLOG				(2 * FANIN_BATCH)					// Persistence tasks waiting before analysis is degraded
+#define SCHED_LAG_WAIT_US				2000											// Average acquisition wait before analysis is degraded
+#define SCHED_WAIT_AVERAGE_SHIFT	3													// Weight of 1/8 for each new acquisition wait
+
+#define ANALYSIS_SLOTS						64												// Chunk copies available to analysis (bits of freeSlots)
+
+#define FEED_DECIMATION						64												// Samples per min/max pair in a decimated feed
+#define FEED_DECIMATE_LAG					4													// Default chunks behind before the feed is decimated
+#define FEED_SUMMARY_LAG					16												// Default chunks behind before only summaries are fed
+#define FEED_RESTORE_LAG					1													// Default chunks behind at which analysis has caught up
+#define FEED_RESTORE_CHUNKS				16												// Chunks caught up before the feed is raised a level
+#define FEED_LOG_SIZE							4096
+
+#define SNAPSHOT_SAMPLES					256												// Latest samples of each channel in a device's snapshot
+#define SNAPSHOT_MAGIC						0x50414E53								// "SNAP"
+#define SNAPSHOT_VERSION					1
+#define SNAPSHOT_READ_RETRIES			1000											// Before a reader gives up on a device
+#define SNAPSHOT_TIMING_READS			100000										// Reads timed each second by the live view
+#ifdef _WIN32
+#define SNAPSHOT_NAME							"Local\\ps4000aFanInSnapshot"
+#else
+#define SNAPSHOT_NAME							"/ps4000aFanInSnapshot"
+#endif
+
+#define SIM_WAVE_LENGTH			1024
+
+#define LATENCY_BUCKETS			32			// Power of two microsecond buckets in each device's latency histogram
+#define BENCH_PERCENTILE		0.99
+
+const uint32_t	bufferLength = 100000;
+
+typedef enum
+{
+	MODEL_NONE = 0,
+	MODEL_PS4824 = 0x12d8,
+	MODEL_PS4225 = 0x1081,
+	MODEL_PS4425 = 0x1149,
+	MODEL_PS4444 = 0x115C
+} MODEL_TYPE;
+
+typedef struct
+{
+	int16_t DCcoupled;
+	int16_t range;
+	int16_t enabled;
+	float analogueOffset;
+}CHANNEL_SETTINGS;
+
+typedef struct
+{
+	int16_t						handle;
+	MODEL_TYPE				model;
+	int8_t						modelString[8];
+	int8_t						serial[11];
+	int16_t						channelCount;
+	int16_t						maxADCValue;
+	CHANNEL_SETTINGS	channelSettings[PS4000A_MAX_CHANNELS];
+}UNIT;
+
+typedef enum
+{
+	TASK_ACQUISITION,
+	TASK_PERSISTENCE,
+	TASK_ANALYSIS,
+	TASK_CLASSES
+} TASK_CLASS;
+
+// A unit of work for the scheduler, embedded at the start of whatever it works on
+typedef struct tTask
+{
+	void				(*run)(struct tTask * task);
+	void *			parameter;
+	TASK_CLASS	taskClass;
+	int64_t			submittedUs;
+} TASK;
+
+// Resolution at which analysis gets a device's samples
+typedef enum
+{
+	FEED_RAW,
+	FEED_DECIMATED,
+	FEED_SUMMARY,
+	FEED_LEVELS
+} FEED_LEVEL;
+
+typedef enum
+{
+	FEED_REASON_START,
+	FEED_REASON_LAG,
+	FEED_REASON_PIPELINE,
+	FEED_REASON_NO_SLOT,
+	FEED_REASON_CAUGHT_UP
+} FEED_REASON;
+
+typedef struct tFeedPolicy
+{
+	int32_t	decimateLag;
+	int32_t	summaryLag;
+	int32_t	restoreLag;
+} FEED_POLICY;
+
+typedef struct tFeedTransition
+{
+	uint16_t		device;
+	FEED_LEVEL	feed;
+	FEED_REASON	reason;
+	int32_t			lag;
+	uint64_t		firstSample;					// First sample fed at the new level
+} FEED_TRANSITION;
+
+// Descriptor for one chunk of samples on its way from a device to a writer
+typedef struct tFanInChunk
+{
+	TASK			task;					// Persistence task writing this chunk
+	uint16_t	device;
+	uint16_t	credit;
+	uint16_t	channels;
+	int16_t		overflow;
+	uint32_t	sequence;
+	uint32_t	noOfSamples;
+	uint64_t	firstSample;
+	int16_t		feed;					// FEED_LEVEL analysis gets this chunk at
+	int16_t		slot;					// Analysis slot reserved for it, unless a summary
+	int16_t *	data;					// One plane of noOfSamples for each enabled channel
+} FANIN_CHUNK;
+
+// Copy of a chunk for analysis, so analysis never holds on to a device's credits
+typedef struct tAnalysisSlot
+{
+	TASK			task;
+	uint16_t	slot;
+	uint16_t	device;
+	uint16_t		channels;
+	uint32_t		sequence;
+	FEED_LEVEL	feed;
+	uint32_t		noOfValues;			// Per channel: samples, or twice the min/max pairs
+	int16_t *		data;
+} ANALYSIS_SLOT;
+
+typedef struct tMeasurement
+{
+	int16_t		minimum;
+	int16_t		maximum;
+	double		mean;
+	double		rms;
+} MEASUREMENT;
+
+typedef struct tFanInCell
+{
+	std::atomic<size_t>	sequence;
+	TASK *							task;
+} FANIN_CELL;
+
+// Bounded multi-producer, multi-consumer queue (D. Vyukov). The positions
+// sit on their own cache lines so producers and consumers don't share one.
+typedef struct tFanInQueue
+{
+	FANIN_CELL													cells[FANIN_QUEUE_SIZE];
+	alignas(64) std::atomic<size_t>			enqueuePos;
+	alignas(64) std::atomic<size_t>			dequeuePos;
+} FANIN_QUEUE;
+
+// The latest state of one device, as dashboards see it
+typedef struct tSnapshotData
+{
+	uint64_t	totalSamples;														// Samples of each channel delivered so far
+	uint64_t	droppedSamples;
+	uint64_t	triggerSample;													// Sample the last trigger was at
+	int64_t		updatedUs;															// TimeNowUs() of the update
+	uint32_t	updates;
+	int16_t		triggered;															// TRUE once a trigger has been seen
+	int16_t		overflow;																// Channels over range in the last update, bit 0 = A
+	int16_t		feed;																		// FEED_LEVEL analysis is getting
+	int16_t		backpressure;
+	uint16_t	channels;																// Rows of latest[] in use
+	uint16_t	count;																	// Samples in each row
+	int16_t		channel[PS4000A_MAX_CHANNELS];					// Channel of each row
+	int16_t		minimum[PS4000A_MAX_CHANNELS];					// Of the samples in each row
+	int16_t		maximum[PS4000A_MAX_CHANNELS];
+	float			mean[PS4000A_MAX_CHANNELS];
+	int16_t		latest[PS4000A_MAX_CHANNELS][SNAPSHOT_SAMPLES];		// Oldest first
+} SNAPSHOT_DATA;
+
+// Written only by the device's poll; readers retry if sequence changed or was odd
+typedef struct tSnapshot
+{
+	alignas(64) std::atomic<uint32_t>	sequence;
+	SNAPSHOT_DATA											data;
+} SNAPSHOT;
+
+// Shared memory, laid out the same in every process that maps it
+typedef struct tSnapshotRegion
+{
+	uint32_t							magic;
+	uint32_t							version;
+	uint32_t							size;
+	std::atomic<uint32_t>	generation;									// Incremented each time streaming starts
+	std::atomic<uint32_t>	nDevices;
+	std::atomic<int32_t>	streaming;
+	SNAPSHOT							devices[MAX_PICO_DEVICES];
+} SNAPSHOT_REGION;
+
+typedef struct tFanInDevice
+{
+	UNIT										unit;
+	uint16_t								index;
+	int16_t									simulated;
+	uint32_t								samplesPerSecond;		// Simulated devices only, 0 = as fast as possible
+	int16_t *								driverBuffers[PS4000A_MAX_CHANNELS];
+	int16_t *								chunkData;
+	FANIN_CHUNK							chunks[FANIN_CREDITS];
+	std::atomic<uint32_t>		freeCredits;				// A bit set for each chunk not in flight
+	std::atomic<uint32_t>		inFlight;
+	std::atomic<int16_t>		backpressure;
+	uint32_t								sequence;
+	uint64_t								totalSamples;				// Samples delivered by the driver
+	uint64_t								simGenerated;
+	uint32_t								simWriteIndex;
+	int64_t									startUs;
+	uint32_t								backpressureEvents;
+	std::atomic<uint64_t>		writtenSamples;
+	std::atomic<uint64_t>		droppedSamples;
+	std::atomic<uint64_t>		writtenChunks;
+	std::atomic<uint64_t>		latencySumUs;
+	std::atomic<int64_t>		latencyMaxUs;
+	std::atomic<uint32_t>		latencyBuckets[LATENCY_BUCKETS];	// Chunks written with a latency of up to 2^n - 1 us
+	TASK										pollTask;
+	std::atomic<int16_t>		pollPending;				// pollTask is queued or running
+	int16_t									failed;
+	int64_t									lastPollUs;
+	int64_t									maxPollGapUs;
+	int64_t									bufferTimeUs;				// Time the driver buffer lasts at the sampling rate
+	uint64_t								lostSamples;				// Simulated devices only, overwritten before they were polled
+	std::atomic_flag				analysisLock;
+	uint32_t								analysedSequence;
+	uint64_t								analysedChunks;
+	FEED_LEVEL							analysedFeed;
+	MEASUREMENT							measurements[PS4000A_MAX_CHANNELS];
+	FEED_LEVEL							feed;								// Only changed by the device's own poll
+	uint32_t								feedCaughtUp;
+	std::atomic<int32_t>		feedOutstanding;		// Chunks fed raw or decimated and not yet analysed
+	uint64_t								feedChunks[FEED_LEVELS];
+	SNAPSHOT_DATA						snapshot;						// Next contents of the device's shared snapshot
+} FANIN_DEVICE;
+
+typedef struct tFanInWorker
+{
+	FANIN_QUEUE		queues[TASK_CLASSES];
+	uint16_t			index;
+	FILE *				fp;
+	uint8_t *			output;
+	uint64_t			bytesIn;
+	uint64_t			bytesOut;
+	uint64_t			chunks;
+	uint64_t			batches;
+	uint64_t			steals;
+	std::thread		thread;
+} FANIN_WORKER;
+
+typedef struct tClassStats
+{
+	std::atomic<uint64_t>	run;
+	std::atomic<uint64_t>	waitSumUs;
+	std::atomic<int64_t>	waitMaxUs;
+	std::atomic<uint64_t>	runSumUs;
+	std::atomic<int64_t>	runMaxUs;
+} CLASS_STATS;
+
+// Header written in front of every chunk
+typedef struct tFanInRecord
+{
+	uint32_t	magic;
+	uint16_t	device;
+	uint16_t	channels;
+	uint32_t	sequence;
+	uint32_t	noOfSamples;
+	uint64_t	firstSample;
+	uint32_t	payloadBytes;
+	int16_t		overflow;
+	int16_t		compressed;
+} FANIN_RECORD;
+
+typedef struct tFanInTotals
+{
+	uint64_t	written;
+	uint64_t	dropped;
+	uint64_t	chunks;
+	uint64_t	bytesIn;
+	uint64_t	bytesOut;
+	uint64_t	batches;
+	uint64_t	minDeviceSamples;
+	uint64_t	maxDeviceSamples;
+	uint64_t	lost;
+	uint64_t	steals;
+	uint64_t	feedChunks[FEED_LEVELS];
+	uint32_t	transitions;
+	uint32_t	backpressureEvents;
+	double		averageLatencyUs;
+	int64_t		maxLatencyUs;
+	int64_t		maxPollGapUs;
+	int64_t		minBufferTimeUs;
+	double		worstAverageLatencyUs;			// Of the device with the highest average
+	int64_t		worstPercentileLatencyUs;		// Highest BENCH_PERCENTILE latency of any device
+} FANIN_TOTALS;
+
+typedef struct tFanInState
+{
+	FANIN_WORKER					workers[MAX_WORKERS];
+	FANIN_DEVICE					devices[MAX_PICO_DEVICES];
+	ANALYSIS_SLOT					analysisSlots[ANALYSIS_SLOTS];
+	int16_t *							analysisData;
+	std::atomic<uint64_t>	freeSlots;										// A bit set for each analysis slot not in use
+	CLASS_STATS						classStats[TASK_CLASSES];
+	std::atomic<int32_t>	pending[TASK_CLASSES];				// Tasks queued in each class
+	std::atomic<int64_t>	acquisitionWaitUs;						// Moving average of the acquisition wait
+	std::atomic<uint32_t>	nextWorker;
+	uint16_t							nDevices;
+	uint16_t							nWorkers;
+	uint16_t							analysisPasses;								// 0 = no analysis
+	int16_t								compress;
+	int16_t								writeToDisk;
+	std::atomic<int16_t>	polling;
+	std::atomic<int16_t>	running;
+	std::atomic<int32_t>	maxBacklog;
+	std::thread						ticker;
+	FEED_POLICY						policy;
+	FEED_TRANSITION				feedLog[FEED_LOG_SIZE];
+	std::atomic<uint32_t>	feedLogCount;
+} FANIN_STATE;
+
+FANIN_STATE g_fanIn;
+SNAPSHOT_REGION * g_snapshot = NULL;
+int16_t g_snapshotShared = FALSE;
+thread_local FANIN_WORKER * t_worker = NULL;
+const char * g_className[TASK_CLASSES] = { "Acquisition", "Persistence", "Analysis" };
+const char * g_feedName[FEED_LEVELS] = { "raw", "decimated", "summary" };
+const char * g_feedReason[] = { "start", "analysis lagging", "pipeline lagging", "no analysis slot", "caught up" };
+int16_t g_simWave[SIM_WAVE_LENGTH];
+
+uint32_t inputRanges[] = {
+							10,
+							20,
+							50,
+							100,
+							200,
+							500,
+							1000,
+							2000,
+							5000,
+							10000,
+							20000,
+							50000,
+							100000,
+							200000 };
+
+/****************************************************************************
+* TimeNowUs
+*
+* Monotonic time in microseconds
+****************************************************************************/
+int64_t TimeNowUs(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/****************************************************************************
+* FanInQueueInit
+*
+* Each cell's sequence starts at its own index, meaning empty and ready for
+* the producer that claims that position
+****************************************************************************/
+void FanInQueueInit(FANIN_QUEUE * queue)
+{
+	size_t i;
+
+	for (i = 0; i < FANIN_QUEUE_SIZE; i++)
+	{
+		queue->cells[i].sequence.store(i, std::memory_order_relaxed);
+		queue->cells[i].task = NULL;
+	}
+
+	queue->enqueuePos.store(0, std::memory_order_relaxed);
+	queue->dequeuePos.store(0, std::memory_order_relaxed);
+}
+
+/****************************************************************************
+* FanInEnqueue
+*
+* Claims the next position with a compare and swap and publishes the task
+* through the cell's sequence. Returns FALSE if the queue is full.
+****************************************************************************/
+int16_t FanInEnqueue(FANIN_QUEUE * queue, TASK * task)
+{
+	FANIN_CELL * cell;
+	size_t pos = queue->enqueuePos.load(std::memory_order_relaxed);
+	intptr_t diff;
+
+	for (;;)
+	{
+		cell = &queue->cells[pos & (FANIN_QUEUE_SIZE - 1)];
+		diff = (intptr_t) cell->sequence.load(std::memory_order_acquire) - (intptr_t) pos;
+
+		if (diff == 0)
+		{
+			if (queue->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return FALSE;
+		}
+		else
+		{
+			pos = queue->enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->task = task;
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	return TRUE;
+}
+
+/****************************************************************************
+* FanInDequeueBatch
+*
+* Counts the run of filled cells from the current read position and claims
+* all of them with a single compare and swap, so a worker pays for one
+* contended operation per batch rather than one per task.
+*
+* Returns the number of tasks taken (0 if the queue is empty)
+****************************************************************************/
+uint32_t FanInDequeueBatch(FANIN_QUEUE * queue, TASK ** tasks, uint32_t maxTasks)
+{
+	FANIN_CELL * cell;
+	size_t pos = queue->dequeuePos.load(std::memory_order_relaxed);
+	intptr_t diff = -1;
+	uint32_t count;
+	uint32_t i;
+
+	for (;;)
+	{
+		for (count = 0; count < maxTasks; count++)
+		{
+			cell = &queue->cells[(pos + count) & (FANIN_QUEUE_SIZE - 1)];
+			diff = (intptr_t) cell->sequence.load(std::memory_order_acquire) - (intptr_t) (pos + count + 1);
+
+			if (diff != 0)
+			{
+				break;
+			}
+		}
+
+		if (count > 0)
+		{
+			if (queue->dequeuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			pos = queue->dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		cell = &queue->cells[(pos + i) & (FANIN_QUEUE_SIZE - 1)];
+		tasks[i] = cell->task;
+		cell->sequence.store(pos + i + FANIN_QUEUE_SIZE, std::memory_order_release);
+	}
+
+	return count;
+}
+
+/****************************************************************************
+* FanInTakeCredit
+*
+* Returns the index of a free chunk buffer of the device, or -1 if all of
+* them are waiting for a writer
+****************************************************************************/
+int32_t FanInTakeCredit(FANIN_DEVICE * device)
+{
+	uint32_t freeCredits = device->freeCredits.load(std::memory_order_acquire);
+	int32_t credit;
+
+	while (freeCredits)
+	{
+		for (credit = 0; !(freeCredits & (1u << credit)); credit++);
+
+		if (device->freeCredits.compare_exchange_weak(freeCredits, freeCredits & ~(1u << credit), std::memory_order_acquire))
+		{
+			device->inFlight.fetch_add(1, std::memory_order_relaxed);
+			return credit;
+		}
+	}
+
+	return -1;
+}
+
+/****************************************************************************
+* FanInReturnCredit
+*
+* Hands a chunk buffer back to its device once a writer is done with it
+****************************************************************************/
+void FanInReturnCredit(FANIN_DEVICE * device, uint16_t credit)
+{
+	device->inFlight.fetch_sub(1, std::memory_order_relaxed);
+	device->freeCredits.fetch_or(1u << credit, std::memory_order_release);
+}
+
+/****************************************************************************
+* StatsMax
+*
+* Raises an atomic maximum to value if value is larger
+****************************************************************************/
+void StatsMax(std::atomic<int64_t> * maximum, int64_t value)
+{
+	int64_t current = maximum->load(std::memory_order_relaxed);
+
+	while (value > current && !maximum->compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+/****************************************************************************
+* LatencyRecord
+*
+* Counts a chunk's latency in the device's histogram. Bucket n holds
+* latencies of 2^(n-1) to 2^n - 1 us, so recording is a bit scan and an add.
+****************************************************************************/
+void LatencyRecord(FANIN_DEVICE * device, int64_t latencyUs)
+{
+	uint32_t bucket = 0;
+
+	while (latencyUs > 0 && bucket < LATENCY_BUCKETS - 1)
+	{
+		latencyUs >>= 1;
+		bucket++;
+	}
+
+	device->latencyBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+/****************************************************************************
+* LatencyPercentile
+*
+* Returns the upper bound of the bucket holding the given fraction of the
+* device's chunks
+****************************************************************************/
+int64_t LatencyPercentile(FANIN_DEVICE * device, double fraction)
+{
+	uint64_t total = 0;
+	uint64_t count = 0;
+	uint32_t bucket;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		total += device->latencyBuckets[bucket];
+	}
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS && total > 0; bucket++)
+	{
+		count += device->latencyBuckets[bucket];
+
+		if (count >= fraction * total)
+		{
+			break;
+		}
+	}
+
+	return total ? ((int64_t) 1 << bucket) - 1 : 0;
+}
+
+/****************************************************************************
+* ProcessCpuUs
+*
+* User and system CPU time used by the whole process so far
+****************************************************************************/
+int64_t ProcessCpuUs(void)
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	ULARGE_INTEGER kernelTime, userTime;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+	{
+		return 0;
+	}
+
+	kernelTime.LowPart = kernel.dwLowDateTime;
+	kernelTime.HighPart = kernel.dwHighDateTime;
+	userTime.LowPart = user.dwLowDateTime;
+	userTime.HighPart = user.dwHighDateTime;
+
+	return (int64_t) ((kernelTime.QuadPart + userTime.QuadPart) / 10);	// 100 ns units
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+
+	return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+/****************************************************************************
+* SchedulerSubmit
+*
+* Queues a task on the calling worker's queue for its class, or on the next
+* worker in turn when called from outside the pool. Returns FALSE if every
+* queue of the class is full.
+****************************************************************************/
+int16_t SchedulerSubmit(TASK * task, TASK_CLASS taskClass)
+{
+	FANIN_WORKER * worker = t_worker;
+	uint16_t i;
+
+	if (worker == NULL)
+	{
+		worker = &g_fanIn.workers[g_fanIn.nextWorker.fetch_add(1, std::memory_order_relaxed) % g_fanIn.nWorkers];
+	}
+
+	task->taskClass = taskClass;
+	task->submittedUs = TimeNowUs();
+	g_fanIn.pending[taskClass].fetch_add(1, std::memory_order_relaxed);
+
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		if (FanInEnqueue(&g_fanIn.workers[(worker->index + i) % g_fanIn.nWorkers].queues[taskClass], task))
+		{
+			return TRUE;
+		}
+	}
+
+	g_fanIn.pending[taskClass].fetch_sub(1, std::memory_order_relaxed);
+	return FALSE;
+}
+
+/****************************************************************************
+* SchedulerTake
+*
+* Takes up to maxTasks tasks of a class from the worker's own queue or, if
+* that is empty, steals them from the same class of another worker
+****************************************************************************/
+uint32_t SchedulerTake(FANIN_WORKER * worker, TASK_CLASS taskClass, TASK ** tasks, uint32_t maxTasks)
+{
+	uint32_t count;
+	uint16_t i;
+
+	if (g_fanIn.pending[taskClass].load(std::memory_order_relaxed) <= 0)
+	{
+		return 0;
+	}
+
+	count = FanInDequeueBatch(&worker->queues[taskClass], tasks, maxTasks);
+
+	for (i = 1; i < g_fanIn.nWorkers && count == 0; i++)
+	{
+		count = FanInDequeueBatch(&g_fanIn.workers[(worker->index + i) % g_fanIn.nWorkers].queues[taskClass], tasks, maxTasks);
+		worker->steals += count;
+	}
+
+	g_fanIn.pending[taskClass].fetch_sub((int32_t) count, std::memory_order_relaxed);
+
+	return count;
+}
+
+/****************************************************************************
+* SchedulerRun
+*
+* Runs a task and records how long it waited and how long it ran. The task
+* may be queued again while it runs, so nothing in it is touched afterwards.
+****************************************************************************/
+void SchedulerRun(TASK * task)
+{
+	TASK_CLASS taskClass = task->taskClass;
+	CLASS_STATS * stats = &g_fanIn.classStats[taskClass];
+	int64_t startUs = TimeNowUs();
+	int64_t waitUs = startUs - task->submittedUs;
+	int64_t runUs;
+	int64_t averageUs;
+
+	stats->waitSumUs.fetch_add((uint64_t) waitUs, std::memory_order_relaxed);
+	StatsMax(&stats->waitMaxUs, waitUs);
+
+	if (taskClass == TASK_ACQUISITION)
+	{
+		averageUs = g_fanIn.acquisitionWaitUs.load(std::memory_order_relaxed);
+		g_fanIn.acquisitionWaitUs.store(averageUs + (waitUs - averageUs) / (1 << SCHED_WAIT_AVERAGE_SHIFT), std::memory_order_relaxed);
+	}
+
+	task->run(task);
+
+	runUs = TimeNowUs() - startUs;
+	stats->run.fetch_add(1, std::memory_order_relaxed);
+	stats->runSumUs.fetch_add((uint64_t) runUs, std::memory_order_relaxed);
+	StatsMax(&stats->runMaxUs, runUs);
+}
+
+/****************************************************************************
+* SchedulerRunAcquisition
+*
+* Runs any acquisition tasks that are waiting, wherever they are queued
+****************************************************************************/
+void SchedulerRunAcquisition(FANIN_WORKER * worker)
+{
+	TASK * task;
+
+	while (SchedulerTake(worker, TASK_ACQUISITION, &task, 1))
+	{
+		SchedulerRun(task);
+	}
+}
+
+/****************************************************************************
+* SchedulerLagging
+*
+* TRUE while acquisition or persistence is falling behind: too many chunks
+* waiting to be written, polls waiting too long to start, or a device
+* running short of credits. Analysis only gets summaries while this is TRUE.
+****************************************************************************/
+int16_t SchedulerLagging(void)
+{
+	uint16_t i;
+
+	if (g_fanIn.pending[TASK_PERSISTENCE].load(std::memory_order_relaxed) > SCHED_LAG_BACKLOG ||
+		g_fanIn.acquisitionWaitUs.load(std::memory_order_relaxed) > SCHED_LAG_WAIT_US)
+	{
+		return TRUE;
+	}
+
+	for (i = 0; i < g_fanIn.nDevices; i++)
+	{
+		if (g_fanIn.devices[i].backpressure)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/****************************************************************************
+* SchedulerWorkerThread
+*
+* Always runs the highest class that has work waiting. Persistence tasks are
+* taken a batch at a time, with waiting acquisition tasks run between them.
+* Returns once the pool is stopped and no class has work left.
+****************************************************************************/
+void SchedulerWorkerThread(FANIN_WORKER * worker)
+{
+	TASK * batch[FANIN_BATCH];
+	uint32_t count;
+	uint32_t i;
+	uint32_t idle = 0;
+
+	t_worker = worker;
+
+	for (;;)
+	{
+		if (SchedulerTake(worker, TASK_ACQUISITION, batch, 1))
+		{
+			SchedulerRun(batch[0]);
+		}
+		else if ((count = SchedulerTake(worker, TASK_PERSISTENCE, batch, FANIN_BATCH)) > 0)
+		{
+			worker->batches++;
+
+			for (i = 0; i < count; i++)
+			{
+				SchedulerRun(batch[i]);
+				SchedulerRunAcquisition(worker);
+			}
+		}
+		else if (SchedulerTake(worker, TASK_ANALYSIS, batch, 1))
+		{
+			SchedulerRun(batch[0]);
+		}
+		else if (!g_fanIn.running)
+		{
+			break;
+		}
+		else
+		{
+			if (++idle < FANIN_IDLE_SPINS)
+			{
+				std::this_thread::yield();
+			}
+			else
+			{
+				Sleep(1);
+			}
+
+			continue;
+		}
+
+		idle = 0;
+	}
+
+	t_worker = NULL;
+}
+
+/****************************************************************************
+* SchedulerTickerThread
+*
+* Queues a poll of every device that doesn't already have one queued or
+* running, every SCHED_TICK_MS
+****************************************************************************/
+void SchedulerTickerThread(void)
+{
+	FANIN_DEVICE * device;
+	int16_t idle;
+	uint16_t i;
+
+	while (g_fanIn.polling)
+	{
+		for (i = 0; i < g_fanIn.nDevices; i++)
+		{
+			device = &g_fanIn.devices[i];
+			idle = FALSE;
+
+			if (!device->failed && device->pollPending.compare_exchange_strong(idle, TRUE))
+			{
+				SchedulerSubmit(&device->pollTask, TASK_ACQUISITION);
+			}
+		}
+
+		Sleep(SCHED_TICK_MS);
+	}
+}
+
+/****************************************************************************
+* FeedLog
+*
+* Records that a device's analysis feed changes level from firstSample on.
+* Called from the device's own poll, so each device's entries are in sample
+* order.
+****************************************************************************/
+void FeedLog(FANIN_DEVICE * device, FEED_LEVEL feed, FEED_REASON reason, int32_t lag, uint64_t firstSample)
+{
+	FEED_TRANSITION * transition;
+	uint32_t index = g_fanIn.feedLogCount.fetch_add(1, std::memory_order_relaxed);
+
+	if (index >= FEED_LOG_SIZE)
+	{
+		return;
+	}
+
+	transition = &g_fanIn.feedLog[index];
+	transition->device = device->index;
+	transition->feed = feed;
+	transition->reason = reason;
+	transition->lag = lag;
+	transition->firstSample = firstSample;
+}
+
+/****************************************************************************
+* FeedSelect
+*
+* Chooses the resolution analysis gets for a new chunk, from how many of
+* the device's chunks analysis has yet to finish and whether persistence or
+* acquisition are lagging. The feed drops straight to the level the lag
+* calls for, and is only raised one level at a time once analysis has kept
+* up for FEED_RESTORE_CHUNKS chunks in a row.
+****************************************************************************/
+void FeedSelect(FANIN_DEVICE * device, FANIN_CHUNK * chunk)
+{
+	FEED_LEVEL feed = device->feed;
+	FEED_REASON reason = FEED_REASON_LAG;
+	int32_t lag = device->feedOutstanding.load(std::memory_order_relaxed);
+	uint64_t freeSlots;
+	uint16_t index = 0;
+
+	if (SchedulerLagging())
+	{
+		feed = FEED_SUMMARY;
+		reason = FEED_REASON_PIPELINE;
+	}
+	else if (lag >= g_fanIn.policy.summaryLag)
+	{
+		feed = FEED_SUMMARY;
+	}
+	else if (lag >= g_fanIn.policy.decimateLag)
+	{
+		feed = feed > FEED_DECIMATED ? feed : FEED_DECIMATED;
+	}
+	else if (lag <= g_fanIn.policy.restoreLag && feed > FEED_RAW && ++device->feedCaughtUp >= FEED_RESTORE_CHUNKS)
+	{
+		feed = (FEED_LEVEL) (feed - 1);
+		reason = FEED_REASON_CAUGHT_UP;
+	}
+
+	if (lag > g_fanIn.policy.restoreLag || feed != device->feed)
+	{
+		device->feedCaughtUp = 0;
+	}
+
+	if (feed != FEED_SUMMARY)
+	{
+		freeSlots = g_fanIn.freeSlots.load(std::memory_order_acquire);
+
+		do
+		{
+			if (freeSlots == 0)
+			{
+				feed = FEED_SUMMARY;
+				reason = FEED_REASON_NO_SLOT;
+				break;
+			}
+
+			for (index = 0; !(freeSlots & ((uint64_t) 1 << index)); index++);
+
+		} while (!g_fanIn.freeSlots.compare_exchange_weak(freeSlots, freeSlots & ~((uint64_t) 1 << index), std::memory_order_acquire));
+	}
+
+	if (feed != device->feed)
+	{
+		FeedLog(device, feed, reason, lag, chunk->firstSample);
+		device->feed = feed;
+	}
+
+	if (feed != FEED_SUMMARY)
+	{
+		device->feedOutstanding.fetch_add(1, std::memory_order_relaxed);
+		chunk->slot = (int16_t) index;
+	}
+
+	chunk->feed = (int16_t) feed;
+}
+
+/****************************************************************************
+* FeedPrintLog
+*
+* Lists, for each device, the ranges of samples analysis saw at each
+* resolution and why the resolution changed
+****************************************************************************/
+void FeedPrintLog(FILE * fp)
+{
+	FEED_TRANSITION * transition;
+	uint32_t count = g_fanIn.feedLogCount < FEED_LOG_SIZE ? (uint32_t) g_fanIn.feedLogCount : FEED_LOG_SIZE;
+	uint32_t i;
+	uint32_t next;
+	uint16_t device;
+	uint64_t lastSample;
+
+	for (device = 0; device < g_fanIn.nDevices; device++)
+	{
+		fprintf(fp, "\nDevice %d analysis feed:\n", device);
+
+		for (i = 0; i < count; i++)
+		{
+			transition = &g_fanIn.feedLog[i];
+
+			if (transition->device != device)
+			{
+				continue;
+			}
+
+			for (next = i + 1; next < count && g_fanIn.feedLog[next].device != device; next++);
+
+			lastSample = next < count ? g_fanIn.feedLog[next].firstSample : g_fanIn.devices[device].totalSamples;
+
+			if (lastSample > transition->firstSample)
+			{
+				fprintf(fp, "  samples %11llu to %11llu  %-9s  %s (%ld chunks behind)\n",
+					(unsigned long long) transition->firstSample,
+					(unsigned long long) lastSample - 1,
+					g_feedName[transition->feed],
+					g_feedReason[transition->reason],
+					(long) transition->lag);
+			}
+		}
+	}
+
+	if (g_fanIn.feedLogCount > FEED_LOG_SIZE)
+	{
+		fprintf(fp, "\n%lu later transitions were not logged\n", (unsigned long) (g_fanIn.feedLogCount - FEED_LOG_SIZE));
+	}
+}
+
+/****************************************************************************
+* SnapshotCreate
+*
+* Maps the shared memory that dashboards read each device's latest state
+* from. If it cannot be shared the snapshots are kept in private memory, so
+* streaming is unaffected.
+****************************************************************************/
+void SnapshotCreate(void)
+{
+#ifdef _WIN32
+	HANDLE mapping = NULL;
+#else
+	int32_t fd;
+#endif
+
+	if (g_snapshot != NULL)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(SNAPSHOT_REGION), SNAPSHOT_NAME);
+
+	if (mapping != NULL)
+	{
+		// The mapping lasts until this process exits
+		g_snapshot = (SNAPSHOT_REGION *) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SNAPSHOT_REGION));
+	}
+#else
+	if ((fd = shm_open(SNAPSHOT_NAME, O_RDWR | O_CREAT, 0644)) >= 0)
+	{
+		if (ftruncate(fd, sizeof(SNAPSHOT_REGION)) == 0)
+		{
+			g_snapshot = (SNAPSHOT_REGION *) mmap(NULL, sizeof(SNAPSHOT_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			g_snapshot = g_snapshot == MAP_FAILED ? NULL : g_snapshot;
+		}
+
+		close(fd);
+
+		if (g_snapshot == NULL)
+		{
+			shm_unlink(SNAPSHOT_NAME);
+		}
+	}
+#endif
+
+	if (g_snapshot == NULL)
+	{
+		printf("SnapshotCreate: Cannot share %s, snapshots are private to this process\n", SNAPSHOT_NAME);
+		g_snapshot = (SNAPSHOT_REGION *) calloc(1, sizeof(SNAPSHOT_REGION));
+		g_snapshotShared = FALSE;
+	}
+	else
+	{
+		memset((void *) g_snapshot, 0, sizeof(SNAPSHOT_REGION));
+		g_snapshotShared = TRUE;
+	}
+
+	if (g_snapshot != NULL)
+	{
+		g_snapshot->version = SNAPSHOT_VERSION;
+		g_snapshot->size = sizeof(SNAPSHOT_REGION);
+		std::atomic_thread_fence(std::memory_order_release);
+		g_snapshot->magic = SNAPSHOT_MAGIC;
+	}
+}
+
+/****************************************************************************
+* SnapshotDestroy
+****************************************************************************/
+void SnapshotDestroy(void)
+{
+	if (g_snapshot == NULL)
+	{
+		return;
+	}
+
+	if (!g_snapshotShared)
+	{
+		free(g_snapshot);
+	}
+	else
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(g_snapshot);
+#else
+		munmap(g_snapshot, sizeof(SNAPSHOT_REGION));
+		shm_unlink(SNAPSHOT_NAME);
+#endif
+	}
+
+	g_snapshot = NULL;
+}
+
+/****************************************************************************
+* SnapshotReset
+*
+* Empties the snapshot of each device about to stream. Readers see the
+* generation change and the sequence move on, so they drop what they had.
+****************************************************************************/
+void SnapshotReset(uint16_t nDevices)
+{
+	FANIN_DEVICE * device;
+	SNAPSHOT * snapshot;
+	int16_t ch;
+	uint16_t i;
+	uint32_t sequence;
+
+	for (i = 0; i < nDevices; i++)
+	{
+		device = &g_fanIn.devices[i];
+		memset(&device->snapshot, 0, sizeof(SNAPSHOT_DATA));
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			if (device->unit.channelSettings[ch].enabled)
+			{
+				device->snapshot.channel[device->snapshot.channels++] = ch;
+			}
+		}
+
+		if (g_snapshot == NULL)
+		{
+			continue;
+		}
+
+		snapshot = &g_snapshot->devices[i];
+		sequence = snapshot->sequence.load(std::memory_order_relaxed);
+		snapshot->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&snapshot->data, &device->snapshot, sizeof(SNAPSHOT_DATA));
+		snapshot->sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	if (g_snapshot != NULL)
+	{
+		g_snapshot->nDevices.store(nDevices, std::memory_order_relaxed);
+		g_snapshot->generation.fetch_add(1, std::memory_order_relaxed);
+		g_snapshot->streaming.store(TRUE, std::memory_order_release);
+	}
+}
+
+/****************************************************************************
+* SnapshotUpdate
+*
+* Called at the end of each callback, by the one poll of the device in
+* flight. The window and statistics are worked out in the device's private
+* copy, so the only work done with the sequence odd is a single memcpy and
+* readers never wait on anything slower.
+****************************************************************************/
+void SnapshotUpdate(FANIN_DEVICE * device, int32_t noOfSamples, uint32_t startIndex, int16_t overflow, uint32_t triggerAt, int16_t triggered)
+{
+	SNAPSHOT_DATA * data = &device->snapshot;
+	SNAPSHOT * snapshot;
+	const int16_t * source;
+	int16_t * row;
+	int16_t minimum;
+	int16_t maximum;
+	int64_t sum;
+	uint32_t keep;
+	uint32_t add;
+	uint32_t i;
+	uint32_t sequence;
+	uint16_t r;
+
+	if (g_snapshot == NULL)
+	{
+		return;
+	}
+
+	add = (uint32_t) noOfSamples < SNAPSHOT_SAMPLES ? (uint32_t) noOfSamples : SNAPSHOT_SAMPLES;
+	keep = data->count + add > SNAPSHOT_SAMPLES ? SNAPSHOT_SAMPLES - add : data->count;
+
+	for (r = 0; r < data->channels; r++)
+	{
+		row = data->latest[r];
+		source = device->driverBuffers[data->channel[r]] + startIndex + noOfSamples - add;
+
+		memmove(row, row + data->count - keep, keep * sizeof(int16_t));
+		memcpy(row + keep, source, add * sizeof(int16_t));
+
+		minimum = maximum = row[0];
+		sum = 0;
+
+		for (i = 0; i < keep + add; i++)
+		{
+			minimum = row[i] < minimum ? row[i] : minimum;
+			maximum = row[i] > maximum ? row[i] : maximum;
+			sum += row[i];
+		}
+
+		data->minimum[r] = minimum;
+		data->maximum[r] = maximum;
+		data->mean[r] = keep + add ? (float) sum / (keep + add) : 0.0f;
+	}
+
+	data->count = (uint16_t) (keep + add);
+
+	if (triggered)
+	{
+		data->triggered = TRUE;
+		data->triggerSample = device->totalSamples - noOfSamples + triggerAt;
+	}
+
+	data->totalSamples = device->totalSamples;
+	data->droppedSamples = device->droppedSamples.load(std::memory_order_relaxed);
+	data->overflow = overflow;
+	data->feed = (int16_t) device->feed;
+	data->backpressure = device->backpressure;
+	data->updatedUs = TimeNowUs();
+	data->updates++;
+
+	snapshot = &g_snapshot->devices[device->index];
+	sequence = snapshot->sequence.load(std::memory_order_relaxed);
+	snapshot->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&snapshot->data, data, sizeof(SNAPSHOT_DATA));
+	snapshot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+/****************************************************************************
+* SnapshotRead
+*
+* Copies one device's snapshot without ever blocking its writer. Only the
+* rows in use are copied. Returns FALSE if the writer kept changing it.
+****************************************************************************/
+int16_t SnapshotRead(const SNAPSHOT_REGION * region, uint16_t index, SNAPSHOT_DATA * data, uint32_t * retries)
+{
+	const SNAPSHOT * snapshot = &region->devices[index];
+	uint32_t before;
+	uint32_t attempt;
+	uint16_t channels;
+
+	for (attempt = 0; attempt < SNAPSHOT_READ_RETRIES; attempt++)
+	{
+		before = snapshot->sequence.load(std::memory_order_acquire);
+
+		if ((before & 1) == 0)
+		{
+			memcpy(data, &snapshot->data, offsetof(SNAPSHOT_DATA, latest));
+			channels = data->channels < PS4000A_MAX_CHANNELS ? data->channels : PS4000A_MAX_CHANNELS;
+			memcpy(data->latest, snapshot->data.latest, (size_t) channels * sizeof(data->latest[0]));
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (snapshot->sequence.load(std::memory_order_relaxed) == before)
+			{
+				data->channels = channels;
+				return TRUE;
+			}
+		}
+
+		(*retries)++;
+	}
+
+	return FALSE;
+}
+
+/****************************************************************************
+* SnapshotWatch
+*
+* Attaches to the snapshots of a stream running in another instance of this
+* program and prints each device's latest state once a second, along with
+* what a read costs, until a key is pressed
+****************************************************************************/
+void SnapshotWatch(void)
+{
+	const SNAPSHOT_REGION * region = NULL;
+	SNAPSHOT_DATA data;
+	uint32_t generation = 0;
+	uint32_t nDevices;
+	uint32_t retries;
+	uint32_t failed;
+	uint32_t reads;
+	uint16_t i;
+	uint16_t r;
+	int64_t startUs;
+	int64_t elapsedUs;
+	int64_t ageUs;
+#ifdef _WIN32
+	HANDLE mapping = NULL;
+#else
+	int32_t fd;
+#endif
+
+#ifdef _WIN32
+	if ((mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, SNAPSHOT_NAME)) != NULL)
+	{
+		region = (const SNAPSHOT_REGION *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(SNAPSHOT_REGION));
+	}
+#else
+	if ((fd = shm_open(SNAPSHOT_NAME, O_RDONLY, 0)) >= 0)
+	{
+		region = (const SNAPSHOT_REGION *) mmap(NULL, sizeof(SNAPSHOT_REGION), PROT_READ, MAP_SHARED, fd, 0);
+		region = region == MAP_FAILED ? NULL : region;
+		close(fd);
+	}
+#endif
+
+	if (region == NULL || region->magic != SNAPSHOT_MAGIC || region->version != SNAPSHOT_VERSION || region->size != sizeof(SNAPSHOT_REGION))
+	{
+		printf("No stream is sharing snapshots (%s). Start one with S or B in another window.\n", SNAPSHOT_NAME);
+	}
+	else
+	{
+		printf("Press a key to stop watching\n");
+
+		while (!_kbhit())
+		{
+			nDevices = region->nDevices.load(std::memory_order_relaxed);
+			nDevices = nDevices > MAX_PICO_DEVICES ? MAX_PICO_DEVICES : nDevices;
+
+			if (!region->streaming.load(std::memory_order_acquire) || nDevices == 0)
+			{
+				printf("Waiting for a stream to start...\n");
+				Sleep(1000);
+				continue;
+			}
+
+			if (region->generation.load(std::memory_order_relaxed) != generation)
+			{
+				generation = region->generation.load(std::memory_order_relaxed);
+				printf("\nStream %lu, %lu devices\n", (unsigned long) generation, (unsigned long) nDevices);
+			}
+
+			// Time a burst of reads across every device while the writers carry on
+			retries = 0;
+			failed = 0;
+			startUs = TimeNowUs();
+
+			for (reads = 0; reads < SNAPSHOT_TIMING_READS; reads++)
+			{
+				failed += !SnapshotRead(region, (uint16_t) (reads % nDevices), &data, &retries);
+			}
+
+			elapsedUs = TimeNowUs() - startUs;
+
+			printf("\nDevice  Updates      Samples    Dropped  Age(ms)  Feed            Trigger  Ch     Min     Max      Mean\n");
+
+			for (i = 0; i < nDevices; i++)
+			{
+				if (!SnapshotRead(region, i, &data, &retries))
+				{
+					printf("%6d  (busy)\n", i);
+					continue;
+				}
+
+				ageUs = data.updates ? TimeNowUs() - data.updatedUs : 0;
+
+				printf("%6d %8lu %12llu %10llu %8.1f  %-9s  %c%11llu",
+					i,
+					(unsigned long) data.updates,
+					(unsigned long long) data.totalSamples,
+					(unsigned long long) data.droppedSamples,
+					ageUs / 1000.0,
+					data.feed >= 0 && data.feed < FEED_LEVELS ? g_feedName[data.feed] : "?",
+					data.triggered ? ' ' : '-',
+					(unsigned long long) data.triggerSample);
+
+				for (r = 0; r < data.channels; r++)
+				{
+					printf("%*s%c  %7d %7d %9.1f%s\n",
+						r ? 75 : 2, "",
+						'A' + data.channel[r],
+						data.minimum[r],
+						data.maximum[r],
+						data.mean[r],
+						data.backpressure && r == 0 ? "  backpressure" : "");
+				}
+
+				if (data.channels == 0)
+				{
+					printf("\n");
+				}
+			}
+
+			printf("\n%lu reads, %.0f ns per read, %lu retries, %lu gave up\n",
+				(unsigned long) reads,
+				reads ? elapsedUs * 1000.0 / reads : 0.0,
+				(unsigned long) retries,
+				(unsigned long) failed);
+
+			Sleep(1000);
+		}
+
+		_getch();
+	}
+
+#ifdef _WIN32
+	if (region != NULL)
+	{
+		UnmapViewOfFile(region);
+	}
+
+	if (mapping != NULL)
+	{
+		CloseHandle(mapping);
+	}
+#else
+	if (region != NULL)
+	{
+		munmap((void *) region, sizeof(SNAPSHOT_REGION));
+	}
+#endif
+}
+
+/****************************************************************************
+* Callback
+* Used by ps4000a data streaming collection calls, on receipt of data.
+*
+* Copies the new samples into chunks of at most FANIN_CHUNK_SAMPLES and
+* queues them for writing. Nothing in here waits on a writer.
+****************************************************************************/
+void PREF4 CallBackFanIn
+(
+	int16_t handle,
+	int32_t noOfSamples,
+	uint32_t startIndex,
+	int16_t overflow,
+	uint32_t triggerAt,
+	int16_t triggered,
+	int16_t autoStop,
+	void * pParameter
+)
+{
+	FANIN_DEVICE * device = (FANIN_DEVICE *) pParameter;
+	FANIN_CHUNK * chunk;
+	int16_t ch;
+	int16_t plane;
+	int16_t dropped = FALSE;
+	int32_t credit;
+	int32_t offset;
+	int32_t backlog;
+	int32_t maxBacklog;
+	uint32_t n;
+
+	for (offset = 0; offset < noOfSamples; offset += n)
+	{
+		n = (uint32_t) (noOfSamples - offset) < FANIN_CHUNK_SAMPLES ? (uint32_t) (noOfSamples - offset) : FANIN_CHUNK_SAMPLES;
+
+		if ((credit = FanInTakeCredit(device)) < 0)
+		{
+			device->droppedSamples.fetch_add(n, std::memory_order_relaxed);
+			dropped = TRUE;
+			continue;
+		}
+
+		chunk = &device->chunks[credit];
+
+		for (ch = 0, plane = 0; ch < device->unit.channelCount; ch++)
+		{
+			if (device->unit.channelSettings[ch].enabled)
+			{
+				memcpy(chunk->data + (size_t) plane * n, device->driverBuffers[ch] + startIndex + offset, n * sizeof(int16_t));
+				plane++;
+			}
+		}
+
+		chunk->channels = plane;
+		chunk->overflow = overflow;
+		chunk->sequence = device->sequence++;
+		chunk->noOfSamples = n;
+		chunk->firstSample = device->totalSamples + offset;
+
+		if (g_fanIn.analysisPasses)
+		{
+			FeedSelect(device, chunk);
+		}
+
+		// Cannot fail while each queue has room for every credit, but don't lose the buffer if it does
+		if (!SchedulerSubmit(&chunk->task, TASK_PERSISTENCE))
+		{
+			if (g_fanIn.analysisPasses && chunk->feed != FEED_SUMMARY)
+			{
+				device->feedOutstanding.fetch_sub(1, std::memory_order_relaxed);
+				g_fanIn.freeSlots.fetch_or((uint64_t) 1 << chunk->slot, std::memory_order_release);
+			}
+
+			FanInReturnCredit(device, (uint16_t) credit);
+			device->droppedSamples.fetch_add(n, std::memory_order_relaxed);
+			dropped = TRUE;
+			continue;
+		}
+
+		backlog = g_fanIn.pending[TASK_PERSISTENCE].load(std::memory_order_relaxed);
+		maxBacklog = g_fanIn.maxBacklog.load(std::memory_order_relaxed);
+
+		while (backlog > maxBacklog && !g_fanIn.maxBacklog.compare_exchange_weak(maxBacklog, backlog, std::memory_order_relaxed));
+	}
+
+	device->totalSamples += noOfSamples;
+	device->backpressure = dropped || device->inFlight.load(std::memory_order_relaxed) >= FANIN_HIGH_WATER;
+
+	SnapshotUpdate(device, noOfSamples, startIndex, overflow, triggerAt, triggered);
+}
+
+/****************************************************************************
+* SimGetStreamingLatestValues
+*
+* Stands in for ps4000aGetStreamingLatestValues on a simulated device. Fills
+* the device's buffers with whatever the device would have sampled since the
+* last call and passes it to the callback in the same way as the driver.
+* Samples older than one buffer length have been overwritten and are lost.
+****************************************************************************/
+PICO_STATUS SimGetStreamingLatestValues(FANIN_DEVICE * device, ps4000aStreamingReady lpPs4000aReady, void * pParameter)
+{
+	int16_t ch;
+	uint32_t i;
+	uint32_t n;
+	uint32_t startIndex;
+	uint64_t due;
+
+	if (device->samplesPerSecond == 0)
+	{
+		n = FANIN_CHUNK_SAMPLES;
+	}
+	else
+	{
+		due = (uint64_t) ((TimeNowUs() - device->startUs) * (device->samplesPerSecond / 1e6));
+
+		if (due - device->simGenerated > bufferLength)
+		{
+			device->lostSamples += due - device->simGenerated - bufferLength;
+			device->simGenerated = due - bufferLength;
+		}
+
+		n = (uint32_t) (due - device->simGenerated);
+	}
+
+	n = n < bufferLength - device->simWriteIndex ? n : bufferLength - device->simWriteIndex;
+
+	if (n == 0)
+	{
+		return PICO_OK;
+	}
+
+	startIndex = device->simWriteIndex;
+
+	for (ch = 0; ch < device->unit.channelCount; ch++)
+	{
+		if (device->unit.channelSettings[ch].enabled)
+		{
+			for (i = 0; i < n; i++)
+			{
+				device->driverBuffers[ch][startIndex + i] = g_simWave[(device->simGenerated + i + ch * (SIM_WAVE_LENGTH / 4)) & (SIM_WAVE_LENGTH - 1)];
+			}
+		}
+	}
+
+	device->simGenerated += n;
+	device->simWriteIndex = (device->simWriteIndex + n) % bufferLength;
+
+	lpPs4000aReady(device->unit.handle, (int32_t) n, startIndex, 0, 0, 0, 0, pParameter);
+
+	return PICO_OK;
+}
+
+/****************************************************************************
+* FanInPollDevice
+*
+* Acquisition task: one ps4000aGetStreamingLatestValues call. If that
+* brought a full chunk or more the driver probably has more waiting, so the
+* device is polled again straight away unless it is under backpressure;
+* otherwise the next tick polls it.
+****************************************************************************/
+void FanInPollDevice(TASK * task)
+{
+	FANIN_DEVICE * device = (FANIN_DEVICE *) task->parameter;
+	PICO_STATUS status;
+	uint64_t before = device->totalSamples;
+	int64_t nowUs = TimeNowUs();
+
+	if (device->lastPollUs && nowUs - device->lastPollUs > device->maxPollGapUs)
+	{
+		device->maxPollGapUs = nowUs - device->lastPollUs;
+	}
+
+	device->lastPollUs = nowUs;
+
+	if (device->simulated)
+	{
+		status = SimGetStreamingLatestValues(device, CallBackFanIn, device);
+	}
+	else
+	{
+		status = ps4000aGetStreamingLatestValues(device->unit.handle, CallBackFanIn, device);
+	}
+
+	if (status != PICO_OK && status != PICO_BUSY)
+	{
+		printf("Device %d: ps4000aGetStreamingLatestValues ------ 0x%08lx \n", device->index, (unsigned long) status);
+		device->failed = TRUE;
+	}
+
+	if (device->backpressure)
+	{
+		device->backpressureEvents++;
+	}
+
+	if (g_fanIn.polling && !device->failed && !device->backpressure && device->totalSamples - before >= FANIN_CHUNK_SAMPLES)
+	{
+		SchedulerSubmit(task, TASK_ACQUISITION);
+	}
+	else
+	{
+		device->pollPending = FALSE;
+	}
+}
+
+/****************************************************************************
+* FanInCompress
+*
+* Stores the difference between successive samples, zigzag encoded so small
+* negative differences stay small, in groups of 7 bits with the top bit set
+* on all but the last group. At most 3 bytes per sample. The range of the
+* samples is found on the way, for the summary feed.
+****************************************************************************/
+uint32_t FanInCompress(const int16_t * samples, uint32_t count, uint8_t * output, MEASUREMENT * summary)
+{
+	int32_t delta;
+	int32_t previous = 0;
+	uint32_t zigzag;
+	uint32_t length = 0;
+	uint32_t i;
+
+	summary->minimum = samples[0];
+	summary->maximum = samples[0];
+
+	for (i = 0; i < count; i++)
+	{
+		summary->minimum = samples[i] < summary->minimum ? samples[i] : summary->minimum;
+		summary->maximum = samples[i] > summary->maximum ? samples[i] : summary->maximum;
+		delta = samples[i] - previous;
+		previous = samples[i];
+		zigzag = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+
+		while (zigzag >= 0x80)
+		{
+			output[length++] = (uint8_t) (zigzag | 0x80);
+			zigzag >>= 7;
+		}
+
+		output[length++] = (uint8_t) zigzag;
+	}
+
+	return length;
+}
+
+/****************************************************************************
+* AnalysisMeasure
+*
+* Minimum, maximum, mean and RMS of count values. For a decimated feed the
+* values are min/max pairs, so the minimum and maximum are exact but the
+* mean and RMS are only those of the envelope.
+****************************************************************************/
+void AnalysisMeasure(const int16_t * values, uint32_t count, MEASUREMENT * measurement)
+{
+	int16_t minimum = values[0];
+	int16_t maximum = values[0];
+	double sum = 0.0;
+	double sumOfSquares = 0.0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		minimum = values[i] < minimum ? values[i] : minimum;
+		maximum = values[i] > maximum ? values[i] : maximum;
+		sum += values[i];
+		sumOfSquares += (double) values[i] * values[i];
+	}
+
+	measurement->minimum = minimum;
+	measurement->maximum = maximum;
+	measurement->mean = sum / count;
+	measurement->rms = sqrt(sumOfSquares / count);
+}
+
+/****************************************************************************
+* AnalysisStore
+*
+* Chunks of one device can be analysed by several workers at once; keeps
+* the measurements of the latest and counts the chunk against its feed
+****************************************************************************/
+void AnalysisStore(FANIN_DEVICE * device, uint32_t sequence, FEED_LEVEL feed, const MEASUREMENT * measurements, uint16_t channels)
+{
+	while (device->analysisLock.test_and_set(std::memory_order_acquire));
+
+	if (device->analysedChunks == 0 || sequence > device->analysedSequence)
+	{
+		memcpy(device->measurements, measurements, channels * sizeof(MEASUREMENT));
+		device->analysedSequence = sequence;
+		device->analysedFeed = feed;
+	}
+
+	device->analysedChunks++;
+	device->feedChunks[feed]++;
+	device->analysisLock.clear(std::memory_order_release);
+}
+
+/****************************************************************************
+* AnalysisRun
+*
+* Analysis task: measures each channel of a raw or decimated chunk,
+* repeated analysisPasses times to stand in for heavier analysis
+****************************************************************************/
+void AnalysisRun(TASK * task)
+{
+	ANALYSIS_SLOT * slot = (ANALYSIS_SLOT *) task->parameter;
+	FANIN_DEVICE * device = &g_fanIn.devices[slot->device];
+	MEASUREMENT measurements[PS4000A_MAX_CHANNELS];
+	uint16_t pass;
+	uint16_t plane;
+
+	for (pass = 0; pass < g_fanIn.analysisPasses; pass++)
+	{
+		for (plane = 0; plane < slot->channels; plane++)
+		{
+			AnalysisMeasure(slot->data + (size_t) plane * slot->noOfValues, slot->noOfValues, &measurements[plane]);
+		}
+	}
+
+	AnalysisStore(device, slot->sequence, slot->feed, measurements, slot->channels);
+
+	device->feedOutstanding.fetch_sub(1, std::memory_order_relaxed);
+	g_fanIn.freeSlots.fetch_or((uint64_t) 1 << slot->slot, std::memory_order_release);
+}
+
+/****************************************************************************
+* FeedDeliver
+*
+* Hands a chunk to analysis at the resolution FeedSelect chose for it: a
+* copy of the samples, a min/max pair for every FEED_DECIMATION samples, or
+* just the range of each channel. The summary is stored straight away, so
+* the persistence worker never runs the analysis itself; the range comes
+* from compression, or from a single compare pass when that is off.
+****************************************************************************/
+void FeedDeliver(FANIN_CHUNK * chunk, MEASUREMENT * summary)
+{
+	FANIN_DEVICE * device = &g_fanIn.devices[chunk->device];
+	ANALYSIS_SLOT * slot;
+	const int16_t * samples;
+	int16_t * values;
+	int16_t minimum;
+	int16_t maximum;
+	uint16_t plane;
+	uint32_t i;
+	uint32_t j;
+	uint32_t end;
+
+	if (chunk->feed == FEED_SUMMARY)
+	{
+		for (plane = 0; plane < chunk->channels; plane++)
+		{
+			if (!g_fanIn.compress)
+			{
+				samples = chunk->data + (size_t) plane * chunk->noOfSamples;
+				summary[plane].minimum = samples[0];
+				summary[plane].maximum = samples[0];
+
+				for (i = 1; i < chunk->noOfSamples; i++)
+				{
+					summary[plane].minimum = samples[i] < summary[plane].minimum ? samples[i] : summary[plane].minimum;
+					summary[plane].maximum = samples[i] > summary[plane].maximum ? samples[i] : summary[plane].maximum;
+				}
+			}
+
+			// Only analysis works out the mean and RMS
+			summary[plane].mean = 0.0;
+			summary[plane].rms = 0.0;
+		}
+
+		AnalysisStore(device, chunk->sequence, FEED_SUMMARY, summary, chunk->channels);
+		return;
+	}
+
+	slot = &g_fanIn.analysisSlots[chunk->slot];
+	slot->device = chunk->device;
+	slot->channels = chunk->channels;
+	slot->sequence = chunk->sequence;
+	slot->feed = (FEED_LEVEL) chunk->feed;
+
+	if (chunk->feed == FEED_RAW)
+	{
+		slot->noOfValues = chunk->noOfSamples;
+		memcpy(slot->data, chunk->data, (size_t) chunk->channels * chunk->noOfSamples * sizeof(int16_t));
+	}
+	else
+	{
+		slot->noOfValues = 2 * ((chunk->noOfSamples + FEED_DECIMATION - 1) / FEED_DECIMATION);
+
+		for (plane = 0; plane < chunk->channels; plane++)
+		{
+			samples = chunk->data + (size_t) plane * chunk->noOfSamples;
+			values = slot->data + (size_t) plane * slot->noOfValues;
+
+			for (i = 0; i < chunk->noOfSamples; i += FEED_DECIMATION)
+			{
+				end = i + FEED_DECIMATION < chunk->noOfSamples ? i + FEED_DECIMATION : chunk->noOfSamples;
+				minimum = samples[i];
+				maximum = samples[i];
+
+				for (j = i + 1; j < end; j++)
+				{
+					minimum = samples[j] < minimum ? samples[j] : minimum;
+					maximum = samples[j] > maximum ? samples[j] : maximum;
+				}
+
+				*values++ = minimum;
+				*values++ = maximum;
+			}
+		}
+	}
+
+	// Every slot fits in the analysis queues, but run it here rather than lose it if not
+	if (!SchedulerSubmit(&slot->task, TASK_ANALYSIS))
+	{
+		AnalysisRun(&slot->task);
+	}
+}
+
+/****************************************************************************
+* FanInWriteChunk
+*
+* Persistence task: writes one chunk, feeds it to analysis, records its
+* latency and returns its buffer to the device
+****************************************************************************/
+void FanInWriteChunk(TASK * task)
+{
+	FANIN_CHUNK * chunk = (FANIN_CHUNK *) task->parameter;
+	FANIN_DEVICE * device = &g_fanIn.devices[chunk->device];
+	FANIN_WORKER * worker = t_worker;
+	FANIN_RECORD record;
+	MEASUREMENT summary[PS4000A_MAX_CHANNELS];
+	uint16_t plane;
+	int64_t latencyUs;
+	size_t rawBytes = (size_t) chunk->channels * chunk->noOfSamples * sizeof(int16_t);
+
+	record.magic = FANIN_RECORD_MAGIC;
+	record.device = chunk->device;
+	record.channels = chunk->channels;
+	record.sequence = chunk->sequence;
+	record.noOfSamples = chunk->noOfSamples;
+	record.firstSample = chunk->firstSample;
+	record.overflow = chunk->overflow;
+	record.compressed = g_fanIn.compress;
+
+	if (g_fanIn.compress)
+	{
+		for (plane = 0, record.payloadBytes = 0; plane < chunk->channels; plane++)
+		{
+			record.payloadBytes += FanInCompress(chunk->data + (size_t) plane * chunk->noOfSamples, chunk->noOfSamples, worker->output + record.payloadBytes,
+				&summary[plane]);
+		}
+	}
+	else
+	{
+		record.payloadBytes = (uint32_t) rawBytes;
+	}
+
+	if (worker->fp != NULL)
+	{
+		fwrite(&record, sizeof(FANIN_RECORD), 1, worker->fp);
+		fwrite(g_fanIn.compress ? (void *) worker->output : (void *) chunk->data, 1, record.payloadBytes, worker->fp);
+	}
+
+	worker->bytesIn += rawBytes;
+	worker->bytesOut += sizeof(FANIN_RECORD) + record.payloadBytes;
+	worker->chunks++;
+
+	if (g_fanIn.analysisPasses)
+	{
+		FeedDeliver(chunk, summary);
+	}
+
+	latencyUs = TimeNowUs() - chunk->task.submittedUs;
+	StatsMax(&device->latencyMaxUs, latencyUs);
+	LatencyRecord(device, latencyUs);
+
+	device->latencySumUs.fetch_add((uint64_t) latencyUs, std::memory_order_relaxed);
+	device->writtenSamples.fetch_add(chunk->noOfSamples, std::memory_order_relaxed);
+	device->writtenChunks.fetch_add(1, std::memory_order_relaxed);
+
+	FanInReturnCredit(device, chunk->credit);
+}
+
+/****************************************************************************
+* FanInStart
+*
+* Allocates the chunk buffers of the first nDevices devices, which must
+* already have their unit and driver buffers set up, then starts the
+* workers and the ticker that polls the devices
+****************************************************************************/
+PICO_STATUS FanInStart(uint16_t nDevices)
+{
+	FANIN_DEVICE * device;
+	FANIN_WORKER * worker;
+	char fileName[32];
+	int16_t ch;
+	int16_t channels;
+	uint16_t i;
+	uint16_t credit;
+	uint32_t bucket;
+	int32_t taskClass;
+
+	g_fanIn.nDevices = nDevices;
+	g_fanIn.analysisData = NULL;
+
+	for (i = 0; i < nDevices; i++)
+	{
+		device = &g_fanIn.devices[i];
+
+		for (ch = 0, channels = 0; ch < device->unit.channelCount; ch++)
+		{
+			channels += device->unit.channelSettings[ch].enabled;
+		}
+
+		device->chunkData = (int16_t *) calloc((size_t) FANIN_CREDITS * channels * FANIN_CHUNK_SAMPLES, sizeof(int16_t));
+
+		if (device->chunkData == NULL)
+		{
+			printf("FanInStart: Not enough memory for the chunks of device %d\n", i);
+
+			while (i > 0)
+			{
+				free(g_fanIn.devices[--i].chunkData);
+			}
+
+			return PICO_MEMORY_FAIL;
+		}
+
+		for (credit = 0; credit < FANIN_CREDITS; credit++)
+		{
+			device->chunks[credit].task.run = FanInWriteChunk;
+			device->chunks[credit].task.parameter = &device->chunks[credit];
+			device->chunks[credit].device = i;
+			device->chunks[credit].credit = credit;
+			device->chunks[credit].data = device->chunkData + (size_t) credit * channels * FANIN_CHUNK_SAMPLES;
+		}
+
+		device->index = i;
+		device->freeCredits = FANIN_CREDITS == 32 ? 0xFFFFFFFF : (1u << FANIN_CREDITS) - 1;
+		device->inFlight = 0;
+		device->backpressure = FALSE;
+		device->sequence = 0;
+		device->totalSamples = 0;
+		device->simGenerated = 0;
+		device->simWriteIndex = 0;
+		device->backpressureEvents = 0;
+		device->writtenSamples = 0;
+		device->droppedSamples = 0;
+		device->writtenChunks = 0;
+		device->latencySumUs = 0;
+		device->latencyMaxUs = 0;
+
+		for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+		{
+			device->latencyBuckets[bucket] = 0;
+		}
+
+		device->pollTask.run = FanInPollDevice;
+		device->pollTask.parameter = device;
+		device->pollPending = FALSE;
+		device->failed = FALSE;
+		device->lastPollUs = 0;
+		device->maxPollGapUs = 0;
+		device->lostSamples = 0;
+		device->analysisLock.clear();
+		device->analysedSequence = 0;
+		device->analysedChunks = 0;
+		device->analysedFeed = FEED_RAW;
+		device->feed = FEED_RAW;
+		device->feedCaughtUp = 0;
+		device->feedOutstanding = 0;
+		memset(device->feedChunks, 0, sizeof(device->feedChunks));
+	}
+
+	if (g_fanIn.analysisPasses)
+	{
+		g_fanIn.analysisData = (int16_t *) malloc((size_t) ANALYSIS_SLOTS * PS4000A_MAX_CHANNELS * FANIN_CHUNK_SAMPLES * sizeof(int16_t));
+
+		if (g_fanIn.analysisData == NULL)
+		{
+			printf("FanInStart: Not enough memory for analysis, analysis is off\n");
+			g_fanIn.analysisPasses = 0;
+		}
+
+		for (i = 0; i < ANALYSIS_SLOTS && g_fanIn.analysisData != NULL; i++)
+		{
+			g_fanIn.analysisSlots[i].task.run = AnalysisRun;
+			g_fanIn.analysisSlots[i].task.parameter = &g_fanIn.analysisSlots[i];
+			g_fanIn.analysisSlots[i].slot = i;
+			g_fanIn.analysisSlots[i].data = g_fanIn.analysisData + (size_t) i * PS4000A_MAX_CHANNELS * FANIN_CHUNK_SAMPLES;
+		}
+	}
+
+	// Compression output of each worker, a compressed chunk is never more than 3 bytes per sample
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		g_fanIn.workers[i].output = (uint8_t *) malloc((size_t) PS4000A_MAX_CHANNELS * FANIN_CHUNK_SAMPLES * 3);
+
+		if (g_fanIn.workers[i].output == NULL)
+		{
+			printf("FanInStart: Not enough memory for the output of worker %d\n", i);
+
+			while (i > 0)
+			{
+				free(g_fanIn.workers[--i].output);
+			}
+
+			for (i = 0; i < nDevices; i++)
+			{
+				free(g_fanIn.devices[i].chunkData);
+				g_fanIn.devices[i].chunkData = NULL;
+			}
+
+			free(g_fanIn.analysisData);
+			g_fanIn.analysisData = NULL;
+
+			return PICO_MEMORY_FAIL;
+		}
+	}
+
+	SnapshotCreate();
+	SnapshotReset(nDevices);
+
+	g_fanIn.freeSlots = ANALYSIS_SLOTS == 64 ? UINT64_MAX : ((uint64_t) 1 << ANALYSIS_SLOTS) - 1;
+	g_fanIn.feedLogCount = 0;
+
+	for (i = 0; i < nDevices && g_fanIn.analysisPasses; i++)
+	{
+		FeedLog(&g_fanIn.devices[i], FEED_RAW, FEED_REASON_START, 0, 0);
+	}
+
+	g_fanIn.acquisitionWaitUs = 0;
+	g_fanIn.maxBacklog = 0;
+	g_fanIn.nextWorker = 0;
+
+	for (taskClass = 0; taskClass < TASK_CLASSES; taskClass++)
+	{
+		g_fanIn.pending[taskClass] = 0;
+		g_fanIn.classStats[taskClass].run = 0;
+		g_fanIn.classStats[taskClass].waitSumUs = 0;
+		g_fanIn.classStats[taskClass].waitMaxUs = 0;
+		g_fanIn.classStats[taskClass].runSumUs = 0;
+		g_fanIn.classStats[taskClass].runMaxUs = 0;
+	}
+
+	g_fanIn.running = TRUE;
+
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		worker = &g_fanIn.workers[i];
+		worker->index = i;
+		worker->fp = NULL;
+		worker->bytesIn = 0;
+		worker->bytesOut = 0;
+		worker->chunks = 0;
+		worker->batches = 0;
+		worker->steals = 0;
+
+		for (taskClass = 0; taskClass < TASK_CLASSES; taskClass++)
+		{
+			FanInQueueInit(&worker->queues[taskClass]);
+		}
+
+		if (g_fanIn.writeToDisk)
+		{
+			sprintf(fileName, "fanin_writer%02d.bin", i);
+			fopen_s(&worker->fp, fileName, "wb");
+
+			if (worker->fp == NULL)
+			{
+				printf("Cannot open the file %s for writing.\n", fileName);
+			}
+		}
+	}
+
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		g_fanIn.workers[i].thread = std::thread(SchedulerWorkerThread, &g_fanIn.workers[i]);
+	}
+
+	for (i = 0; i < nDevices; i++)
+	{
+		g_fanIn.devices[i].startUs = TimeNowUs();
+	}
+
+	g_fanIn.polling = TRUE;
+	g_fanIn.ticker = std::thread(SchedulerTickerThread);
+
+	return PICO_OK;
+}
+
+/****************************************************************************
+* FanInStop
+*
+* Stops polling, lets the workers finish every queued task, then releases
+* everything
+****************************************************************************/
+void FanInStop(void)
+{
+	uint16_t i;
+
+	g_fanIn.polling = FALSE;
+	g_fanIn.ticker.join();
+
+	for (i = 0; i < g_fanIn.nDevices; i++)
+	{
+		while (g_fanIn.devices[i].pollPending)
+		{
+			Sleep(1);
+		}
+	}
+
+	g_fanIn.running = FALSE;
+
+	if (g_snapshot != NULL)
+	{
+		g_snapshot->streaming.store(FALSE, std::memory_order_release);
+	}
+
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		g_fanIn.workers[i].thread.join();
+
+		if (g_fanIn.workers[i].fp != NULL)
+		{
+			fclose(g_fanIn.workers[i].fp);
+		}
+
+		free(g_fanIn.workers[i].output);
+	}
+
+	for (i = 0; i < g_fanIn.nDevices; i++)
+	{
+		free(g_fanIn.devices[i].chunkData);
+		g_fanIn.devices[i].chunkData = NULL;
+	}
+
+	free(g_fanIn.analysisData);
+	g_fanIn.analysisData = NULL;
+}
+
+/****************************************************************************
+* FanInCollectTotals
+****************************************************************************/
+void FanInCollectTotals(FANIN_TOTALS * totals)
+{
+	FANIN_DEVICE * device;
+	uint16_t i;
+	uint64_t latencySumUs = 0;
+	double averageLatencyUs;
+	int64_t percentileLatencyUs;
+
+	memset(totals, 0, sizeof(FANIN_TOTALS));
+	totals->minDeviceSamples = UINT64_MAX;
+	totals->minBufferTimeUs = INT64_MAX;
+
+	for (i = 0; i < g_fanIn.nDevices; i++)
+	{
+		device = &g_fanIn.devices[i];
+		totals->written += device->writtenSamples;
+		totals->dropped += device->droppedSamples;
+		totals->lost += device->lostSamples;
+		totals->chunks += device->writtenChunks;
+		totals->backpressureEvents += device->backpressureEvents;
+		totals->feedChunks[FEED_RAW] += device->feedChunks[FEED_RAW];
+		totals->feedChunks[FEED_DECIMATED] += device->feedChunks[FEED_DECIMATED];
+		totals->feedChunks[FEED_SUMMARY] += device->feedChunks[FEED_SUMMARY];
+		latencySumUs += device->latencySumUs;
+		totals->maxLatencyUs = device->latencyMaxUs > totals->maxLatencyUs ? (int64_t) device->latencyMaxUs : totals->maxLatencyUs;
+		totals->maxPollGapUs = device->maxPollGapUs > totals->maxPollGapUs ? device->maxPollGapUs : totals->maxPollGapUs;
+		totals->minBufferTimeUs = device->bufferTimeUs < totals->minBufferTimeUs ? device->bufferTimeUs : totals->minBufferTimeUs;
+		totals->minDeviceSamples = device->writtenSamples < totals->minDeviceSamples ? (uint64_t) device->writtenSamples : totals->minDeviceSamples;
+		totals->maxDeviceSamples = device->writtenSamples > totals->maxDeviceSamples ? (uint64_t) device->writtenSamples : totals->maxDeviceSamples;
+
+		averageLatencyUs = device->writtenChunks ? (double) device->latencySumUs / device->writtenChunks : 0.0;
+		percentileLatencyUs = LatencyPercentile(device, BENCH_PERCENTILE);
+		totals->worstAverageLatencyUs = averageLatencyUs > totals->worstAverageLatencyUs ? averageLatencyUs : totals->worstAverageLatencyUs;
+		totals->worstPercentileLatencyUs = percentileLatencyUs > totals->worstPercentileLatencyUs ? percentileLatencyUs : totals->worstPercentileLatencyUs;
+	}
+
+	for (i = 0; i < g_fanIn.nWorkers; i++)
+	{
+		totals->bytesIn += g_fanIn.workers[i].bytesIn;
+		totals->bytesOut += g_fanIn.workers[i].bytesOut;
+		totals->batches += g_fanIn.workers[i].batches;
+		totals->steals += g_fanIn.workers[i].steals;
+	}
+
+	totals->transitions = (g_fanIn.feedLogCount > g_fanIn.nDevices && g_fanIn.analysisPasses) ? g_fanIn.feedLogCount - g_fanIn.nDevices : 0;
+	totals->averageLatencyUs = totals->chunks ? (double) latencySumUs / totals->chunks : 0.0;
+}
+
+/****************************************************************************
+* SchedulerPrintClasses
+*
+* How long each class waited to start and ran for. The longest gap between
+* two polls of a device is compared with the time its driver buffer lasts:
+* as long as the gap is shorter, no analysis load can make it overflow.
+****************************************************************************/
+void SchedulerPrintClasses(void)
+{
+	CLASS_STATS * stats;
+	FANIN_TOTALS totals;
+	int32_t taskClass;
+
+	FanInCollectTotals(&totals);
+
+	printf("\nClass              Run   Avg wait   Max wait    Avg run    Max run\n");
+
+	for (taskClass = 0; taskClass < TASK_CLASSES; taskClass++)
+	{
+		stats = &g_fanIn.classStats[taskClass];
+
+		printf("%-12s %9llu %8.0fus %8lldus %8.0fus %8lldus\n",
+			g_className[taskClass],
+			(unsigned long long) stats->run,
+			stats->run ? (double) stats->waitSumUs / stats->run : 0.0,
+			(long long) stats->waitMaxUs,
+			stats->run ? (double) stats->runSumUs / stats->run : 0.0,
+			(long long) stats->runMaxUs);
+	}
+
+	if (totals.minBufferTimeUs > 0)
+	{
+		printf("\nLongest gap between polls %lldus, driver buffer lasts %lldus at the sampling rate\n", (long long) totals.maxPollGapUs, (long long) totals.minBufferTimeUs);
+	}
+	else
+	{
+		printf("\nLongest gap between polls %lldus\n", (long long) totals.maxPollGapUs);
+	}
+
+	printf("%llu tasks stolen, most chunks waiting to be written %ld\n", (unsigned long long) totals.steals, (long) g_fanIn.maxBacklog);
+
+	if (g_fanIn.analysisPasses)
+	{
+		printf("Analysis fed %llu chunks raw, %llu decimated and %llu as summaries, %lu changes of feed\n",
+			(unsigned long long) totals.feedChunks[FEED_RAW], (unsigned long long) totals.feedChunks[FEED_DECIMATED],
+			(unsigned long long) totals.feedChunks[FEED_SUMMARY], (unsigned long) totals.transitions);
+	}
+}
+
+/****************************************************************************
+* FanInPrintStats
+****************************************************************************/
+void FanInPrintStats(int64_t elapsedUs)
+{
+	FANIN_DEVICE * device;
+	FANIN_TOTALS totals;
+	uint16_t i;
+	uint16_t ch;
+	uint16_t plane;
+
+	FanInCollectTotals(&totals);
+
+	printf("\nDevice  Serial       Samples   MS/s  Dropped  Chunks  Avg latency  P99 latency  Max latency  Max poll gap  Backpressure\n");
+
+	for (i = 0; i < g_fanIn.nDevices; i++)
+	{
+		device = &g_fanIn.devices[i];
+
+		printf("%6d  %-10s %9llu %6.2f %8llu %7llu %10.0fus %10lldus %10lldus %11lldus %13lu\n",
+			i,
+			device->simulated ? "(sim)" : (char *) device->unit.serial,
+			(unsigned long long) device->writtenSamples,
+			device->writtenSamples / (double) elapsedUs,
+			(unsigned long long) device->droppedSamples,
+			(unsigned long long) device->writtenChunks,
+			device->writtenChunks ? (double) device->latencySumUs / device->writtenChunks : 0.0,
+			(long long) LatencyPercentile(device, BENCH_PERCENTILE),
+			(long long) device->latencyMaxUs,
+			(long long) device->maxPollGapUs,
+			(unsigned long) device->backpressureEvents);
+	}
+
+	printf("\n%llu samples written by %d workers in %.2f s (%.2f MS/s)\n", (unsigned long long) totals.written, g_fanIn.nWorkers, elapsedUs / 1e6, totals.written / (double) elapsedUs);
+	printf("%llu samples dropped\n", (unsigned long long) totals.dropped);
+	printf("%.1f chunks per batch, %.1f MB in, %.1f MB out\n", totals.batches ? (double) totals.chunks / totals.batches : 0.0,
+		totals.bytesIn / (1024.0 * 1024.0), totals.bytesOut / (1024.0 * 1024.0));
+
+	SchedulerPrintClasses();
+
+	for (i = 0; i < g_fanIn.nDevices && g_fanIn.analysisPasses; i++)
+	{
+		device = &g_fanIn.devices[i];
+		printf("\nDevice %d, %llu chunks analysed, latest from the %s feed (ADC counts):\n", i, (unsigned long long) device->analysedChunks,
+			g_feedName[device->analysedFeed]);
+
+		for (ch = 0, plane = 0; ch < device->unit.channelCount && device->analysedChunks; ch++)
+		{
+			if (device->unit.channelSettings[ch].enabled)
+			{
+				if (device->analysedFeed == FEED_SUMMARY)
+				{
+					printf("  Ch%c  min %6d  max %6d\n", 'A' + ch, device->measurements[plane].minimum, device->measurements[plane].maximum);
+				}
+				else
+				{
+					printf("  Ch%c  min %6d  max %6d  mean %9.1f  rms %9.1f\n", 'A' + ch, device->measurements[plane].minimum,
+						device->measurements[plane].maximum, device->measurements[plane].mean, device->measurements[plane].rms);
+				}
+
+				plane++;
+			}
+		}
+	}
+
+	if (g_fanIn.analysisPasses)
+	{
+		FeedPrintLog(stdout);
+	}
+}
+
+/****************************************************************************
+* SetDefaults - set up channel voltage scales, coupling and offset
+****************************************************************************/
+PICO_STATUS SetDefaults(UNIT * unit)
+{
+	PICO_STATUS status = PICO_OK;
+
+	for (int32_t ch = 0; ch < unit->channelCount && status == PICO_OK; ch++)
+	{
+		status = ps4000aSetChannel(unit->handle,
+			(PS4000A_CHANNEL)(PS4000A_CHANNEL_A + ch),
+			unit->channelSettings[PS4000A_CHANNEL_A + ch].enabled,
+			(PS4000A_COUPLING)unit->channelSettings[PS4000A_CHANNEL_A + ch].DCcoupled,
+			(PICO_CONNECT_PROBE_RANGE) unit->channelSettings[PS4000A_CHANNEL_A + ch].range,
+			unit->channelSettings[PS4000A_CHANNEL_A + ch].analogueOffset);
+
+		printf(status ? "SetDefaults:ps4000aSetChannel------ 0x%08lx for channel %i\n" : "", (unsigned long) status, ch);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* OpenDevice
+* Opens the next device not yet opened and enables all of its channels
+*
+* Returns
+* - PICO_STATUS to indicate success, or if an error occurred
+***************************************************************************/
+PICO_STATUS OpenDevice(UNIT * unit)
+{
+	PICO_STATUS status;
+	int8_t line[80];
+	int16_t requiredSize;
+
+	status = ps4000aOpenUnit(&unit->handle, NULL);
+
+	if (unit->handle <= 0)
+	{
+		return status;
+	}
+
+	// Run from USB power only if that's what the device is connected to
+	if (status == PICO_POWER_SUPPLY_NOT_CONNECTED || status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT)
+	{
+		status = ps4000aChangePowerSource(unit->handle, status);
+	}
+
+	if (status != PICO_OK)
+	{
+		ps4000aCloseUnit(unit->handle);
+		return status;
+	}
+
+	ps4000aGetUnitInfo(unit->handle, line, sizeof(line), &requiredSize, PICO_VARIANT_INFO);
+	memcpy(unit->modelString, line, sizeof(unit->modelString));
+	unit->modelString[sizeof(unit->modelString) - 1] = 0;
+
+	ps4000aGetUnitInfo(unit->handle, line, sizeof(line), &requiredSize, PICO_BATCH_AND_SERIAL);
+	memcpy(unit->serial, line, sizeof(unit->serial));
+	unit->serial[sizeof(unit->serial) - 1] = 0;
+
+	switch (atoi((char *) unit->modelString))
+	{
+		case MODEL_PS4824:
+			unit->model = MODEL_PS4824;
+			unit->channelCount = OCTO_SCOPE;
+			break;
+
+		case MODEL_PS4225:
+			unit->model = MODEL_PS4225;
+			unit->channelCount = DUAL_SCOPE;
+			break;
+
+		default:
+			unit->model = (MODEL_TYPE) atoi((char *) unit->modelString);
+			unit->channelCount = QUAD_SCOPE;
+			break;
+	}
+
+	for (int ch = 0; ch < unit->channelCount; ch++)
+	{
+		unit->channelSettings[ch].enabled = TRUE;
+		unit->channelSettings[ch].DCcoupled = TRUE;
+		unit->channelSettings[ch].range = PS4000A_5V;
+		unit->channelSettings[ch].analogueOffset = 0.0f;
+	}
+
+	ps4000aMaximumValue(unit->handle, &unit->maxADCValue);
+
+	return SetDefaults(unit);
+}
+
+/****************************************************************************
+* StreamDevices
+*
+* Opens every connected device, starts them all streaming and feeds them
+* through the worker pool until a key is pressed
+***************************************************************************/
+void StreamDevices(void)
+{
+	FANIN_DEVICE * device;
+	FANIN_TOTALS totals;
+	PICO_STATUS status = PICO_OK;
+	uint16_t nDevices = 0;
+	uint16_t i;
+	uint32_t sampleInterval;
+	int16_t ch;
+	int64_t startUs;
+	FILE * fp = NULL;
+
+	printf("Opening devices...\n");
+
+	while (nDevices < MAX_PICO_DEVICES)
+	{
+		device = &g_fanIn.devices[nDevices];
+		memset(&device->unit, 0, sizeof(UNIT));
+		device->simulated = FALSE;
+
+		if ((status = OpenDevice(&device->unit)) != PICO_OK)
+		{
+			break;
+		}
+
+		printf("Device %d: PicoScope %s, serial %s, %d channels\n", nDevices, device->unit.modelString, device->unit.serial, device->unit.channelCount);
+		nDevices++;
+	}
+
+	if (status != PICO_OK && status != PICO_NOT_FOUND)
+	{
+		printf("OpenDevice ------ 0x%08lx \n", (unsigned long) status);
+	}
+
+	if (nDevices == 0)
+	{
+		printf("No devices found\n");
+		return;
+	}
+
+	status = PICO_OK;
+
+	for (i = 0; i < nDevices && status == PICO_OK; i++)
+	{
+		device = &g_fanIn.devices[i];
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			device->driverBuffers[ch] = (int16_t *) calloc(bufferLength, sizeof(int16_t));
+
+			if (device->driverBuffers[ch] == NULL)
+			{
+				status = PICO_MEMORY_FAIL;
+				break;
+			}
+
+			ps4000aSetDataBuffer(device->unit.handle, (PS4000A_CHANNEL) ch, device->driverBuffers[ch], bufferLength, 0, PS4000A_RATIO_MODE_NONE);
+		}
+
+		ps4000aSetSimpleTrigger(device->unit.handle, 0, PS4000A_CHANNEL_A, 0, PS4000A_RISING, 0, 0);
+	}
+
+	// Every device is streaming before the first poll is queued
+	for (i = 0; i < nDevices && status == PICO_OK; i++)
+	{
+		device = &g_fanIn.devices[i];
+		sampleInterval = 1;
+
+		status = ps4000aRunStreaming(device->unit.handle, &sampleInterval, PS4000A_US, 0, bufferLength, FALSE, 1, PS4000A_RATIO_MODE_NONE, bufferLength);
+		device->bufferTimeUs = (int64_t) bufferLength * sampleInterval;
+
+		if (status != PICO_OK)
+		{
+			printf("StreamDevices:ps4000aRunStreaming(device %d) ------ 0x%08lx \n", i, (unsigned long) status);
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		status = FanInStart(nDevices);
+	}
+
+	if (status == PICO_OK)
+	{
+		printf("\nStreaming %d devices with %d workers...Press a key to stop\n", nDevices, g_fanIn.nWorkers);
+		startUs = TimeNowUs();
+
+		while (!_kbhit())
+		{
+			Sleep(1000);
+			FanInCollectTotals(&totals);
+			printf("\r%llu samples written, %llu dropped, %lu backpressure events   ", (unsigned long long) totals.written,
+				(unsigned long long) totals.dropped, (unsigned long) totals.backpressureEvents);
+			fflush(stdout);
+		}
+
+		_getch();
+		FanInStop();
+		FanInPrintStats(TimeNowUs() - startUs);
+
+		if (g_fanIn.writeToDisk && g_fanIn.analysisPasses)
+		{
+			fopen_s(&fp, "fanin_feed.txt", "w");
+
+			if (fp != NULL)
+			{
+				fprintf(fp, "Analysis feed of each device, by sample number\n");
+				FeedPrintLog(fp);
+				fclose(fp);
+				printf("\nAnalysis feed log written to fanin_feed.txt\n");
+			}
+		}
+	}
+
+	for (i = 0; i < nDevices; i++)
+	{
+		device = &g_fanIn.devices[i];
+		ps4000aStop(device->unit.handle);
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			ps4000aSetDataBuffer(device->unit.handle, (PS4000A_CHANNEL) ch, NULL, 0, 0, PS4000A_RATIO_MODE_NONE);
+			free(device->driverBuffers[ch]);
+			device->driverBuffers[ch] = NULL;
+		}
+
+		ps4000aCloseUnit(device->unit.handle);
+	}
+}
+
+/****************************************************************************
+* BenchmarkRun
+*
+* Streams nDevices simulated devices for durationMs and returns the totals
+* and the CPU time the process used meanwhile
+***************************************************************************/
+PICO_STATUS BenchmarkRun(uint16_t nDevices, uint32_t samplesPerSecond, uint32_t durationMs, FANIN_TOTALS * totals, int64_t * elapsedUs,
+	int64_t * cpuUs)
+{
+	FANIN_DEVICE * device;
+	PICO_STATUS status = PICO_OK;
+	uint16_t i;
+	int16_t ch;
+	int64_t startUs;
+	int64_t startCpuUs;
+
+	for (i = 0; i < nDevices && status == PICO_OK; i++)
+	{
+		device = &g_fanIn.devices[i];
+		memset(&device->unit, 0, sizeof(UNIT));
+		sprintf((char *) device->unit.serial, "SIM%03d", i);
+		device->unit.handle = (int16_t) (i + 1);
+		device->unit.channelCount = QUAD_SCOPE;
+		device->unit.maxADCValue = 32767;
+		device->simulated = TRUE;
+		device->samplesPerSecond = samplesPerSecond;
+		device->bufferTimeUs = samplesPerSecond ? (int64_t) (bufferLength * 1e6 / samplesPerSecond) : 0;
+
+		for (ch = 0; ch < device->unit.channelCount; ch++)
+		{
+			device->unit.channelSettings[ch].enabled = TRUE;
+			device->unit.channelSettings[ch].range = PS4000A_5V;
+			device->driverBuffers[ch] = (int16_t *) calloc(bufferLength, sizeof(int16_t));
+			status = device->driverBuffers[ch] == NULL ? PICO_MEMORY_FAIL : status;
+		}
+	}
+
+	if (status == PICO_OK && (status = FanInStart(nDevices)) == PICO_OK)
+	{
+		startUs = TimeNowUs();
+		startCpuUs = ProcessCpuUs();
+		Sleep(durationMs);
+		FanInStop();
+		*elapsedUs = TimeNowUs() - startUs;
+		*cpuUs = ProcessCpuUs() - startCpuUs;
+		FanInCollectTotals(totals);
+	}
+
+	for (i = 0; i < nDevices; i++)
+	{
+		for (ch = 0; ch < PS4000A_MAX_CHANNELS; ch++)
+		{
+			free(g_fanIn.devices[i].driverBuffers[ch]);
+			g_fanIn.devices[i].driverBuffers[ch] = NULL;
+		}
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* Benchmark
+*
+* Runs the pipeline with 1, 2, 4... simulated devices, each with 4 channels,
+* and shows how throughput scales with the number of producers. Fairness is
+* the least written device's share divided by the most written device's.
+* Worst avg and worst p99 are the latencies of the slowest device (p99 is
+* rounded up to a power of two microseconds), and
+* CPU/device is the process's CPU time (workers, polling and writing) per
+* device as a share of one core. The largest run that kept up is used to
+* estimate how many devices this machine can take at that rate.
+***************************************************************************/
+void Benchmark(void)
+{
+	FANIN_TOTALS totals;
+	uint32_t maxDevices = 16;
+	uint32_t samplesPerSecond = 1000000;
+	uint32_t durationMs = 2000;
+	uint32_t nDevices;
+	uint32_t keptUp = 0;
+	uint32_t cores = std::thread::hardware_concurrency();
+	int64_t elapsedUs;
+	int64_t cpuUs;
+	double singleDevice = 0.0;
+	double throughput;
+	double cpuPerDevice;
+	double keptUpCpuPerDevice = 0.0;
+
+	printf("Maximum number of simulated devices (1..%d): ", MAX_PICO_DEVICES);
+	scanf_s("%u", &maxDevices);
+	maxDevices = maxDevices < 1 ? 1 : maxDevices > MAX_PICO_DEVICES ? MAX_PICO_DEVICES : maxDevices;
+
+	printf("Samples per second per device (0 = as fast as possible): ");
+	scanf_s("%u", &samplesPerSecond);
+
+	printf("Duration of each run in ms: ");
+	scanf_s("%u", &durationMs);
+
+	printf("\n%d workers, compression %s, %s, analysis %s\n", g_fanIn.nWorkers, g_fanIn.compress ? "on" : "off",
+		g_fanIn.writeToDisk ? "writing to disk" : "output discarded", g_fanIn.analysisPasses ? "on" : "off");
+	printf("\nDevices      MS/s  Scaling  Dropped     Lost  Fairness  Chunks/batch  Avg latency  Max latency  Worst avg  Worst p99  Max poll gap  Backpressure  CPU/device\n");
+
+	for (nDevices = 1; nDevices <= maxDevices; nDevices = nDevices * 2 > maxDevices ? maxDevices : nDevices * 2)
+	{
+		if (BenchmarkRun((uint16_t) nDevices, samplesPerSecond, durationMs, &totals, &elapsedUs, &cpuUs) != PICO_OK)
+		{
+			printf("Benchmark: Not enough memory for %d devices\n", nDevices);
+			break;
+		}
+
+		throughput = totals.written / (double) elapsedUs;
+		singleDevice = nDevices == 1 ? throughput : singleDevice;
+		cpuPerDevice = 100.0 * cpuUs / elapsedUs / nDevices;
+
+		if (totals.dropped == 0 && totals.lost == 0)
+		{
+			keptUp = nDevices;
+			keptUpCpuPerDevice = cpuPerDevice;
+		}
+
+		printf("%7d %9.2f %7.2fx %8llu %8llu %9.2f %13.1f %10.0fus %10lldus %8.0fus %8lldus %11lldus %13lu %10.1f%%\n",
+			nDevices,
+			throughput,
+			singleDevice > 0 ? throughput / singleDevice : 0.0,
+			(unsigned long long) totals.dropped,
+			(unsigned long long) totals.lost,
+			totals.maxDeviceSamples ? (double) totals.minDeviceSamples / totals.maxDeviceSamples : 0.0,
+			totals.batches ? (double) totals.chunks / totals.batches : 0.0,
+			totals.averageLatencyUs,
+			(long long) totals.maxLatencyUs,
+			totals.worstAverageLatencyUs,
+			(long long) totals.worstPercentileLatencyUs,
+			(long long) totals.maxPollGapUs,
+			(unsigned long) totals.backpressureEvents,
+			cpuPerDevice);
+
+		if (nDevices == maxDevices)
+		{
+			SchedulerPrintClasses();
+			break;
+		}
+	}
+
+	if (keptUp == 0)
+	{
+		printf("\nEvery run dropped or lost samples\n");
+	}
+	else if (samplesPerSecond == 0)
+	{
+		printf("\nLargest run with nothing dropped or lost: %d devices as fast as possible\n", keptUp);
+	}
+	else
+	{
+		printf("\nLargest run with nothing dropped or lost: %d devices at %u S/s, %.1f%% of a core each\n", keptUp, samplesPerSecond, keptUpCpuPerDevice);
+
+		if (keptUpCpuPerDevice > 0.0 && cores > 0)
+		{
+			printf("At that CPU cost the %u core%s of this machine could take about %.0f devices\n", cores, cores == 1 ? "" : "s", cores * 100.0 / keptUpCpuPerDevice);
+		}
+	}
+}
+
+int main(void)
+{
+	int8_t ch = '.';
+	uint32_t nWorkers;
+	uint32_t analysisPasses;
+	int32_t decimateLag;
+	int32_t summaryLag;
+	int32_t restoreLag;
+	uint32_t i;
+
+	printf("PicoScope 4000 Series (ps4000a) Driver Multiple Device Streaming Example Program\n\n");
+
+	for (i = 0; i < SIM_WAVE_LENGTH; i++)
+	{
+		g_simWave[i] = (int16_t) (16000 * ((i < SIM_WAVE_LENGTH / 2) ? (int32_t) i * 4 - SIM_WAVE_LENGTH : 3 * SIM_WAVE_LENGTH - (int32_t) i * 4) / SIM_WAVE_LENGTH + rand() % 64 - 32);
+	}
+
+	g_fanIn.nWorkers = 2;
+	g_fanIn.analysisPasses = 1;
+	g_fanIn.policy.decimateLag = FEED_DECIMATE_LAG;
+	g_fanIn.policy.summaryLag = FEED_SUMMARY_LAG;
+	g_fanIn.policy.restoreLag = FEED_RESTORE_LAG;
+	g_fanIn.compress = TRUE;
+	g_fanIn.writeToDisk = TRUE;
+
+	while (ch != 'X')
+	{
+		printf("\n\n");
+		printf("S - Stream all connected devices              B - Benchmark with simulated devices\n");
+		printf("W - Set number of worker threads (%2d)         C - Compression (%s)\n", g_fanIn.nWorkers, g_fanIn.compress ? "on" : "off");
+		printf("A - Analysis passes per chunk (%2d, 0 = off)   D - Write to disk (%s)\n", g_fanIn.analysisPasses, g_fanIn.writeToDisk ? "on" : "off");
+		printf("G - Analysis degradation (%d/%d/%d chunks)      L - Live snapshot of a running stream\n", g_fanIn.policy.decimateLag, g_fanIn.policy.summaryLag, g_fanIn.policy.restoreLag);
+		printf("                                              X - Exit\n");
+		printf("Operation:");
+
+		ch = toupper(_getch());
+
+		printf("\n\n");
+		switch (ch)
+		{
+		case 'S':
+			StreamDevices();
+			break;
+
+		case 'B':
+			Benchmark();
+			break;
+
+		case 'W':
+			printf("Number of worker threads (1..%d): ", MAX_WORKERS);
+			nWorkers = g_fanIn.nWorkers;
+			scanf_s("%u", &nWorkers);
+			g_fanIn.nWorkers = (uint16_t) (nWorkers < 1 ? 1 : nWorkers > MAX_WORKERS ? MAX_WORKERS : nWorkers);
+			break;
+
+		case 'A':
+			printf("Analysis passes per chunk (0 = off): ");
+			analysisPasses = g_fanIn.analysisPasses;
+			scanf_s("%u", &analysisPasses);
+			g_fanIn.analysisPasses = (uint16_t) (analysisPasses > 1000 ? 1000 : analysisPasses);
+			break;
+
+		case 'G':
+			decimateLag = g_fanIn.policy.decimateLag;
+			summaryLag = g_fanIn.policy.summaryLag;
+			restoreLag = g_fanIn.policy.restoreLag;
+
+			printf("Chunks analysis may fall behind before it gets decimated data: ");
+			scanf_s("%d", &decimateLag);
+			printf("Chunks analysis may fall behind before it only gets summaries: ");
+			scanf_s("%d", &summaryLag);
+			printf("Chunks behind at which analysis has caught up: ");
+			scanf_s("%d", &restoreLag);
+
+			if (restoreLag < 0 || decimateLag <= restoreLag || summaryLag < decimateLag)
+			{
+				printf("Thresholds must satisfy 0 <= caught up < decimated <= summaries only\n");
+				break;
+			}
+
+			g_fanIn.policy.decimateLag = decimateLag;
+			g_fanIn.policy.summaryLag = summaryLag;
+			g_fanIn.policy.restoreLag = restoreLag;
+			break;
+
+		case 'C':
+			g_fanIn.compress = !g_fanIn.compress;
+			break;
+
+		case 'D':
+			g_fanIn.writeToDisk = !g_fanIn.writeToDisk;
+			break;
+
+		case 'L':
+			SnapshotWatch();
+			break;
+
+		case 'X':
+			break;
+
+		default:
+			printf("Invalid operation\n");
+			break;
+		}
+	}
+
+	SnapshotDestroy();
+
+	return 1;
+}
@@ -18,12 +18,26 @@
  *   Collect a block of samples when a trigger event occurs
  *	 Collect a block of samples using Equivalent Time Sampling (ETS)
  *   Collect samples using a rapid block capture with trigger
+ *   Triage rapid block captures and read back only the selected ones
+ *   Repeat triggered captures using overlapped data retrieval
+ *   Archive rapid block captures as events on one timeline and query them
  *   Collect a stream of data immediately
  *   Collect a stream of data when a trigger event occurs
  *   Set Signal Generator, using standard or custom signals
  *   Change timebase & voltage scales
+ *   Autoset the voltage ranges, timebase and trigger level
+ *   Trace the stages of block, rapid block and streaming captures
+ *   Serve acquisition metrics to Prometheus on a loopback HTTP endpoint
+ *   Stream raw samples to stdout for another program to read
  *   Display data in mV or ADC counts
  *	 Handle power source changes
+ *   Catalogue every capture file and query the catalogue
+ *   Keep capture buffers within a memory budget
+ *   Run a test sequence of capture steps from a file
+ *   Compare two captures sample by sample within per-channel tolerances
+ *   Apply per-channel calibration and probe scaling to sample output
+ *   Join a capture with slow logger readings on a common host timeline
+ *   Raise threshold alarms on streamed samples as they arrive
  *
  *	To build this application:-
  *
@@ -53,18 +67,46 @@
  *			./autogen.sh <ENTER>
  *			make <ENTER>
  *
+ *		If sys/sdt.h is installed (systemtap-sdt-dev or systemtap-sdt-devel), the
+ *		build includes USDT probes in the acquisition paths. They cost a single
+ *		no-op instruction each until a tracer attaches, e.g.
+ *
+ *			bpftrace -l 'usdt:./ps5000aCon:*' <ENTER>
+ *			bpftrace -e 'usdt:./ps5000aCon:ps5000acon:get_values_start { @s[tid] = nsecs; }
+ *				usdt:./ps5000aCon:ps5000acon:get_values_end /@s[tid]/ { @us = hist((nsecs - @s[tid]) / 1000); }' <ENTER>
+ *
+ *		Raw samples can be piped straight into another program during
+ *		streaming (menu K). The menu and messages then appear on stderr:
+ *
+ *			./ps5000aCon | ./analyzer <ENTER>
+ *
  * Copyright (C) 2013-2018 Pico Technology Ltd. See LICENSE file for terms.
  *
  ******************************************************************************/
 
+#ifndef _WIN32
+#define _GNU_SOURCE		// vmsplice and F_SETPIPE_SZ
+#endif
+
 #include <stdio.h>
+#include <time.h>
+#include <math.h>
 
 /* Headers for Windows */
 #ifdef _WIN32
+#include <winsock2.h>
 #include "windows.h"
 #include <conio.h>
+#include <io.h>
+#include <fcntl.h>
 #include "ps5000aApi.h"
+
+#define MSG_NOSIGNAL 0
 #else
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <sys/types.h>
 #include <string.h>
 #include <termios.h>
@@ -72,6 +114,18 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <libps5000a-1.1/ps5000aApi.h>
 #ifndef PICO_STATUS
@@ -82,6 +136,13 @@
 #define scanf_s scanf
 #define fscanf_s fscanf
 #define memcpy_s(a,b,c,d) memcpy(a,c,d)
+#define localtime_s(a,b) localtime_r(b,a)
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
+#define closesocket close
+#define INVALID_SOCKET (-1)
+
+typedef int32_t SOCKET;
 
 typedef enum enBOOL{FALSE,TRUE} BOOL;
 
@@ -135,6 +196,32 @@ return (fp>0)?0:-1;
 #define min(a,b) ((a) < (b) ? a : b)
 #endif
 
+/* USDT probes for perf and bpftrace, provider ps5000acon. Compiled out where sys/sdt.h is not available.
+ * Each probe has the same arguments at every site:
+ *	run_block_arm (samples, timebase)			get_values_start (samples, captures)
+ *	get_values_end (samples, status)			block_ready (status)
+ *	streaming_callback_entry (samples, startIndex, overflow)
+ *	streaming_callback_exit (samples)			writer_flush (samples)
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE0(name)			DTRACE_PROBE(ps5000acon, name)
+#define PROBE1(name, a)			DTRACE_PROBE1(ps5000acon, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(ps5000acon, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(ps5000acon, name, a, b, c)
+#else
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+/* SSE2 kernels for sample conversion and capture comparison, with plain C fallbacks */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 int32_t cycles = 0;
 
 #define BUFFER_SIZE 	1024
@@ -153,6 +240,18 @@ typedef struct
 	float analogueOffset;
 }CHANNEL_SETTINGS;
 
+typedef struct
+{
+	float gain;
+	float offset;		// mV, added after the gain
+}CALIBRATION;
+
+typedef struct
+{
+	float scale;		// Engineering units per mV at the probe input
+	int8_t units[8];
+}PROBE_SETTINGS;
+
 typedef enum
 {
 	MODEL_NONE = 0,
@@ -207,6 +306,8 @@ typedef struct
 	CHANNEL_SETTINGS	channelSettings [PS5000A_MAX_CHANNELS];
 	PS5000A_DEVICE_RESOLUTION	resolution;
 	int16_t						digitalPortCount;
+	CALIBRATION				calibration [PS5000A_MAX_CHANNELS][PS5000A_MAX_RANGES];
+	PROBE_SETTINGS		probe [PS5000A_MAX_CHANNELS];
 }UNIT;
 
 uint32_t	timebase = 8;
@@ -236,8 +337,8 @@ int16_t			g_trig = 0;
 uint32_t		g_trigAt = 0;
 int16_t			g_overflow = 0;
 
-int8_t blockFile[20]  = "block.txt";
-int8_t streamFile[20] = "stream.txt";
+int8_t blockFile[80]  = "block.txt";
+int8_t streamFile[80] = "stream.txt";
 
 typedef struct tBufferInfo
 {
@@ -248,1695 +349,9637 @@ typedef struct tBufferInfo
 } BUFFER_INFO;
 
 /****************************************************************************
-* callbackStreaming
-* Used by ps5000a data streaming collection calls, on receipt of data.
-* Used to set global flags etc checked by user routines
+* Capture catalogue
+*
+* Every capture written to disk is given a unique file name and a fixed-size
+* record is appended to a single catalogue file (captures.cat) describing the
+* device, settings, trigger, time span, file name and per-channel summary
+* statistics. Records are appended in time order so that time range queries
+* can binary search the file instead of reading every record.
 ****************************************************************************/
-void PREF4 callBackStreaming(	int16_t handle,
-	int32_t noOfSamples,
-	uint32_t startIndex,
-	int16_t overflow,
-	uint32_t triggerAt,
-	int16_t triggered,
-	int16_t autoStop,
-	void	*pParameter)
+#define CATALOGUE_FILE			"captures.cat"
+#define CATALOGUE_VERSION		1
+#define CATALOGUE_FILE_NAME_LENGTH	80
+
+typedef struct tChannelSummary
 {
-	int32_t channel;
-	BUFFER_INFO * bufferInfo = NULL;
+	int16_t		enabled;
+	int16_t		range;
+	int16_t		overflow;
+	int16_t		minValue;
+	int16_t		maxValue;
+	int16_t		reserved;
+	uint32_t	count;
+	double		sum;
+}CHANNEL_SUMMARY;
+
+typedef struct tCatalogueRecord
+{
+	uint32_t				version;
+	uint32_t				recordSize;
+	int64_t					startTime;		// Host time (seconds since the epoch) when the capture started
+	int64_t					endTime;		// Host time when the capture file was closed
+	int8_t					modelString[8];
+	int8_t					serial[16];
+	int8_t					mode[16];		// "Block", "ETS", "Rapid block" or "Streaming"
+	int16_t					resolution;
+	int16_t					triggerEnabled;
+	int16_t					triggerChannel;
+	int16_t					triggerThreshold;	// ADC counts
+	uint32_t				timebase;
+	int32_t					sampleIntervalNs;
+	uint32_t				sampleCount;
+	uint32_t				segmentCount;
+	int8_t					fileName[CATALOGUE_FILE_NAME_LENGTH];
+	CHANNEL_SUMMARY	channels[PS5000A_MAX_CHANNELS];
+}CATALOGUE_RECORD;
+
+// Trigger channel and threshold of the most recent call to setTrigger()
+PS5000A_CHANNEL	g_lastTriggerChannel = PS5000A_CHANNEL_A;
+int16_t					g_lastTriggerThreshold = 0;
 
-	if (pParameter != NULL)
-	{
-		bufferInfo = (BUFFER_INFO *) pParameter;
-	}
+/****************************************************************************
+* Memory budget
+*
+* Sample buffers are allocated with memoryAlloc(), which charges them to a
+* priority class against one budget. Each class may only fill the budget up
+* to its own limit, so application copies are refused long before the
+* buffers the driver writes into. Capture routines check memoryAvailable()
+* before arming the device and reduce the size of the capture rather than
+* failing part way through.
+****************************************************************************/
+typedef enum
+{
+	MEMORY_ACQUISITION,		// Buffers the driver writes captured data into
+	MEMORY_APPLICATION,		// Copies of captured data held by the application
+	MEMORY_CLASS_COUNT
+} MEMORY_CLASS;
 
-	// used for streaming
-	g_sampleCount = noOfSamples;
-	g_startIndex  = startIndex;
-	g_autoStopped = autoStop;
+#define DEFAULT_MEMORY_BUDGET_MB	512
+#define MIN_STREAMING_BUFFER			1000
 
-	// flag to say done reading data
-	g_ready = TRUE;
+typedef struct tMemoryHeader
+{
+	size_t				size;
+	MEMORY_CLASS	memoryClass;
+	uint32_t			guard;
+	uint32_t			reserved;
+} MEMORY_HEADER;
 
-	// flags to show if & where a trigger has occurred
-	g_trig = triggered;
-	g_trigAt = triggerAt;
+typedef struct tMemoryGovernor
+{
+	size_t						budget;
+	size_t						used[MEMORY_CLASS_COUNT];
+	size_t						peak;
+	uint32_t					refused[MEMORY_CLASS_COUNT];
+} MEMORY_GOVERNOR;
 
-	g_overflow = overflow;
+#define MEMORY_GUARD	0x4D454D42
 
-	if (bufferInfo != NULL && noOfSamples)
-	{
-		for (channel = 0; channel < bufferInfo->unit->channelCount; channel++)
-		{
-			if (bufferInfo->unit->channelSettings[channel].enabled)
-			{
-				if (bufferInfo->appBuffers && bufferInfo->driverBuffers)
-				{
-					// Max buffers
-					if (bufferInfo->appBuffers[channel * 2]  && bufferInfo->driverBuffers[channel * 2])
-					{
-						memcpy_s (&bufferInfo->appBuffers[channel * 2][startIndex], noOfSamples * sizeof(int16_t),
-							&bufferInfo->driverBuffers[channel * 2][startIndex], noOfSamples * sizeof(int16_t));
-					}
+// Percentage of the budget that each class may fill
+const uint16_t memoryClassLimit[MEMORY_CLASS_COUNT] = { 100, 90 };
+const int8_t * memoryClassName[MEMORY_CLASS_COUNT] = { "Acquisition", "Application" };
 
-					// Min buffers
-					if (bufferInfo->appBuffers[channel * 2 + 1] && bufferInfo->driverBuffers[channel * 2 + 1])
-					{
-						memcpy_s (&bufferInfo->appBuffers[channel * 2 + 1][startIndex], noOfSamples * sizeof(int16_t),
-							&bufferInfo->driverBuffers[channel * 2 + 1][startIndex], noOfSamples * sizeof(int16_t));
-					}
-				}
-			}
-		}
-	}
-}
+MEMORY_GOVERNOR g_memory = { (size_t) DEFAULT_MEMORY_BUDGET_MB * 1024 * 1024 };
 
 /****************************************************************************
-* Callback
-* used by ps5000a data block collection calls, on receipt of data.
-* used to set global flags etc checked by user routines
+* memoryUsed
+*
+* Total number of bytes currently allocated in all classes
 ****************************************************************************/
-void PREF4 callBackBlock( int16_t handle, PICO_STATUS status, void * pParameter)
+size_t memoryUsed(void)
 {
-	if (status != PICO_CANCELLED)
+	size_t total = 0;
+	int16_t i;
+
+	for (i = 0; i < MEMORY_CLASS_COUNT; i++)
 	{
-		g_ready = TRUE;
+		total += g_memory.used[i];
 	}
+
+	return total;
 }
 
 /****************************************************************************
-* SetDefaults - restore default settings
+* memoryAvailable
+*
+* Number of bytes that can still be allocated in the given class
 ****************************************************************************/
-void setDefaults(UNIT * unit)
+size_t memoryAvailable(MEMORY_CLASS memoryClass)
 {
-	PICO_STATUS status;
-	PICO_STATUS powerStatus;
-	int32_t i;
+	size_t limit = g_memory.budget / 100 * memoryClassLimit[memoryClass];
+	size_t used = memoryUsed();
 
-	status = ps5000aSetEts(unit->handle, PS5000A_ETS_OFF, 0, 0, NULL);					// Turn off hasHardwareETS
-	printf(status?"setDefaults:ps5000aSetEts------ 0x%08lx \n":"", status);
+	return (used < limit) ? limit - used : 0;
+}
 
-	powerStatus = ps5000aCurrentPowerSource(unit->handle);
+/****************************************************************************
+* memoryAlloc
+*
+* Allocates count * size zeroed bytes charged to the given class.
+* Returns NULL if the class limit would be exceeded.
+****************************************************************************/
+void * memoryAlloc(MEMORY_CLASS memoryClass, size_t count, size_t size)
+{
+	size_t bytes = count * size;
+	MEMORY_HEADER * header;
 
-	for (i = 0; i < unit->channelCount; i++) // reset channels to most recent settings
+	if (memoryAvailable(memoryClass) < bytes)
 	{
-		if(i >= DUAL_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
-		{
-			// No need to set the channels C and D if Quad channel scope and power not enabled.
-		}
-		else
-		{
-			status = ps5000aSetChannel(unit->handle, (PS5000A_CHANNEL)(PS5000A_CHANNEL_A + i),
-				unit->channelSettings[PS5000A_CHANNEL_A + i].enabled,
-				(PS5000A_COUPLING)unit->channelSettings[PS5000A_CHANNEL_A + i].DCcoupled,
-				(PS5000A_RANGE)unit->channelSettings[PS5000A_CHANNEL_A + i].range, 
-				unit->channelSettings[PS5000A_CHANNEL_A + i].analogueOffset);
+		g_memory.refused[memoryClass]++;
+		return NULL;
+	}
 
-			printf(status?"SetDefaults:ps5000aSetChannel------ 0x%08lx \n":"", status);
+	header = (MEMORY_HEADER *) calloc(1, sizeof(MEMORY_HEADER) + bytes);
 
-		}
+	if (header == NULL)
+	{
+		g_memory.refused[memoryClass]++;
+		return NULL;
 	}
-}
 
-/****************************************************************************
-* adc_to_mv
-*
-* Convert an 16-bit ADC count into millivolts
-****************************************************************************/
-int32_t adc_to_mv(int32_t raw, int32_t rangeIndex, UNIT * unit)
-{
-	return (raw * inputRanges[rangeIndex]) / unit->maxADCValue;
+	header->size = bytes;
+	header->memoryClass = memoryClass;
+	header->guard = MEMORY_GUARD;
+
+	g_memory.used[memoryClass] += bytes;
+	g_memory.peak = max(g_memory.peak, memoryUsed());
+
+	return header + 1;
 }
 
 /****************************************************************************
-* mv_to_adc
-*
-* Convert a millivolt value into a 16-bit ADC count
+* memoryFree
 *
-*  (useful for setting trigger thresholds)
+* Releases memory allocated with memoryAlloc()
 ****************************************************************************/
-int16_t mv_to_adc(int16_t mv, int16_t rangeIndex, UNIT * unit)
-{
-	return (mv * unit->maxADCValue) / inputRanges[rangeIndex];
-}
-
-/****************************************************************************************
-* ChangePowerSource - function to handle switches between +5V supply, and USB only power
-* Only applies to PicoScope 544xA/B units 
-******************************************************************************************/
-PICO_STATUS changePowerSource(int16_t handle, PICO_STATUS status, UNIT * unit)
+void memoryFree(void * p)
 {
-	int8_t ch;
+	MEMORY_HEADER * header;
 
-	switch (status)
+	if (p == NULL)
 	{
-		case PICO_POWER_SUPPLY_NOT_CONNECTED:		// User must acknowledge they want to power via USB
-			do
-			{
-				printf("\n5 V power supply not connected.");
-				printf("\nDo you want to run using USB only Y/N?\n");
-				ch = toupper(_getch());
-				
-				if(ch == 'Y')
-				{
-					printf("\nPowering the unit via USB\n");
-					status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_NOT_CONNECTED);		// Tell the driver that's ok
-				
-					if(status == PICO_OK && unit->channelCount == QUAD_SCOPE)
-					{
-						unit->channelSettings[PS5000A_CHANNEL_C].enabled = FALSE;
-						unit->channelSettings[PS5000A_CHANNEL_D].enabled = FALSE;
-					}
-					else if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-					{
-						status = changePowerSource(handle, status, unit);
-					}
-					else
-					{
-						// Do nothing
-					}
+		return;
+	}
 
-				}
-			}
-			while(ch != 'Y' && ch != 'N');
-			printf(ch == 'N'?"Please use the +5V power supply to power this unit\n":"");
-			break;
+	header = ((MEMORY_HEADER *) p) - 1;
 
-		case PICO_POWER_SUPPLY_CONNECTED:
-			printf("\nUsing +5 V power supply voltage.\n");
-			status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_CONNECTED);		// Tell the driver we are powered from +5V supply
-			break;
+	if (header->guard != MEMORY_GUARD)
+	{
+		printf("memoryFree: Invalid pointer\n");
+		return;
+	}
 
-		case PICO_USB3_0_DEVICE_NON_USB3_0_PORT:
-			do
-			{
-				printf("\nUSB 3.0 device on non-USB 3.0 port.");
-				printf("\nDo you wish to continue Y/N?\n");
-				ch = toupper(_getch());
+	header->guard = 0;
+	g_memory.used[header->memoryClass] -= header->size;
+	free(header);
+}
 
-				if (ch == 'Y')
-				{
-					printf("\nSwitching to use USB power from non-USB 3.0 port.\n");
-					status = ps5000aChangePowerSource(handle, PICO_USB3_0_DEVICE_NON_USB3_0_PORT);		// Tell the driver that's ok
+/****************************************************************************
+* displayMemoryUsage
+*
+* Shows the live accounting for each class
+****************************************************************************/
+void displayMemoryUsage(void)
+{
+	int16_t i;
 
-					if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-					{
-						status = changePowerSource(handle, status, unit);
-					}
-					else
-					{
-						// Do nothing
-					}
+	printf("Memory budget %lu MB, in use %.1f MB, peak %.1f MB\n\n", (uint32_t) (g_memory.budget / (1024 * 1024)),
+		memoryUsed() / (1024.0 * 1024.0), g_memory.peak / (1024.0 * 1024.0));
 
-				}
-			} while (ch != 'Y' && ch != 'N');
-			printf(ch == 'N' ? "Please use a USB 3.0 port or press 'Y'.\n" : "");
-			break;
+	printf("Class          Limit    In use (MB)   Available (MB)   Refused\n");
 
-		case PICO_POWER_SUPPLY_UNDERVOLTAGE:
-			do
-			{
-				printf("\nUSB not supplying required voltage");
-				printf("\nPlease plug in the +5 V power supply\n");
-				printf("\nHit any key to continue, or Esc to exit...\n");
-				ch = _getch();
-				
-				if (ch == 0x1B)	// ESC key
-				{
-					exit(0);
-				}
-				else
-				{
-					status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_CONNECTED);		// Tell the driver that's ok
-				}
-			}
-			while (status == PICO_POWER_SUPPLY_REQUEST_INVALID);
-			break;
+	for (i = 0; i < MEMORY_CLASS_COUNT; i++)
+	{
+		printf("%-12s   %3d%%   %11.1f   %14.1f   %7lu\n", memoryClassName[i], memoryClassLimit[i],
+			g_memory.used[i] / (1024.0 * 1024.0), memoryAvailable((MEMORY_CLASS) i) / (1024.0 * 1024.0), g_memory.refused[i]);
 	}
 
 	printf("\n");
-	return status;
 }
 
 /****************************************************************************
-* ClearDataBuffers
+* setMemoryBudget
 *
-* stops GetData writing values to memory that has been released
+* Shows the memory accounting and lets the user change the budget
 ****************************************************************************/
-PICO_STATUS clearDataBuffers(UNIT * unit)
+void setMemoryBudget(void)
 {
-	int32_t i;
-	PICO_STATUS status;
+	uint32_t budgetMB = 0;
 
-	for (i = 0; i < unit->channelCount; i++) 
+	displayMemoryUsage();
+
+	printf("Enter new budget in MB (0 to keep %lu MB): ", (uint32_t) (g_memory.budget / (1024 * 1024)));
+	fflush(stdin);
+	scanf_s("%u", &budgetMB);
+
+	if (budgetMB > 0)
 	{
-		if(unit->channelSettings[i].enabled)
-		{
-			if ((status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL) i, NULL, NULL, 0, 0, PS5000A_RATIO_MODE_NONE)) != PICO_OK)
-			{
-				printf("clearDataBuffers:ps5000aSetDataBuffers(channel %d) ------ 0x%08lx \n", i, status);
-			}
-		}
+		g_memory.budget = (size_t) budgetMB * 1024 * 1024;
+		printf("Memory budget set to %lu MB\n", budgetMB);
 	}
-	return status;
 }
 
 /****************************************************************************
-* BlockDataHandler
-* - Used by all block data routines
-* - acquires data (user sets trigger mode before calling), displays 10 items
-*   and saves all to block.txt
-* Input :
-* - unit : the unit to use.
-* - text : the text to display before the display of data slice
-* - offset : the offset into the data buffer to start the display's slice.
-* - etsModeSet : a flag to indicate if ETS mode has been set on the device
+* timeNowUs
+*
+* Monotonic time in microseconds, used to time operations
 ****************************************************************************/
-void blockDataHandler(UNIT * unit, int8_t * text, int32_t offset, int16_t etsModeSet)
+int64_t timeNowUs(void)
 {
-	int16_t retry;
-	int16_t triggerEnabled = 0;
-	int16_t pwqEnabled = 0;
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
 
-	int16_t * buffers[2 * PS5000A_MAX_CHANNELS];
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
 
-	int32_t i, j;
-	int32_t timeInterval;
-	int32_t sampleCount = BUFFER_SIZE;
-	int32_t maxSamples;
-	int32_t timeIndisposed;
+	return (int64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 + (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
 
-	uint32_t downSampleRatio = 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	int64_t * etsTime; // Buffer for ETS time data
-	
-	PICO_STATUS status;
-	PICO_STATUS powerStatus;
-	
-	PS5000A_RATIO_MODE ratioMode = PS5000A_RATIO_MODE_NONE;
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
 
-	FILE * fp = NULL;
+/****************************************************************************
+* wallClockUs
+*
+* Wall clock time in microseconds since the epoch (1970-01-01 UTC)
+****************************************************************************/
+int64_t wallClockUs(void)
+{
+#ifdef _WIN32
+	FILETIME fileTime;
+	ULARGE_INTEGER value;
 
-	powerStatus = ps5000aCurrentPowerSource(unit->handle);
-	
-	for (i = 0; i < unit->channelCount; i++) 
+	// FILETIME counts 100 ns intervals since 1601-01-01
+	GetSystemTimeAsFileTime(&fileTime);
+	value.LowPart = fileTime.dwLowDateTime;
+	value.HighPart = fileTime.dwHighDateTime;
+
+	return (int64_t) ((value.QuadPart - 116444736000000000ULL) / 10);
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+/****************************************************************************
+* Trace events
+*
+* Scoped trace events around the stages of the block, rapid block and
+* streaming handlers, written to TRACE_FILE in the Chrome trace event JSON
+* format that chrome://tracing and ui.perfetto.dev both open.
+*
+* Events are queued in a bounded ring that any thread may write to: each
+* slot carries a sequence number, so the main thread and the driver's
+* callback threads claim a slot with one compare-and-swap and never wait
+* for each other. A writer thread drains the ring in order every
+* TRACE_FLUSH_MS and formats the JSON, so no file I/O happens on the
+* acquisition path. An event that finds the ring full is dropped and
+* counted rather than stalling the capture. While tracing is off,
+* traceBegin() and traceEnd() are a single test of g_trace.enabled.
+*
+* Usage:
+*	int64_t start = traceBegin();
+*	... stage ...
+*	traceEnd("Stage name", start, samples);
+****************************************************************************/
+#define TRACE_RING_SIZE		65536	// Must be a power of two
+#define TRACE_FLUSH_MS		100
+#define TRACE_FILE			"trace.json"
+
+#ifdef _WIN32
+#define traceCompareAndSwap(target, expected, value) (InterlockedCompareExchange64((target), (value), (expected)) == (expected))
+#define traceIncrement(target) InterlockedIncrement64(target)
+#define traceDecrement(target) InterlockedDecrement64(target)
+#define traceBarrier() MemoryBarrier()
+#define traceThreadId() ((uint32_t) GetCurrentThreadId())
+#else
+#define traceCompareAndSwap(target, expected, value) __sync_bool_compare_and_swap((target), (expected), (value))
+#define traceIncrement(target) __sync_add_and_fetch((target), 1)
+#define traceDecrement(target) __sync_sub_and_fetch((target), 1)
+#define traceBarrier() __sync_synchronize()
+#define traceThreadId() ((uint32_t) syscall(SYS_gettid))
+#endif
+
+typedef struct
+{
+	volatile int64_t	sequence;
+	const char *		name;
+	int64_t				start;		// Ticks
+	int64_t				duration;	// Ticks
+	int64_t				count;		// Samples, bytes or captures handled by the stage
+	uint32_t			threadId;
+}TRACE_SLOT;
+
+typedef struct
+{
+	volatile int32_t	enabled;
+	volatile int32_t	stop;
+	volatile int64_t	head;
+	int64_t				tail;			// Writer thread only
+	volatile int64_t	dropped;
+	volatile int64_t	producers;		// Threads inside traceEnd
+	int64_t				written;
+	int64_t				ticksPerSecond;
+	int64_t				origin;
+	TRACE_SLOT *		slots;
+	FILE *				fp;
+#ifdef _WIN32
+	HANDLE				thread;
+#else
+	pthread_t			thread;
+#endif
+}TRACE_STATE;
+
+TRACE_STATE g_trace;
+
+/****************************************************************************
+* traceTicks
+*
+* High resolution time stamp in ticks of g_trace.ticksPerSecond. On Windows
+* this is the performance counter, which is read from the invariant TSC on
+* current processors.
+****************************************************************************/
+int64_t traceTicks(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+
+	QueryPerformanceCounter(&counter);
+
+	return (int64_t) counter.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/****************************************************************************
+* traceBegin
+*
+* Returns the start time of a stage, or 0 if tracing is off
+****************************************************************************/
+int64_t traceBegin(void)
+{
+	return g_trace.enabled ? traceTicks() : 0;
+}
+
+/****************************************************************************
+* traceEnd
+*
+* Queues a complete event for a stage started with traceBegin. The name
+* must be a string literal, only the pointer is queued.
+****************************************************************************/
+void traceEnd(const char * name, int64_t start, int64_t count)
+{
+	int64_t end;
+	int64_t position;
+	int64_t sequence;
+	TRACE_SLOT * slot;
+
+	if (start == 0 || !g_trace.enabled)
 	{
-		if (i >= DUAL_SCOPE && unit->channelCount == QUAD_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
-		{
-			// No need to set the channels C and D if Quad channel scope and power supply not connected.
-		}
-		else
-		{
-			if (unit->channelSettings[i].enabled)
-			{
-				buffers[i * 2] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
-				buffers[i * 2 + 1] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
-			
-				status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)i, buffers[i * 2], buffers[i * 2 + 1], sampleCount, 0, ratioMode);
-				printf(status ? "blockDataHandler:ps5000aSetDataBuffers(channel %d) ------ 0x%08lx \n":"", i, status);
-			}
-		}
+		return;
 	}
 
-	// Set up ETS time buffers if ETS Block mode data is being captured
-	if (etsModeSet)
+	end = traceTicks();
+
+	// Announce this thread before checking the flag again, so traceStop cannot free the ring under it
+	traceIncrement(&g_trace.producers);
+
+	if (!g_trace.enabled)
 	{
-		etsTime = (int64_t *) calloc(sampleCount, sizeof (int64_t));   
-		status = ps5000aSetEtsTimeBuffer(unit->handle, etsTime, sampleCount);
-	}	
+		traceDecrement(&g_trace.producers);
+		return;
+	}
 
+	position = g_trace.head;
 
-	/*  Find the maximum number of samples and the time interval (in nanoseconds).
-	 *	If the function returns PICO_OK, the timebase will be used.
-	 */
-	do 
+	for (;;)
 	{
-		status = ps5000aGetTimebase(unit->handle, timebase, sampleCount, &timeInterval, &maxSamples, 0);
+		slot = &g_trace.slots[position & (TRACE_RING_SIZE - 1)];
+		sequence = slot->sequence;
 
-		if (status == PICO_INVALID_NUMBER_CHANNELS_FOR_RESOLUTION)
+		if (sequence == position)
 		{
-			printf("BlockDataHandler: Error - Invalid number of channels for resolution.\n");
-			return;
+			// The slot is free for this position, try to claim it
+			if (traceCompareAndSwap(&g_trace.head, position, position + 1))
+			{
+				break;
+			}
 		}
-		else if(status == PICO_OK)
+		else if (sequence < position)
 		{
-			// Do nothing
+			// The writer has not drained this slot yet, so the ring is full
+			traceIncrement(&g_trace.dropped);
+			traceDecrement(&g_trace.producers);
+			return;
 		}
-		else
+
+		position = g_trace.head;
+	}
+
+	slot->name = name;
+	slot->start = start;
+	slot->duration = end - start;
+	slot->count = count;
+	slot->threadId = traceThreadId();
+
+	// Publish the event to the writer
+	traceBarrier();
+	slot->sequence = position + 1;
+
+	traceDecrement(&g_trace.producers);
+}
+
+/****************************************************************************
+* traceDrain
+*
+* Writes every event published so far, in the order the slots were claimed
+****************************************************************************/
+void traceDrain(void)
+{
+	TRACE_SLOT * slot;
+
+	for (;;)
+	{
+		slot = &g_trace.slots[g_trace.tail & (TRACE_RING_SIZE - 1)];
+
+		if (slot->sequence != g_trace.tail + 1)
 		{
-			timebase++;
+			break;
 		}
+
+		traceBarrier();
+
+		// Chrome trace times are in microseconds
+		fprintf(g_trace.fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"count\":%lld}}",
+			g_trace.written ? ",\n" : "", slot->name, slot->threadId,
+			(slot->start - g_trace.origin) * 1e6 / g_trace.ticksPerSecond, slot->duration * 1e6 / g_trace.ticksPerSecond,
+			(long long) slot->count);
+
+		g_trace.written++;
+
+		// Hand the slot back to the producers, one lap ahead
+		traceBarrier();
+		slot->sequence = g_trace.tail + TRACE_RING_SIZE;
+		g_trace.tail++;
 	}
-	while(status != PICO_OK);
+}
 
-	if (!etsModeSet)
+/****************************************************************************
+* traceWriterThread
+*
+* Drains the ring in the background until tracing is stopped
+****************************************************************************/
+#ifdef _WIN32
+DWORD WINAPI traceWriterThread(LPVOID parameter)
+#else
+void * traceWriterThread(void * parameter)
+#endif
+{
+	while (!g_trace.stop)
 	{
-		printf("\nTimebase: %lu  SampleInterval: %ld ns\n", timebase, timeInterval);
+		traceDrain();
+		Sleep(TRACE_FLUSH_MS);
 	}
 
-	/* Start it collecting, then wait for completion*/
-	g_ready = FALSE;
+	traceDrain();
 
-	do
-	{
-		retry = 0;
+	return 0;
+}
 
-		status = ps5000aRunBlock(unit->handle, 0, sampleCount, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+/****************************************************************************
+* traceStart
+*
+* Opens TRACE_FILE, starts the writer thread and turns tracing on
+****************************************************************************/
+void traceStart(void)
+{
+	int32_t i;
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+#endif
 
-		if (status != PICO_OK)
+	g_trace.slots = (TRACE_SLOT *) calloc(TRACE_RING_SIZE, sizeof(TRACE_SLOT));
+	fopen_s(&g_trace.fp, TRACE_FILE, "w");
+
+	if (g_trace.slots == NULL || g_trace.fp == NULL)
+	{
+		printf("Cannot start tracing to %s.\n", TRACE_FILE);
+		free(g_trace.slots);
+		g_trace.slots = NULL;
+
+		if (g_trace.fp != NULL)
 		{
-			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
-			// PicoScope 524XD devices on non-USB 3.0 port
-			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED || 
-						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE) 
-			{
-				status = changePowerSource(unit->handle, status, unit);
-				retry = 1;
-			}
-			else
-			{
-				printf("BlockDataHandler:ps5000aRunBlock ------ 0x%08lx \n", status);
-				return;
-			}
+			fclose(g_trace.fp);
+			g_trace.fp = NULL;
 		}
-	}
-	while(retry);
 
-	status = ps5000aIsTriggerOrPulseWidthQualifierEnabled(unit->handle, &triggerEnabled, &pwqEnabled);
+		return;
+	}
 
-	if (triggerEnabled || pwqEnabled)
+	for (i = 0; i < TRACE_RING_SIZE; i++)
 	{
-		printf("Waiting for trigger... Press any key to abort\n");
+		g_trace.slots[i].sequence = i;
 	}
-	else
+
+#ifdef _WIN32
+	QueryPerformanceFrequency(&frequency);
+	g_trace.ticksPerSecond = frequency.QuadPart;
+#else
+	g_trace.ticksPerSecond = 1000000000;
+#endif
+
+	g_trace.head = 0;
+	g_trace.tail = 0;
+	g_trace.dropped = 0;
+	g_trace.producers = 0;
+	g_trace.written = 0;
+	g_trace.stop = FALSE;
+	g_trace.origin = traceTicks();
+
+	fprintf(g_trace.fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+#ifdef _WIN32
+	g_trace.thread = CreateThread(NULL, 0, traceWriterThread, NULL, 0, NULL);
+#else
+	pthread_create(&g_trace.thread, NULL, traceWriterThread, NULL);
+#endif
+
+	traceBarrier();
+	g_trace.enabled = TRUE;
+
+	printf("Tracing to %s\n", TRACE_FILE);
+}
+
+/****************************************************************************
+* traceStop
+*
+* Turns tracing off, writes the events still queued and closes the file
+****************************************************************************/
+void traceStop(void)
+{
+	if (!g_trace.enabled)
 	{
-		printf("Press any key to abort\n");
+		return;
 	}
 
-	while (!g_ready && !_kbhit())
+	g_trace.enabled = FALSE;
+	traceBarrier();
+
+	// Wait for any event being queued to be published before the writer's final drain
+	while (g_trace.producers != 0)
 	{
 		Sleep(0);
 	}
 
-	if (g_ready) 
-	{
+	g_trace.stop = TRUE;
 
-		// Can retrieve data using different ratios and ratio modes from driver
-		status = ps5000aGetValues(unit->handle, 0, (uint32_t*) &sampleCount, downSampleRatio, ratioMode, 0, NULL);
+#ifdef _WIN32
+	WaitForSingleObject(g_trace.thread, INFINITE);
+	CloseHandle(g_trace.thread);
+#else
+	pthread_join(g_trace.thread, NULL);
+#endif
 
-		if (status != PICO_OK)
-		{
-			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
-			// PicoScope 524XD devices on non-USB 3.0 port
-			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
-						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-			{
-				if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-				{
-					changePowerSource(unit->handle, status, unit);
-				}
-				else
-				{
-					printf("\nPower Source Changed. Data collection aborted.\n");
-				}
-			}
-			else
-			{
-				printf("blockDataHandler:ps5000aGetValues ------ 0x%08lx \n", status);
-			}
-		}
-		else
-		{
-			/* Print out the first 10 readings, converting the readings to mV if required */
-			printf("%s\n",text);
+	fprintf(g_trace.fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ps5000aCon\"}}\n]}\n",
+		g_trace.written ? ",\n" : "");
+	fclose(g_trace.fp);
+	g_trace.fp = NULL;
 
-			printf("Channels are in (%s):-\n\n", ( scaleVoltages ) ? ("mV") : ("ADC Counts"));
+	free(g_trace.slots);
+	g_trace.slots = NULL;
 
-			for (j = 0; j < unit->channelCount; j++) 
-			{
-				if (unit->channelSettings[j].enabled) 
-				{
-					printf("Channel %c:    ", 'A' + j);
-				}
-			}
-			
-			printf("\n\n");
+	printf("%lld trace events written to %s, %lld dropped\n", (long long) g_trace.written, TRACE_FILE, (long long) g_trace.dropped);
+}
 
-			for (i = offset; i < offset+10; i++) 
-			{
-				for (j = 0; j < unit->channelCount; j++) 
-				{
-					if (unit->channelSettings[j].enabled) 
-					{
-						printf("  %6d     ", scaleVoltages ? 
-							adc_to_mv(buffers[j * 2][i], unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit)	// If scaleVoltages, print mV value
-							: buffers[j * 2][i]);																	// else print ADC Count
-					}
-				}
-				
-				printf("\n");
-			}
-
-			sampleCount = min(sampleCount, BUFFER_SIZE);
+/****************************************************************************
+* Metrics endpoint
+*
+* Serves Prometheus text format metrics on http://127.0.0.1:<port>/metrics
+* so that a local scraper (or curl) can watch an acquisition while it runs.
+* The socket is bound to the loopback interface only.
+*
+* The capture paths only ever add to counters with atomic increments; the
+* server thread reads them when it is scraped and formats the response, so
+* a slow scrape can never hold up a callback. Counters are monotonic, so
+* samples per second and writer throughput come from rate() in PromQL.
+****************************************************************************/
+#define METRICS_DEFAULT_PORT	9105
+#define METRICS_POLL_MS			200
+#define METRICS_RESPONSE_SIZE	16384
+#define METRICS_BUCKETS			9
 
-			fopen_s(&fp, blockFile, "w");
+#ifdef _WIN32
+#define metricsAdd(target, value) InterlockedExchangeAdd64((target), (value))
+#else
+#define metricsAdd(target, value) __sync_fetch_and_add((target), (value))
+#endif
 
-			if (fp != NULL)
-			{
-				if (etsModeSet)
-				{
-					fprintf(fp, "ETS Block Data log\n\n");
-				}
-				else
-				{
-					fprintf(fp, "Block Data log\n\n");
-				}
-				
-				fprintf(fp,"Results shown for each of the %d Channels are......\n",unit->channelCount);
-				fprintf(fp,"Maximum Aggregated value ADC Count & mV, Minimum Aggregated value ADC Count & mV\n\n");
+// Upper bounds of the callback inter-arrival histogram buckets, in us
+const int64_t metricsBucketUs[METRICS_BUCKETS] = { 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000 };
 
-				if (etsModeSet)
-				{
-					fprintf(fp, "Time (fs) ");
-				}
-				else
-				{
-					fprintf(fp, "Time (ns) ");
-				}
+typedef struct
+{
+	volatile int32_t	running;
+	volatile int32_t	stop;
+	uint16_t			port;
+	UNIT *				unit;
+	SOCKET				listener;
+#ifdef _WIN32
+	HANDLE				thread;
+#else
+	pthread_t			thread;
+#endif
 
-				for (i = 0; i < unit->channelCount; i++) 
-				{
-					if (unit->channelSettings[i].enabled) 
-					{
-						fprintf(fp," Ch    Max ADC   Max mV  Min ADC   Min mV   ");
-					}
-				}
-				fprintf(fp, "\n");
+	volatile int64_t	samples[PS5000A_MAX_CHANNELS];
+	volatile int64_t	overflows[PS5000A_MAX_CHANNELS];
+	volatile int64_t	captures[3];						// Block, rapid block segments, streaming callbacks
+	volatile int64_t	callbackBuckets[METRICS_BUCKETS + 1];	// Last bucket is +Inf
+	volatile int64_t	callbackSumUs;
+	volatile int64_t	lastCallbackUs;						// Written by the streaming callback only
+	volatile int64_t	streamBufferSize;
+	volatile int64_t	streamBufferEnd;
+	volatile int64_t	writerBytes;
+	volatile int64_t	writerUs;
+	volatile int64_t	scrapes;
+}METRICS_STATE;
+
+METRICS_STATE g_metrics;
 
-				for (i = 0; i < sampleCount; i++) 
-				{
-					if (etsModeSet)
-					{
-						fprintf(fp, "%I64d ", etsTime[i]);
-					}
-					else
-					{
-						fprintf(fp, "%I64u ", g_times[0] + (uint64_t)(i * timeInterval));
-					}
+/****************************************************************************
+* metricsAddSamples
+*
+* Counts samples and overflows received on every enabled channel
+****************************************************************************/
+void metricsAddSamples(UNIT * unit, int64_t count, int16_t overflow)
+{
+	int16_t ch;
 
-					for (j = 0; j < unit->channelCount; j++) 
-					{
-						if (unit->channelSettings[j].enabled) 
-						{
-							fprintf(	fp,
-								"Ch%C  %6d = %+6dmV, %6d = %+6dmV   ",
-								'A' + j,
-								buffers[j * 2][i],
-								adc_to_mv(buffers[j * 2][i], unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit),
-								buffers[j * 2 + 1][i],
-								adc_to_mv(buffers[j * 2 + 1][i], unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit));
-						}
-					}
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			metricsAdd(&g_metrics.samples[ch], count);
 
-					fprintf(fp, "\n");
-				}
-				
-			}
-			else
+			if (overflow & (1 << ch))
 			{
-				printf(	"Cannot open the file %s for writing.\n"
-					"Please ensure that you have permission to access the file.\n", blockFile);
+				metricsAdd(&g_metrics.overflows[ch], 1);
 			}
-		} 
-	}
-	else 
-	{
-		printf("Data collection aborted\n");
-		_getch();
+		}
 	}
+}
 
-	if ((status = ps5000aStop(unit->handle)) != PICO_OK)
-	{
-		printf("blockDataHandler:ps5000aStop ------ 0x%08lx \n", status);
-	}
+/****************************************************************************
+* metricsStreamingCallback
+*
+* Records the time since the previous streaming callback in the histogram
+****************************************************************************/
+void metricsStreamingCallback(void)
+{
+	int64_t now = timeNowUs();
+	int64_t interval;
+	int32_t bucket;
 
-	if (fp != NULL)
-	{
-		fclose(fp);
-	}
-	
-	for (i = 0; i < unit->channelCount; i++) 
+	if (g_metrics.lastCallbackUs != 0)
 	{
-		if (unit->channelSettings[i].enabled)
+		interval = now - g_metrics.lastCallbackUs;
+
+		for (bucket = 0; bucket < METRICS_BUCKETS && interval > metricsBucketUs[bucket]; bucket++)
 		{
-			free(buffers[i * 2]);
-			free(buffers[i * 2 + 1]);
+			// Find the first bucket the interval fits
 		}
-	}
 
-	if (etsModeSet)
-	{
-		free(etsTime);
+		metricsAdd(&g_metrics.callbackBuckets[bucket], 1);
+		metricsAdd(&g_metrics.callbackSumUs, interval);
 	}
-	
-	clearDataBuffers(unit);
+
+	g_metrics.lastCallbackUs = now;
 }
 
 /****************************************************************************
-* streamDataHandler
-* - Used by the two stream data examples - untriggered and triggered
-* Inputs:
-* - unit - the unit to sample on
-* - preTrigger - the number of samples in the pre-trigger phase 
-*					(0 if no trigger has been set)
-***************************************************************************/
-void streamDataHandler(UNIT * unit, uint32_t preTrigger)
+* metricsFormat
+*
+* Formats every metric in the Prometheus text exposition format and
+* returns the length of the text
+****************************************************************************/
+int32_t metricsFormat(char * text, int32_t size)
 {
-	int32_t i, j;
-	uint32_t sampleCount = 50000; /* make sure overview buffer is large enough */
-	FILE * fp = NULL;
-	int16_t * buffers[2 * PS5000A_MAX_CHANNELS];
-	int16_t * appBuffers[2 * PS5000A_MAX_CHANNELS];
-	PICO_STATUS status;
-	PICO_STATUS powerStatus;
-	uint32_t sampleInterval;
-	int32_t index = 0;
-	int32_t totalSamples;
-	uint32_t postTrigger;
-	int16_t autostop;
-	uint32_t downsampleRatio;
-	uint32_t triggeredAt = 0;
-	PS5000A_TIME_UNITS timeUnits;
-	PS5000A_RATIO_MODE ratioMode;
-	int16_t retry = 0;
-	int16_t powerChange = 0;
-	uint32_t numStreamingValues = 0;
+	int32_t length = 0;
+	int32_t bucket;
+	int16_t ch;
+	int64_t cumulative = 0;
+	int64_t traceQueued;
+	UNIT * unit = g_metrics.unit;
 
-	BUFFER_INFO bufferInfo;
+#define METRICS_PRINT(...) length += snprintf(text + length, (length < size) ? size - length : 0, __VA_ARGS__)
 
-	powerStatus = ps5000aCurrentPowerSource(unit->handle);
-	
-	for (i = 0; i < unit->channelCount; i++) 
-	{
-		if (i >= DUAL_SCOPE && unit->channelCount == QUAD_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
-		{
-			// No need to set the channels C and D if Quad channel scope and power supply not connected.
-		}
-		else
-		{
-			if (unit->channelSettings[i].enabled)
-			{
-				buffers[i * 2] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
-				buffers[i * 2 + 1] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
-			
-				status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)i, buffers[i * 2], buffers[i * 2 + 1], sampleCount, 0, PS5000A_RATIO_MODE_NONE);
+	METRICS_PRINT("# HELP ps5000a_device_open Whether the device is open.\n# TYPE ps5000a_device_open gauge\n");
+	METRICS_PRINT("ps5000a_device_open{serial=\"%s\"} %d\n", (char *) unit->serial,
+		(unit->openStatus == PICO_OK || unit->openStatus == PICO_POWER_SUPPLY_NOT_CONNECTED) ? 1 : 0);
 
-				appBuffers[i * 2] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
-				appBuffers[i * 2 + 1] = (int16_t*) calloc(sampleCount, sizeof(int16_t));
+	METRICS_PRINT("# HELP ps5000a_device_ready Whether the last capture has data ready.\n# TYPE ps5000a_device_ready gauge\n");
+	METRICS_PRINT("ps5000a_device_ready{serial=\"%s\"} %d\n", (char *) unit->serial, g_ready ? 1 : 0);
 
-				printf(status?"StreamDataHandler:ps5000aSetDataBuffers(channel %ld) ------ 0x%08lx \n":"", i, status);
-			}
-		}
-	}
-	
-	downsampleRatio = 1;
-	timeUnits = PS5000A_US;
-	sampleInterval = 1;
-	ratioMode = PS5000A_RATIO_MODE_NONE;
-	preTrigger = 0;
-	postTrigger = 1000000;
-	autostop = TRUE;
-	
-	bufferInfo.unit = unit;	
-	bufferInfo.driverBuffers = buffers;
-	bufferInfo.appBuffers = appBuffers;
+	METRICS_PRINT("# HELP ps5000a_samples_total Samples received per channel.\n# TYPE ps5000a_samples_total counter\n");
 
-	if (autostop)
+	for (ch = 0; ch < unit->channelCount; ch++)
 	{
-		printf("\nStreaming Data for %lu samples", postTrigger / downsampleRatio);
-		
-		if (preTrigger)	// We pass 0 for preTrigger if we're not setting up a trigger
-		{
-			printf(" after the trigger occurs\nNote: %lu Pre Trigger samples before Trigger arms\n\n",preTrigger / downsampleRatio);
-		}
-		else
-		{
-			printf("\n\n");
-		}
+		METRICS_PRINT("ps5000a_samples_total{channel=\"%c\"} %lld\n", 'A' + ch, (long long) g_metrics.samples[ch]);
 	}
-	else
+
+	METRICS_PRINT("# HELP ps5000a_overflows_total Captures or streaming callbacks with the channel over range.\n# TYPE ps5000a_overflows_total counter\n");
+
+	for (ch = 0; ch < unit->channelCount; ch++)
 	{
-		printf("\nStreaming Data continually.\n\n");
+		METRICS_PRINT("ps5000a_overflows_total{channel=\"%c\"} %lld\n", 'A' + ch, (long long) g_metrics.overflows[ch]);
 	}
 
-	g_autoStopped = FALSE;
+	METRICS_PRINT("# HELP ps5000a_captures_total Block captures, rapid block segments and streaming callbacks.\n# TYPE ps5000a_captures_total counter\n");
+	METRICS_PRINT("ps5000a_captures_total{mode=\"block\"} %lld\n", (long long) g_metrics.captures[0]);
+	METRICS_PRINT("ps5000a_captures_total{mode=\"rapid\"} %lld\n", (long long) g_metrics.captures[1]);
+	METRICS_PRINT("ps5000a_captures_total{mode=\"streaming\"} %lld\n", (long long) g_metrics.captures[2]);
 
+	METRICS_PRINT("# HELP ps5000a_callback_interval_seconds Time between streaming callbacks.\n# TYPE ps5000a_callback_interval_seconds histogram\n");
 
-	do
+	for (bucket = 0; bucket < METRICS_BUCKETS; bucket++)
 	{
-		retry = 0;
+		cumulative += g_metrics.callbackBuckets[bucket];
+		METRICS_PRINT("ps5000a_callback_interval_seconds_bucket{le=\"%g\"} %lld\n", metricsBucketUs[bucket] / 1e6, (long long) cumulative);
+	}
 
-		status = ps5000aRunStreaming(unit->handle, &sampleInterval, timeUnits, preTrigger, postTrigger, autostop, 
-										downsampleRatio, ratioMode, sampleCount);
+	cumulative += g_metrics.callbackBuckets[METRICS_BUCKETS];
+	METRICS_PRINT("ps5000a_callback_interval_seconds_bucket{le=\"+Inf\"} %lld\n", (long long) cumulative);
+	METRICS_PRINT("ps5000a_callback_interval_seconds_sum %.6f\n", g_metrics.callbackSumUs / 1e6);
+	METRICS_PRINT("ps5000a_callback_interval_seconds_count %lld\n", (long long) cumulative);
 
-		if (status != PICO_OK)
-		{
-			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
-			// PicoScope 524XD devices on non-USB 3.0 port
-			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
-						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)		
-			{
-				status = changePowerSource(unit->handle, status, unit);
-				retry = 1;
-			}
-			else
-			{
-				printf("streamDataHandler:ps5000aRunStreaming ------ 0x%08lx \n", status);
-				return;
-			}
-		}
-	}
-	while (retry);
+	METRICS_PRINT("# HELP ps5000a_stream_buffer_fill_ratio Position of the last streaming callback in the overview buffer.\n# TYPE ps5000a_stream_buffer_fill_ratio gauge\n");
+	METRICS_PRINT("ps5000a_stream_buffer_fill_ratio %.4f\n", g_metrics.streamBufferSize ? (double) g_metrics.streamBufferEnd / g_metrics.streamBufferSize : 0.0);
 
-	printf("Streaming data...Press a key to stop\n");
+	traceQueued = g_trace.enabled ? g_trace.head - g_trace.tail : 0;
+	METRICS_PRINT("# HELP ps5000a_trace_ring_fill_ratio Trace events queued for the trace writer.\n# TYPE ps5000a_trace_ring_fill_ratio gauge\n");
+	METRICS_PRINT("ps5000a_trace_ring_fill_ratio %.4f\n", (double) traceQueued / TRACE_RING_SIZE);
 
-	
-	fopen_s(&fp, streamFile, "w");
+	METRICS_PRINT("# HELP ps5000a_writer_bytes_total Bytes written to data files.\n# TYPE ps5000a_writer_bytes_total counter\n");
+	METRICS_PRINT("ps5000a_writer_bytes_total %lld\n", (long long) g_metrics.writerBytes);
+	METRICS_PRINT("# HELP ps5000a_writer_seconds_total Time spent writing data files.\n# TYPE ps5000a_writer_seconds_total counter\n");
+	METRICS_PRINT("ps5000a_writer_seconds_total %.6f\n", g_metrics.writerUs / 1e6);
 
-	if (fp != NULL)
+	METRICS_PRINT("# HELP ps5000a_memory_used_bytes Buffer memory in use under the memory budget.\n# TYPE ps5000a_memory_used_bytes gauge\n");
+	METRICS_PRINT("ps5000a_memory_used_bytes %llu\n", (unsigned long long) memoryUsed());
+
+	METRICS_PRINT("# HELP ps5000a_scrapes_total Scrapes served.\n# TYPE ps5000a_scrapes_total counter\n");
+	METRICS_PRINT("ps5000a_scrapes_total %lld\n", (long long) g_metrics.scrapes);
+
+#undef METRICS_PRINT
+
+	return min(length, size - 1);
+}
+
+/****************************************************************************
+* metricsSend
+*
+* Sends all of length bytes to a client. A client that has gone away only
+* ends its own response, it does not raise SIGPIPE.
+* Returns FALSE if the connection failed
+****************************************************************************/
+int16_t metricsSend(SOCKET client, const char * data, int32_t length)
+{
+	int32_t sent;
+
+	while (length > 0)
 	{
-		fprintf(fp,"Streaming Data Log\n\n");
-		fprintf(fp,"For each of the %d Channels, results shown are....\n",unit->channelCount);
-		fprintf(fp,"Maximum Aggregated value ADC Count & mV, Minimum Aggregated value ADC Count & mV\n\n");
+		sent = send(client, data, length, MSG_NOSIGNAL);
 
-		for (i = 0; i < unit->channelCount; i++) 
+		if (sent <= 0)
 		{
-			if (unit->channelSettings[i].enabled) 
-			{
-				fprintf(fp,"   Max ADC    Max mV  Min ADC  Min mV   ");
-			}
+			return FALSE;
 		}
-		fprintf(fp, "\n");
+
+		data += sent;
+		length -= sent;
 	}
-	
 
-	totalSamples = 0;
+	return TRUE;
+}
 
-	while (!_kbhit() && !g_autoStopped)
+/****************************************************************************
+* metricsServe
+*
+* Answers one HTTP request on an accepted connection
+****************************************************************************/
+void metricsServe(SOCKET client)
+{
+	static char response[METRICS_RESPONSE_SIZE];
+	char request[512];
+	char header[256];
+	int32_t received;
+	int32_t headerLength;
+	int32_t bodyLength;
+	fd_set readable;
+	struct timeval timeout;
+
+	// Don't let a client that never sends its request hold up the server
+	FD_ZERO(&readable);
+	FD_SET(client, &readable);
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+
+	if (select((int) client + 1, &readable, NULL, NULL, &timeout) <= 0)
 	{
-		/* Poll until data is received. Until then, GetStreamingLatestValues wont call the callback */
-		g_ready = FALSE;
+		return;
+	}
 
-		status = ps5000aGetStreamingLatestValues(unit->handle, callBackStreaming, &bufferInfo);
+	received = recv(client, request, sizeof(request) - 1, 0);
 
-		// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
-		// PicoScope 524XD devices on non-USB 3.0 port
-		if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
-			status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-		{
-			if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
-			{
-				changePowerSource(unit->handle, status, unit);
-			}
-
-			printf("\n\nPower Source Change");
-			powerChange = 1;
-		}
-
-		index ++;
-
-		if (g_ready && g_sampleCount > 0) /* Can be ready and have no data, if autoStop has fired */
-		{
-			if (g_trig)
-			{
-				triggeredAt = totalSamples + g_trigAt;		// Calculate where the trigger occurred in the total samples collected
-			}
-
-			totalSamples += g_sampleCount;
-			printf("\nCollected %3li samples, index = %5lu, Total: %6d samples ", g_sampleCount, g_startIndex, totalSamples);
-			
-			if (g_trig)
-			{
-				printf("Trig. at index %lu total %lu", g_trigAt, triggeredAt + 1);	// show where trigger occurred
-				
-			}
-			
-			for (i = g_startIndex; i < (int32_t)(g_startIndex + g_sampleCount); i++) 
-			{
-				
-				if (fp != NULL)
-				{
-					for (j = 0; j < unit->channelCount; j++) 
-					{
-						if (unit->channelSettings[j].enabled) 
-						{
-							fprintf(	fp,
-								"Ch%C  %5d = %+5dmV, %5d = %+5dmV   ",
-								(char)('A' + j),
-								appBuffers[j * 2][i],
-								adc_to_mv(appBuffers[j * 2][i], unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit),
-								appBuffers[j * 2 + 1][i],
-								adc_to_mv(appBuffers[j * 2 + 1][i], unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit));
-						}
-					}
-
-					fprintf(fp, "\n");
-				}
-				else
-				{
-					printf("Cannot open the file %s for writing.\n", streamFile);
-				}
-				
-			}
-		}
+	if (received <= 0)
+	{
+		return;
 	}
 
-	printf("\n\n");
-
-	ps5000aStop(unit->handle);
+	request[received] = '\0';
 
-	if (fp != NULL)
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
 	{
-
-		fclose (fp);
+		metricsAdd(&g_metrics.scrapes, 1);
+		bodyLength = metricsFormat(response, sizeof(response));
+		headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\nConnection: close\r\n\r\n", bodyLength);
 	}
-
-	if (!g_autoStopped && !powerChange)  
+	else
 	{
-		printf("\nData collection aborted\n");
-		_getch();
+		bodyLength = snprintf(response, sizeof(response), "Not found\n");
+		headerLength = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+			"Content-Length: %d\r\nConnection: close\r\n\r\n", bodyLength);
 	}
-	else
+
+	if (metricsSend(client, header, headerLength))
 	{
-		printf("\nData collection complete.\n\n");
+		metricsSend(client, response, bodyLength);
 	}
-	
-	for (i = 0; i < unit->channelCount; i++) 
+}
+
+/****************************************************************************
+* metricsServerThread
+*
+* Accepts connections until the endpoint is stopped, waking every
+* METRICS_POLL_MS to check for the stop request
+****************************************************************************/
+#ifdef _WIN32
+DWORD WINAPI metricsServerThread(LPVOID parameter)
+#else
+void * metricsServerThread(void * parameter)
+#endif
+{
+	SOCKET client;
+	fd_set readable;
+	struct timeval timeout;
+
+	while (!g_metrics.stop)
 	{
-		if(unit->channelSettings[i].enabled)
+		FD_ZERO(&readable);
+		FD_SET(g_metrics.listener, &readable);
+		timeout.tv_sec = 0;
+		timeout.tv_usec = METRICS_POLL_MS * 1000;
+
+		if (select((int) g_metrics.listener + 1, &readable, NULL, NULL, &timeout) <= 0)
 		{
-			free(buffers[i * 2]);
-			free(appBuffers[i * 2]);
+			continue;
+		}
+
+		client = accept(g_metrics.listener, NULL, NULL);
 
-			free(buffers[i * 2 + 1]);
-			free(appBuffers[i * 2 + 1]);
+		if (client != INVALID_SOCKET)
+		{
+			metricsServe(client);
+			closesocket(client);
 		}
 	}
 
-	clearDataBuffers(unit);
+	return 0;
 }
 
-
 /****************************************************************************
-* setTrigger
-*
-* - Used to call all the functions required to set up triggering.
+* metricsStart
 *
-***************************************************************************/
-PICO_STATUS setTrigger(UNIT * unit,
-	PS5000A_TRIGGER_CHANNEL_PROPERTIES_V2 * channelProperties,
-	int16_t nChannelProperties,
-	PS5000A_CONDITION * triggerConditions,
-	int16_t nTriggerConditions,
-	PS5000A_DIRECTION * directions,
-	uint16_t nDirections,
-	struct tPwq * pwq,
-	uint32_t delay,
-	uint64_t autoTriggerUs)
+* Opens the endpoint on the loopback interface and starts the server thread
+****************************************************************************/
+void metricsStart(UNIT * unit)
 {
-	PICO_STATUS status;
-	PS5000A_CONDITIONS_INFO info = PS5000A_CLEAR;
-	PS5000A_CONDITIONS_INFO pwqInfo = PS5000A_CLEAR;
+	uint32_t port = 0;
+	int32_t reuse = 1;
+	struct sockaddr_in address;
+#ifdef _WIN32
+	WSADATA wsaData;
 
-	int16_t auxOutputEnabled = 0; // Not used by function call
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
 
-	status = ps5000aSetTriggerChannelPropertiesV2(unit->handle, channelProperties, nChannelProperties, auxOutputEnabled);
+	printf("Port (0 for %d): ", METRICS_DEFAULT_PORT);
+	fflush(stdin);
+	scanf_s("%u", &port);
 
-	if (status != PICO_OK) 
+	if (port == 0 || port > 65535)
 	{
-		printf("setTrigger:ps5000aSetTriggerChannelPropertiesV2 ------ Ox%08lx \n", status);
-		return status;
+		port = METRICS_DEFAULT_PORT;
 	}
 
-	if (nTriggerConditions != 0)
-	{
-		info = (PS5000A_CONDITIONS_INFO)(PS5000A_CLEAR | PS5000A_ADD); // Clear and add trigger condition specified unless no trigger conditions have been specified
-	}
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons((uint16_t) port);
 
-	status = ps5000aSetTriggerChannelConditionsV2(unit->handle, triggerConditions, nTriggerConditions, info);
+	g_metrics.listener = socket(AF_INET, SOCK_STREAM, 0);
 
-	if (status != PICO_OK)
+	if (g_metrics.listener == INVALID_SOCKET)
 	{
-		printf("setTrigger:ps5000aSetTriggerChannelConditionsV2 ------ 0x%08lx \n", status);
-		return status;
+		printf("metricsStart: Cannot create a socket.\n");
+		return;
 	}
 
-	status = ps5000aSetTriggerChannelDirectionsV2(unit->handle, directions, nDirections);
+	setsockopt(g_metrics.listener, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse));
 
-	if (status != PICO_OK) 
+	if (bind(g_metrics.listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(g_metrics.listener, 4) != 0)
 	{
-		printf("setTrigger:ps5000aSetTriggerChannelDirectionsV2 ------ 0x%08lx \n", status);
-		return status;
+		printf("metricsStart: Cannot listen on 127.0.0.1:%u, is the port in use?\n", port);
+		closesocket(g_metrics.listener);
+		return;
 	}
 
-	status = ps5000aSetAutoTriggerMicroSeconds(unit->handle, autoTriggerUs);
-
-	if (status != PICO_OK)
-	{
-		printf("setTrigger:ps5000aSetAutoTriggerMicroSeconds ------ 0x%08lx \n", status);
-		return status;
-	}
+	g_metrics.unit = unit;
+	g_metrics.port = (uint16_t) port;
+	g_metrics.stop = FALSE;
 
-	status = ps5000aSetTriggerDelay(unit->handle, delay);
-	
-	if (status != PICO_OK)
-	{
-		printf("setTrigger:ps5000aSetTriggerDelay ------ 0x%08lx \n", status);
-		return status;
-	}
+#ifdef _WIN32
+	g_metrics.thread = CreateThread(NULL, 0, metricsServerThread, NULL, 0, NULL);
+#else
+	pthread_create(&g_metrics.thread, NULL, metricsServerThread, NULL);
+#endif
 
-	// Clear and add pulse width qualifier condition, clear if no pulse width qualifier has been specified
-	if (pwq->nPwqConditions != 0)
-	{
-		pwqInfo = (PS5000A_CONDITIONS_INFO)(PS5000A_CLEAR | PS5000A_ADD);
-	}
+	g_metrics.running = TRUE;
 
-	status = ps5000aSetPulseWidthQualifierConditions(unit->handle, pwq->pwqConditions, pwq->nPwqConditions, pwqInfo);
+	printf("Serving metrics on http://127.0.0.1:%u/metrics\n", port);
+}
 
-	if (status != PICO_OK)
+/****************************************************************************
+* metricsStop
+*
+* Stops the server thread and closes the endpoint. The counters are kept.
+****************************************************************************/
+void metricsStop(void)
+{
+	if (!g_metrics.running)
 	{
-		printf("setTrigger:ps5000aSetPulseWidthQualifierConditions ------ 0x%08lx \n", status);
-		return status;
+		return;
 	}
 
-	status = ps5000aSetPulseWidthQualifierDirections(unit->handle, pwq->pwqDirections, pwq->nPwqDirections);
+	g_metrics.stop = TRUE;
 
-	if (status != PICO_OK)
-	{
-		printf("setTrigger:ps5000aSetPulseWidthQualifierDirections ------ 0x%08lx \n", status);
-		return status;
-	}
+#ifdef _WIN32
+	WaitForSingleObject(g_metrics.thread, INFINITE);
+	CloseHandle(g_metrics.thread);
+#else
+	pthread_join(g_metrics.thread, NULL);
+#endif
 
-	status = ps5000aSetPulseWidthQualifierProperties(unit->handle, pwq->lower, pwq->upper, pwq->type);
+	closesocket(g_metrics.listener);
 
-	if (status != PICO_OK)
-	{
-		printf("setTrigger:ps5000aSetPulseWidthQualifierProperties ------ Ox%08lx \n", status);
-		return status;
-	}
+#ifdef _WIN32
+	WSACleanup();
+#endif
 
-	return status;
+	g_metrics.running = FALSE;
+
+	printf("Metrics endpoint stopped\n");
 }
 
 /****************************************************************************
-* collectBlockImmediate
-*  this function demonstrates how to collect a single block of data
-*  from the unit (start collecting immediately)
+* Raw sample output
+*
+* Streams the samples of every enabled channel to stdout as int16 frames so
+* that another program can read them directly (ps5000aCon | ./analyzer).
+* If stdout is a pipe, it is kept for the samples from start up and console
+* output goes to stderr, so the menus never reach the reader. If it is
+* redirected to a file, choosing a raw format takes it over in the same way
+* until raw output is turned off again. Until then stdout is left alone, so
+* ps5000aCon > log still captures the console.
+*
+* A frame is RAW_FRAME_SAMPLES samples of every enabled channel, either
+* interleaved (A B C D A B C D ...) or planar (all of A, then all of B...).
+* The last frame of a stream may be shorter, with the same number of
+* samples for each channel. An optional RAW_HEADER in front of the first
+* frame describes the layout.
+*
+* When stdout is a pipe, full buffers are passed to the pipe with vmsplice
+* (SPLICE_F_GIFT) rather than copied by write. The pipe then refers to the
+* pages of the buffer until the reader has read them, so the buffers are
+* used in turn and a buffer is only filled again after more than a pipe's
+* worth of data has followed it. Each buffer is a separate mapping so that
+* unmapping it at the end of a stream cannot pass its pages to anything
+* else while the pipe still refers to them. The header is on the stack, so
+* it is always copied with write, as are the buffers without vmsplice.
 ****************************************************************************/
-void collectBlockImmediate(UNIT * unit)
-{
-	PICO_STATUS status = PICO_OK;
+#define RAW_FRAME_SAMPLES		4096
+#define RAW_BUFFERS				4
+#define RAW_PIPE_SIZE			(1024 * 1024)
+#define RAW_HEADER_MAGIC		0x52355350	// "PS5R"
+#define RAW_VERSION				1
 
-	printf("Collect block immediate...\n");
-	printf("Press a key to start\n");
-	_getch();
+#ifdef _WIN32
+#define rawWriteFd(fd, data, length) _write((fd), (data), (uint32_t) (length))
+#else
+#define rawWriteFd(fd, data, length) write((fd), (data), (length))
+#endif
 
-	setDefaults(unit);
+typedef enum
+{
+	RAW_OFF,
+	RAW_INTERLEAVED,
+	RAW_PLANAR
+} RAW_FORMAT;
 
-	/* Trigger disabled	*/
-	status = ps5000aSetSimpleTrigger(unit->handle, 0, PS5000A_CHANNEL_A, 0, PS5000A_RISING, 0, 0);
+// 40 bytes, written in the byte order of the host
+typedef struct
+{
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	headerBytes;
+	uint16_t	format;								// RAW_INTERLEAVED or RAW_PLANAR
+	uint16_t	channels;							// Enabled channels in each frame
+	uint16_t	channelMask;						// Bit 0 = channel A
+	int16_t		maxADCValue;
+	uint32_t	frameSamples;
+	uint32_t	sampleIntervalNs;
+	int32_t		rangeMv[PS5000A_MAX_CHANNELS];		// Of each channel in the frame, in frame order
+}RAW_HEADER;
 
-	blockDataHandler(unit, (int8_t *) "First 10 readings\n", 0, FALSE);
-}
+typedef struct
+{
+	int32_t		fd;									// -1 unless raw output has taken over stdout
+	RAW_FORMAT	format;
+	int16_t		header;
+	int16_t		isPipe;
+	int16_t		redirected;							// stdout was not a terminal at start up
+	int16_t		active;
+	int16_t		channels;
+	int16_t		channelIndex[PS5000A_MAX_CHANNELS];
+	size_t		frameBytes;
+	size_t		bufferBytes;
+	int8_t *	buffers[RAW_BUFFERS];
+	int32_t		current;
+	size_t		used;								// Bytes of whole frames in the current buffer
+	uint32_t	frameFill;							// Samples in the frame being filled
+	int64_t		bytes;
+	int64_t		splices;
+	int64_t		writes;
+	int64_t		startUs;
+}RAW_OUTPUT;
+
+RAW_OUTPUT g_raw = { -1, RAW_OFF, TRUE };
 
 /****************************************************************************
-* collectBlockEts
-*  this function demonstrates how to collect a block of
-*  data using equivalent time sampling (ETS).
+* rawTakeStdout
+*
+* Keeps stdout for raw samples and points console output at stderr
 ****************************************************************************/
-void collectBlockEts(UNIT * unit)
+void rawTakeStdout(void)
 {
-	PICO_STATUS status;
-	int32_t ets_sampletime;
-	int16_t triggerVoltage = 1000; // millivolts
-	uint32_t delay = 0;
-	int16_t etsModeSet = FALSE;
-
-	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
-	int16_t voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
-	int16_t triggerThreshold = 0;
+	if (g_raw.fd >= 0)
+	{
+		return;
+	}
 
-	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
-	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
-	struct tPS5000ACondition conditions;
-	struct tPS5000ADirection directions;
+#ifdef _WIN32
+	g_raw.fd = _dup(_fileno(stdout));
+	_setmode(g_raw.fd, _O_BINARY);
+	_dup2(_fileno(stderr), _fileno(stdout));
+#else
+	g_raw.fd = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
 
-	// Struct to hold Pulse Width Qualifier information
-	struct tPwq pulseWidth;
+	// A reader that exits should end the stream, not the program
+	signal(SIGPIPE, SIG_IGN);
+#endif
 
-	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
-	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
-	memset(&directions, 0, sizeof(struct tPS5000ADirection));
-	memset(&pulseWidth, 0, sizeof(struct tPwq));
+	printf("Console output is on stderr, raw samples go to stdout\n");
+}
 
-	// If the channel is not enabled, warn the User and return
-	if (unit->channelSettings[triggerChannel].enabled == 0)
+/****************************************************************************
+* rawReleaseStdout
+*
+* Gives stdout back to the console once raw output is turned off
+****************************************************************************/
+void rawReleaseStdout(void)
+{
+	if (g_raw.fd < 0)
 	{
-		printf("collectBlockTriggered: Channel not enabled.");
 		return;
 	}
 
-	// If the trigger voltage level is greater than the range selected, set the threshold to half
-	// of the range selected e.g. for +/- 200mV, set the threshold to 100mV
-	if (triggerVoltage > voltageRange)
-	{
-		triggerVoltage = (voltageRange / 2);
-	}
+#ifdef _WIN32
+	_dup2(g_raw.fd, _fileno(stdout));
+	_close(g_raw.fd);
+#else
+	dup2(g_raw.fd, STDOUT_FILENO);
+	close(g_raw.fd);
+	signal(SIGPIPE, SIG_DFL);
+#endif
 
-	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+	g_raw.fd = -1;
+}
 
-	// Set trigger channel properties
-	triggerProperties.thresholdUpper = triggerThreshold;
-	triggerProperties.thresholdUpperHysteresis = 256 * 10;
-	triggerProperties.thresholdLower = triggerThreshold;
-	triggerProperties.thresholdLowerHysteresis = 256 * 10;
-	triggerProperties.channel = (PS5000A_CHANNEL)(triggerChannel);
+/****************************************************************************
+* rawInit
+*
+* Called before anything is printed. Takes stdout over straight away if it
+* is a pipe; if it is redirected to a file, that waits until a raw format
+* is chosen.
+****************************************************************************/
+void rawInit(void)
+{
+#ifdef _WIN32
+	g_raw.redirected = !_isatty(_fileno(stdout));
+	g_raw.isPipe = g_raw.redirected && GetFileType((HANDLE) _get_osfhandle(_fileno(stdout))) == FILE_TYPE_PIPE;
+#else
+	struct stat status;
 
-	// Set trigger conditions
-	conditions.source = (PS5000A_CHANNEL)triggerChannel;
-	conditions.condition = PS5000A_CONDITION_TRUE;
+	g_raw.redirected = !isatty(STDOUT_FILENO);
+	g_raw.isPipe = g_raw.redirected && fstat(STDOUT_FILENO, &status) == 0 && S_ISFIFO(status.st_mode);
+#endif
 
-	// Set trigger directions
-	directions.source = (PS5000A_CHANNEL)triggerChannel;
-	directions.direction = PS5000A_RISING;
-	directions.mode = PS5000A_LEVEL;
+	// Console output may move to stderr later, so nothing can be left in the buffer
+	if (g_raw.redirected)
+	{
+		setvbuf(stdout, NULL, _IONBF, 0);
+	}
 
-	printf("Collect ETS block...\n");
-	printf("Collects when value rises past %d", scaleVoltages? 
-		adc_to_mv(triggerProperties.thresholdUpper,	unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
-		: triggerProperties.thresholdUpper);																// else print ADC Count
-	
-	printf(scaleVoltages? " mV\n" : "ADC Counts\n");
-	printf("Press a key to start...\n");
-	_getch();
+	// The reader of a pipe only wants samples, not the menus
+	if (g_raw.isPipe)
+	{
+		rawTakeStdout();
+	}
+}
 
-	setDefaults(unit);
+/****************************************************************************
+* rawSend
+*
+* Passes length bytes to stdout. With gift, they are given to a pipe with
+* vmsplice and must not be changed until the reader has them.
+****************************************************************************/
+int16_t rawSend(int8_t * data, size_t length, int16_t gift)
+{
+	int64_t written;
+#ifdef HAVE_VMSPLICE
+	struct iovec iov;
 
-	// Trigger enabled
-	// Rising edge
-	// Threshold = 1000 mV
-	status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, delay, 0);
+	while (gift && g_raw.isPipe && length > 0)
+	{
+		iov.iov_base = data;
+		iov.iov_len = length;
+		written = vmsplice(g_raw.fd, &iov, 1, SPLICE_F_GIFT);
 
-	status = ps5000aSetEts(unit->handle, PS5000A_ETS_FAST, 20, 4, &ets_sampletime);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
 
-	if (status == PICO_OK)
-	{
-		etsModeSet = TRUE;
+			if (errno != EINVAL && errno != ENOSYS)
+			{
+				return FALSE;
+			}
+
+			// Not supported here after all
+			g_raw.isPipe = FALSE;
+			break;
+		}
+
+		data += written;
+		length -= written;
+		g_raw.splices++;
 	}
+#endif
 
-	printf("ETS Sample Time is %ld picoseconds\n", ets_sampletime);
+	while (length > 0)
+	{
+		written = rawWriteFd(g_raw.fd, data, length);
 
-	blockDataHandler(unit, (int8_t *) "Ten readings after trigger\n", BUFFER_SIZE / 10 - 5, etsModeSet); // 10% of data is pre-trigger
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
 
-	status = ps5000aSetEts(unit->handle, PS5000A_ETS_OFF, 0, 0, &ets_sampletime);
+			return FALSE;
+		}
 
-	etsModeSet = FALSE;
+		data += written;
+		length -= written;
+		g_raw.writes++;
+	}
+
+	return TRUE;
 }
 
 /****************************************************************************
-* collectBlockTriggered
-*  this function demonstrates how to collect a single block of data from the
-*  unit, when a trigger event occurs.
+* rawFlush
+*
+* Sends the whole frames of the current buffer and, at the end of a stream,
+* the partly filled frame, then moves on to the next buffer
 ****************************************************************************/
-void collectBlockTriggered(UNIT * unit)
+int16_t rawFlush(int16_t last)
 {
-	int16_t triggerVoltage					= 1000; // mV
-	PS5000A_CHANNEL triggerChannel	= PS5000A_CHANNEL_A;
-	int16_t voltageRange						= inputRanges[unit->channelSettings[triggerChannel].range];
-	int16_t triggerThreshold				= 0;
+	int8_t * frame = g_raw.buffers[g_raw.current] + g_raw.used;
+	size_t length = g_raw.used;
+	int16_t ch;
 
-	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
-	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties; 
-	struct tPS5000ACondition conditions; 
-	struct tPS5000ADirection directions; 
+	if (last && g_raw.frameFill > 0)
+	{
+		// Close up the planes of a short planar frame
+		if (g_raw.format == RAW_PLANAR)
+		{
+			for (ch = 1; ch < g_raw.channels; ch++)
+			{
+				memmove(frame + (size_t) ch * g_raw.frameFill * sizeof(int16_t), frame + (size_t) ch * RAW_FRAME_SAMPLES * sizeof(int16_t),
+					g_raw.frameFill * sizeof(int16_t));
+			}
+		}
 
-	// Struct to hold Pulse Width Qualifier information
-	struct tPwq pulseWidth;
+		length += (size_t) g_raw.channels * g_raw.frameFill * sizeof(int16_t);
+		g_raw.frameFill = 0;
+	}
 
-	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
-	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
-	memset(&directions, 0, sizeof(struct tPS5000ADirection));
-	memset(&pulseWidth, 0, sizeof(struct tPwq));
+	g_raw.current = (g_raw.current + 1) % RAW_BUFFERS;
+	g_raw.used = 0;
 
-	// If the channel is not enabled, warn the User and return
-	if (unit->channelSettings[triggerChannel].enabled == 0)
+	if (length == 0)
 	{
-		printf("collectBlockTriggered: Channel not enabled.");
-		return;
+		return TRUE;
 	}
 
-	// If the trigger voltage level is greater than the range selected, set the threshold to half
-	// of the range selected e.g. for 200 mV, set the threshold to 10 0mV
-	if (triggerVoltage > voltageRange)
+	if (!rawSend(g_raw.buffers[(g_raw.current + RAW_BUFFERS - 1) % RAW_BUFFERS], length, TRUE))
 	{
-		triggerVoltage = (voltageRange / 2);
+		return FALSE;
 	}
 
-	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+	g_raw.bytes += length;
 
-	// Set trigger channel properties
-	triggerProperties.thresholdUpper						= triggerThreshold;
-	triggerProperties.thresholdUpperHysteresis	= 256 * 10;
-	triggerProperties.thresholdLower						= triggerThreshold;
-	triggerProperties.thresholdLowerHysteresis	= 256 * 10;
-	triggerProperties.channel										= triggerChannel;
+	return TRUE;
+}
 
-	// Set trigger conditions
-	conditions.source = triggerChannel;
-	conditions.condition = PS5000A_CONDITION_TRUE;
-	
-	// Set trigger directions
-	directions.source = triggerChannel;
-	directions.direction = PS5000A_RISING;
-	directions.mode = PS5000A_LEVEL;
+/****************************************************************************
+* rawStop
+*
+* Sends what is left and releases the buffers
+****************************************************************************/
+void rawStop(void)
+{
+	int32_t i;
+	int64_t elapsedUs = timeNowUs() - g_raw.startUs;
 
-	printf("Collect block triggered...\n");
-	printf("Collects when value rises past %d", scaleVoltages?
-		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
-		: triggerProperties.thresholdUpper);																// else print ADC Count
-	
-	printf(scaleVoltages?"mV\n" : "ADC Counts\n");
+	if (!g_raw.active)
+	{
+		return;
+	}
 
-	printf("Press a key to start...\n");
-	_getch();
+	rawFlush(TRUE);
 
-	setDefaults(unit);
+	for (i = 0; i < RAW_BUFFERS; i++)
+	{
+#ifdef _WIN32
+		memoryFree(g_raw.buffers[i]);
+#else
+		munmap(g_raw.buffers[i], g_raw.bufferBytes);
+#endif
+		g_raw.buffers[i] = NULL;
+	}
 
-	/* Trigger enabled
-	* Rising edge
-	* Threshold = 1000 mV */
-	setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+	g_raw.active = FALSE;
 
-	blockDataHandler(unit, (int8_t *) "Ten readings after trigger\n", 0, FALSE);
+	printf("%.1f MB of raw samples sent to stdout at %.1f MB/s (%lld vmsplice, %lld write calls)\n", g_raw.bytes / (1024.0 * 1024.0),
+		elapsedUs > 0 ? g_raw.bytes / (double) elapsedUs : 0.0, (long long) g_raw.splices, (long long) g_raw.writes);
 }
 
 /****************************************************************************
-* collectRapidBlock
-*  this function demonstrates how to collect a set of captures using
-*  rapid block mode.
+* rawStart
+*
+* Sets up the frame layout of the enabled channels, maps the buffers and
+* sends the header. Buffers hold as many whole frames as fit in the pipe.
+* Returns FALSE if raw output cannot start.
 ****************************************************************************/
-void collectRapidBlock(UNIT * unit)
+int16_t rawStart(UNIT * unit, uint32_t sampleIntervalNs)
 {
-	uint32_t	nCaptures;
-	uint32_t	nSegments;
-	int32_t		nMaxSamples;
-	uint32_t	nSamples = 1000;
-	int32_t		timeIndisposed;
-	uint32_t	capture;
-	int16_t		channel;
-	int16_t***	rapidBuffers;
-	int16_t*	overflow;
-	PICO_STATUS status;
-	int16_t		i;
-	uint32_t	nCompletedCaptures;
-	int16_t		retry;
-
-	int16_t		triggerVoltage = 1000; // mV
-	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
-	int16_t		voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
-	int16_t		triggerThreshold = 0;
-
-	int32_t		timeIntervalNs = 0;
-	int32_t		maxSamples = 0;
-	uint32_t	maxSegments = 0;
-
-	uint64_t timeStampCounterDiff = 0;
-
-	PS5000A_TRIGGER_INFO * triggerInfo; // Struct to store trigger timestamping information
-
-	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
-	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
-	struct tPS5000ACondition conditions;
-	struct tPS5000ADirection directions;
+	RAW_HEADER header;
+	size_t pipeSize = RAW_PIPE_SIZE;
+	int16_t ch;
+	int32_t i;
 
-	// Struct to hold Pulse Width Qualifier information
-	struct tPwq pulseWidth;
+	memset(&header, 0, sizeof(header));
+	g_raw.channels = 0;
 
-	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
-	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
-	memset(&directions, 0, sizeof(struct tPS5000ADirection));
-	memset(&pulseWidth, 0, sizeof(struct tPwq));
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			header.channelMask |= 1 << ch;
+			header.rangeMv[g_raw.channels] = inputRanges[unit->channelSettings[ch].range];
+			g_raw.channelIndex[g_raw.channels++] = ch;
+		}
+	}
 
-	// If the channel is not enabled, warn the User and return
-	if (unit->channelSettings[triggerChannel].enabled == 0)
+	if (g_raw.channels == 0)
 	{
-		printf("collectBlockTriggered: Channel not enabled.");
-		return;
+		printf("rawStart: No channels enabled\n");
+		return FALSE;
 	}
 
-	// If the trigger voltage level is greater than the range selected, set the threshold to half
-	// of the range selected e.g. for 200 mV, set the threshold to 10 0mV
-	if (triggerVoltage > voltageRange)
+#ifdef HAVE_VMSPLICE
+	if (g_raw.isPipe)
 	{
-		triggerVoltage = (voltageRange / 2);
+		fcntl(g_raw.fd, F_SETPIPE_SZ, RAW_PIPE_SIZE);
+		pipeSize = fcntl(g_raw.fd, F_GETPIPE_SZ) > 0 ? (size_t) fcntl(g_raw.fd, F_GETPIPE_SZ) : pipeSize;
 	}
+#endif
 
-	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+	g_raw.frameBytes = (size_t) g_raw.channels * RAW_FRAME_SAMPLES * sizeof(int16_t);
+	g_raw.bufferBytes = max(pipeSize / g_raw.frameBytes, 1) * g_raw.frameBytes;
+	g_raw.current = 0;
+	g_raw.used = 0;
+	g_raw.frameFill = 0;
+	g_raw.bytes = 0;
+	g_raw.splices = 0;
+	g_raw.writes = 0;
 
-	// Set trigger channel properties
-	triggerProperties.thresholdUpper = triggerThreshold;
-	triggerProperties.thresholdUpperHysteresis = 256 * 10;
-	triggerProperties.thresholdLower = triggerThreshold;
-	triggerProperties.thresholdLowerHysteresis = 256 * 10;
-	triggerProperties.channel = triggerChannel;
+	for (i = 0; i < RAW_BUFFERS; i++)
+	{
+#ifdef _WIN32
+		g_raw.buffers[i] = (int8_t *) memoryAlloc(MEMORY_APPLICATION, g_raw.bufferBytes, 1);
+#else
+		g_raw.buffers[i] = (int8_t *) mmap(NULL, g_raw.bufferBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		g_raw.buffers[i] = g_raw.buffers[i] == MAP_FAILED ? NULL : g_raw.buffers[i];
+#endif
 
-	// Set trigger conditions
-	conditions.source = triggerChannel;
-	conditions.condition = PS5000A_CONDITION_TRUE;
+		if (g_raw.buffers[i] == NULL)
+		{
+			printf("rawStart: Not enough memory for the raw output buffers\n");
 
-	// Set trigger directions
-	directions.source = triggerChannel;
-	directions.direction = PS5000A_RISING;
-	directions.mode = PS5000A_LEVEL;
+			while (i > 0)
+			{
+				i--;
+#ifdef _WIN32
+				memoryFree(g_raw.buffers[i]);
+#else
+				munmap(g_raw.buffers[i], g_raw.bufferBytes);
+#endif
+				g_raw.buffers[i] = NULL;
+			}
 
-	printf("Collect rapid block triggered...\n");
-	printf("Collects when value rises past %d ", scaleVoltages ?
-		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
-		: triggerProperties.thresholdUpper);																// else print ADC Count
+			return FALSE;
+		}
+	}
 
-	printf(scaleVoltages ? "mV\n" : "ADC Counts\n");
-	printf("Press any key to abort\n");
+	g_raw.active = TRUE;
+	g_raw.startUs = timeNowUs();
 
-	setDefaults(unit);
+	if (g_raw.header)
+	{
+		header.magic = RAW_HEADER_MAGIC;
+		header.version = RAW_VERSION;
+		header.headerBytes = sizeof(RAW_HEADER);
+		header.format = (uint16_t) g_raw.format;
+		header.channels = g_raw.channels;
+		header.maxADCValue = unit->maxADCValue;
+		header.frameSamples = RAW_FRAME_SAMPLES;
+		header.sampleIntervalNs = sampleIntervalNs;
+
+		// Copied, as the stack it is on is reused long before a slow reader gets to it
+		if (!rawSend((int8_t *) &header, sizeof(RAW_HEADER), FALSE))
+		{
+			printf("rawStart: Cannot write to stdout\n");
+			rawStop();
+			return FALSE;
+		}
 
-	// Trigger enabled
-	status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+		g_raw.bytes += sizeof(RAW_HEADER);
+	}
 
-	// Find the maximum number of segments
-	status = ps5000aGetMaxSegments(unit->handle, &maxSegments);
+	return TRUE;
+}
 
-	// Set the number of segments - this can be more than the number of waveforms to collect
-	nSegments = 64;
+/****************************************************************************
+* rawWriteSamples
+*
+* Adds count samples of every enabled channel, from startIndex in the
+* streaming buffers, to the frames and sends each buffer as it fills.
+* Returns FALSE if stdout can no longer be written to.
+****************************************************************************/
+int16_t rawWriteSamples(int16_t ** appBuffers, uint32_t startIndex, uint32_t count)
+{
+	int8_t * frame;
+	int16_t * out;
+	int16_t ch;
+	uint32_t n;
+	uint32_t i;
 
-	if (nSegments > maxSegments)
+	while (count > 0)
 	{
-		nSegments = maxSegments;
-	}
+		n = min(count, RAW_FRAME_SAMPLES - g_raw.frameFill);
+		frame = g_raw.buffers[g_raw.current] + g_raw.used;
 
-	// Set the number of captures
-	nCaptures = 10;
+		if (g_raw.format == RAW_INTERLEAVED)
+		{
+			out = (int16_t *) frame + (size_t) g_raw.frameFill * g_raw.channels;
 
-	// Segment the memory
+			for (i = startIndex; i < startIndex + n; i++)
+			{
+				for (ch = 0; ch < g_raw.channels; ch++)
+				{
+					*out++ = appBuffers[g_raw.channelIndex[ch] * 2][i];
+				}
+			}
+		}
+		else
+		{
+			for (ch = 0; ch < g_raw.channels; ch++)
+			{
+				memcpy((int16_t *) frame + (size_t) ch * RAW_FRAME_SAMPLES + g_raw.frameFill, &appBuffers[g_raw.channelIndex[ch] * 2][startIndex],
+					n * sizeof(int16_t));
+			}
+		}
+
+		g_raw.frameFill += n;
+		startIndex += n;
+		count -= n;
+
+		if (g_raw.frameFill == RAW_FRAME_SAMPLES)
+		{
+			g_raw.frameFill = 0;
+			g_raw.used += g_raw.frameBytes;
+
+			if (g_raw.used == g_raw.bufferBytes && !rawFlush(FALSE))
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/****************************************************************************
+* setRawOutput
+*
+* Chooses the frame format of raw output and whether it has a header
+****************************************************************************/
+void setRawOutput(void)
+{
+	int32_t format = g_raw.format;
+	int8_t ch;
+
+	if (!g_raw.redirected)
+	{
+		printf("stdout is a terminal. Redirect it to use raw output, e.g. ps5000aCon | ./analyzer\n");
+		return;
+	}
+
+	printf("Raw samples to stdout during streaming:\n");
+	printf("0 - Off\n");
+	printf("1 - Interleaved frames\n");
+	printf("2 - Planar frames\n");
+	printf("Format: ");
+
+	do
+	{
+		fflush(stdin);
+		scanf_s("%d", &format);
+	} while (format < RAW_OFF || format > RAW_PLANAR);
+
+	g_raw.format = (RAW_FORMAT) format;
+
+	// A pipe keeps stdout, so that the console never goes to its reader
+	if (g_raw.format == RAW_OFF)
+	{
+		if (!g_raw.isPipe)
+		{
+			rawReleaseStdout();
+		}
+	}
+	else
+	{
+		rawTakeStdout();
+
+		printf("Header in front of the first frame (Y/N)? ");
+		ch = toupper(_getch());
+		g_raw.header = ch != 'N';
+
+		printf("\n%s frames of %d samples per channel%s, %s\n", g_raw.format == RAW_PLANAR ? "Planar" : "Interleaved", RAW_FRAME_SAMPLES,
+			g_raw.header ? " after a header" : "",
+#ifdef HAVE_VMSPLICE
+			g_raw.isPipe ? "spliced into the pipe" : "written to the file");
+#else
+			"written to stdout");
+#endif
+	}
+}
+
+/****************************************************************************
+* Threshold alarms
+*
+* During streaming, the rules in ALARM_RULES_FILE are checked against every
+* sample inside callBackStreaming(). This happens as soon as the driver
+* hands over a block, before the block is catalogued, converted or written
+* to the file, so an alarm never waits on the file I/O of the capture.
+* Lines starting with '#' are ignored; the others are one of
+*
+*   high <channel> <limit> <clear> [hold ms]
+*   low  <channel> <limit> <clear> [hold ms]
+*   rate <channel> <limit> <clear> [hold ms]
+*
+* e.g.
+*
+*   high A 1500 1400 0.5
+*   low  B -200 -150
+*   rate A 2000000 500000 0.01
+*
+* Limits are in the calibrated units of the channel. A rate is in those
+* units per second, in either direction, between successive samples. An
+* alarm is raised once samples have stayed beyond the limit for the hold
+* time. It clears when a sample comes back past the clear level, so a
+* signal that wanders between the two levels does not chatter. High and
+* rate rules use the maximum of each aggregated sample and low rules use
+* the minimum.
+*
+* Each raise and clear is appended to ALARM_LOG_FILE with the host time of
+* the sample that caused it. The lines from one callback are flushed
+* together as soon as its samples have been checked, so a signal that
+* keeps crossing a limit costs one write per callback, not one per alarm.
+* The alarm latency is the time from the callback being entered to the
+* flush. Its mean and maximum are shown at the end of the capture. The
+* callback only counts the changes; streamDataHandler() shows them.
+*
+* usbtc08Con.c, usbpt104Con.c and plcm3Con.c take the same rules through
+* copies of alarmEvaluate(), and point back here. Keep them in step.
+****************************************************************************/
+#define ALARM_RULES_FILE		"ps5000a_alarms.txt"
+#define ALARM_LOG_FILE			"ps5000a_alarms.log"
+#define ALARM_MAX_RULES			16
+#define ALARM_MAX_LINE			256
+
+typedef enum
+{
+	ALARM_HIGH,
+	ALARM_LOW,
+	ALARM_RATE
+} ALARM_KIND;
+
+const char * alarmKinds[] = { "high", "low", "rate" };
+
+typedef struct tAlarmRule
+{
+	ALARM_KIND	kind;
+	int16_t		channel;
+	double		limit;
+	double		clear;
+	double		holdMs;
+	int16_t		raised;
+	int16_t		pending;						// Beyond the limit, waiting out the hold time
+	double		pendingMs;
+	int16_t		havePrevious;
+	double		previous;						// Last value and time, for rate rules
+	double		previousMs;
+} ALARM_RULE;
+
+typedef struct tAlarms
+{
+	ALARM_RULE	rules[ALARM_MAX_RULES];
+	int16_t		count;
+	FILE *		log;
+	float		scale[PS5000A_MAX_CHANNELS];	// From conversionFactors() at the start of the capture
+	float		offset[PS5000A_MAX_CHANNELS];
+	double		sampleIntervalMs;
+	int64_t		hostStartMs;
+	uint64_t	samples;						// Samples per channel checked so far
+	uint32_t	raised;
+	uint32_t	cleared;
+	uint32_t	unflushed;						// Changes written since the last flush
+	uint32_t	flushed;						// Changes flushed so far, shown by streamDataHandler()
+	int64_t		latencyTotalUs;
+	int64_t		latencyMaxUs;
+} ALARMS;
+
+ALARMS g_alarms;
+
+/****************************************************************************
+* alarmStart
+*
+* Reads the rules for the enabled channels from ALARM_RULES_FILE and opens
+* ALARM_LOG_FILE for the capture. The conversion factors of each channel
+* are set by the caller.
+*
+* Returns the number of rules, 0 without a rules file
+****************************************************************************/
+int32_t alarmStart(UNIT * unit, uint32_t sampleIntervalNs, int64_t hostStartMs)
+{
+	FILE * fp = NULL;
+	ALARM_RULE * rule;
+	char line[ALARM_MAX_LINE];
+	char kind[16];
+	char channel[4];
+	double limit;
+	double clear;
+	double holdMs;
+	int32_t fields;
+	int32_t ch;
+	int32_t lineNumber = 0;
+
+	memset(&g_alarms, 0, sizeof(g_alarms));
+
+	fopen_s(&fp, ALARM_RULES_FILE, "r");
+
+	if (fp == NULL)
+	{
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineNumber++;
+		holdMs = 0.0;
+
+		if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#')
+		{
+			continue;
+		}
+
+		fields = sscanf(line, "%*s %3s %lf %lf %lf", channel, &limit, &clear, &holdMs);
+		ch = toupper(channel[0]) - 'A';
+
+		if (fields < 3 || holdMs < 0.0)
+		{
+			printf("%s line %d: expected %s <channel> <limit> <clear> [hold ms]\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		if (channel[1] != '\0' || ch < 0 || ch >= unit->channelCount || !unit->channelSettings[ch].enabled)
+		{
+			printf("%s line %d: channel %s is not enabled\n", ALARM_RULES_FILE, lineNumber, channel);
+			continue;
+		}
+
+		if (g_alarms.count == ALARM_MAX_RULES)
+		{
+			printf("%s line %d: only %d rules are allowed\n", ALARM_RULES_FILE, lineNumber, ALARM_MAX_RULES);
+			break;
+		}
+
+		rule = &g_alarms.rules[g_alarms.count];
+
+		if (strcmp(kind, "high") == 0)
+		{
+			rule->kind = ALARM_HIGH;
+		}
+		else if (strcmp(kind, "low") == 0)
+		{
+			rule->kind = ALARM_LOW;
+		}
+		else if (strcmp(kind, "rate") == 0)
+		{
+			rule->kind = ALARM_RATE;
+		}
+		else
+		{
+			printf("%s line %d: unknown rule %s\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		// The clear level has to be on the safe side of the limit
+		if ((rule->kind == ALARM_LOW) ? clear < limit : clear > limit)
+		{
+			printf("%s line %d: the clear level is beyond the limit\n", ALARM_RULES_FILE, lineNumber);
+			continue;
+		}
+
+		rule->channel = (int16_t) ch;
+		rule->limit = limit;
+		rule->clear = clear;
+		rule->holdMs = holdMs;
+		g_alarms.count++;
+	}
+
+	fclose(fp);
+
+	if (g_alarms.count == 0)
+	{
+		return 0;
+	}
+
+	fopen_s(&g_alarms.log, ALARM_LOG_FILE, "a");
+
+	if (g_alarms.log == NULL)
+	{
+		printf("Cannot open %s, alarms are off.\n", ALARM_LOG_FILE);
+		g_alarms.count = 0;
+		return 0;
+	}
+
+	_fseeki64(g_alarms.log, 0, SEEK_END);
+
+	if (_ftelli64(g_alarms.log) == 0)
+	{
+		fprintf(g_alarms.log, "Host time (ms),Channel,Rule,Change,Value,Level\n");
+		fflush(g_alarms.log);
+	}
+
+	g_alarms.sampleIntervalMs = sampleIntervalNs / 1e6;
+	g_alarms.hostStartMs = hostStartMs;
+
+	printf("%d alarm rules from %s, alarms are appended to %s\n", g_alarms.count, ALARM_RULES_FILE, ALARM_LOG_FILE);
+
+	return g_alarms.count;
+}
+
+/****************************************************************************
+* alarmReport
+*
+* Writes a change of state of a rule, to be flushed by alarmFlush()
+****************************************************************************/
+void alarmReport(ALARM_RULE * rule, const char * change, double value, double timeMs)
+{
+	fprintf(g_alarms.log, "%.3f,%c,%s,%s,%.6g,%.6g\n",
+		g_alarms.hostStartMs + timeMs,
+		'A' + rule->channel,
+		alarmKinds[rule->kind],
+		change,
+		value,
+		rule->raised ? rule->limit : rule->clear);
+
+	if (rule->raised)
+	{
+		g_alarms.raised++;
+	}
+	else
+	{
+		g_alarms.cleared++;
+	}
+
+	g_alarms.unflushed++;
+}
+
+/****************************************************************************
+* alarmFlush
+*
+* Flushes the changes written since the last call, times them from the
+* arrival of their samples and counts them for streamDataHandler() to show
+****************************************************************************/
+void alarmFlush(int64_t arrivalUs)
+{
+	int64_t latencyUs;
+
+	if (g_alarms.unflushed == 0)
+	{
+		return;
+	}
+
+	fflush(g_alarms.log);
+
+	latencyUs = timeNowUs() - arrivalUs;
+	g_alarms.latencyTotalUs += latencyUs * g_alarms.unflushed;
+	g_alarms.latencyMaxUs = max(g_alarms.latencyMaxUs, latencyUs);
+
+	g_alarms.flushed += g_alarms.unflushed;
+	g_alarms.unflushed = 0;
+}
+
+/****************************************************************************
+* alarmEvaluate
+*
+* Takes one value of the channel of a rule, at timeMs from the start of
+* the capture, through the rule
+****************************************************************************/
+void alarmEvaluate(ALARM_RULE * rule, double value, double timeMs)
+{
+	double measured = value;
+	int16_t beyond;
+	int16_t within;
+
+	if (rule->kind == ALARM_RATE)
+	{
+		if (!rule->havePrevious || timeMs <= rule->previousMs)
+		{
+			rule->havePrevious = TRUE;
+			rule->previous = value;
+			rule->previousMs = timeMs;
+			return;
+		}
+
+		measured = fabs(value - rule->previous) * 1000.0 / (timeMs - rule->previousMs);
+		rule->previous = value;
+		rule->previousMs = timeMs;
+	}
+
+	if (rule->kind == ALARM_LOW)
+	{
+		beyond = measured < rule->limit;
+		within = measured > rule->clear;
+	}
+	else
+	{
+		beyond = measured > rule->limit;
+		within = measured < rule->clear;
+	}
+
+	if (rule->raised)
+	{
+		if (within)
+		{
+			rule->raised = FALSE;
+			rule->pending = FALSE;
+			alarmReport(rule, "cleared", measured, timeMs);
+		}
+	}
+	else if (!beyond)
+	{
+		rule->pending = FALSE;
+	}
+	else
+	{
+		if (!rule->pending)
+		{
+			rule->pending = TRUE;
+			rule->pendingMs = timeMs;
+		}
+
+		if (timeMs - rule->pendingMs >= rule->holdMs)
+		{
+			rule->raised = TRUE;
+			alarmReport(rule, "raised", measured, timeMs);
+		}
+	}
+}
+
+/****************************************************************************
+* alarmSkip
+*
+* Counts the samples at the start of a block that cannot change the state
+* of a level rule. That is every sample before the first one to cross the
+* level that the rule is waiting for, found without the bookkeeping of
+* alarmEvaluate()
+****************************************************************************/
+int32_t alarmSkip(ALARM_RULE * rule, const int16_t * samples, int32_t count, float scale, float offset)
+{
+	double level = rule->raised ? rule->clear : rule->limit;
+	int32_t i = 0;
+
+	if (rule->kind == ALARM_RATE || rule->pending)
+	{
+		return 0;
+	}
+
+	// Raising a high rule or clearing a low one needs a sample above the level
+	if ((rule->kind == ALARM_HIGH) != rule->raised)
+	{
+		while (i < count && samples[i] * scale + offset <= level)
+		{
+			i++;
+		}
+	}
+	else
+	{
+		while (i < count && samples[i] * scale + offset >= level)
+		{
+			i++;
+		}
+	}
+
+	return i;
+}
+
+/****************************************************************************
+* alarmStreaming
+*
+* Checks the samples a streaming callback has just copied to the
+* application buffers against every rule
+****************************************************************************/
+void alarmStreaming(int16_t ** appBuffers, uint32_t startIndex, int32_t count, int64_t arrivalUs)
+{
+	ALARM_RULE * rule;
+	int16_t * samples;
+	float scale;
+	float offset;
+	int32_t r;
+	int32_t i;
+
+	for (r = 0; r < g_alarms.count; r++)
+	{
+		rule = &g_alarms.rules[r];
+		samples = appBuffers[rule->channel * 2 + (rule->kind == ALARM_LOW)];
+		scale = g_alarms.scale[rule->channel];
+		offset = g_alarms.offset[rule->channel];
+
+		if (samples == NULL)
+		{
+			continue;
+		}
+
+		i = 0;
+
+		while (i < count)
+		{
+			i += alarmSkip(rule, &samples[startIndex + i], count - i, scale, offset);
+
+			if (i < count)
+			{
+				alarmEvaluate(rule, samples[startIndex + i] * scale + offset, (g_alarms.samples + i) * g_alarms.sampleIntervalMs);
+				i++;
+			}
+		}
+	}
+
+	g_alarms.samples += count;
+	alarmFlush(arrivalUs);
+}
+
+/****************************************************************************
+* alarmStop
+*
+* Closes the alarm log and shows how quickly alarms were written
+****************************************************************************/
+void alarmStop(void)
+{
+	uint32_t changes = g_alarms.raised + g_alarms.cleared;
+
+	if (g_alarms.count == 0)
+	{
+		return;
+	}
+
+	fclose(g_alarms.log);
+	g_alarms.log = NULL;
+	g_alarms.count = 0;
+
+	if (changes)
+	{
+		printf("%u alarms raised and %u cleared, written %.0f us on average and at most %lld us after their samples arrived\n",
+			g_alarms.raised, g_alarms.cleared, (double) g_alarms.latencyTotalUs / changes, (long long) g_alarms.latencyMaxUs);
+	}
+	else
+	{
+		printf("No alarms raised\n");
+	}
+}
+
+/****************************************************************************
+* callbackStreaming
+* Used by ps5000a data streaming collection calls, on receipt of data.
+* Used to set global flags etc checked by user routines
+****************************************************************************/
+void PREF4 callBackStreaming(	int16_t handle,
+	int32_t noOfSamples,
+	uint32_t startIndex,
+	int16_t overflow,
+	uint32_t triggerAt,
+	int16_t triggered,
+	int16_t autoStop,
+	void	*pParameter)
+{
+	int32_t channel;
+	int64_t stage = traceBegin();
+	int64_t arrivalUs = g_alarms.count ? timeNowUs() : 0;
+	BUFFER_INFO * bufferInfo = NULL;
+
+	PROBE3(streaming_callback_entry, noOfSamples, startIndex, overflow);
+
+	if (pParameter != NULL)
+	{
+		bufferInfo = (BUFFER_INFO *) pParameter;
+	}
+
+	// used for streaming
+	g_sampleCount = noOfSamples;
+	g_startIndex  = startIndex;
+	g_autoStopped = autoStop;
+
+	// flag to say done reading data
+	g_ready = TRUE;
+
+	// flags to show if & where a trigger has occurred
+	g_trig = triggered;
+	g_trigAt = triggerAt;
+
+	g_overflow = overflow;
+
+	if (bufferInfo != NULL && noOfSamples)
+	{
+		metricsStreamingCallback();
+		metricsAddSamples(bufferInfo->unit, noOfSamples, overflow);
+		metricsAdd(&g_metrics.captures[2], 1);
+		g_metrics.streamBufferEnd = startIndex + noOfSamples;
+
+		for (channel = 0; channel < bufferInfo->unit->channelCount; channel++)
+		{
+			if (bufferInfo->unit->channelSettings[channel].enabled)
+			{
+				if (bufferInfo->appBuffers && bufferInfo->driverBuffers)
+				{
+					// Max buffers
+					if (bufferInfo->appBuffers[channel * 2]  && bufferInfo->driverBuffers[channel * 2])
+					{
+						memcpy_s (&bufferInfo->appBuffers[channel * 2][startIndex], noOfSamples * sizeof(int16_t),
+							&bufferInfo->driverBuffers[channel * 2][startIndex], noOfSamples * sizeof(int16_t));
+					}
+
+					// Min buffers
+					if (bufferInfo->appBuffers[channel * 2 + 1] && bufferInfo->driverBuffers[channel * 2 + 1])
+					{
+						memcpy_s (&bufferInfo->appBuffers[channel * 2 + 1][startIndex], noOfSamples * sizeof(int16_t),
+							&bufferInfo->driverBuffers[channel * 2 + 1][startIndex], noOfSamples * sizeof(int16_t));
+					}
+				}
+			}
+		}
+
+		traceEnd("Callback copy", stage, noOfSamples);
+
+		if (g_alarms.count && bufferInfo->appBuffers)
+		{
+			stage = traceBegin();
+			alarmStreaming(bufferInfo->appBuffers, startIndex, noOfSamples, arrivalUs);
+			traceEnd("Alarm rules", stage, noOfSamples);
+		}
+	}
+
+	PROBE1(streaming_callback_exit, noOfSamples);
+}
+
+/****************************************************************************
+* Callback
+* used by ps5000a data block collection calls, on receipt of data.
+* used to set global flags etc checked by user routines
+****************************************************************************/
+void PREF4 callBackBlock( int16_t handle, PICO_STATUS status, void * pParameter)
+{
+	PROBE1(block_ready, status);
+
+	if (status != PICO_CANCELLED)
+	{
+		g_ready = TRUE;
+	}
+}
+
+/****************************************************************************
+* SetDefaults - restore default settings
+****************************************************************************/
+void setDefaults(UNIT * unit)
+{
+	PICO_STATUS status;
+	PICO_STATUS powerStatus;
+	int32_t i;
+
+	status = ps5000aSetEts(unit->handle, PS5000A_ETS_OFF, 0, 0, NULL);					// Turn off hasHardwareETS
+	printf(status?"setDefaults:ps5000aSetEts------ 0x%08lx \n":"", status);
+
+	powerStatus = ps5000aCurrentPowerSource(unit->handle);
+
+	for (i = 0; i < unit->channelCount; i++) // reset channels to most recent settings
+	{
+		if(i >= DUAL_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
+		{
+			// No need to set the channels C and D if Quad channel scope and power not enabled.
+		}
+		else
+		{
+			status = ps5000aSetChannel(unit->handle, (PS5000A_CHANNEL)(PS5000A_CHANNEL_A + i),
+				unit->channelSettings[PS5000A_CHANNEL_A + i].enabled,
+				(PS5000A_COUPLING)unit->channelSettings[PS5000A_CHANNEL_A + i].DCcoupled,
+				(PS5000A_RANGE)unit->channelSettings[PS5000A_CHANNEL_A + i].range, 
+				unit->channelSettings[PS5000A_CHANNEL_A + i].analogueOffset);
+
+			printf(status?"SetDefaults:ps5000aSetChannel------ 0x%08lx \n":"", status);
+
+		}
+	}
+}
+
+/****************************************************************************
+* adc_to_mv
+*
+* Convert an 16-bit ADC count into millivolts
+****************************************************************************/
+int32_t adc_to_mv(int32_t raw, int32_t rangeIndex, UNIT * unit)
+{
+	return (raw * inputRanges[rangeIndex]) / unit->maxADCValue;
+}
+
+/****************************************************************************
+* mv_to_adc
+*
+* Convert a millivolt value into a 16-bit ADC count
+*
+*  (useful for setting trigger thresholds)
+****************************************************************************/
+int16_t mv_to_adc(int16_t mv, int16_t rangeIndex, UNIT * unit)
+{
+	return (mv * unit->maxADCValue) / inputRanges[rangeIndex];
+}
+
+/****************************************************************************
+* Calibration and probe scaling
+*
+* A calibration table is read from CALIBRATION_FILE when a unit is opened
+* (and again from the main menu). Blank lines and lines starting with '#'
+* are ignored; the others are one of
+*
+*   cal   <serial|*> <channel> <range mV|*> <gain> <offset mV>
+*   probe <serial|*> <channel> <scale> <units>
+*
+* e.g.
+*
+*   cal   * A * 1.0 0.0
+*   cal   GR123/0045 A 5000 1.0021 -1.8
+*   probe GR123/0045 B 10 mV
+*   probe GR123/0045 C 10 mA
+*
+* A 'cal' line corrects readings on that channel and range to
+* gain * mV + offset. A 'probe' line then multiplies them by scale and
+* labels them with units, so a 100 mV/A current clamp read in mA has a
+* scale of 10. Later lines override earlier ones, and anything not listed
+* is left uncorrected in mV.
+*
+* Output is rounded to whole units, like the plain mV output, so the units
+* must be no coarser than 1 mV at the probe input: a scale below 1 (that
+* clamp read in A would be 0.01) is rejected and a smaller unit is needed.
+*
+* convertSamples() folds the input range, the ADC scale, the analogue
+* offset, the calibration and the probe into one multiply and add per
+* sample, so corrected output costs no more than the plain mV conversion.
+* Trigger thresholds and the capture catalogue stay in nominal mV.
+****************************************************************************/
+#define CALIBRATION_FILE		"ps5000a_calibration.txt"
+#define CALIBRATION_MAX_LINE	256
+
+/****************************************************************************
+* calibrationReset
+*
+* Sets every channel and range of the unit to uncorrected mV
+****************************************************************************/
+void calibrationReset(UNIT * unit)
+{
+	int32_t ch;
+	int32_t range;
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		for (range = 0; range < PS5000A_MAX_RANGES; range++)
+		{
+			unit->calibration[ch][range].gain = 1.0f;
+			unit->calibration[ch][range].offset = 0.0f;
+		}
+
+		unit->probe[ch].scale = 1.0f;
+		strcpy((char *) unit->probe[ch].units, "mV");
+	}
+}
+
+/****************************************************************************
+* calibrationLoad
+*
+* Resets the unit's calibration and applies the lines of CALIBRATION_FILE
+* that match its serial number. A missing file leaves it uncorrected.
+*
+* Returns the number of lines applied, or -1 if the file could not be opened
+****************************************************************************/
+int32_t calibrationLoad(UNIT * unit)
+{
+	FILE * fp = NULL;
+	char line[CALIBRATION_MAX_LINE];
+	char keyword[16];
+	char serial[16];
+	char channel[4];
+	char range[16];
+	char units[16];
+	float gain;
+	float offset;
+	int32_t ch;
+	int32_t rangeIndex;
+	int32_t lineNumber = 0;
+	int32_t applied = 0;
+	int16_t found;
+
+	calibrationReset(unit);
+
+	fopen_s(&fp, CALIBRATION_FILE, "r");
+
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineNumber++;
+
+		if (sscanf(line, "%15s %15s %3s", keyword, serial, channel) != 3 || keyword[0] == '#')
+		{
+			continue;
+		}
+
+		if (strcmp(serial, "*") != 0 && strcmp(serial, (char *) unit->serial) != 0)
+		{
+			continue;
+		}
+
+		ch = toupper(channel[0]) - 'A';
+
+		if (channel[1] != '\0' || ch < 0 || ch >= unit->channelCount)
+		{
+			printf("%s line %d: no channel %s on this unit\n", CALIBRATION_FILE, lineNumber, channel);
+			continue;
+		}
+
+		if (strcmp(keyword, "cal") == 0)
+		{
+			if (sscanf(line, "%*s %*s %*s %15s %f %f", range, &gain, &offset) != 3)
+			{
+				printf("%s line %d: expected cal <serial> <channel> <range mV> <gain> <offset mV>\n", CALIBRATION_FILE, lineNumber);
+				continue;
+			}
+
+			found = FALSE;
+
+			for (rangeIndex = unit->firstRange; rangeIndex <= unit->lastRange; rangeIndex++)
+			{
+				if (strcmp(range, "*") == 0 || inputRanges[rangeIndex] == atoi(range))
+				{
+					unit->calibration[ch][rangeIndex].gain = gain;
+					unit->calibration[ch][rangeIndex].offset = offset;
+					found = TRUE;
+				}
+			}
+
+			if (!found)
+			{
+				printf("%s line %d: no %s mV range on this unit\n", CALIBRATION_FILE, lineNumber, range);
+				continue;
+			}
+
+			applied++;
+		}
+		else if (strcmp(keyword, "probe") == 0)
+		{
+			if (sscanf(line, "%*s %*s %*s %f %15s", &gain, units) != 2 || strlen(units) >= sizeof(unit->probe[ch].units))
+			{
+				printf("%s line %d: expected probe <serial> <channel> <scale> <units>\n", CALIBRATION_FILE, lineNumber);
+				continue;
+			}
+
+			if (fabsf(gain) < 1.0f)
+			{
+				printf("%s line %d: scale %g would round away readings, use a smaller unit than %s\n", CALIBRATION_FILE, lineNumber, gain, units);
+				continue;
+			}
+
+			unit->probe[ch].scale = gain;
+			strcpy((char *) unit->probe[ch].units, units);
+			applied++;
+		}
+		else
+		{
+			printf("%s line %d: unknown keyword %s\n", CALIBRATION_FILE, lineNumber, keyword);
+		}
+	}
+
+	fclose(fp);
+
+	return applied;
+}
+
+/****************************************************************************
+* conversionFactors
+*
+* Gets the scale and offset that take a channel's ADC counts to calibrated
+* engineering units at its current range and resolution
+****************************************************************************/
+void conversionFactors(UNIT * unit, int32_t channel, float * scale, float * offset)
+{
+	CHANNEL_SETTINGS * settings = &unit->channelSettings[channel];
+	CALIBRATION * calibration = &unit->calibration[channel][settings->range];
+	float probe = unit->probe[channel].scale;
+
+	*scale = (float) inputRanges[settings->range] / unit->maxADCValue * calibration->gain * probe;
+	*offset = (calibration->offset - settings->analogueOffset * 1000.0f * calibration->gain) * probe;
+}
+
+/****************************************************************************
+* convertSample
+*
+* Converts one ADC count with factors from conversionFactors()
+****************************************************************************/
+int32_t convertSample(int16_t raw, float scale, float offset)
+{
+	return (int32_t) lrintf(raw * scale + offset);
+}
+
+/****************************************************************************
+* convertSamples
+*
+* Converts count ADC counts with factors from conversionFactors(), eight
+* at a time with SSE2 where it is available
+****************************************************************************/
+void convertSamples(const int16_t * raw, int32_t * out, int32_t count, float scale, float offset)
+{
+	int32_t i = 0;
+
+#ifdef HAVE_SSE2
+	__m128 scales = _mm_set1_ps(scale);
+	__m128 offsets = _mm_set1_ps(offset);
+	__m128i samples;
+	__m128i low;
+	__m128i high;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		samples = _mm_loadu_si128((const __m128i *) (raw + i));
+
+		// Sign extend to 32 bits by unpacking each sample into the top half of a lane
+		low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+		high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+
+		_mm_storeu_si128((__m128i *) (out + i), _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(low), scales), offsets)));
+		_mm_storeu_si128((__m128i *) (out + i + 4), _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(high), scales), offsets)));
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		out[i] = convertSample(raw[i], scale, offset);
+	}
+}
+
+/****************************************************************************************
+* ChangePowerSource - function to handle switches between +5V supply, and USB only power
+* Only applies to PicoScope 544xA/B units 
+******************************************************************************************/
+PICO_STATUS changePowerSource(int16_t handle, PICO_STATUS status, UNIT * unit)
+{
+	int8_t ch;
+
+	switch (status)
+	{
+		case PICO_POWER_SUPPLY_NOT_CONNECTED:		// User must acknowledge they want to power via USB
+			do
+			{
+				printf("\n5 V power supply not connected.");
+				printf("\nDo you want to run using USB only Y/N?\n");
+				ch = toupper(_getch());
+				
+				if(ch == 'Y')
+				{
+					printf("\nPowering the unit via USB\n");
+					status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_NOT_CONNECTED);		// Tell the driver that's ok
+				
+					if(status == PICO_OK && unit->channelCount == QUAD_SCOPE)
+					{
+						unit->channelSettings[PS5000A_CHANNEL_C].enabled = FALSE;
+						unit->channelSettings[PS5000A_CHANNEL_D].enabled = FALSE;
+					}
+					else if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+					{
+						status = changePowerSource(handle, status, unit);
+					}
+					else
+					{
+						// Do nothing
+					}
+
+				}
+			}
+			while(ch != 'Y' && ch != 'N');
+			printf(ch == 'N'?"Please use the +5V power supply to power this unit\n":"");
+			break;
+
+		case PICO_POWER_SUPPLY_CONNECTED:
+			printf("\nUsing +5 V power supply voltage.\n");
+			status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_CONNECTED);		// Tell the driver we are powered from +5V supply
+			break;
+
+		case PICO_USB3_0_DEVICE_NON_USB3_0_PORT:
+			do
+			{
+				printf("\nUSB 3.0 device on non-USB 3.0 port.");
+				printf("\nDo you wish to continue Y/N?\n");
+				ch = toupper(_getch());
+
+				if (ch == 'Y')
+				{
+					printf("\nSwitching to use USB power from non-USB 3.0 port.\n");
+					status = ps5000aChangePowerSource(handle, PICO_USB3_0_DEVICE_NON_USB3_0_PORT);		// Tell the driver that's ok
+
+					if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+					{
+						status = changePowerSource(handle, status, unit);
+					}
+					else
+					{
+						// Do nothing
+					}
+
+				}
+			} while (ch != 'Y' && ch != 'N');
+			printf(ch == 'N' ? "Please use a USB 3.0 port or press 'Y'.\n" : "");
+			break;
+
+		case PICO_POWER_SUPPLY_UNDERVOLTAGE:
+			do
+			{
+				printf("\nUSB not supplying required voltage");
+				printf("\nPlease plug in the +5 V power supply\n");
+				printf("\nHit any key to continue, or Esc to exit...\n");
+				ch = _getch();
+				
+				if (ch == 0x1B)	// ESC key
+				{
+					exit(0);
+				}
+				else
+				{
+					status = ps5000aChangePowerSource(handle, PICO_POWER_SUPPLY_CONNECTED);		// Tell the driver that's ok
+				}
+			}
+			while (status == PICO_POWER_SUPPLY_REQUEST_INVALID);
+			break;
+	}
+
+	printf("\n");
+	return status;
+}
+
+/****************************************************************************
+* ClearDataBuffers
+*
+* stops GetData writing values to memory that has been released
+****************************************************************************/
+PICO_STATUS clearDataBuffers(UNIT * unit)
+{
+	int32_t i;
+	PICO_STATUS status;
+
+	for (i = 0; i < unit->channelCount; i++) 
+	{
+		if(unit->channelSettings[i].enabled)
+		{
+			if ((status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL) i, NULL, NULL, 0, 0, PS5000A_RATIO_MODE_NONE)) != PICO_OK)
+			{
+				printf("clearDataBuffers:ps5000aSetDataBuffers(channel %d) ------ 0x%08lx \n", i, status);
+			}
+		}
+	}
+	return status;
+}
+
+/****************************************************************************
+* catalogueBegin
+*
+* Starts a catalogue record for a new capture and generates a unique
+* file name for it of the form <prefix>_<serial>_<YYYYMMDD>_<HHMMSS>.txt
+* Input :
+* - unit : the unit being used for the capture.
+* - record : the record to initialise.
+* - mode : text describing the capture mode.
+* - prefix : the prefix for the file name.
+* - fileName : the buffer (CATALOGUE_FILE_NAME_LENGTH bytes) to receive the file name.
+****************************************************************************/
+void catalogueBegin(UNIT * unit, CATALOGUE_RECORD * record, int8_t * mode, int8_t * prefix, int8_t * fileName)
+{
+	int16_t i;
+	int16_t suffix = 0;
+	int8_t serial[sizeof(record->serial)];
+	int8_t timeString[20];
+	time_t now = time(NULL);
+	struct tm localTime;
+	FILE * fp = NULL;
+
+	memset(record, 0, sizeof(CATALOGUE_RECORD));
+
+	record->version = CATALOGUE_VERSION;
+	record->recordSize = sizeof(CATALOGUE_RECORD);
+	record->startTime = (int64_t) now;
+	record->resolution = (int16_t) unit->resolution;
+	record->segmentCount = 1;
+
+	memcpy(record->modelString, unit->modelString, sizeof(record->modelString) - 1);
+	memcpy(record->serial, unit->serial, min(sizeof(unit->serial), sizeof(record->serial) - 1));
+	strncpy((char *) record->mode, (char *) mode, sizeof(record->mode) - 1);
+
+	for (i = 0; i < unit->channelCount; i++)
+	{
+		record->channels[i].enabled = unit->channelSettings[i].enabled;
+		record->channels[i].range = unit->channelSettings[i].range;
+		record->channels[i].minValue = 32767;
+		record->channels[i].maxValue = -32768;
+	}
+
+	// Serial numbers contain a '/' which cannot be used in a file name
+	memcpy(serial, record->serial, sizeof(serial));
+
+	for (i = 0; serial[i] != '\0'; i++)
+	{
+		if (serial[i] == '/' || serial[i] == '\\' || serial[i] == ' ')
+		{
+			serial[i] = '-';
+		}
+	}
+
+	localtime_s(&localTime, &now);
+	strftime((char *) timeString, sizeof(timeString), "%Y%m%d_%H%M%S", &localTime);
+
+	// Captures started within the same second are given a numeric suffix
+	do
+	{
+		if (fp != NULL)
+		{
+			fclose(fp);
+			fp = NULL;
+		}
+
+		if (suffix == 0)
+		{
+			snprintf((char *) fileName, CATALOGUE_FILE_NAME_LENGTH, "%s_%s_%s.txt", prefix, serial, timeString);
+		}
+		else
+		{
+			snprintf((char *) fileName, CATALOGUE_FILE_NAME_LENGTH, "%s_%s_%s_%d.txt", prefix, serial, timeString, suffix);
+		}
+
+		suffix++;
+		fopen_s(&fp, fileName, "r");
+	}
+	while (fp != NULL);
+
+	strncpy((char *) record->fileName, (char *) fileName, sizeof(record->fileName) - 1);
+}
+
+/****************************************************************************
+* catalogueUpdate
+*
+* Adds a buffer of samples to the summary statistics of a channel
+****************************************************************************/
+void catalogueUpdate(CATALOGUE_RECORD * record, int16_t channel, int16_t * buffer, uint32_t count)
+{
+	uint32_t i;
+	CHANNEL_SUMMARY * summary = &record->channels[channel];
+
+	for (i = 0; i < count; i++)
+	{
+		summary->minValue = min(summary->minValue, buffer[i]);
+		summary->maxValue = max(summary->maxValue, buffer[i]);
+		summary->sum += buffer[i];
+	}
+
+	summary->count += count;
+}
+
+/****************************************************************************
+* catalogueCommit
+*
+* Completes a catalogue record and appends it to the catalogue file
+* Input :
+* - record : the record to write.
+* - overflow : bit field of channels that went over range during the capture.
+****************************************************************************/
+void catalogueCommit(CATALOGUE_RECORD * record, int16_t overflow)
+{
+	int16_t i;
+	FILE * fp = NULL;
+
+	record->endTime = (int64_t) time(NULL);
+
+	for (i = 0; i < PS5000A_MAX_CHANNELS; i++)
+	{
+		record->channels[i].overflow = (overflow >> i) & 1;
+	}
+
+	fopen_s(&fp, CATALOGUE_FILE, "ab");
+
+	if (fp == NULL)
+	{
+		printf("catalogueCommit: Cannot open the file %s for writing.\n", CATALOGUE_FILE);
+		return;
+	}
+
+	if (fwrite(record, sizeof(CATALOGUE_RECORD), 1, fp) != 1)
+	{
+		printf("catalogueCommit: Error writing to %s.\n", CATALOGUE_FILE);
+	}
+
+	fclose(fp);
+}
+
+/****************************************************************************
+* catalogueReadRecord
+*
+* Reads the record at the given index of the catalogue file
+****************************************************************************/
+int16_t catalogueReadRecord(FILE * fp, int32_t index, CATALOGUE_RECORD * record)
+{
+	if (fseek(fp, (long) index * (long) sizeof(CATALOGUE_RECORD), SEEK_SET) != 0)
+	{
+		return FALSE;
+	}
+
+	return fread(record, sizeof(CATALOGUE_RECORD), 1, fp) == 1;
+}
+
+/****************************************************************************
+* parseDate
+*
+* Converts a YYYY-MM-DD string to local time, returns -1 for "*"
+****************************************************************************/
+int64_t parseDate(int8_t * text)
+{
+	struct tm date;
+
+	memset(&date, 0, sizeof(struct tm));
+
+	if (sscanf((char *) text, "%d-%d-%d", &date.tm_year, &date.tm_mon, &date.tm_mday) != 3)
+	{
+		return -1;
+	}
+
+	date.tm_year -= 1900;
+	date.tm_mon -= 1;
+	date.tm_isdst = -1;
+
+	return (int64_t) mktime(&date);
+}
+
+/****************************************************************************
+* queryCatalogue
+*
+* Lists the captures in the catalogue matching a serial number, a channel
+* that overflowed and a date range, e.g. all captures from unit X with
+* channel C overflow in March.
+****************************************************************************/
+void queryCatalogue(UNIT * unit)
+{
+	int8_t serial[16];
+	int8_t overflowChannel[4];
+	int8_t fromText[16];
+	int8_t toText[16];
+	int8_t timeString[24];
+	int16_t ch;
+	int16_t match;
+	int32_t lower;
+	int32_t upper;
+	int32_t middle;
+	int32_t index;
+	int32_t recordCount;
+	int32_t matches = 0;
+	int64_t fromTime;
+	int64_t toTime;
+	time_t startTime;
+	struct tm localTime;
+	FILE * fp = NULL;
+	CATALOGUE_RECORD record;
+
+	fopen_s(&fp, CATALOGUE_FILE, "rb");
+
+	if (fp == NULL)
+	{
+		printf("queryCatalogue: No captures have been catalogued (%s not found).\n", CATALOGUE_FILE);
+		return;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	recordCount = (int32_t) (ftell(fp) / (long) sizeof(CATALOGUE_RECORD));
+
+	printf("%d captures catalogued in %s\n\n", recordCount, CATALOGUE_FILE);
+	printf("Enter * for any value.\n");
+
+	printf("Serial number (this unit is %s): ", unit->serial);
+	fflush(stdin);
+	scanf_s("%15s", serial, (unsigned) sizeof(serial));
+
+	printf("Channel that overflowed (A..%c): ", 'A' + unit->channelCount - 1);
+	fflush(stdin);
+	scanf_s("%3s", overflowChannel, (unsigned) sizeof(overflowChannel));
+
+	printf("From date (YYYY-MM-DD): ");
+	fflush(stdin);
+	scanf_s("%15s", fromText, (unsigned) sizeof(fromText));
+
+	printf("To date, inclusive (YYYY-MM-DD): ");
+	fflush(stdin);
+	scanf_s("%15s", toText, (unsigned) sizeof(toText));
+
+	fromTime = parseDate(fromText);
+	toTime = parseDate(toText);
+
+	if (toTime >= 0)
+	{
+		toTime += 24 * 60 * 60;
+	}
+
+	// Records are in time order - binary search for the first record in range
+	lower = 0;
+	upper = recordCount;
+
+	if (fromTime >= 0)
+	{
+		while (lower < upper)
+		{
+			middle = lower + (upper - lower) / 2;
+
+			if (catalogueReadRecord(fp, middle, &record) && record.startTime < fromTime)
+			{
+				lower = middle + 1;
+			}
+			else
+			{
+				upper = middle;
+			}
+		}
+	}
+
+	printf("\n");
+
+	for (index = lower; index < recordCount && catalogueReadRecord(fp, index, &record); index++)
+	{
+		if (toTime >= 0 && record.startTime >= toTime)
+		{
+			break;
+		}
+
+		match = (serial[0] == '*' || strstr((char *) record.serial, (char *) serial) != NULL);
+
+		if (match && overflowChannel[0] != '*')
+		{
+			ch = toupper(overflowChannel[0]) - 'A';
+			match = (ch >= 0 && ch < PS5000A_MAX_CHANNELS && record.channels[ch].overflow);
+		}
+
+		if (!match)
+		{
+			continue;
+		}
+
+		matches++;
+
+		startTime = (time_t) record.startTime;
+		localtime_s(&localTime, &startTime);
+		strftime((char *) timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", &localTime);
+
+		printf("%s  %-7s %-10s %-11s %s\n", timeString, record.modelString, record.serial, record.mode, record.fileName);
+		printf("    Timebase %lu (%ld ns), %lu samples, %lu segment(s), duration %ld s", record.timebase, record.sampleIntervalNs,
+			record.sampleCount, record.segmentCount, (int32_t) (record.endTime - record.startTime));
+		printf(record.triggerEnabled ? ", trigger on %c at %d ADC counts\n" : ", no trigger\n", 'A' + record.triggerChannel, record.triggerThreshold);
+
+		for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+		{
+			if (record.channels[ch].enabled && record.channels[ch].count > 0)
+			{
+				printf("    Ch%c %6d mV range: min %6d max %6d mean %8.1f ADC counts%s\n", 'A' + ch, inputRanges[record.channels[ch].range],
+					record.channels[ch].minValue, record.channels[ch].maxValue, record.channels[ch].sum / record.channels[ch].count,
+					record.channels[ch].overflow ? "  OVERFLOW" : "");
+			}
+		}
+	}
+
+	printf("\n%d matching captures\n", matches);
+
+	fclose(fp);
+}
+
+/****************************************************************************
+* Event store
+*
+* Every rapid block segment is appended to an event store as an event on a
+* single 64-bit timeline (nanoseconds since the epoch) that carries on
+* across runs. Within a run, segments are placed by their trigger time
+* stamp counters. The first segment of each run is flagged with
+* PICO_DEVICE_TIME_STAMP_RESET and its counter is arbitrary, so it is
+* anchored to the host clock read just before the run was started.
+*
+* Samples are appended to EVENT_DATA_FILE and a fixed-size record for each
+* event is appended to EVENT_INDEX_FILE. The samples are written before the
+* record, so an interrupted write never leaves a record pointing at missing
+* data. Events are appended in time order, so time range queries binary
+* search the index in the same way as the capture catalogue.
+****************************************************************************/
+#define EVENT_INDEX_FILE		"events.idx"
+#define EVENT_DATA_FILE			"events.dat"
+#define EVENT_VERSION				1
+
+#define EVENT_TIME_HOST				0x0001	// Time taken from the host clock at the start of the run
+#define EVENT_TIME_ESTIMATED	0x0002	// Time stamp counter reset part way through a run, the time is a lower bound
+
+typedef struct tEventRecord
+{
+	uint32_t	version;
+	uint32_t	recordSize;
+	int64_t		time;								// Trigger time, nanoseconds since the epoch
+	int64_t		dataOffset;					// Offset of the samples in EVENT_DATA_FILE
+	uint32_t	run;								// Rapid block run the event was captured in
+	uint32_t	segment;
+	uint32_t	sampleCount;				// Samples per enabled channel
+	int32_t		sampleIntervalNs;
+	uint16_t	channelMask;				// Channels stored, in channel order
+	uint16_t	flags;							// EVENT_TIME_*
+	int16_t		overflow;
+	int16_t		resolution;
+	int16_t		range[PS5000A_MAX_CHANNELS];
+	int16_t		minValue[PS5000A_MAX_CHANNELS];
+	int16_t		maxValue[PS5000A_MAX_CHANNELS];
+	int8_t		serial[16];
+}EVENT_RECORD;
+
+/****************************************************************************
+* eventReadRecord
+*
+* Reads the record at the given index of the event index file
+****************************************************************************/
+int16_t eventReadRecord(FILE * fp, int64_t index, EVENT_RECORD * record)
+{
+	if (_fseeki64(fp, index * (int64_t) sizeof(EVENT_RECORD), SEEK_SET) != 0)
+	{
+		return FALSE;
+	}
+
+	return fread(record, sizeof(EVENT_RECORD), 1, fp) == 1;
+}
+
+/****************************************************************************
+* eventStoreAppend
+*
+* Appends every segment of a rapid block run to the event store
+* Input :
+* - rapidBuffers : the samples, [channel][segment].
+* - triggerInfo : the trigger information of every segment.
+* - runStartUs : the host clock, in microseconds since the epoch, read just
+*   before the run was started.
+* Returns the number of events appended.
+****************************************************************************/
+uint32_t eventStoreAppend(UNIT * unit, int16_t *** rapidBuffers, int16_t * overflow, PS5000A_TRIGGER_INFO * triggerInfo, uint32_t nCaptures,
+	uint32_t nSamples, int32_t timeIntervalNs, int64_t runStartUs)
+{
+	int16_t ch;
+	uint32_t capture;
+	uint32_t i;
+	uint32_t appended = 0;
+	uint32_t run = 0;
+	uint64_t baseCounter = 0;
+	int64_t baseTime = 0;
+	int64_t lastTime = 0;
+	int64_t recordCount;
+	FILE * indexFile = NULL;
+	FILE * dataFile = NULL;
+	EVENT_RECORD record;
+
+	// Carry on from the last event in the store
+	fopen_s(&indexFile, EVENT_INDEX_FILE, "rb");
+
+	if (indexFile != NULL)
+	{
+		_fseeki64(indexFile, 0, SEEK_END);
+		recordCount = _ftelli64(indexFile) / (int64_t) sizeof(EVENT_RECORD);
+
+		if (recordCount > 0 && eventReadRecord(indexFile, recordCount - 1, &record))
+		{
+			lastTime = record.time;
+			run = record.run + 1;
+		}
+
+		fclose(indexFile);
+		indexFile = NULL;
+	}
+
+	fopen_s(&indexFile, EVENT_INDEX_FILE, "ab");
+	fopen_s(&dataFile, EVENT_DATA_FILE, "ab");
+
+	if (indexFile == NULL || dataFile == NULL)
+	{
+		printf("eventStoreAppend: Cannot open %s and %s for writing.\n", EVENT_INDEX_FILE, EVENT_DATA_FILE);
+
+		if (indexFile != NULL)
+		{
+			fclose(indexFile);
+		}
+
+		if (dataFile != NULL)
+		{
+			fclose(dataFile);
+		}
+
+		return 0;
+	}
+
+	_fseeki64(dataFile, 0, SEEK_END);
+
+	for (capture = 0; capture < nCaptures; capture++)
+	{
+		memset(&record, 0, sizeof(EVENT_RECORD));
+
+		record.version = EVENT_VERSION;
+		record.recordSize = sizeof(EVENT_RECORD);
+		record.run = run;
+		record.segment = capture;
+		record.sampleCount = nSamples;
+		record.sampleIntervalNs = timeIntervalNs;
+		record.overflow = overflow[capture];
+		record.resolution = (int16_t) unit->resolution;
+		memcpy(record.serial, unit->serial, min(sizeof(unit->serial), sizeof(record.serial) - 1));
+
+		if (capture == 0)
+		{
+			// The counter of the first segment is arbitrary, anchor it to the host clock but keep the timeline in order
+			baseCounter = triggerInfo[capture].timeStampCounter;
+			baseTime = max(runStartUs * 1000, lastTime + 1);
+			record.flags = EVENT_TIME_HOST;
+		}
+		else if (triggerInfo[capture].status & PICO_DEVICE_TIME_STAMP_RESET)
+		{
+			// The counter was reset part way through the run, so this trigger was at least one segment after the last
+			baseCounter = triggerInfo[capture].timeStampCounter;
+			baseTime = lastTime + (int64_t) nSamples * timeIntervalNs;
+			record.flags = EVENT_TIME_ESTIMATED;
+		}
+
+		record.time = baseTime + (int64_t) (triggerInfo[capture].timeStampCounter - baseCounter) * timeIntervalNs;
+		record.dataOffset = _ftelli64(dataFile);
+
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			record.minValue[ch] = 32767;
+			record.maxValue[ch] = -32768;
+
+			if (!unit->channelSettings[ch].enabled)
+			{
+				continue;
+			}
+
+			record.channelMask |= 1 << ch;
+			record.range[ch] = unit->channelSettings[ch].range;
+
+			for (i = 0; i < nSamples; i++)
+			{
+				record.minValue[ch] = min(record.minValue[ch], rapidBuffers[ch][capture][i]);
+				record.maxValue[ch] = max(record.maxValue[ch], rapidBuffers[ch][capture][i]);
+			}
+
+			if (fwrite(rapidBuffers[ch][capture], sizeof(int16_t), nSamples, dataFile) != nSamples)
+			{
+				break;
+			}
+		}
+
+		if (ch < unit->channelCount || fflush(dataFile) != 0 || fwrite(&record, sizeof(EVENT_RECORD), 1, indexFile) != 1)
+		{
+			printf("eventStoreAppend: Error writing event %lu of run %lu.\n", capture, run);
+			break;
+		}
+
+		lastTime = record.time;
+		appended++;
+	}
+
+	fclose(dataFile);
+	fclose(indexFile);
+
+	return appended;
+}
+
+/****************************************************************************
+* formatEventTime
+*
+* Formats a timeline value as local date and time with microseconds
+****************************************************************************/
+void formatEventTime(int64_t time, int8_t * text, size_t length)
+{
+	int8_t seconds[24];
+	time_t whole = (time_t) (time / 1000000000);
+	uint32_t microseconds = (uint32_t) ((time % 1000000000) / 1000) % 1000000;		// Keeps the field to 6 digits
+	struct tm localTime;
+
+	localtime_s(&localTime, &whole);
+	strftime((char *) seconds, sizeof(seconds), "%Y-%m-%d %H:%M:%S", &localTime);
+	snprintf((char *) text, length, "%s.%06lu", seconds, microseconds);
+}
+
+/****************************************************************************
+* parseDateTime
+*
+* Converts a YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS string to a timeline value,
+* returns -1 for "*". If endOfDay is set the result is the end of the day,
+* or of the second if a time is given.
+****************************************************************************/
+int64_t parseDateTime(int8_t * text, int16_t endOfDay)
+{
+	int32_t hours = 0;
+	int32_t minutes = 0;
+	int32_t seconds = 0;
+	int64_t date = parseDate(text);
+	int8_t * timePart = (int8_t *) strchr((char *) text, 'T');
+
+	if (date < 0)
+	{
+		return -1;
+	}
+
+	// The end of a time given to the second is the start of the next second
+	if (timePart != NULL && sscanf((char *) timePart + 1, "%d:%d:%d", &hours, &minutes, &seconds) >= 2)
+	{
+		return (date + hours * 3600 + minutes * 60 + seconds + (endOfDay ? 1 : 0)) * 1000000000;
+	}
+
+	return (date + (endOfDay ? 24 * 60 * 60 : 0)) * 1000000000;
+}
+
+/****************************************************************************
+* exportEvent
+*
+* Reads the samples of one event back from the event store and writes them
+* to a text file
+****************************************************************************/
+void exportEvent(UNIT * unit, EVENT_RECORD * record, int64_t index)
+{
+	int16_t ch;
+	int16_t nChannels = 0;
+	int16_t * samples[PS5000A_MAX_CHANNELS];
+	uint32_t i;
+	int8_t fileName[CATALOGUE_FILE_NAME_LENGTH];
+	int8_t timeString[32];
+	FILE * dataFile = NULL;
+	FILE * fp = NULL;
+
+	memset(samples, 0, sizeof(samples));
+
+	fopen_s(&dataFile, EVENT_DATA_FILE, "rb");
+
+	if (dataFile == NULL || _fseeki64(dataFile, record->dataOffset, SEEK_SET) != 0)
+	{
+		printf("exportEvent: Cannot read %s.\n", EVENT_DATA_FILE);
+
+		if (dataFile != NULL)
+		{
+			fclose(dataFile);
+		}
+
+		return;
+	}
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		if (record->channelMask & (1 << ch))
+		{
+			samples[ch] = (int16_t *) memoryAlloc(MEMORY_APPLICATION, record->sampleCount, sizeof(int16_t));
+
+			if (samples[ch] == NULL || fread(samples[ch], sizeof(int16_t), record->sampleCount, dataFile) != record->sampleCount)
+			{
+				break;
+			}
+
+			nChannels++;
+		}
+	}
+
+	fclose(dataFile);
+
+	if (ch < PS5000A_MAX_CHANNELS)
+	{
+		printf("exportEvent: Cannot read the samples of event %lld.\n", (long long) index);
+	}
+	else
+	{
+		snprintf((char *) fileName, sizeof(fileName), "event_%lld.txt", (long long) index);
+		fopen_s(&fp, fileName, "w");
+
+		if (fp == NULL)
+		{
+			printf("Cannot open the file %s for writing.\n", fileName);
+		}
+		else
+		{
+			formatEventTime(record->time, timeString, sizeof(timeString));
+
+			fprintf(fp, "Event %lld: run %lu segment %lu, triggered %s\n", (long long) index, record->run, record->segment, timeString);
+			fprintf(fp, "%lu samples at %ld ns. Results shown are ADC Count & mV for each stored channel\n\n", record->sampleCount, record->sampleIntervalNs);
+
+			for (i = 0; i < record->sampleCount; i++)
+			{
+				for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+				{
+					if (samples[ch] != NULL)
+					{
+						fprintf(fp, "Ch%C  %6d = %+6dmV   ", 'A' + ch, samples[ch][i], adc_to_mv(samples[ch][i], record->range[ch], unit));
+					}
+				}
+
+				fprintf(fp, "\n");
+			}
+
+			fclose(fp);
+			printf("%d channel(s) of event %lld written to %s\n", nChannels, (long long) index, fileName);
+		}
+	}
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		memoryFree(samples[ch]);
+	}
+}
+
+/****************************************************************************
+* queryEvents
+*
+* Lists the events in a time range that match a measured attribute, e.g.
+* every event in the last hour where channel B went above 2 V, and exports
+* the samples of a chosen event
+****************************************************************************/
+void queryEvents(UNIT * unit)
+{
+	int8_t fromText[24];
+	int8_t toText[24];
+	int8_t channelText[4] = "A";
+	int8_t timeString[32];
+	int16_t ch = 0;
+	int16_t channel;
+	int16_t match;
+	int32_t test = 0;
+	int32_t level = 0;
+	int32_t peakToPeak;
+	int64_t lower;
+	int64_t upper;
+	int64_t middle;
+	int64_t index;
+	int64_t recordCount;
+	int64_t matches = 0;
+	int64_t fromTime;
+	int64_t toTime;
+	int64_t previousTime = -1;
+	int32_t exportIndex = -1;
+	FILE * fp = NULL;
+	EVENT_RECORD record;
+
+	fopen_s(&fp, EVENT_INDEX_FILE, "rb");
+
+	if (fp == NULL)
+	{
+		printf("queryEvents: No events have been stored (%s not found).\n", EVENT_INDEX_FILE);
+		return;
+	}
+
+	_fseeki64(fp, 0, SEEK_END);
+	recordCount = _ftelli64(fp) / (int64_t) sizeof(EVENT_RECORD);
+
+	printf("%lld events stored in %s\n\n", (long long) recordCount, EVENT_INDEX_FILE);
+	printf("Enter * for any time.\n");
+
+	printf("From (YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS): ");
+	fflush(stdin);
+	scanf_s("%23s", fromText, (unsigned) sizeof(fromText));
+
+	printf("To, inclusive (YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS): ");
+	fflush(stdin);
+	scanf_s("%23s", toText, (unsigned) sizeof(toText));
+
+	printf("Keep events with\n0: any measurement\n1: peak to peak above a level\n2: maximum above a level\n3: minimum below a level\n4: time since the previous event above a level\n");
+
+	do
+	{
+		printf("Test [0...4]: ");
+		scanf_s("%d", &test);
+	}
+	while (test < 0 || test > 4);
+
+	if (test >= 1 && test <= 3)
+	{
+		printf("Channel: ");
+		scanf_s("%3s", channelText, (unsigned) sizeof(channelText));
+		ch = toupper(channelText[0]) - 'A';
+
+		if (ch < 0 || ch >= PS5000A_MAX_CHANNELS)
+		{
+			ch = 0;
+		}
+
+		printf("Level (mV): ");
+		scanf_s("%d", &level);
+	}
+	else if (test == 4)
+	{
+		printf("Level (us): ");
+		scanf_s("%d", &level);
+	}
+
+	fromTime = parseDateTime(fromText, FALSE);
+	toTime = parseDateTime(toText, TRUE);
+
+	// Events are in time order - binary search for the first event in range
+	lower = 0;
+	upper = recordCount;
+
+	if (fromTime >= 0)
+	{
+		while (lower < upper)
+		{
+			middle = lower + (upper - lower) / 2;
+
+			if (eventReadRecord(fp, middle, &record) && record.time < fromTime)
+			{
+				lower = middle + 1;
+			}
+			else
+			{
+				upper = middle;
+			}
+		}
+	}
+
+	if (lower > 0 && eventReadRecord(fp, lower - 1, &record))
+	{
+		previousTime = record.time;
+	}
+
+	printf("\n");
+
+	for (index = lower; index < recordCount && eventReadRecord(fp, index, &record); index++)
+	{
+		if (toTime >= 0 && record.time >= toTime)
+		{
+			break;
+		}
+
+		peakToPeak = (record.channelMask & (1 << ch)) ?
+			adc_to_mv(record.maxValue[ch], record.range[ch], unit) - adc_to_mv(record.minValue[ch], record.range[ch], unit) : 0;
+
+		switch (test)
+		{
+			case 1:
+				match = (record.channelMask & (1 << ch)) && peakToPeak > level;
+				break;
+
+			case 2:
+				match = (record.channelMask & (1 << ch)) && adc_to_mv(record.maxValue[ch], record.range[ch], unit) > level;
+				break;
+
+			case 3:
+				match = (record.channelMask & (1 << ch)) && adc_to_mv(record.minValue[ch], record.range[ch], unit) < level;
+				break;
+
+			case 4:
+				match = previousTime >= 0 && (record.time - previousTime) / 1000 > level;
+				break;
+
+			default:
+				match = TRUE;
+				break;
+		}
+
+		if (match)
+		{
+			matches++;
+
+			formatEventTime(record.time, timeString, sizeof(timeString));
+
+			printf("%8lld  %s%s  run %lu segment %lu", (long long) index, timeString,
+				(record.flags & EVENT_TIME_ESTIMATED) ? "+" : " ", record.run, record.segment);
+
+			if (previousTime >= 0)
+			{
+				printf("  +%.3f ms", (record.time - previousTime) / 1000000.0);
+			}
+
+			printf("\n         ");
+
+			for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++)
+			{
+				if (record.channelMask & (1 << channel))
+				{
+					printf(" Ch%c %+6d..%+6d mV%s", 'A' + channel, adc_to_mv(record.minValue[channel], record.range[channel], unit),
+						adc_to_mv(record.maxValue[channel], record.range[channel], unit), (record.overflow & (1 << channel)) ? " OVERFLOW" : "");
+				}
+			}
+
+			printf("\n");
+		}
+
+		previousTime = record.time;
+	}
+
+	printf("\n%lld matching events (+ marks a time that is a lower bound)\n", (long long) matches);
+
+	if (matches > 0)
+	{
+		printf("Event to export to a file (-1 for none): ");
+		scanf_s("%d", &exportIndex);
+
+		if (exportIndex >= 0 && eventReadRecord(fp, exportIndex, &record))
+		{
+			exportEvent(unit, &record, exportIndex);
+		}
+	}
+
+	fclose(fp);
+}
+
+/****************************************************************************
+* Capture diff
+*
+* Compares two captures of the same stimulus, e.g. a device under test
+* against a reference capture, sample by sample. Text capture files (block,
+* rapid block, streaming and exported events) and raw stream files written
+* with K are read through a window mapped onto the file, DIFF_BLOCK samples
+* per channel at a time, so captures far larger than memory can be compared.
+*
+* Rapid block captures and events are compared segment by segment. The
+* second capture is aligned to the first at the trigger (both start at
+* sample 0) or at the lag that maximises the cross-correlation of the first
+* DIFF_CORRELATION_SAMPLES of the first common channel.
+*
+* Every sample whose difference is outside its channel's tolerance is
+* counted, and runs of them no more than DIFF_MERGE_GAP samples apart are
+* reported as one region.
+****************************************************************************/
+#define DIFF_BLOCK					65536				// Samples per channel decoded at a time
+#define DIFF_WINDOW					(64 * 1024 * 1024)	// Bytes of a file mapped at a time
+#define DIFF_MAX_LINE				1024
+#define DIFF_CORRELATION_SAMPLES	16384
+#define DIFF_MAX_LAG				4096
+#define DIFF_MERGE_GAP				16
+#define DIFF_REPORT_REGIONS			20					// Regions listed on the console; all are in the report file
+#define DIFF_REPORT_FILE			"capture_diff.txt"
+#define DIFF_SUMMARY_HEADING		"Ch  Tolerance   Outside       (%)  Regions   Mean A-B    RMS A-B  Max |A-B|  at segment/sample"
+
+typedef struct
+{
+	int8_t *	fileName;
+#ifdef _WIN32
+	HANDLE		file;
+	HANDLE		mapping;
+#else
+	int32_t		fd;
+#endif
+	int64_t		size;
+	int64_t		granularity;
+	int8_t *	window;
+	int64_t		windowOffset;
+	int64_t		windowLength;
+	int64_t		dataStart;
+	int64_t		position;							// Next byte to decode
+	int16_t		raw;								// TRUE for a raw stream file with a RAW_HEADER
+	int16_t		format;
+	int16_t		channels;							// Raw: channels in each frame
+	int16_t		frameChannel[PS5000A_MAX_CHANNELS];	// Raw: channel of each plane in frame order
+	uint16_t	channelMask;
+	int16_t		maxADCValue;						// 0 when the file does not record the ranges
+	int32_t		rangeMv[PS5000A_MAX_CHANNELS];
+	uint32_t	frameSamples;
+	int64_t		frameStart;
+	uint32_t	frameLength;
+	uint32_t	frameOffset;
+	int16_t		seenData;
+	int16_t *	samples[PS5000A_MAX_CHANNELS];
+	uint32_t	count;								// Samples of each channel in samples[]
+	uint32_t	used;
+	uint32_t	segment;							// Segment the samples in samples[] belong to
+	uint64_t	blockStart;							// Index of samples[0] within its segment
+	uint64_t	unmatched;							// Samples with no counterpart in the other capture
+}DIFF_CAPTURE;
+
+typedef struct
+{
+	int16_t		tolerance;
+	uint64_t	compared;
+	uint64_t	outside;
+	int64_t		sum;								// Of A - B
+	double		sumOfSquares;
+	int16_t		maxDifference;						// Of |A - B|
+	uint32_t	maxSegment;
+	uint64_t	maxSample;
+	uint64_t	regions;
+	int16_t		inRegion;
+	uint32_t	regionSegment;
+	uint64_t	regionStart;
+	uint64_t	regionEnd;
+	int16_t		regionMax;
+}DIFF_CHANNEL;
+
+typedef struct
+{
+	int16_t		channel;
+	uint32_t	segment;
+	uint64_t	start;
+	uint64_t	end;
+	int16_t		maxDifference;
+}DIFF_REGION;
+
+/****************************************************************************
+* diffMap
+*
+* Returns a pointer to length bytes of the file from offset, moving the
+* mapped window if they are not all inside it
+****************************************************************************/
+int8_t * diffMap(DIFF_CAPTURE * capture, int64_t offset, int64_t length)
+{
+	int64_t windowOffset;
+	int64_t windowLength;
+
+	if (capture->window != NULL && offset >= capture->windowOffset &&
+		offset + length <= capture->windowOffset + capture->windowLength)
+	{
+		return capture->window + (offset - capture->windowOffset);
+	}
+
+	windowOffset = offset - (offset % capture->granularity);
+	windowLength = min(capture->size - windowOffset, max((int64_t) DIFF_WINDOW, offset - windowOffset + length));
+
+#ifdef _WIN32
+	if (capture->window != NULL)
+	{
+		UnmapViewOfFile(capture->window);
+	}
+
+	capture->window = (int8_t *) MapViewOfFile(capture->mapping, FILE_MAP_READ, (DWORD) (windowOffset >> 32),
+		(DWORD) windowOffset, (SIZE_T) windowLength);
+#else
+	if (capture->window != NULL)
+	{
+		munmap(capture->window, (size_t) capture->windowLength);
+	}
+
+	capture->window = (int8_t *) mmap(NULL, (size_t) windowLength, PROT_READ, MAP_SHARED, capture->fd, (off_t) windowOffset);
+
+	if (capture->window == (int8_t *) MAP_FAILED)
+	{
+		capture->window = NULL;
+	}
+	else
+	{
+		madvise(capture->window, (size_t) windowLength, MADV_SEQUENTIAL);
+	}
+#endif
+
+	if (capture->window == NULL)
+	{
+		printf("diffMap: cannot map %lld bytes of %s\n", windowLength, capture->fileName);
+		return NULL;
+	}
+
+	capture->windowOffset = windowOffset;
+	capture->windowLength = windowLength;
+
+	return capture->window + (offset - windowOffset);
+}
+
+/****************************************************************************
+* diffLine
+*
+* Returns the text line at the current position of a text capture and its
+* length without the line end, or NULL at the end of the file
+****************************************************************************/
+int8_t * diffLine(DIFF_CAPTURE * capture, int64_t * length)
+{
+	int8_t * line;
+	int8_t * end;
+	int64_t available;
+
+	if (capture->position >= capture->size)
+	{
+		return NULL;
+	}
+
+	available = min(capture->size - capture->position, (int64_t) DIFF_MAX_LINE);
+	line = diffMap(capture, capture->position, available);
+
+	if (line == NULL)
+	{
+		return NULL;
+	}
+
+	end = (int8_t *) memchr(line, '\n', (size_t) available);
+	*length = end != NULL ? end - line : available;
+
+	return line;
+}
+
+/****************************************************************************
+* diffDecodeText
+*
+* Decodes the ADC counts of the lines of a text capture. Each "ChX  count"
+* on a line is one sample of channel X; "Capture" and "Event" lines start a
+* new segment, which is always decoded into a block of its own.
+****************************************************************************/
+uint32_t diffDecodeText(DIFF_CAPTURE * capture)
+{
+	int8_t * line;
+	int64_t length;
+	int64_t i;
+	int32_t value;
+	int16_t negative;
+	int16_t ch;
+	int16_t found;
+	uint32_t count = 0;
+
+	while (count < DIFF_BLOCK && (line = diffLine(capture, &length)) != NULL)
+	{
+		if ((length >= 8 && strncmp((char *) line, "Capture ", 8) == 0) ||
+			(length >= 6 && strncmp((char *) line, "Event ", 6) == 0))
+		{
+			if (count > 0)
+			{
+				break;		// The next block starts the new segment
+			}
+
+			if (capture->seenData)
+			{
+				capture->segment++;
+				capture->blockStart = 0;
+				capture->seenData = FALSE;
+			}
+
+			capture->position += length + 1;
+			continue;
+		}
+
+		found = FALSE;
+
+		for (i = 0; i + 3 < length; i++)
+		{
+			if (line[i] != 'C' || line[i + 1] != 'h' || line[i + 2] < 'A' || line[i + 2] >= 'A' + PS5000A_MAX_CHANNELS || line[i + 3] != ' ')
+			{
+				continue;
+			}
+
+			ch = line[i + 2] - 'A';
+
+			for (i += 3; i < length && line[i] == ' '; i++)
+			{
+			}
+
+			negative = i < length && line[i] == '-';
+
+			if (i < length && (line[i] == '-' || line[i] == '+'))
+			{
+				i++;
+			}
+
+			if (i >= length || line[i] < '0' || line[i] > '9')
+			{
+				continue;
+			}
+
+			for (value = 0; i < length && line[i] >= '0' && line[i] <= '9'; i++)
+			{
+				value = value * 10 + (line[i] - '0');
+			}
+
+			if (capture->samples[ch] != NULL)
+			{
+				capture->samples[ch][count] = (int16_t) (negative ? -value : value);
+			}
+
+			capture->channelMask |= 1 << ch;
+			found = TRUE;
+		}
+
+		capture->position += length + 1;
+
+		if (found)
+		{
+			capture->seenData = TRUE;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/****************************************************************************
+* diffDecodeRaw
+*
+* Splits the frames of a raw stream file into channels
+****************************************************************************/
+uint32_t diffDecodeRaw(DIFF_CAPTURE * capture)
+{
+	int8_t * frame;
+	int16_t * source;
+	int16_t c;
+	uint32_t i;
+	uint32_t n;
+	uint32_t count = 0;
+	uint32_t frameBytes = capture->channels * sizeof(int16_t);
+
+	while (count < DIFF_BLOCK)
+	{
+		if (capture->frameOffset == capture->frameLength)
+		{
+			capture->frameStart = capture->position;
+			capture->frameLength = (uint32_t) min((int64_t) capture->frameSamples, (capture->size - capture->position) / frameBytes);
+			capture->frameOffset = 0;
+
+			if (capture->frameLength == 0)
+			{
+				capture->position = capture->size;
+				break;
+			}
+		}
+
+		n = min(DIFF_BLOCK - count, capture->frameLength - capture->frameOffset);
+		frame = diffMap(capture, capture->frameStart, (int64_t) capture->frameLength * frameBytes);
+
+		if (frame == NULL)
+		{
+			capture->position = capture->size;
+			break;
+		}
+
+		for (c = 0; c < capture->channels; c++)
+		{
+			int16_t * destination = capture->samples[capture->frameChannel[c]];
+
+			if (destination == NULL)
+			{
+				continue;
+			}
+
+			if (capture->format == RAW_PLANAR)
+			{
+				memcpy(destination + count, frame + ((size_t) c * capture->frameLength + capture->frameOffset) * sizeof(int16_t), n * sizeof(int16_t));
+			}
+			else
+			{
+				source = ((int16_t *) frame) + (size_t) capture->frameOffset * capture->channels + c;
+
+				for (i = 0; i < n; i++)
+				{
+					destination[count + i] = source[(size_t) i * capture->channels];
+				}
+			}
+		}
+
+		capture->frameOffset += n;
+		count += n;
+
+		if (capture->frameOffset == capture->frameLength)
+		{
+			capture->position = capture->frameStart + (int64_t) capture->frameLength * frameBytes;
+		}
+	}
+
+	return count;
+}
+
+/****************************************************************************
+* diffFill
+*
+* Decodes the next block of a capture once the current one is used up.
+* Returns the number of samples left in the block, 0 at the end of the file.
+****************************************************************************/
+uint32_t diffFill(DIFF_CAPTURE * capture)
+{
+	if (capture->used < capture->count)
+	{
+		return capture->count - capture->used;
+	}
+
+	capture->blockStart += capture->count;
+	capture->used = 0;
+	capture->count = capture->raw ? diffDecodeRaw(capture) : diffDecodeText(capture);
+
+	return capture->count;
+}
+
+/****************************************************************************
+* diffRewind
+*
+* Returns a capture to its first sample
+****************************************************************************/
+void diffRewind(DIFF_CAPTURE * capture)
+{
+	capture->position = capture->dataStart;
+	capture->frameLength = 0;
+	capture->frameOffset = 0;
+	capture->seenData = FALSE;
+	capture->count = 0;
+	capture->used = 0;
+	capture->segment = 0;
+	capture->blockStart = 0;
+	capture->unmatched = 0;
+}
+
+/****************************************************************************
+* diffSkip
+*
+* Drops the first samples of a capture, used to apply the alignment lag
+****************************************************************************/
+void diffSkip(DIFF_CAPTURE * capture, uint64_t samples)
+{
+	uint32_t n;
+
+	while (samples > 0 && diffFill(capture) > 0)
+	{
+		n = (uint32_t) min((uint64_t) (capture->count - capture->used), samples);
+		capture->used += n;
+		samples -= n;
+	}
+}
+
+/****************************************************************************
+* diffClose
+****************************************************************************/
+void diffClose(DIFF_CAPTURE * capture)
+{
+	int16_t ch;
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		memoryFree(capture->samples[ch]);
+		capture->samples[ch] = NULL;
+	}
+
+#ifdef _WIN32
+	if (capture->window != NULL)
+	{
+		UnmapViewOfFile(capture->window);
+	}
+
+	if (capture->mapping != NULL)
+	{
+		CloseHandle(capture->mapping);
+	}
+
+	if (capture->file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(capture->file);
+	}
+#else
+	if (capture->window != NULL)
+	{
+		munmap(capture->window, (size_t) capture->windowLength);
+	}
+
+	if (capture->fd >= 0)
+	{
+		close(capture->fd);
+	}
+#endif
+
+	capture->window = NULL;
+}
+
+/****************************************************************************
+* diffOpen
+*
+* Maps a capture file and works out its layout and channels. The sample
+* blocks are only allocated for the channels in channelMask.
+****************************************************************************/
+int16_t diffOpen(DIFF_CAPTURE * capture, int8_t * fileName)
+{
+	RAW_HEADER header;
+	int8_t * data;
+	int16_t c;
+	int16_t ch;
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	SYSTEM_INFO systemInfo;
+#else
+	struct stat info;
+#endif
+
+	memset(capture, 0, sizeof(DIFF_CAPTURE));
+	capture->fileName = fileName;
+
+#ifdef _WIN32
+	capture->file = CreateFileA((LPCSTR) fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (capture->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(capture->file, &size) || size.QuadPart == 0 ||
+		(capture->mapping = CreateFileMapping(capture->file, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL)
+	{
+		printf("Cannot open capture %s\n", fileName);
+		diffClose(capture);
+		return FALSE;
+	}
+
+	GetSystemInfo(&systemInfo);
+	capture->size = size.QuadPart;
+	capture->granularity = systemInfo.dwAllocationGranularity;
+#else
+	capture->fd = open((char *) fileName, O_RDONLY);
+
+	if (capture->fd < 0 || fstat(capture->fd, &info) != 0 || info.st_size == 0)
+	{
+		printf("Cannot open capture %s\n", fileName);
+		diffClose(capture);
+		return FALSE;
+	}
+
+	capture->size = info.st_size;
+	capture->granularity = sysconf(_SC_PAGESIZE);
+#endif
+
+	data = diffMap(capture, 0, min(capture->size, (int64_t) sizeof(RAW_HEADER)));
+
+	if (data == NULL)
+	{
+		diffClose(capture);
+		return FALSE;
+	}
+
+	if (capture->size >= (int64_t) sizeof(RAW_HEADER))
+	{
+		memcpy(&header, data, sizeof(RAW_HEADER));
+	}
+	else
+	{
+		memset(&header, 0, sizeof(RAW_HEADER));
+	}
+
+	if (header.magic == RAW_HEADER_MAGIC)
+	{
+		if (header.channels == 0 || header.channels > PS5000A_MAX_CHANNELS || header.frameSamples == 0 ||
+			(header.format != RAW_INTERLEAVED && header.format != RAW_PLANAR))
+		{
+			printf("%s has an invalid raw header\n", fileName);
+			diffClose(capture);
+			return FALSE;
+		}
+
+		capture->raw = TRUE;
+		capture->format = header.format;
+		capture->channels = header.channels;
+		capture->channelMask = header.channelMask;
+		capture->frameSamples = header.frameSamples;
+		capture->maxADCValue = header.maxADCValue;
+		capture->dataStart = header.headerBytes;
+
+		for (ch = 0, c = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+		{
+			if (header.channelMask & (1 << ch))
+			{
+				capture->frameChannel[c] = ch;
+				capture->rangeMv[ch] = header.rangeMv[c];
+				c++;
+			}
+		}
+	}
+	else
+	{
+		// Text capture: find the channels from the first line of samples
+		while (capture->channelMask == 0 && capture->position < capture->size)
+		{
+			diffFill(capture);
+		}
+	}
+
+	diffRewind(capture);
+
+	if (capture->channelMask == 0)
+	{
+		printf("%s holds no samples\n", fileName);
+		diffClose(capture);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/****************************************************************************
+* diffAllocate
+*
+* Allocates the sample blocks of the channels that are compared
+****************************************************************************/
+int16_t diffAllocate(DIFF_CAPTURE * capture, uint16_t channelMask)
+{
+	int16_t ch;
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		if (channelMask & (1 << ch))
+		{
+			capture->samples[ch] = (int16_t *) memoryAlloc(MEMORY_APPLICATION, DIFF_BLOCK, sizeof(int16_t));
+
+			if (capture->samples[ch] == NULL)
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/****************************************************************************
+* diffSamples
+*
+* Compares count samples of one channel. Adds the sum of A - B and of its
+* square to sum and sumOfSquares, returns the largest |A - B| and sets bit i
+* of outside[i / 16] for every sample outside the tolerance. Differences
+* saturate at the limits of int16_t.
+****************************************************************************/
+int16_t diffSamples(const int16_t * a, const int16_t * b, uint32_t count, int16_t tolerance,
+	uint16_t * outside, int64_t * sum, int64_t * sumOfSquares)
+{
+	uint32_t i = 0;
+	int32_t difference;
+	int32_t magnitude;
+	int32_t maxDifference = 0;
+	int64_t blockSum = 0;
+	int64_t blockSquares = 0;
+#ifdef HAVE_SSE2
+	int32_t lanes32[4];
+	int64_t lanes64[2];
+	int16_t lanes16[8];
+	int16_t lane;
+	__m128i ones = _mm_set1_epi16(1);
+	__m128i zero = _mm_setzero_si128();
+	__m128i limit = _mm_set1_epi16(tolerance);
+	__m128i sums = _mm_setzero_si128();
+	__m128i squares = _mm_setzero_si128();
+	__m128i largest = _mm_setzero_si128();
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i *) (a + i));
+		__m128i b0 = _mm_loadu_si128((const __m128i *) (b + i));
+		__m128i a1 = _mm_loadu_si128((const __m128i *) (a + i + 8));
+		__m128i b1 = _mm_loadu_si128((const __m128i *) (b + i + 8));
+		__m128i d0 = _mm_subs_epi16(a0, b0);
+		__m128i d1 = _mm_subs_epi16(a1, b1);
+		__m128i m0 = _mm_max_epi16(d0, _mm_subs_epi16(b0, a0));
+		__m128i m1 = _mm_max_epi16(d1, _mm_subs_epi16(b1, a1));
+		__m128i s0 = _mm_madd_epi16(d0, d0);
+		__m128i s1 = _mm_madd_epi16(d1, d1);
+
+		// Pairs of squares fit in int32_t, their running total needs int64_t
+		sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(d0, ones), _mm_madd_epi16(d1, ones)));
+		squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(s0, zero));
+		squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(s0, zero));
+		squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(s1, zero));
+		squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(s1, zero));
+		largest = _mm_max_epi16(largest, _mm_max_epi16(m0, m1));
+
+		outside[i / 16] = (uint16_t) _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(m0, limit), _mm_cmpgt_epi16(m1, limit)));
+	}
+
+	_mm_storeu_si128((__m128i *) lanes32, sums);
+	_mm_storeu_si128((__m128i *) lanes64, squares);
+	_mm_storeu_si128((__m128i *) lanes16, largest);
+
+	blockSum = (int64_t) lanes32[0] + lanes32[1] + lanes32[2] + lanes32[3];
+	blockSquares = lanes64[0] + lanes64[1];
+
+	for (lane = 0; lane < 8; lane++)
+	{
+		maxDifference = max(maxDifference, lanes16[lane]);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		if (i % 16 == 0)
+		{
+			outside[i / 16] = 0;
+		}
+
+		difference = max(-32768, min(32767, (int32_t) a[i] - b[i]));
+		magnitude = min(32767, abs(difference));
+
+		blockSum += difference;
+		blockSquares += (int64_t) difference * difference;
+		maxDifference = max(maxDifference, magnitude);
+
+		if (magnitude > tolerance)
+		{
+			outside[i / 16] |= (uint16_t) (1 << (i % 16));
+		}
+	}
+
+	*sum += blockSum;
+	*sumOfSquares += blockSquares;
+
+	return (int16_t) maxDifference;
+}
+
+/****************************************************************************
+* diffCloseRegion
+*
+* Reports the region a channel is in, if any
+****************************************************************************/
+void diffCloseRegion(DIFF_CHANNEL * channel, int16_t ch, FILE * fp, DIFF_REGION * regions, uint32_t * nRegions)
+{
+	if (!channel->inRegion)
+	{
+		return;
+	}
+
+	if (fp != NULL)
+	{
+		fprintf(fp, "%c  %8lu  %12llu  %12llu  %9llu  %6d\n", 'A' + ch, channel->regionSegment, channel->regionStart,
+			channel->regionEnd, channel->regionEnd - channel->regionStart + 1, channel->regionMax);
+	}
+
+	if (*nRegions < DIFF_REPORT_REGIONS)
+	{
+		regions[*nRegions].channel = ch;
+		regions[*nRegions].segment = channel->regionSegment;
+		regions[*nRegions].start = channel->regionStart;
+		regions[*nRegions].end = channel->regionEnd;
+		regions[*nRegions].maxDifference = channel->regionMax;
+		(*nRegions)++;
+	}
+
+	channel->regions++;
+	channel->inRegion = FALSE;
+}
+
+/****************************************************************************
+* diffRegions
+*
+* Extends or starts regions for the samples flagged in outside and returns
+* how many there are. Sample numbers are those of the first capture within
+* its segment.
+****************************************************************************/
+uint32_t diffRegions(DIFF_CHANNEL * channel, int16_t ch, const int16_t * a, const int16_t * b, const uint16_t * outside,
+	uint32_t count, uint32_t segment, uint64_t firstSample, FILE * fp, DIFF_REGION * regions, uint32_t * nRegions)
+{
+	uint32_t word;
+	uint32_t bits;
+	uint32_t i;
+	uint32_t flagged = 0;
+	uint64_t sample;
+	int16_t magnitude;
+
+	for (word = 0; word < (count + 15) / 16; word++)
+	{
+		for (bits = outside[word]; bits != 0; bits &= bits - 1)
+		{
+			for (i = 0; !(bits & (1 << i)); i++)
+			{
+			}
+
+			i += word * 16;
+			sample = firstSample + i;
+			magnitude = (int16_t) min(32767, abs((int32_t) a[i] - b[i]));
+
+			if (!channel->inRegion || channel->regionSegment != segment || sample - channel->regionEnd > DIFF_MERGE_GAP)
+			{
+				diffCloseRegion(channel, ch, fp, regions, nRegions);
+
+				channel->inRegion = TRUE;
+				channel->regionSegment = segment;
+				channel->regionStart = sample;
+				channel->regionMax = 0;
+			}
+
+			channel->regionEnd = sample;
+			channel->regionMax = max(channel->regionMax, magnitude);
+			flagged++;
+		}
+	}
+
+	return flagged;
+}
+
+/****************************************************************************
+* diffCorrelate
+*
+* Finds the lag of the second capture against the first at which the first
+* DIFF_CORRELATION_SAMPLES of one channel correlate best. A positive lag
+* means the second capture is late. Returns the correlation coefficient.
+****************************************************************************/
+double diffCorrelate(DIFF_CAPTURE * first, DIFF_CAPTURE * second, int16_t ch, int32_t maxLag, int32_t * bestLag)
+{
+	int16_t * x;
+	int16_t * y;
+	double * xEnergy;
+	double * yEnergy;
+	double meanX = 0.0;
+	double meanY = 0.0;
+	double best = -2.0;
+	double energy;
+	double r;
+	int64_t dot;
+	int32_t lag;
+	int32_t n;
+	int32_t i;
+	int32_t overlap;
+
+	diffFill(first);
+	diffFill(second);
+
+	n = (int32_t) min(first->count, second->count);
+	n = min(n, DIFF_CORRELATION_SAMPLES);
+	maxLag = min(maxLag, n / 2);
+	*bestLag = 0;
+
+	if (n < 16)
+	{
+		return 0.0;
+	}
+
+	x = (int16_t *) memoryAlloc(MEMORY_APPLICATION, n, sizeof(int16_t));
+	y = (int16_t *) memoryAlloc(MEMORY_APPLICATION, n, sizeof(int16_t));
+	xEnergy = (double *) memoryAlloc(MEMORY_APPLICATION, n + 1, sizeof(double));
+	yEnergy = (double *) memoryAlloc(MEMORY_APPLICATION, n + 1, sizeof(double));
+
+	if (x == NULL || y == NULL || xEnergy == NULL || yEnergy == NULL)
+	{
+		memoryFree(x);
+		memoryFree(y);
+		memoryFree(xEnergy);
+		memoryFree(yEnergy);
+		return 0.0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		meanX += first->samples[ch][i];
+		meanY += second->samples[ch][i];
+	}
+
+	meanX /= n;
+	meanY /= n;
+	xEnergy[0] = yEnergy[0] = 0.0;
+
+	// Remove the offsets so that they do not dominate the correlation
+	for (i = 0; i < n; i++)
+	{
+		x[i] = (int16_t) max(-32767.0, min(32767.0, first->samples[ch][i] - meanX));
+		y[i] = (int16_t) max(-32767.0, min(32767.0, second->samples[ch][i] - meanY));
+		xEnergy[i + 1] = xEnergy[i] + (double) x[i] * x[i];
+		yEnergy[i + 1] = yEnergy[i] + (double) y[i] * y[i];
+	}
+
+	for (lag = -maxLag; lag <= maxLag; lag++)
+	{
+		const int16_t * p = lag >= 0 ? x : x - lag;
+		const int16_t * q = lag >= 0 ? y + lag : y;
+
+		overlap = n - abs(lag);
+		dot = 0;
+		i = 0;
+
+#ifdef HAVE_SSE2
+		{
+			int64_t lanes[2];
+			__m128i total = _mm_setzero_si128();
+
+			for (; i + 8 <= overlap; i += 8)
+			{
+				__m128i product = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (p + i)), _mm_loadu_si128((const __m128i *) (q + i)));
+				__m128i sign = _mm_srai_epi32(product, 31);
+
+				total = _mm_add_epi64(total, _mm_unpacklo_epi32(product, sign));
+				total = _mm_add_epi64(total, _mm_unpackhi_epi32(product, sign));
+			}
+
+			_mm_storeu_si128((__m128i *) lanes, total);
+			dot = lanes[0] + lanes[1];
+		}
+#endif
+
+		for (; i < overlap; i++)
+		{
+			dot += (int32_t) p[i] * q[i];
+		}
+
+		energy = (lag >= 0 ? xEnergy[overlap] : xEnergy[n] - xEnergy[-lag]) *
+			(lag >= 0 ? yEnergy[n] - yEnergy[lag] : yEnergy[overlap]);
+		r = energy > 0.0 ? dot / sqrt(energy) : 0.0;
+
+		if (r > best)
+		{
+			best = r;
+			*bestLag = lag;
+		}
+	}
+
+	memoryFree(x);
+	memoryFree(y);
+	memoryFree(xEnergy);
+	memoryFree(yEnergy);
+
+	return best;
+}
+
+/****************************************************************************
+* compareCaptures
+*
+* Asks for two capture files and the tolerance of each channel, compares
+* them and writes every differing region and a summary to DIFF_REPORT_FILE
+****************************************************************************/
+void compareCaptures(UNIT * unit)
+{
+	int8_t fileNames[2][CATALOGUE_FILE_NAME_LENGTH];
+	int8_t answer[8];
+	int16_t ch;
+	int16_t i;
+	int16_t byCorrelation;
+	int16_t reference = -1;
+	int32_t tolerance;
+	int32_t maxLag = DIFF_MAX_LAG;
+	int32_t lag = 0;
+	uint32_t n;
+	uint32_t nRegions = 0;
+	uint64_t totalCompared = 0;
+	uint16_t channelMask;
+	uint16_t * outside;
+	int64_t startTime;
+	int64_t elapsedUs;
+	int64_t squares;
+	double correlation = 0.0;
+	double bytes;
+	DIFF_CAPTURE captures[2];
+	DIFF_CHANNEL channels[PS5000A_MAX_CHANNELS];
+	DIFF_REGION regions[DIFF_REPORT_REGIONS];
+	FILE * fp = NULL;
+
+	for (i = 0; i < 2; i++)
+	{
+		printf("%s capture file: ", i == 0 ? "Reference" : "Compared");
+		fflush(stdin);
+		scanf_s("%79s", fileNames[i], (unsigned) sizeof(fileNames[i]));
+	}
+
+	if (!diffOpen(&captures[0], fileNames[0]))
+	{
+		return;
+	}
+
+	if (!diffOpen(&captures[1], fileNames[1]))
+	{
+		diffClose(&captures[0]);
+		return;
+	}
+
+	channelMask = captures[0].channelMask & captures[1].channelMask;
+
+	if (channelMask == 0)
+	{
+		printf("The captures have no channels in common\n");
+		diffClose(&captures[0]);
+		diffClose(&captures[1]);
+		return;
+	}
+
+	outside = (uint16_t *) memoryAlloc(MEMORY_APPLICATION, DIFF_BLOCK / 16, sizeof(uint16_t));
+
+	if (outside == NULL || !diffAllocate(&captures[0], channelMask) || !diffAllocate(&captures[1], channelMask))
+	{
+		printf("Not enough memory to compare the captures\n");
+		memoryFree(outside);
+		diffClose(&captures[0]);
+		diffClose(&captures[1]);
+		return;
+	}
+
+	memset(channels, 0, sizeof(channels));
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		if (!(channelMask & (1 << ch)))
+		{
+			continue;
+		}
+
+		if (reference < 0)
+		{
+			reference = ch;
+		}
+
+		printf("Tolerance for channel %c in ADC counts", 'A' + ch);
+
+		if (captures[0].maxADCValue > 0)
+		{
+			printf(" (%d counts = %d mV)", captures[0].maxADCValue, captures[0].rangeMv[ch]);
+		}
+
+		printf(": ");
+		tolerance = 0;
+		scanf_s("%d", &tolerance);
+		channels[ch].tolerance = (int16_t) max(0, min(32767, tolerance));
+	}
+
+	printf("Align at the trigger (T) or by cross-correlation (C)? ");
+	fflush(stdin);
+	scanf_s("%7s", answer, (unsigned) sizeof(answer));
+	byCorrelation = toupper(answer[0]) == 'C';
+
+	startTime = timeNowUs();
+
+	if (byCorrelation)
+	{
+		correlation = diffCorrelate(&captures[0], &captures[1], reference, maxLag, &lag);
+		diffRewind(&captures[0]);
+		diffRewind(&captures[1]);
+		diffSkip(&captures[lag >= 0 ? 1 : 0], abs(lag));
+
+		printf("\nChannel %c correlates best (r = %.4f) with the compared capture %d samples %s\n", 'A' + reference, correlation,
+			abs(lag), lag >= 0 ? "late" : "early");
+	}
+
+	fopen_s(&fp, DIFF_REPORT_FILE, "w");
+
+	if (fp != NULL)
+	{
+		fprintf(fp, "Reference %s, compared %s, ", fileNames[0], fileNames[1]);
+
+		if (byCorrelation)
+		{
+			fprintf(fp, "aligned by cross-correlation of channel %c: lag %d samples, r = %.4f\n\n", 'A' + reference, lag, correlation);
+		}
+		else
+		{
+			fprintf(fp, "aligned at the trigger\n\n");
+		}
+
+		fprintf(fp, "Ch   Segment   First sample   Last sample    Samples  Max |A-B|\n");
+	}
+
+	while (TRUE)
+	{
+		diffFill(&captures[0]);
+		diffFill(&captures[1]);
+
+		if (captures[0].used == captures[0].count || captures[1].used == captures[1].count)
+		{
+			break;
+		}
+
+		// A segment that is longer in one capture: skip the rest of it
+		if (captures[0].segment != captures[1].segment)
+		{
+			i = captures[0].segment < captures[1].segment ? 0 : 1;
+			captures[i].unmatched += captures[i].count - captures[i].used;
+			captures[i].used = captures[i].count;
+			continue;
+		}
+
+		n = min(captures[0].count - captures[0].used, captures[1].count - captures[1].used);
+
+		for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+		{
+			const int16_t * a;
+			const int16_t * b;
+			int16_t largest;
+			uint32_t j;
+			uint64_t firstSample = captures[0].blockStart + captures[0].used;
+
+			if (!(channelMask & (1 << ch)))
+			{
+				continue;
+			}
+
+			a = captures[0].samples[ch] + captures[0].used;
+			b = captures[1].samples[ch] + captures[1].used;
+			squares = 0;
+			largest = diffSamples(a, b, n, channels[ch].tolerance, outside, &channels[ch].sum, &squares);
+			channels[ch].sumOfSquares += (double) squares;
+			channels[ch].compared += n;
+
+			if (largest > channels[ch].maxDifference || channels[ch].compared == n)
+			{
+				for (j = 0; j < n && min(32767, abs((int32_t) a[j] - b[j])) != largest; j++)
+				{
+				}
+
+				channels[ch].maxDifference = largest;
+				channels[ch].maxSegment = captures[0].segment;
+				channels[ch].maxSample = firstSample + j;
+			}
+
+			channels[ch].outside += diffRegions(&channels[ch], ch, a, b, outside, n, captures[0].segment, firstSample, fp, regions, &nRegions);
+		}
+
+		captures[0].used += n;
+		captures[1].used += n;
+		totalCompared += n;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		do
+		{
+			captures[i].unmatched += captures[i].count - captures[i].used;
+			captures[i].used = captures[i].count;
+		}
+		while (diffFill(&captures[i]) > 0);
+	}
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		diffCloseRegion(&channels[ch], ch, fp, regions, &nRegions);
+	}
+
+	elapsedUs = max(timeNowUs() - startTime, 1);
+	bytes = (double) captures[0].size + captures[1].size;
+
+	printf("\n%llu samples per channel compared in %.2f s (%.1f MB/s)", totalCompared, elapsedUs / 1e6,
+		bytes / (1024.0 * 1024.0) / (elapsedUs / 1e6));
+
+	if (captures[0].segment > 0 || captures[1].segment > 0)
+	{
+		printf(", %lu and %lu segments", captures[0].segment + 1, captures[1].segment + 1);
+	}
+
+	printf("\n");
+
+	if (captures[0].unmatched > 0 || captures[1].unmatched > 0)
+	{
+		printf("%llu reference and %llu compared samples had no counterpart\n", captures[0].unmatched, captures[1].unmatched);
+	}
+
+	if (nRegions > 0)
+	{
+		printf("\nCh   Segment   First sample   Last sample  Max |A-B|\n");
+
+		for (i = 0; i < (int16_t) nRegions; i++)
+		{
+			printf("%c  %8lu  %12llu  %12llu  %9d\n", 'A' + regions[i].channel, regions[i].segment, regions[i].start,
+				regions[i].end, regions[i].maxDifference);
+		}
+	}
+
+	if (fp != NULL)
+	{
+		fprintf(fp, "\n%llu samples per channel compared, %llu reference and %llu compared samples had no counterpart\n\n%s\n",
+			totalCompared, captures[0].unmatched, captures[1].unmatched, DIFF_SUMMARY_HEADING);
+	}
+
+	printf("\n%s\n", DIFF_SUMMARY_HEADING);
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		double mean;
+		double rms;
+		int8_t line[160];
+
+		if (!(channelMask & (1 << ch)) || channels[ch].compared == 0)
+		{
+			continue;
+		}
+
+		mean = (double) channels[ch].sum / channels[ch].compared;
+		rms = sqrt(channels[ch].sumOfSquares / channels[ch].compared);
+
+		snprintf((char *) line, sizeof(line), "%c   %9d  %8llu  %8.4f  %7llu  %9.2f  %9.2f  %9d  %lu/%llu", 'A' + ch, channels[ch].tolerance,
+			channels[ch].outside, 100.0 * channels[ch].outside / channels[ch].compared, channels[ch].regions, mean, rms,
+			channels[ch].maxDifference, channels[ch].maxSegment, channels[ch].maxSample);
+
+		printf("%s", line);
+
+		if (captures[0].maxADCValue > 0)
+		{
+			printf("  (%.1f mV)", (double) channels[ch].maxDifference * captures[0].rangeMv[ch] / captures[0].maxADCValue);
+		}
+
+		printf("\n");
+
+		if (fp != NULL)
+		{
+			fprintf(fp, "%s\n", line);
+		}
+	}
+
+	if (fp != NULL)
+	{
+		fclose(fp);
+		printf("\nAll regions and the summary written to %s\n", DIFF_REPORT_FILE);
+	}
+
+	memoryFree(outside);
+	diffClose(&captures[0]);
+	diffClose(&captures[1]);
+}
+
+/****************************************************************************
+* Timeline join
+*
+* Lines a stored scope capture up with readings from the slow loggers on
+* the same computer (usbtc08_adaptive.csv from usbtc08Con, usbpt104_data.csv
+* from usbpt104Con, adaptive.csv from picohrdlCon, or any CSV file whose
+* first column is the host time in ms since the epoch). The capture's
+* samples are placed on the host timeline from the start time in the
+* streaming file's header, or the catalogue's start time to the second for
+* other captures. A file name may be followed by @ and a correction in ms
+* that is added to its host times.
+*
+* Two views can be written to JOIN_FILE for a window of the capture:
+*
+*   H/I - one row per scope sample, with each logger value held from its
+*         last reading or interpolated between the readings either side
+*   A   - one row per reading of the first logger file, with the minimum,
+*         mean and maximum of the scope samples up to its next reading and
+*         the values of the other files held at its time
+*
+* Nothing is prepared in advance. The capture is decoded through the
+* capture diff's mapped window only up to the end of the window, and each
+* logger file is read forward just far enough to have the readings either
+* side of the current time, so a view costs one pass over the data it
+* covers. Scope values are in nominal mV.
+****************************************************************************/
+#define JOIN_MAX_SOURCES		4					// Logger files joined with one capture
+#define JOIN_MAX_COLUMNS		16					// Values after the host time in a logger file
+#define JOIN_MAX_NAME			32
+#define JOIN_MAX_LINE			1024
+#define JOIN_HEADER_LINES		8					// Searched for the host start time of a capture
+#define JOIN_HOST_START			"Host start time (ms since the epoch):"
+#define JOIN_FILE				"join.csv"
+
+typedef enum
+{
+	JOIN_HOLD,
+	JOIN_INTERPOLATE,
+	JOIN_AGGREGATE
+} JOIN_MODE;
+
+typedef struct
+{
+	int64_t		timeNs;								// From the start of the capture
+	double		values[JOIN_MAX_COLUMNS];
+}JOIN_ROW;
+
+typedef struct
+{
+	int8_t		fileName[CATALOGUE_FILE_NAME_LENGTH];
+	FILE *		fp;
+	double		offsetMs;
+	int16_t		columns;
+	int8_t		names[JOIN_MAX_COLUMNS][JOIN_MAX_NAME];
+	JOIN_ROW	rows[2];							// The last reading at or before the current time and the one after it
+	int16_t		valid[2];
+	uint64_t	rowIndex;							// Of rows[0]
+	uint64_t	rowsRead;
+}JOIN_SOURCE;
+
+typedef struct
+{
+	int16_t		minValue;
+	int16_t		maxValue;
+	int64_t		sum;
+	uint32_t	count;
+}JOIN_AGGREGATE_CHANNEL;
+
+/****************************************************************************
+* joinReadRow
+*
+* Reads the next reading of a logger file into a row. Empty fields and
+* anything that is not a number are NaN.
+****************************************************************************/
+int16_t joinReadRow(JOIN_SOURCE * source, int64_t captureStartMs, JOIN_ROW * row)
+{
+	char line[JOIN_MAX_LINE];
+	char * field;
+	char * end;
+	double hostMs;
+	int16_t column;
+
+	while (fgets(line, sizeof(line), source->fp) != NULL)
+	{
+		hostMs = strtod(line, &end);
+
+		if (end == line || (*end != ',' && *end != '\n' && *end != '\r' && *end != '\0'))
+		{
+			continue;
+		}
+
+		row->timeNs = (int64_t) floor((hostMs + source->offsetMs - captureStartMs) * 1e6 + 0.5);
+
+		for (column = 0, field = end; column < source->columns; column++)
+		{
+			row->values[column] = NAN;
+
+			if (*field != ',')
+			{
+				continue;
+			}
+
+			field++;
+			row->values[column] = strtod(field, &end);
+
+			if (end == field)
+			{
+				row->values[column] = NAN;
+			}
+
+			field = end + strcspn(end, ",\r\n");
+		}
+
+		source->rowsRead++;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/****************************************************************************
+* joinOpenSource
+*
+* Opens a logger file given as name or name@correction, takes the names of
+* its columns from the header and reads its first two readings
+****************************************************************************/
+int16_t joinOpenSource(JOIN_SOURCE * source, int8_t * spec, int64_t captureStartMs)
+{
+	char line[JOIN_MAX_LINE];
+	char * at;
+	char * name;
+	size_t length;
+
+	memset(source, 0, sizeof(JOIN_SOURCE));
+	strncpy((char *) source->fileName, (char *) spec, sizeof(source->fileName) - 1);
+
+	if ((at = strchr((char *) source->fileName, '@')) != NULL)
+	{
+		*at = '\0';
+		source->offsetMs = atof(at + 1);
+	}
+
+	fopen_s(&source->fp, source->fileName, "r");
+
+	if (source->fp == NULL || fgets(line, sizeof(line), source->fp) == NULL)
+	{
+		printf("Cannot read %s\n", source->fileName);
+
+		if (source->fp != NULL)
+		{
+			fclose(source->fp);
+			source->fp = NULL;
+		}
+
+		return FALSE;
+	}
+
+	// The first column is the host time, the others are values
+	line[strcspn(line, "\r\n")] = '\0';
+	name = strchr(line, ',');
+
+	while (name != NULL && source->columns < JOIN_MAX_COLUMNS)
+	{
+		name++;
+		length = strcspn(name, ",");
+		length = min(length, JOIN_MAX_NAME - 1);
+		memcpy(source->names[source->columns], name, length);
+		source->names[source->columns][length] = '\0';
+		source->columns++;
+		name = strchr(name, ',');
+	}
+
+	source->valid[0] = joinReadRow(source, captureStartMs, &source->rows[0]);
+	source->valid[1] = source->valid[0] && joinReadRow(source, captureStartMs, &source->rows[1]);
+
+	return TRUE;
+}
+
+/****************************************************************************
+* joinAdvance
+*
+* Reads forward until rows[0] is the last reading at or before timeNs.
+* Returns TRUE if that moved rows[0] on.
+****************************************************************************/
+int16_t joinAdvance(JOIN_SOURCE * source, int64_t captureStartMs, int64_t timeNs)
+{
+	int16_t moved = FALSE;
+
+	while (source->valid[1] && source->rows[1].timeNs <= timeNs)
+	{
+		source->rows[0] = source->rows[1];
+		source->valid[1] = joinReadRow(source, captureStartMs, &source->rows[1]);
+		source->rowIndex++;
+		moved = TRUE;
+	}
+
+	return moved;
+}
+
+/****************************************************************************
+* joinValue
+*
+* A logger value at timeNs, NaN before its first reading
+****************************************************************************/
+double joinValue(JOIN_SOURCE * source, int16_t column, int64_t timeNs, JOIN_MODE mode)
+{
+	JOIN_ROW * before = &source->rows[0];
+	JOIN_ROW * after = &source->rows[1];
+
+	if (!source->valid[0] || before->timeNs > timeNs)
+	{
+		return NAN;
+	}
+
+	if (mode == JOIN_INTERPOLATE && source->valid[1] && after->timeNs > before->timeNs)
+	{
+		return before->values[column] + (after->values[column] - before->values[column]) *
+			(double) (timeNs - before->timeNs) / (double) (after->timeNs - before->timeNs);
+	}
+
+	return before->values[column];
+}
+
+/****************************************************************************
+* joinPutValue
+*
+* Writes a value to a CSV row, leaving the field empty for NaN
+****************************************************************************/
+void joinPutValue(FILE * fp, double value)
+{
+	if (value == value)
+	{
+		fprintf(fp, ",%.10g", value);
+	}
+	else
+	{
+		fputc(',', fp);
+	}
+}
+
+/****************************************************************************
+* joinMv
+*
+* A scope sample in nominal mV at the range it was captured on
+****************************************************************************/
+double joinMv(int16_t raw, CHANNEL_SUMMARY * channel, UNIT * unit)
+{
+	return (double) raw * inputRanges[channel->range] / unit->maxADCValue;
+}
+
+/****************************************************************************
+* joinAggregate
+*
+* Adds a scope sample to the bucket of a channel
+****************************************************************************/
+void joinAggregate(JOIN_AGGREGATE_CHANNEL * aggregate, int16_t value)
+{
+	if (aggregate->count == 0 || value < aggregate->minValue)
+	{
+		aggregate->minValue = value;
+	}
+
+	if (aggregate->count == 0 || value > aggregate->maxValue)
+	{
+		aggregate->maxValue = value;
+	}
+
+	aggregate->sum += value;
+	aggregate->count++;
+}
+
+/****************************************************************************
+* joinWriteBucket
+*
+* Writes a row of the aggregate view: a reading of the first logger file,
+* the scope samples up to its next reading and the other files' values
+* held at its time
+****************************************************************************/
+void joinWriteBucket(FILE * fp, JOIN_SOURCE * sources, int16_t nSources, int64_t captureStartMs, JOIN_ROW * row,
+	JOIN_AGGREGATE_CHANNEL * aggregates, uint16_t channelMask, CHANNEL_SUMMARY * channels, UNIT * unit)
+{
+	int16_t channel;
+	int16_t column;
+	int16_t s;
+
+	fprintf(fp, "%.9f,%.3f", row->timeNs / 1e9, captureStartMs + row->timeNs / 1e6);
+
+	for (column = 0; column < sources[0].columns; column++)
+	{
+		joinPutValue(fp, row->values[column]);
+	}
+
+	for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++)
+	{
+		if (!(channelMask & (1 << channel)))
+		{
+			continue;
+		}
+
+		if (aggregates[channel].count == 0)
+		{
+			fprintf(fp, ",,,");
+			continue;
+		}
+
+		fprintf(fp, ",%.3f,%.3f,%.3f", joinMv(aggregates[channel].minValue, &channels[channel], unit),
+			joinMv(1, &channels[channel], unit) * aggregates[channel].sum / aggregates[channel].count,
+			joinMv(aggregates[channel].maxValue, &channels[channel], unit));
+	}
+
+	for (s = 1; s < nSources; s++)
+	{
+		joinAdvance(&sources[s], captureStartMs, row->timeNs);
+
+		for (column = 0; column < sources[s].columns; column++)
+		{
+			joinPutValue(fp, joinValue(&sources[s], column, row->timeNs, JOIN_HOLD));
+		}
+	}
+
+	fprintf(fp, "\n");
+}
+
+/****************************************************************************
+* joinCaptureStart
+*
+* The host time of the first sample of a capture in ms since the epoch:
+* from the file's header if it has one, otherwise from the catalogue
+****************************************************************************/
+int64_t joinCaptureStart(int8_t * fileName, CATALOGUE_RECORD * record)
+{
+	char line[JOIN_MAX_LINE];
+	int16_t i;
+	long long hostStartMs;
+	FILE * fp = NULL;
+
+	fopen_s(&fp, fileName, "r");
+
+	for (i = 0; fp != NULL && i < JOIN_HEADER_LINES && fgets(line, sizeof(line), fp) != NULL; i++)
+	{
+		if (strncmp(line, JOIN_HOST_START, strlen(JOIN_HOST_START)) == 0 &&
+			sscanf(line + strlen(JOIN_HOST_START), "%lld", &hostStartMs) == 1)
+		{
+			fclose(fp);
+			return (int64_t) hostStartMs;
+		}
+	}
+
+	if (fp != NULL)
+	{
+		fclose(fp);
+	}
+
+	printf("%s has no host start time, using the catalogue's to the second\n", fileName);
+
+	return record->startTime * 1000;
+}
+
+/****************************************************************************
+* joinCaptures
+*
+* Asks for a capture, the logger files, the view and the window and writes
+* the joined view to JOIN_FILE
+****************************************************************************/
+void joinCaptures(UNIT * unit)
+{
+	int8_t fileName[CATALOGUE_FILE_NAME_LENGTH];
+	int8_t spec[CATALOGUE_FILE_NAME_LENGTH];
+	int8_t ch;
+	int16_t channel;
+	int16_t s;
+	int16_t column;
+	int16_t nSources = 0;
+	int16_t inBucket = FALSE;
+	int16_t found = FALSE;
+	int32_t index;
+	uint32_t n;
+	uint64_t sample;
+	uint64_t samplesRead = 0;
+	uint64_t rowsWritten = 0;
+	uint64_t rowsRead = 0;
+	int64_t captureStartMs;
+	int64_t timeNs = 0;
+	int64_t fromNs;
+	int64_t toNs;
+	int64_t startTime;
+	double fromSeconds = 0.0;
+	double toSeconds = 0.0;
+	JOIN_MODE mode;
+	JOIN_SOURCE sources[JOIN_MAX_SOURCES];
+	JOIN_ROW bucketRow;
+	JOIN_AGGREGATE_CHANNEL aggregates[PS5000A_MAX_CHANNELS];
+	CATALOGUE_RECORD record;
+	DIFF_CAPTURE capture;
+	FILE * fp = NULL;
+
+	printf("Scope capture file: ");
+	fflush(stdin);
+	scanf_s("%79s", fileName, (unsigned) sizeof(fileName));
+
+	// The catalogue has the sample interval and the ranges
+	fopen_s(&fp, CATALOGUE_FILE, "rb");
+
+	for (index = 0; fp != NULL && catalogueReadRecord(fp, index, &record); index++)
+	{
+		if (strcmp((char *) record.fileName, (char *) fileName) == 0)
+		{
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (fp != NULL)
+	{
+		fclose(fp);
+		fp = NULL;
+	}
+
+	if (!found || record.sampleIntervalNs <= 0)
+	{
+		printf("%s is not in the capture catalogue\n", fileName);
+		return;
+	}
+
+	captureStartMs = joinCaptureStart(fileName, &record);
+
+	printf("Logger files, each name or name@correction in ms (. when done):\n");
+
+	while (nSources < JOIN_MAX_SOURCES)
+	{
+		scanf_s("%79s", spec, (unsigned) sizeof(spec));
+
+		if (strcmp((char *) spec, ".") == 0)
+		{
+			break;
+		}
+
+		if (joinOpenSource(&sources[nSources], spec, captureStartMs))
+		{
+			nSources++;
+		}
+	}
+
+	if (nSources == 0)
+	{
+		printf("No logger files to join\n");
+		return;
+	}
+
+	printf("H - Hold logger values at each scope sample\n");
+	printf("I - Interpolate logger values at each scope sample\n");
+	printf("A - Aggregate scope samples to the readings of %s\n", sources[0].fileName);
+
+	do
+	{
+		ch = toupper(_getch());
+	}
+	while (ch != 'H' && ch != 'I' && ch != 'A');
+
+	mode = ch == 'H' ? JOIN_HOLD : ch == 'I' ? JOIN_INTERPOLATE : JOIN_AGGREGATE;
+
+	printf("From (s after the start of the capture): ");
+	scanf_s("%lf", &fromSeconds);
+	printf("To (s after the start of the capture, 0 for the end): ");
+	scanf_s("%lf", &toSeconds);
+
+	fromNs = (int64_t) (max(fromSeconds, 0.0) * 1e9);
+	toNs = toSeconds > 0.0 ? (int64_t) (toSeconds * 1e9) : INT64_MAX;
+
+	if (!diffOpen(&capture, fileName))
+	{
+		for (s = 0; s < nSources; s++)
+		{
+			fclose(sources[s].fp);
+		}
+
+		return;
+	}
+
+	fopen_s(&fp, JOIN_FILE, "w");
+
+	if (fp == NULL || !diffAllocate(&capture, capture.channelMask))
+	{
+		printf(fp == NULL ? "Cannot open %s for writing\n" : "Not enough memory to read the capture\n", JOIN_FILE);
+		diffClose(&capture);
+
+		for (s = 0; s < nSources; s++)
+		{
+			fclose(sources[s].fp);
+		}
+
+		if (fp != NULL)
+		{
+			fclose(fp);
+		}
+
+		return;
+	}
+
+	startTime = timeNowUs();
+
+	// Header: time, then the first file's columns in an aggregate view, the scope channels and the other files' columns
+	fprintf(fp, "Time (s),Host time (ms)");
+
+	for (column = 0; column < sources[0].columns && mode == JOIN_AGGREGATE; column++)
+	{
+		fprintf(fp, ",%s %s", sources[0].fileName, sources[0].names[column]);
+	}
+
+	for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++)
+	{
+		if (capture.channelMask & (1 << channel))
+		{
+			fprintf(fp, mode == JOIN_AGGREGATE ? ",Ch%c min (mV),Ch%c mean (mV),Ch%c max (mV)" : ",Ch%c (mV)", 'A' + channel, 'A' + channel, 'A' + channel);
+		}
+	}
+
+	for (s = (mode == JOIN_AGGREGATE); s < nSources; s++)
+	{
+		for (column = 0; column < sources[s].columns; column++)
+		{
+			fprintf(fp, ",%s %s", sources[s].fileName, sources[s].names[column]);
+		}
+	}
+
+	fprintf(fp, "\n");
+
+	sample = (uint64_t) ((fromNs + record.sampleIntervalNs - 1) / record.sampleIntervalNs);
+	diffSkip(&capture, sample);
+
+	while (diffFill(&capture) > 0 && capture.segment == 0)
+	{
+		for (n = capture.used; n < capture.count; n++, sample++)
+		{
+			timeNs = (int64_t) sample * record.sampleIntervalNs;
+
+			if (timeNs > toNs)
+			{
+				break;
+			}
+
+			samplesRead++;
+
+			if (mode != JOIN_AGGREGATE)
+			{
+				fprintf(fp, "%.9f,%.3f", timeNs / 1e9, captureStartMs + timeNs / 1e6);
+
+				for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++)
+				{
+					if (capture.channelMask & (1 << channel))
+					{
+						fprintf(fp, ",%.3f", joinMv(capture.samples[channel][n], &record.channels[channel], unit));
+					}
+				}
+
+				for (s = 0; s < nSources; s++)
+				{
+					joinAdvance(&sources[s], captureStartMs, timeNs);
+
+					for (column = 0; column < sources[s].columns; column++)
+					{
+						joinPutValue(fp, joinValue(&sources[s], column, timeNs, mode));
+					}
+				}
+
+				fprintf(fp, "\n");
+				rowsWritten++;
+				continue;
+			}
+
+			// Aggregate view: a new reading of the first file closes the bucket of the one before
+			if (joinAdvance(&sources[0], captureStartMs, timeNs) || !inBucket)
+			{
+				if (inBucket)
+				{
+					joinWriteBucket(fp, sources, nSources, captureStartMs, &bucketRow, aggregates, capture.channelMask, record.channels, unit);
+					rowsWritten++;
+				}
+
+				inBucket = sources[0].valid[0] && sources[0].rows[0].timeNs <= timeNs;
+				bucketRow = sources[0].rows[0];
+				memset(aggregates, 0, sizeof(aggregates));
+			}
+
+			if (!inBucket)
+			{
+				continue;
+			}
+
+			for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++)
+			{
+				if (capture.channelMask & (1 << channel))
+				{
+					joinAggregate(&aggregates[channel], capture.samples[channel][n]);
+				}
+			}
+		}
+
+		capture.used = n;
+
+		if (timeNs > toNs)
+		{
+			break;
+		}
+	}
+
+	if (inBucket)
+	{
+		joinWriteBucket(fp, sources, nSources, captureStartMs, &bucketRow, aggregates, capture.channelMask, record.channels, unit);
+		rowsWritten++;
+	}
+
+	for (s = 0; s < nSources; s++)
+	{
+		rowsRead += sources[s].rowsRead;
+		fclose(sources[s].fp);
+	}
+
+	fclose(fp);
+	diffClose(&capture);
+
+	printf("\n%llu rows written to %s from %llu scope samples and %llu logger readings in %.1f ms\n",
+		(unsigned long long) rowsWritten, JOIN_FILE, (unsigned long long) samplesRead, (unsigned long long) rowsRead,
+		(timeNowUs() - startTime) / 1000.0);
+}
+
+/****************************************************************************
+* BlockDataHandler
+* - Used by all block data routines
+* - acquires data (user sets trigger mode before calling), displays 10 items
+*   and saves all to a uniquely named block file that is added to the
+*   capture catalogue
+* Input :
+* - unit : the unit to use.
+* - text : the text to display before the display of data slice
+* - offset : the offset into the data buffer to start the display's slice.
+* - etsModeSet : a flag to indicate if ETS mode has been set on the device
+****************************************************************************/
+void blockDataHandler(UNIT * unit, int8_t * text, int32_t offset, int16_t etsModeSet)
+{
+	int16_t retry;
+	int16_t triggerEnabled = 0;
+	int16_t pwqEnabled = 0;
+
+	int16_t * buffers[2 * PS5000A_MAX_CHANNELS];
+
+	float scales[PS5000A_MAX_CHANNELS];
+	float offsets[PS5000A_MAX_CHANNELS];
+
+	int32_t i, j;
+	int32_t timeInterval;
+	int32_t sampleCount = BUFFER_SIZE;
+	int32_t maxSamples;
+	int32_t timeIndisposed;
+
+	uint32_t downSampleRatio = 1;
+
+	int64_t * etsTime = NULL; // Buffer for ETS time data
+	int64_t stage;
+	int64_t writeStartUs;
+	int64_t writeStartBytes;
+
+	int16_t overflow = 0;
+	int16_t allocationFailed = FALSE;
+	
+	PICO_STATUS status;
+	PICO_STATUS powerStatus;
+	
+	PS5000A_RATIO_MODE ratioMode = PS5000A_RATIO_MODE_NONE;
+
+	FILE * fp = NULL;
+
+	CATALOGUE_RECORD record;
+
+	memset(buffers, 0, sizeof(buffers));
+
+	powerStatus = ps5000aCurrentPowerSource(unit->handle);
+	
+	for (i = 0; i < unit->channelCount; i++) 
+	{
+		if (i >= DUAL_SCOPE && unit->channelCount == QUAD_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
+		{
+			// No need to set the channels C and D if Quad channel scope and power supply not connected.
+		}
+		else
+		{
+			if (unit->channelSettings[i].enabled)
+			{
+				buffers[i * 2] = (int16_t*) memoryAlloc(MEMORY_ACQUISITION, sampleCount, sizeof(int16_t));
+				buffers[i * 2 + 1] = (int16_t*) memoryAlloc(MEMORY_ACQUISITION, sampleCount, sizeof(int16_t));
+
+				if (buffers[i * 2] == NULL || buffers[i * 2 + 1] == NULL)
+				{
+					allocationFailed = TRUE;
+				}
+			
+				status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)i, buffers[i * 2], buffers[i * 2 + 1], sampleCount, 0, ratioMode);
+				printf(status ? "blockDataHandler:ps5000aSetDataBuffers(channel %d) ------ 0x%08lx \n":"", i, status);
+			}
+		}
+	}
+
+	// Set up ETS time buffers if ETS Block mode data is being captured
+	if (etsModeSet)
+	{
+		etsTime = (int64_t *) memoryAlloc(MEMORY_ACQUISITION, sampleCount, sizeof (int64_t));
+		allocationFailed |= (etsTime == NULL);
+		status = ps5000aSetEtsTimeBuffer(unit->handle, etsTime, sampleCount);
+	}
+
+	if (allocationFailed)
+	{
+		printf("blockDataHandler: Capture would exceed the memory budget (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+
+		for (i = 0; i < 2 * PS5000A_MAX_CHANNELS; i++)
+		{
+			memoryFree(buffers[i]);
+		}
+
+		memoryFree(etsTime);
+		clearDataBuffers(unit);
+		return;
+	}
+
+
+	/*  Find the maximum number of samples and the time interval (in nanoseconds).
+	 *	If the function returns PICO_OK, the timebase will be used.
+	 */
+	do 
+	{
+		status = ps5000aGetTimebase(unit->handle, timebase, sampleCount, &timeInterval, &maxSamples, 0);
+
+		if (status == PICO_INVALID_NUMBER_CHANNELS_FOR_RESOLUTION)
+		{
+			printf("BlockDataHandler: Error - Invalid number of channels for resolution.\n");
+			return;
+		}
+		else if(status == PICO_OK)
+		{
+			// Do nothing
+		}
+		else
+		{
+			timebase++;
+		}
+	}
+	while(status != PICO_OK);
+
+	if (!etsModeSet)
+	{
+		printf("\nTimebase: %lu  SampleInterval: %ld ns\n", timebase, timeInterval);
+	}
+
+	/* Start it collecting, then wait for completion*/
+	g_ready = FALSE;
+	stage = traceBegin();
+
+	do
+	{
+		retry = 0;
+
+		PROBE2(run_block_arm, sampleCount, timebase);
+		status = ps5000aRunBlock(unit->handle, 0, sampleCount, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+
+		if (status != PICO_OK)
+		{
+			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
+			// PicoScope 524XD devices on non-USB 3.0 port
+			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED || 
+						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE) 
+			{
+				status = changePowerSource(unit->handle, status, unit);
+				retry = 1;
+			}
+			else
+			{
+				printf("BlockDataHandler:ps5000aRunBlock ------ 0x%08lx \n", status);
+				return;
+			}
+		}
+	}
+	while(retry);
+
+	traceEnd("RunBlock", stage, sampleCount);
+
+	status = ps5000aIsTriggerOrPulseWidthQualifierEnabled(unit->handle, &triggerEnabled, &pwqEnabled);
+
+	if (triggerEnabled || pwqEnabled)
+	{
+		printf("Waiting for trigger... Press any key to abort\n");
+	}
+	else
+	{
+		printf("Press any key to abort\n");
+	}
+
+	stage = traceBegin();
+
+	while (!g_ready && !_kbhit())
+	{
+		Sleep(0);
+	}
+
+	traceEnd("Wait for data", stage, 0);
+
+	if (g_ready) 
+	{
+
+		// Can retrieve data using different ratios and ratio modes from driver
+		stage = traceBegin();
+		PROBE2(get_values_start, sampleCount, 1);		// One capture
+		status = ps5000aGetValues(unit->handle, 0, (uint32_t*) &sampleCount, downSampleRatio, ratioMode, 0, &overflow);
+		PROBE2(get_values_end, sampleCount, status);
+		traceEnd("GetValues", stage, sampleCount);
+
+		if (status == PICO_OK)
+		{
+			metricsAddSamples(unit, sampleCount, overflow);
+			metricsAdd(&g_metrics.captures[0], 1);
+		}
+
+		if (status != PICO_OK)
+		{
+			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
+			// PicoScope 524XD devices on non-USB 3.0 port
+			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+			{
+				if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+				{
+					changePowerSource(unit->handle, status, unit);
+				}
+				else
+				{
+					printf("\nPower Source Changed. Data collection aborted.\n");
+				}
+			}
+			else
+			{
+				printf("blockDataHandler:ps5000aGetValues ------ 0x%08lx \n", status);
+			}
+		}
+		else
+		{
+			for (j = 0; j < unit->channelCount; j++)
+			{
+				conversionFactors(unit, j, &scales[j], &offsets[j]);
+			}
+
+			/* Print out the first 10 readings, converting the readings to calibrated units if required */
+			printf("%s\n",text);
+
+			printf("Channels are in (%s):-\n\n", ( scaleVoltages ) ? ("calibrated units") : ("ADC Counts"));
+
+			for (j = 0; j < unit->channelCount; j++) 
+			{
+				if (unit->channelSettings[j].enabled) 
+				{
+					printf("Channel %c: %-3s", 'A' + j, scaleVoltages ? (char *) unit->probe[j].units : "");
+				}
+			}
+			
+			printf("\n\n");
+
+			for (i = offset; i < offset+10; i++) 
+			{
+				for (j = 0; j < unit->channelCount; j++) 
+				{
+					if (unit->channelSettings[j].enabled) 
+					{
+						printf("  %6d     ", scaleVoltages ? 
+							convertSample(buffers[j * 2][i], scales[j], offsets[j])	// If scaleVoltages, print calibrated value
+							: buffers[j * 2][i]);									// else print ADC Count
+					}
+				}
+				
+				printf("\n");
+			}
+
+			sampleCount = min(sampleCount, BUFFER_SIZE);
+
+			catalogueBegin(unit, &record, (int8_t *) (etsModeSet ? "ETS" : "Block"), (int8_t *) (etsModeSet ? "ets" : "block"), blockFile);
+			record.timebase = timebase;
+			record.sampleIntervalNs = timeInterval;
+			record.sampleCount = sampleCount;
+			record.triggerEnabled = triggerEnabled;
+			record.triggerChannel = (int16_t) g_lastTriggerChannel;
+			record.triggerThreshold = g_lastTriggerThreshold;
+
+			fopen_s(&fp, blockFile, "w");
+
+			if (fp != NULL)
+			{
+				if (etsModeSet)
+				{
+					fprintf(fp, "ETS Block Data log\n\n");
+				}
+				else
+				{
+					fprintf(fp, "Block Data log\n\n");
+				}
+				
+				fprintf(fp,"Results shown for each of the %d Channels are......\n",unit->channelCount);
+				fprintf(fp,"Maximum Aggregated value ADC Count & calibrated value, Minimum Aggregated value ADC Count & calibrated value\n\n");
+
+				if (etsModeSet)
+				{
+					fprintf(fp, "Time (fs) ");
+				}
+				else
+				{
+					fprintf(fp, "Time (ns) ");
+				}
+
+				for (i = 0; i < unit->channelCount; i++) 
+				{
+					if (unit->channelSettings[i].enabled) 
+					{
+						fprintf(fp," Ch    Max ADC  Max val  Min ADC  Min val   ");
+					}
+				}
+				fprintf(fp, "\n");
+
+				stage = traceBegin();
+				writeStartUs = timeNowUs();
+				writeStartBytes = _ftelli64(fp);
+
+				for (i = 0; i < sampleCount; i++) 
+				{
+					if (etsModeSet)
+					{
+						fprintf(fp, "%I64d ", etsTime[i]);
+					}
+					else
+					{
+						fprintf(fp, "%I64u ", g_times[0] + (uint64_t)(i * timeInterval));
+					}
+
+					for (j = 0; j < unit->channelCount; j++) 
+					{
+						if (unit->channelSettings[j].enabled) 
+						{
+							fprintf(	fp,
+								"Ch%C  %6d = %+6d%s, %6d = %+6d%s   ",
+								'A' + j,
+								buffers[j * 2][i],
+								convertSample(buffers[j * 2][i], scales[j], offsets[j]),
+								unit->probe[j].units,
+								buffers[j * 2 + 1][i],
+								convertSample(buffers[j * 2 + 1][i], scales[j], offsets[j]),
+								unit->probe[j].units);
+						}
+					}
+
+					fprintf(fp, "\n");
+				}
+
+				fflush(fp);
+				metricsAdd(&g_metrics.writerBytes, _ftelli64(fp) - writeStartBytes);
+				metricsAdd(&g_metrics.writerUs, timeNowUs() - writeStartUs);
+				PROBE1(writer_flush, sampleCount);
+				traceEnd("Write file", stage, sampleCount);
+
+				for (j = 0; j < unit->channelCount; j++)
+				{
+					if (unit->channelSettings[j].enabled)
+					{
+						catalogueUpdate(&record, j, buffers[j * 2], sampleCount);
+					}
+				}
+
+				catalogueCommit(&record, overflow);
+				printf("\nData written to %s\n", blockFile);
+			}
+			else
+			{
+				printf(	"Cannot open the file %s for writing.\n"
+					"Please ensure that you have permission to access the file.\n", blockFile);
+			}
+		} 
+	}
+	else 
+	{
+		printf("Data collection aborted\n");
+		_getch();
+	}
+
+	if ((status = ps5000aStop(unit->handle)) != PICO_OK)
+	{
+		printf("blockDataHandler:ps5000aStop ------ 0x%08lx \n", status);
+	}
+
+	if (fp != NULL)
+	{
+		fclose(fp);
+	}
+	
+	for (i = 0; i < 2 * PS5000A_MAX_CHANNELS; i++) 
+	{
+		memoryFree(buffers[i]);
+	}
+
+	memoryFree(etsTime);
+	
+	clearDataBuffers(unit);
+}
+
+/****************************************************************************
+* streamDataHandler
+* - Used by the two stream data examples - untriggered and triggered
+* Inputs:
+* - unit - the unit to sample on
+* - preTrigger - the number of samples in the pre-trigger phase 
+*					(0 if no trigger has been set)
+***************************************************************************/
+void streamDataHandler(UNIT * unit, uint32_t preTrigger)
+{
+	int32_t i, j;
+	uint32_t sampleCount = 50000; /* make sure overview buffer is large enough */
+	FILE * fp = NULL;
+	int16_t * buffers[2 * PS5000A_MAX_CHANNELS];
+	int16_t * appBuffers[2 * PS5000A_MAX_CHANNELS];
+	int32_t * mvBuffers[2 * PS5000A_MAX_CHANNELS];
+	float scales[PS5000A_MAX_CHANNELS];
+	float offsets[PS5000A_MAX_CHANNELS];
+	int16_t separateConversion = (int16_t) g_trace.enabled;
+	int64_t hostStartMs;
+	PICO_STATUS status;
+	PICO_STATUS powerStatus;
+	uint32_t sampleInterval;
+	int32_t index = 0;
+	int32_t totalSamples;
+	uint32_t postTrigger;
+	int16_t autostop;
+	uint32_t downsampleRatio;
+	uint32_t triggeredAt = 0;
+	PS5000A_TIME_UNITS timeUnits;
+	PS5000A_RATIO_MODE ratioMode;
+	int16_t retry = 0;
+	int16_t powerChange = 0;
+	uint32_t numStreamingValues = 0;
+	int16_t triggerEnabled = 0;
+	int16_t pwqEnabled = 0;
+	int16_t overflowFlags = 0;
+	int16_t enabledChannels = 0;
+	int16_t allocationFailed = FALSE;
+	size_t bytesPerSample;
+	int64_t stage;
+	int64_t writeStartUs;
+	int64_t writeStartBytes = 0;
+	int64_t progressUs = 0;
+	int16_t rawFailed = FALSE;
+	uint32_t alarmsShown = 0;
+
+	BUFFER_INFO bufferInfo;
+	CATALOGUE_RECORD record;
+
+	memset(buffers, 0, sizeof(buffers));
+	memset(appBuffers, 0, sizeof(appBuffers));
+	memset(mvBuffers, 0, sizeof(mvBuffers));
+
+	powerStatus = ps5000aCurrentPowerSource(unit->handle);
+
+	for (i = 0; i < unit->channelCount; i++)
+	{
+		if (unit->channelSettings[i].enabled)
+		{
+			enabledChannels++;
+		}
+	}
+
+	// Each enabled channel needs a max and min buffer for the driver and a copy of each for the application.
+	// While tracing, each copy is also converted in a separate pass so that the conversion can be timed on its own.
+	// Shrink the overview buffer rather than exceed the memory budget.
+	bytesPerSample = (size_t) enabledChannels * (4 * sizeof(int16_t) + (separateConversion ? 2 * sizeof(int32_t) : 0));
+
+	if (bytesPerSample > 0 && (size_t) sampleCount * bytesPerSample > memoryAvailable(MEMORY_APPLICATION))
+	{
+		sampleCount = (uint32_t) (memoryAvailable(MEMORY_APPLICATION) / bytesPerSample);
+
+		if (sampleCount < MIN_STREAMING_BUFFER)
+		{
+			printf("streamDataHandler: Not enough memory within the budget to stream (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+			return;
+		}
+
+		printf("Overview buffer reduced to %lu samples to stay within the memory budget.\n", sampleCount);
+	}
+	
+	for (i = 0; i < unit->channelCount; i++) 
+	{
+		if (i >= DUAL_SCOPE && unit->channelCount == QUAD_SCOPE && powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
+		{
+			// No need to set the channels C and D if Quad channel scope and power supply not connected.
+		}
+		else
+		{
+			if (unit->channelSettings[i].enabled)
+			{
+				buffers[i * 2] = (int16_t*) memoryAlloc(MEMORY_ACQUISITION, sampleCount, sizeof(int16_t));
+				buffers[i * 2 + 1] = (int16_t*) memoryAlloc(MEMORY_ACQUISITION, sampleCount, sizeof(int16_t));
+			
+				status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)i, buffers[i * 2], buffers[i * 2 + 1], sampleCount, 0, PS5000A_RATIO_MODE_NONE);
+
+				appBuffers[i * 2] = (int16_t*) memoryAlloc(MEMORY_APPLICATION, sampleCount, sizeof(int16_t));
+				appBuffers[i * 2 + 1] = (int16_t*) memoryAlloc(MEMORY_APPLICATION, sampleCount, sizeof(int16_t));
+
+				if (separateConversion)
+				{
+					mvBuffers[i * 2] = (int32_t*) memoryAlloc(MEMORY_APPLICATION, sampleCount, sizeof(int32_t));
+					mvBuffers[i * 2 + 1] = (int32_t*) memoryAlloc(MEMORY_APPLICATION, sampleCount, sizeof(int32_t));
+				}
+
+				if (buffers[i * 2] == NULL || buffers[i * 2 + 1] == NULL || appBuffers[i * 2] == NULL || appBuffers[i * 2 + 1] == NULL ||
+					(separateConversion && (mvBuffers[i * 2] == NULL || mvBuffers[i * 2 + 1] == NULL)))
+				{
+					allocationFailed = TRUE;
+				}
+
+				printf(status?"StreamDataHandler:ps5000aSetDataBuffers(channel %ld) ------ 0x%08lx \n":"", i, status);
+			}
+		}
+	}
+
+	if (allocationFailed)
+	{
+		printf("streamDataHandler: Streaming buffers would exceed the memory budget (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+
+		for (i = 0; i < 2 * PS5000A_MAX_CHANNELS; i++)
+		{
+			memoryFree(buffers[i]);
+			memoryFree(appBuffers[i]);
+			memoryFree(mvBuffers[i]);
+		}
+
+		clearDataBuffers(unit);
+		return;
+	}
+	
+	downsampleRatio = 1;
+	timeUnits = PS5000A_US;
+	sampleInterval = 1;
+	ratioMode = PS5000A_RATIO_MODE_NONE;
+	preTrigger = 0;
+	postTrigger = 1000000;
+	autostop = TRUE;
+	
+	bufferInfo.unit = unit;	
+	g_metrics.streamBufferSize = sampleCount;
+	g_metrics.lastCallbackUs = 0;
+	bufferInfo.driverBuffers = buffers;
+	bufferInfo.appBuffers = appBuffers;
+
+	if (autostop)
+	{
+		printf("\nStreaming Data for %lu samples", postTrigger / downsampleRatio);
+		
+		if (preTrigger)	// We pass 0 for preTrigger if we're not setting up a trigger
+		{
+			printf(" after the trigger occurs\nNote: %lu Pre Trigger samples before Trigger arms\n\n",preTrigger / downsampleRatio);
+		}
+		else
+		{
+			printf("\n\n");
+		}
+	}
+	else
+	{
+		printf("\nStreaming Data continually.\n\n");
+	}
+
+	g_autoStopped = FALSE;
+
+
+	do
+	{
+		retry = 0;
+
+		status = ps5000aRunStreaming(unit->handle, &sampleInterval, timeUnits, preTrigger, postTrigger, autostop, 
+										downsampleRatio, ratioMode, sampleCount);
+
+		if (status != PICO_OK)
+		{
+			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
+			// PicoScope 524XD devices on non-USB 3.0 port
+			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+						status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)		
+			{
+				status = changePowerSource(unit->handle, status, unit);
+				retry = 1;
+			}
+			else
+			{
+				printf("streamDataHandler:ps5000aRunStreaming ------ 0x%08lx \n", status);
+				return;
+			}
+		}
+	}
+	while (retry);
+
+	printf("Streaming data...Press a key to stop\n");
+
+	ps5000aIsTriggerOrPulseWidthQualifierEnabled(unit->handle, &triggerEnabled, &pwqEnabled);
+
+	hostStartMs = wallClockUs() / 1000;
+	catalogueBegin(unit, &record, (int8_t *) "Streaming", (int8_t *) "stream", streamFile);
+	record.sampleIntervalNs = sampleInterval * 1000;	// Sample interval is in microseconds
+	record.triggerEnabled = triggerEnabled;
+	record.triggerChannel = (int16_t) g_lastTriggerChannel;
+	record.triggerThreshold = g_lastTriggerThreshold;
+
+	for (j = 0; j < unit->channelCount; j++)
+	{
+		conversionFactors(unit, j, &scales[j], &offsets[j]);
+	}
+
+	if (alarmStart(unit, sampleInterval * 1000, hostStartMs))
+	{
+		memcpy(g_alarms.scale, scales, sizeof(scales));
+		memcpy(g_alarms.offset, offsets, sizeof(offsets));
+	}
+
+	// Raw output takes the place of the text file
+	if (g_raw.format != RAW_OFF && g_raw.fd >= 0 && rawStart(unit, sampleInterval * 1000))
+	{
+		printf("Raw samples are going to stdout\n");
+	}
+	else
+	{
+		fopen_s(&fp, streamFile, "w");
+	}
+
+	if (fp != NULL)
+	{
+		fprintf(fp,"Streaming Data Log\n\n");
+		fprintf(fp,"%s %lld\n\n", JOIN_HOST_START, (long long) hostStartMs);
+		fprintf(fp,"For each of the %d Channels, results shown are....\n",unit->channelCount);
+		fprintf(fp,"Maximum Aggregated value ADC Count & calibrated value, Minimum Aggregated value ADC Count & calibrated value\n\n");
+
+		for (i = 0; i < unit->channelCount; i++) 
+		{
+			if (unit->channelSettings[i].enabled) 
+			{
+				fprintf(fp,"   Max ADC   Max val  Min ADC  Min val   ");
+			}
+		}
+		fprintf(fp, "\n");
+	}
+	
+
+	totalSamples = 0;
+
+	while (!_kbhit() && !g_autoStopped)
+	{
+		/* Poll until data is received. Until then, GetStreamingLatestValues wont call the callback */
+		g_ready = FALSE;
+
+		stage = traceBegin();
+		status = ps5000aGetStreamingLatestValues(unit->handle, callBackStreaming, &bufferInfo);
+		traceEnd("GetStreamingLatestValues", stage, g_ready ? g_sampleCount : 0);
+
+		// Counted by alarmFlush() in the callback, which keeps the console out of it
+		if (g_alarms.flushed != alarmsShown)
+		{
+			printf("\n%u alarm changes written to %s ", g_alarms.flushed - alarmsShown, ALARM_LOG_FILE);
+			alarmsShown = g_alarms.flushed;
+		}
+
+		// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
+		// PicoScope 524XD devices on non-USB 3.0 port
+		if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+			status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+		{
+			if (status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+			{
+				changePowerSource(unit->handle, status, unit);
+			}
+
+			printf("\n\nPower Source Change");
+			powerChange = 1;
+		}
+
+		index ++;
+
+		if (g_ready && g_sampleCount > 0) /* Can be ready and have no data, if autoStop has fired */
+		{
+			if (g_trig)
+			{
+				triggeredAt = totalSamples + g_trigAt;		// Calculate where the trigger occurred in the total samples collected
+			}
+
+			totalSamples += g_sampleCount;
+			overflowFlags |= g_overflow;
+
+			if (g_raw.active)
+			{
+				stage = traceBegin();
+				writeStartUs = timeNowUs();
+
+				rawFailed = !rawWriteSamples(appBuffers, g_startIndex, g_sampleCount);
+
+				metricsAdd(&g_metrics.writerBytes, (int64_t) g_sampleCount * g_raw.channels * sizeof(int16_t));
+				metricsAdd(&g_metrics.writerUs, timeNowUs() - writeStartUs);
+				PROBE1(writer_flush, g_sampleCount);
+				traceEnd("Raw output", stage, g_sampleCount);
+
+				if (rawFailed)
+				{
+					printf("\nstdout has been closed, streaming stopped\n");
+					break;
+				}
+
+				// One line a second rather than one per callback
+				if (writeStartUs - progressUs >= 1000000)
+				{
+					printf("\rCollected %d samples", totalSamples);
+					progressUs = writeStartUs;
+				}
+
+				continue;
+			}
+
+			printf("\nCollected %3li samples, index = %5lu, Total: %6d samples ", g_sampleCount, g_startIndex, totalSamples);
+
+			stage = traceBegin();
+
+			for (j = 0; j < unit->channelCount; j++)
+			{
+				if (unit->channelSettings[j].enabled)
+				{
+					catalogueUpdate(&record, j, &appBuffers[j * 2][g_startIndex], g_sampleCount);
+				}
+			}
+
+			traceEnd("Catalogue update", stage, g_sampleCount);
+			
+			if (g_trig)
+			{
+				printf("Trig. at index %lu total %lu", g_trigAt, triggeredAt + 1);	// show where trigger occurred
+				
+			}
+			
+			// While tracing, convert to calibrated units as a separate pass so that it can be traced apart from the file writing
+			if (separateConversion)
+			{
+				stage = traceBegin();
+
+				for (j = 0; j < unit->channelCount; j++)
+				{
+					if (unit->channelSettings[j].enabled)
+					{
+						convertSamples(&appBuffers[j * 2][g_startIndex], &mvBuffers[j * 2][g_startIndex], (int32_t) g_sampleCount, scales[j], offsets[j]);
+						convertSamples(&appBuffers[j * 2 + 1][g_startIndex], &mvBuffers[j * 2 + 1][g_startIndex], (int32_t) g_sampleCount, scales[j], offsets[j]);
+					}
+				}
+
+				traceEnd("Convert samples", stage, g_sampleCount);
+			}
+
+			stage = traceBegin();
+			writeStartUs = timeNowUs();
+
+			if (fp != NULL)
+			{
+				writeStartBytes = _ftelli64(fp);
+			}
+
+			for (i = g_startIndex; i < (int32_t)(g_startIndex + g_sampleCount); i++) 
+			{
+				
+				if (fp != NULL)
+				{
+					for (j = 0; j < unit->channelCount; j++) 
+					{
+						if (unit->channelSettings[j].enabled) 
+						{
+							fprintf(	fp,
+								"Ch%C  %5d = %+5d%s, %5d = %+5d%s   ",
+								(char)('A' + j),
+								appBuffers[j * 2][i],
+								separateConversion ? mvBuffers[j * 2][i] : convertSample(appBuffers[j * 2][i], scales[j], offsets[j]),
+								unit->probe[j].units,
+								appBuffers[j * 2 + 1][i],
+								separateConversion ? mvBuffers[j * 2 + 1][i] : convertSample(appBuffers[j * 2 + 1][i], scales[j], offsets[j]),
+								unit->probe[j].units);
+						}
+					}
+
+					fprintf(fp, "\n");
+				}
+				else
+				{
+					printf("Cannot open the file %s for writing.\n", streamFile);
+				}
+				
+			}
+
+			if (fp != NULL)
+			{
+				fflush(fp);
+				metricsAdd(&g_metrics.writerBytes, _ftelli64(fp) - writeStartBytes);
+				metricsAdd(&g_metrics.writerUs, timeNowUs() - writeStartUs);
+			}
+
+			PROBE1(writer_flush, g_sampleCount);
+			traceEnd("Write file", stage, g_sampleCount);
+		}
+	}
+
+	printf("\n\n");
+
+	ps5000aStop(unit->handle);
+	rawStop();
+	alarmStop();
+
+	if (fp != NULL)
+	{
+
+		fclose (fp);
+
+		record.sampleCount = totalSamples;
+		catalogueCommit(&record, overflowFlags);
+		printf("Data written to %s\n", streamFile);
+	}
+
+	if (!g_autoStopped && !powerChange)  
+	{
+		printf("\nData collection aborted\n");
+
+		// Only wait for the key that stopped it
+		if (!rawFailed)
+		{
+			_getch();
+		}
+	}
+	else
+	{
+		printf("\nData collection complete.\n\n");
+	}
+	
+	for (i = 0; i < 2 * PS5000A_MAX_CHANNELS; i++) 
+	{
+		memoryFree(buffers[i]);
+		memoryFree(appBuffers[i]);
+		memoryFree(mvBuffers[i]);
+	}
+
+	clearDataBuffers(unit);
+}
+
+
+/****************************************************************************
+* setTrigger
+*
+* - Used to call all the functions required to set up triggering.
+*
+***************************************************************************/
+PICO_STATUS setTrigger(UNIT * unit,
+	PS5000A_TRIGGER_CHANNEL_PROPERTIES_V2 * channelProperties,
+	int16_t nChannelProperties,
+	PS5000A_CONDITION * triggerConditions,
+	int16_t nTriggerConditions,
+	PS5000A_DIRECTION * directions,
+	uint16_t nDirections,
+	struct tPwq * pwq,
+	uint32_t delay,
+	uint64_t autoTriggerUs)
+{
+	PICO_STATUS status;
+	PS5000A_CONDITIONS_INFO info = PS5000A_CLEAR;
+	PS5000A_CONDITIONS_INFO pwqInfo = PS5000A_CLEAR;
+
+	int16_t auxOutputEnabled = 0; // Not used by function call
+
+	if (nChannelProperties > 0)
+	{
+		g_lastTriggerChannel = channelProperties[0].channel;
+		g_lastTriggerThreshold = channelProperties[0].thresholdUpper;
+	}
+
+	status = ps5000aSetTriggerChannelPropertiesV2(unit->handle, channelProperties, nChannelProperties, auxOutputEnabled);
+
+	if (status != PICO_OK) 
+	{
+		printf("setTrigger:ps5000aSetTriggerChannelPropertiesV2 ------ Ox%08lx \n", status);
+		return status;
+	}
+
+	if (nTriggerConditions != 0)
+	{
+		info = (PS5000A_CONDITIONS_INFO)(PS5000A_CLEAR | PS5000A_ADD); // Clear and add trigger condition specified unless no trigger conditions have been specified
+	}
+
+	status = ps5000aSetTriggerChannelConditionsV2(unit->handle, triggerConditions, nTriggerConditions, info);
+
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetTriggerChannelConditionsV2 ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	status = ps5000aSetTriggerChannelDirectionsV2(unit->handle, directions, nDirections);
+
+	if (status != PICO_OK) 
+	{
+		printf("setTrigger:ps5000aSetTriggerChannelDirectionsV2 ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	status = ps5000aSetAutoTriggerMicroSeconds(unit->handle, autoTriggerUs);
+
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetAutoTriggerMicroSeconds ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	status = ps5000aSetTriggerDelay(unit->handle, delay);
+	
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetTriggerDelay ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	// Clear and add pulse width qualifier condition, clear if no pulse width qualifier has been specified
+	if (pwq->nPwqConditions != 0)
+	{
+		pwqInfo = (PS5000A_CONDITIONS_INFO)(PS5000A_CLEAR | PS5000A_ADD);
+	}
+
+	status = ps5000aSetPulseWidthQualifierConditions(unit->handle, pwq->pwqConditions, pwq->nPwqConditions, pwqInfo);
+
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetPulseWidthQualifierConditions ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	status = ps5000aSetPulseWidthQualifierDirections(unit->handle, pwq->pwqDirections, pwq->nPwqDirections);
+
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetPulseWidthQualifierDirections ------ 0x%08lx \n", status);
+		return status;
+	}
+
+	status = ps5000aSetPulseWidthQualifierProperties(unit->handle, pwq->lower, pwq->upper, pwq->type);
+
+	if (status != PICO_OK)
+	{
+		printf("setTrigger:ps5000aSetPulseWidthQualifierProperties ------ Ox%08lx \n", status);
+		return status;
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* collectBlockImmediate
+*  this function demonstrates how to collect a single block of data
+*  from the unit (start collecting immediately)
+****************************************************************************/
+void collectBlockImmediate(UNIT * unit)
+{
+	PICO_STATUS status = PICO_OK;
+
+	printf("Collect block immediate...\n");
+	printf("Press a key to start\n");
+	_getch();
+
+	setDefaults(unit);
+
+	/* Trigger disabled	*/
+	status = ps5000aSetSimpleTrigger(unit->handle, 0, PS5000A_CHANNEL_A, 0, PS5000A_RISING, 0, 0);
+
+	blockDataHandler(unit, (int8_t *) "First 10 readings\n", 0, FALSE);
+}
+
+/****************************************************************************
+* collectBlockEts
+*  this function demonstrates how to collect a block of
+*  data using equivalent time sampling (ETS).
+****************************************************************************/
+void collectBlockEts(UNIT * unit)
+{
+	PICO_STATUS status;
+	int32_t ets_sampletime;
+	int16_t triggerVoltage = 1000; // millivolts
+	uint32_t delay = 0;
+	int16_t etsModeSet = FALSE;
+
+	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
+	int16_t voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
+	int16_t triggerThreshold = 0;
+
+	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
+	struct tPS5000ACondition conditions;
+	struct tPS5000ADirection directions;
+
+	// Struct to hold Pulse Width Qualifier information
+	struct tPwq pulseWidth;
+
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	// If the channel is not enabled, warn the User and return
+	if (unit->channelSettings[triggerChannel].enabled == 0)
+	{
+		printf("collectBlockTriggered: Channel not enabled.");
+		return;
+	}
+
+	// If the trigger voltage level is greater than the range selected, set the threshold to half
+	// of the range selected e.g. for +/- 200mV, set the threshold to 100mV
+	if (triggerVoltage > voltageRange)
+	{
+		triggerVoltage = (voltageRange / 2);
+	}
+
+	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+
+	// Set trigger channel properties
+	triggerProperties.thresholdUpper = triggerThreshold;
+	triggerProperties.thresholdUpperHysteresis = 256 * 10;
+	triggerProperties.thresholdLower = triggerThreshold;
+	triggerProperties.thresholdLowerHysteresis = 256 * 10;
+	triggerProperties.channel = (PS5000A_CHANNEL)(triggerChannel);
+
+	// Set trigger conditions
+	conditions.source = (PS5000A_CHANNEL)triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+
+	// Set trigger directions
+	directions.source = (PS5000A_CHANNEL)triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Collect ETS block...\n");
+	printf("Collects when value rises past %d", scaleVoltages? 
+		adc_to_mv(triggerProperties.thresholdUpper,	unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);																// else print ADC Count
+	
+	printf(scaleVoltages? " mV\n" : "ADC Counts\n");
+	printf("Press a key to start...\n");
+	_getch();
+
+	setDefaults(unit);
+
+	// Trigger enabled
+	// Rising edge
+	// Threshold = 1000 mV
+	status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, delay, 0);
+
+	status = ps5000aSetEts(unit->handle, PS5000A_ETS_FAST, 20, 4, &ets_sampletime);
+
+	if (status == PICO_OK)
+	{
+		etsModeSet = TRUE;
+	}
+
+	printf("ETS Sample Time is %ld picoseconds\n", ets_sampletime);
+
+	blockDataHandler(unit, (int8_t *) "Ten readings after trigger\n", BUFFER_SIZE / 10 - 5, etsModeSet); // 10% of data is pre-trigger
+
+	status = ps5000aSetEts(unit->handle, PS5000A_ETS_OFF, 0, 0, &ets_sampletime);
+
+	etsModeSet = FALSE;
+}
+
+/****************************************************************************
+* collectBlockTriggered
+*  this function demonstrates how to collect a single block of data from the
+*  unit, when a trigger event occurs.
+****************************************************************************/
+void collectBlockTriggered(UNIT * unit)
+{
+	int16_t triggerVoltage					= 1000; // mV
+	PS5000A_CHANNEL triggerChannel	= PS5000A_CHANNEL_A;
+	int16_t voltageRange						= inputRanges[unit->channelSettings[triggerChannel].range];
+	int16_t triggerThreshold				= 0;
+
+	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties; 
+	struct tPS5000ACondition conditions; 
+	struct tPS5000ADirection directions; 
+
+	// Struct to hold Pulse Width Qualifier information
+	struct tPwq pulseWidth;
+
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	// If the channel is not enabled, warn the User and return
+	if (unit->channelSettings[triggerChannel].enabled == 0)
+	{
+		printf("collectBlockTriggered: Channel not enabled.");
+		return;
+	}
+
+	// If the trigger voltage level is greater than the range selected, set the threshold to half
+	// of the range selected e.g. for 200 mV, set the threshold to 10 0mV
+	if (triggerVoltage > voltageRange)
+	{
+		triggerVoltage = (voltageRange / 2);
+	}
+
+	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+
+	// Set trigger channel properties
+	triggerProperties.thresholdUpper						= triggerThreshold;
+	triggerProperties.thresholdUpperHysteresis	= 256 * 10;
+	triggerProperties.thresholdLower						= triggerThreshold;
+	triggerProperties.thresholdLowerHysteresis	= 256 * 10;
+	triggerProperties.channel										= triggerChannel;
+
+	// Set trigger conditions
+	conditions.source = triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+	
+	// Set trigger directions
+	directions.source = triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Collect block triggered...\n");
+	printf("Collects when value rises past %d", scaleVoltages?
+		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);																// else print ADC Count
+	
+	printf(scaleVoltages?"mV\n" : "ADC Counts\n");
+
+	printf("Press a key to start...\n");
+	_getch();
+
+	setDefaults(unit);
+
+	/* Trigger enabled
+	* Rising edge
+	* Threshold = 1000 mV */
+	setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+
+	blockDataHandler(unit, (int8_t *) "Ten readings after trigger\n", 0, FALSE);
+}
+
+/****************************************************************************
+* freeRapidBuffers
+*
+* Releases the per channel, per capture buffers used for rapid block mode
+****************************************************************************/
+void freeRapidBuffers(UNIT * unit, int16_t *** rapidBuffers, uint32_t nCaptures)
+{
+	int16_t channel;
+	uint32_t capture;
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				memoryFree(rapidBuffers[channel][capture]);
+			}
+
+			free(rapidBuffers[channel]);
+		}
+	}
+
+	free(rapidBuffers);
+}
+
+/****************************************************************************
+* Rapid block triage
+*
+* Instead of reading every segment at full resolution, triage first reads
+* a min/max aggregate of every segment (TRIAGE_POINTS pairs per segment),
+* tests it with a predicate and only then reads the segments that passed at
+* full resolution. The aggregate keeps the true minimum and maximum of each
+* group of samples, so level and peak to peak tests never miss a segment
+* that would have passed at full resolution.
+****************************************************************************/
+#define TRIAGE_POINTS		100
+
+/****************************************************************************
+* triagePoints
+*
+* Number of min/max pairs in the aggregate of one segment. The last group
+* may be short, so round up to keep its samples.
+****************************************************************************/
+uint32_t triagePoints(uint32_t nSamples)
+{
+	uint32_t ratio = max(nSamples / TRIAGE_POINTS, 1);
+
+	return (nSamples + ratio - 1) / ratio;
+}
+
+// Returns TRUE if the segment should be read at full resolution
+typedef int16_t (*TRIAGE_PREDICATE)(int16_t * maxBuffer, int16_t * minBuffer, uint32_t count, int16_t level);
+
+/****************************************************************************
+* triageAbove - any sample above the level
+****************************************************************************/
+int16_t triageAbove(int16_t * maxBuffer, int16_t * minBuffer, uint32_t count, int16_t level)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (maxBuffer[i] > level)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/****************************************************************************
+* triageBelow - any sample below the level
+****************************************************************************/
+int16_t triageBelow(int16_t * maxBuffer, int16_t * minBuffer, uint32_t count, int16_t level)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (minBuffer[i] < level)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/****************************************************************************
+* triagePeakToPeak - peak to peak amplitude greater than the level
+****************************************************************************/
+int16_t triagePeakToPeak(int16_t * maxBuffer, int16_t * minBuffer, uint32_t count, int16_t level)
+{
+	uint32_t i;
+	int16_t highest = -32768;
+	int16_t lowest = 32767;
+
+	for (i = 0; i < count; i++)
+	{
+		highest = max(highest, maxBuffer[i]);
+		lowest = min(lowest, minBuffer[i]);
+	}
+
+	return ((int32_t) highest - lowest) > level;
+}
+
+/****************************************************************************
+* triageRapidBlock
+*
+* Reads aggregated data for every captured segment, evaluates the predicate
+* on one channel and writes only the selected segments, read at full
+* resolution, to a catalogued file
+****************************************************************************/
+void triageRapidBlock(UNIT * unit, uint32_t nCaptures, uint32_t nSamples, int32_t timeIntervalNs, PS5000A_CHANNEL channel,
+	TRIAGE_PREDICATE predicate, int16_t level)
+{
+	int16_t ch;
+	int16_t overflowFlags = 0;
+	int16_t segmentOverflow;
+	int16_t allocationFailed = FALSE;
+	uint32_t ratio;
+	uint32_t nPoints;
+	uint32_t nValues;
+	uint32_t capture;
+	uint32_t nSelected = 0;
+	uint32_t i;
+	uint64_t bytesRead;
+	int64_t startTime = timeNowUs();
+	int16_t * aggregateMax;
+	int16_t * aggregateMin;
+	int16_t * overflow;
+	int16_t * buffers[PS5000A_MAX_CHANNELS];
+	float scales[PS5000A_MAX_CHANNELS];
+	float offsets[PS5000A_MAX_CHANNELS];
+	uint8_t * selected;
+	FILE * fp = NULL;
+	int8_t triageFile[CATALOGUE_FILE_NAME_LENGTH];
+	CATALOGUE_RECORD record;
+	PICO_STATUS status = PICO_OK;
+
+	ratio = max(nSamples / TRIAGE_POINTS, 1);
+	nPoints = triagePoints(nSamples);
+
+	// Phase 1 - aggregated data of every segment for the channel being tested
+	aggregateMax = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, (size_t) nCaptures * nPoints, sizeof(int16_t));
+	aggregateMin = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, (size_t) nCaptures * nPoints, sizeof(int16_t));
+	overflow = (int16_t *) calloc(nCaptures, sizeof(int16_t));
+	selected = (uint8_t *) calloc(nCaptures, sizeof(uint8_t));
+
+	memset(buffers, 0, sizeof(buffers));
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			buffers[ch] = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, nSamples, sizeof(int16_t));
+			allocationFailed |= (buffers[ch] == NULL);
+		}
+	}
+
+	if (aggregateMax == NULL || aggregateMin == NULL || allocationFailed)
+	{
+		printf("triageRapidBlock: Buffers would exceed the memory budget (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+		status = PICO_MEMORY_FAIL;
+	}
+
+	for (capture = 0; capture < nCaptures && status == PICO_OK; capture++)
+	{
+		status = ps5000aSetDataBuffers(unit->handle, channel, aggregateMax + (size_t) capture * nPoints, aggregateMin + (size_t) capture * nPoints,
+			nPoints, capture, PS5000A_RATIO_MODE_AGGREGATE);
+	}
+
+	if (status == PICO_OK)
+	{
+		nValues = nPoints;
+		status = ps5000aGetValuesBulk(unit->handle, &nValues, 0, nCaptures - 1, ratio, PS5000A_RATIO_MODE_AGGREGATE, overflow);
+
+		if (status != PICO_OK)
+		{
+			printf("triageRapidBlock:ps5000aGetValuesBulk ------ 0x%08lx \n", status);
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		for (capture = 0; capture < nCaptures; capture++)
+		{
+			selected[capture] = (uint8_t) predicate(aggregateMax + (size_t) capture * nPoints, aggregateMin + (size_t) capture * nPoints, nValues, level);
+			nSelected += selected[capture];
+		}
+
+		bytesRead = (uint64_t) nCaptures * nValues * 2 * sizeof(int16_t);
+
+		printf("Triage of %lu segments (%lu min/max pairs each) took %.1f ms, %lu selected\n", nCaptures, nValues,
+			(timeNowUs() - startTime) / 1000.0, nSelected);
+	}
+
+	// Phase 2 - full resolution data of the selected segments, written one segment at a time
+	if (status == PICO_OK && nSelected > 0)
+	{
+		catalogueBegin(unit, &record, (int8_t *) "Rapid triage", (int8_t *) "triage", triageFile);
+		record.timebase = timebase;
+		record.sampleIntervalNs = timeIntervalNs;
+		record.sampleCount = nSamples;
+		record.segmentCount = nSelected;
+		record.triggerEnabled = TRUE;
+		record.triggerChannel = (int16_t) g_lastTriggerChannel;
+		record.triggerThreshold = g_lastTriggerThreshold;
+
+		fopen_s(&fp, triageFile, "w");
+
+		if (fp == NULL)
+		{
+			printf("Cannot open the file %s for writing.\n", triageFile);
+		}
+		else
+		{
+			for (ch = 0; ch < unit->channelCount; ch++)
+			{
+				conversionFactors(unit, ch, &scales[ch], &offsets[ch]);
+			}
+
+			fprintf(fp, "Rapid Block Triage Data log\n\n");
+			fprintf(fp, "%lu of %lu captures selected. Results shown are ADC Count & calibrated value for each enabled channel\n\n", nSelected, nCaptures);
+
+			for (capture = 0; capture < nCaptures && status == PICO_OK; capture++)
+			{
+				if (!selected[capture])
+				{
+					continue;
+				}
+
+				// The same full resolution buffers are used for each selected segment in turn
+				for (ch = 0; ch < unit->channelCount; ch++)
+				{
+					if (unit->channelSettings[ch].enabled)
+					{
+						status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, buffers[ch], nSamples, capture, PS5000A_RATIO_MODE_NONE);
+					}
+				}
+
+				nValues = nSamples;
+				status = ps5000aGetValues(unit->handle, 0, &nValues, 1, PS5000A_RATIO_MODE_NONE, capture, &segmentOverflow);
+
+				for (ch = 0; ch < unit->channelCount; ch++)
+				{
+					if (unit->channelSettings[ch].enabled)
+					{
+						ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, NULL, 0, capture, PS5000A_RATIO_MODE_NONE);
+					}
+				}
+
+				if (status != PICO_OK)
+				{
+					printf("triageRapidBlock:ps5000aGetValues(segment %lu) ------ 0x%08lx \n", capture, status);
+					break;
+				}
+
+				fprintf(fp, "Capture %lu\n", capture);
+
+				for (i = 0; i < nValues; i++)
+				{
+					for (ch = 0; ch < unit->channelCount; ch++)
+					{
+						if (unit->channelSettings[ch].enabled)
+						{
+							fprintf(fp, "Ch%C  %6d = %+6d%s   ", 'A' + ch, buffers[ch][i],
+								convertSample(buffers[ch][i], scales[ch], offsets[ch]), unit->probe[ch].units);
+						}
+					}
+
+					fprintf(fp, "\n");
+				}
+
+				for (ch = 0; ch < unit->channelCount; ch++)
+				{
+					if (unit->channelSettings[ch].enabled)
+					{
+						catalogueUpdate(&record, ch, buffers[ch], nValues);
+						bytesRead += (uint64_t) nValues * sizeof(int16_t);
+					}
+				}
+
+				overflowFlags |= segmentOverflow;
+			}
+
+			fclose(fp);
+
+			catalogueCommit(&record, overflowFlags);
+			printf("Data written to %s\n", triageFile);
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		for (ch = 0, i = 0; ch < unit->channelCount; ch++)
+		{
+			i += unit->channelSettings[ch].enabled;
+		}
+
+		printf("%.1f MB read from the device instead of %.1f MB for every segment at full resolution\n", bytesRead / (1024.0 * 1024.0),
+			(double) nCaptures * nSamples * i * sizeof(int16_t) / (1024.0 * 1024.0));
+	}
+
+	// Unregister the aggregate buffers before they are freed
+	for (capture = 0; capture < nCaptures; capture++)
+	{
+		ps5000aSetDataBuffers(unit->handle, channel, NULL, NULL, 0, capture, PS5000A_RATIO_MODE_AGGREGATE);
+	}
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		memoryFree(buffers[ch]);
+	}
+
+	memoryFree(aggregateMax);
+	memoryFree(aggregateMin);
+	free(overflow);
+	free(selected);
+}
+
+/****************************************************************************
+* collectRapidBlock
+*  this function demonstrates how to collect a set of captures using
+*  rapid block mode.
+*  With triage set, the number of captures and samples and a test are
+*  entered first and only the captures that pass the test are read back
+*  at full resolution (see triageRapidBlock).
+****************************************************************************/
+void collectRapidBlock(UNIT * unit, int16_t triage)
+{
+	uint32_t	nCaptures;
+	uint32_t	nSegments;
+	int32_t		nMaxSamples;
+	uint32_t	nSamples = 1000;
+	int32_t		timeIndisposed;
+	uint32_t	capture;
+	int16_t		channel;
+	int16_t***	rapidBuffers;
+	int16_t*	overflow;
+	float		scales[PS5000A_MAX_CHANNELS];
+	float		offsets[PS5000A_MAX_CHANNELS];
+	PICO_STATUS status;
+	int32_t		i;
+	uint32_t	nCompletedCaptures;
+	int16_t		retry;
+	int64_t		runStartUs;
+	int64_t		stage;
+	int64_t		writeStartUs;
+	int64_t		writeStartBytes;
+
+	int16_t		triggerVoltage = 1000; // mV
+	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
+	int16_t		voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
+	int16_t		triggerThreshold = 0;
+
+	int32_t		timeIntervalNs = 0;
+	int32_t		maxSamples = 0;
+	uint32_t	maxSegments = 0;
+
+	uint64_t timeStampCounterDiff = 0;
+
+	int16_t overflowFlags = 0;
+	int16_t enabledChannels = 0;
+	int16_t allocationFailed = FALSE;
+	uint32_t maxCaptures;
+	size_t bytesPerCapture;
+	FILE * fp = NULL;
+	int8_t rapidFile[CATALOGUE_FILE_NAME_LENGTH];
+
+	int8_t		triageChannel[4] = "A";
+	int32_t		triageTest = 1;
+	int32_t		triageLevel = 0;
+	TRIAGE_PREDICATE	triagePredicate[3] = { triageAbove, triageBelow, triagePeakToPeak };
+	CATALOGUE_RECORD record;
+
+	PS5000A_TRIGGER_INFO * triggerInfo; // Struct to store trigger timestamping information
+
+	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
+	struct tPS5000ACondition conditions;
+	struct tPS5000ADirection directions;
+
+	// Struct to hold Pulse Width Qualifier information
+	struct tPwq pulseWidth;
+
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	// If the channel is not enabled, warn the User and return
+	if (unit->channelSettings[triggerChannel].enabled == 0)
+	{
+		printf("collectBlockTriggered: Channel not enabled.");
+		return;
+	}
+
+	// If the trigger voltage level is greater than the range selected, set the threshold to half
+	// of the range selected e.g. for 200 mV, set the threshold to 10 0mV
+	if (triggerVoltage > voltageRange)
+	{
+		triggerVoltage = (voltageRange / 2);
+	}
+
+	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+
+	// Set trigger channel properties
+	triggerProperties.thresholdUpper = triggerThreshold;
+	triggerProperties.thresholdUpperHysteresis = 256 * 10;
+	triggerProperties.thresholdLower = triggerThreshold;
+	triggerProperties.thresholdLowerHysteresis = 256 * 10;
+	triggerProperties.channel = triggerChannel;
+
+	// Set trigger conditions
+	conditions.source = triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+
+	// Set trigger directions
+	directions.source = triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Collect rapid block triggered...\n");
+	printf("Collects when value rises past %d ", scaleVoltages ?
+		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);																// else print ADC Count
+
+	printf(scaleVoltages ? "mV\n" : "ADC Counts\n");
+
+	if (triage)
+	{
+		printf("Number of captures: ");
+		fflush(stdin);
+		scanf_s("%u", &nCaptures);
+
+		printf("Samples per capture: ");
+		scanf_s("%u", &nSamples);
+
+		do
+		{
+			printf("Channel to test: ");
+			scanf_s("%3s", triageChannel, (unsigned) sizeof(triageChannel));
+			triageChannel[0] = toupper(triageChannel[0]) - 'A';
+		}
+		while (triageChannel[0] < 0 || triageChannel[0] >= unit->channelCount || !unit->channelSettings[triageChannel[0]].enabled);
+
+		printf("Keep captures with\n1: any sample above a level\n2: any sample below a level\n3: peak to peak above a level\n");
+
+		do
+		{
+			printf("Test [1...3]: ");
+			scanf_s("%d", &triageTest);
+		}
+		while (triageTest < 1 || triageTest > 3);
+
+		printf("Level (mV): ");
+		scanf_s("%d", &triageLevel);
+
+		if (nCaptures == 0 || nSamples == 0)
+		{
+			printf("collectRapidBlock: The number of captures and samples must be at least 1.\n");
+			return;
+		}
+	}
+
+	printf("Press any key to abort\n");
+
+	setDefaults(unit);
+
+	// Trigger enabled
+	status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+
+	// Find the maximum number of segments
+	status = ps5000aGetMaxSegments(unit->handle, &maxSegments);
+
+	// Set the number of segments - this can be more than the number of waveforms to collect
+	nSegments = 64;
+
+	if (nSegments > maxSegments)
+	{
+		nSegments = maxSegments;
+	}
+
+	// Set the number of captures
+	if (triage)
+	{
+		nCaptures = min(nCaptures, maxSegments);
+		nSegments = max(nSegments, nCaptures);
+	}
+	else
+	{
+		nCaptures = 10;
+	}
+
+	// Only capture as many segments as can be read back within the memory budget
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			enabledChannels++;
+		}
+	}
+
+	if (triage)
+	{
+		// Triage holds a min/max pair per TRIAGE_POINTS for every capture, plus one full capture
+		bytesPerCapture = (size_t) triagePoints(nSamples) * 2 * sizeof(int16_t);
+		maxCaptures = (uint32_t) ((memoryAvailable(MEMORY_ACQUISITION) - min(memoryAvailable(MEMORY_ACQUISITION), (size_t) enabledChannels * nSamples * sizeof(int16_t))) / bytesPerCapture);
+	}
+	else
+	{
+		bytesPerCapture = (size_t) enabledChannels * nSamples * sizeof(int16_t);
+		maxCaptures = (uint32_t) (memoryAvailable(MEMORY_ACQUISITION) / bytesPerCapture);
+	}
+
+	if (maxCaptures == 0)
+	{
+		printf("collectRapidBlock: Not enough memory within the budget for a single capture (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+		return;
+	}
+
+	if (nCaptures > maxCaptures)
+	{
+		printf("Number of captures reduced from %lu to %lu to stay within the memory budget.\n", nCaptures, maxCaptures);
+		nCaptures = maxCaptures;
+	}
+
+	// Segment the memory
 	status = ps5000aMemorySegments(unit->handle, nSegments, &nMaxSamples);
 
-	// Set the number of captures
-	status = ps5000aSetNoOfCaptures(unit->handle, nCaptures);
+	if (status != PICO_OK)
+	{
+		printf("collectRapidBlock:ps5000aMemorySegments ------ 0x%08lx \n", status);
+		return;
+	}
+
+	// Each segment can only hold nMaxSamples
+	if (nSamples > (uint32_t) nMaxSamples)
+	{
+		printf("Samples per capture reduced from %lu to %ld to fit in a memory segment.\n", nSamples, nMaxSamples);
+		nSamples = nMaxSamples;
+	}
+
+	// Set the number of captures
+	status = ps5000aSetNoOfCaptures(unit->handle, nCaptures);
+
+	// Run
+	timebase = 127;		// 1 MS/s at 8-bit resolution, ~504 kS/s at 12 & 16-bit resolution
+
+	// Verify timebase and number of samples per channel for segment 0
+	do
+	{
+		status = ps5000aGetTimebase(unit->handle, timebase, nSamples, &timeIntervalNs, &maxSamples, 0);
+
+		if (status == PICO_INVALID_TIMEBASE)
+		{
+			timebase++;
+		}
+	} while (status == PICO_INVALID_TIMEBASE);
+
+	if (status != PICO_OK)
+	{
+		printf("collectRapidBlock:ps5000aGetTimebase ------ 0x%08lx \n", status);
+		return;
+	}
+
+	// Clear the ready flag before starting, the callback can fire before ps5000aRunBlock returns
+	g_ready = 0;
+
+	// Host time of the run, used to place the first segment on the event timeline
+	runStartUs = wallClockUs();
+	stage = traceBegin();
+
+	do
+	{
+		retry = 0;
+		PROBE2(run_block_arm, nSamples, timebase);
+		status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+
+		if (status != PICO_OK)
+		{
+			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
+			// PicoScope 524XD devices on non-USB 3.0 port
+			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED || status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT)
+			{
+				status = changePowerSource(unit->handle, status, unit);
+				retry = 1;
+			}
+			else
+			{
+				printf("collectRapidBlock:ps5000aRunBlock ------ 0x%08lx \n", status);
+			}
+		}
+	} while (retry);
+
+	traceEnd("RunBlock", stage, nCaptures);
+
+	// Wait until data ready
+	stage = traceBegin();
+
+	while (!g_ready && !_kbhit())
+	{
+		Sleep(0);
+	}
+
+	traceEnd("Wait for data", stage, 0);
+
+	if (!g_ready)
+	{
+		_getch();
+		status = ps5000aStop(unit->handle);
+		status = ps5000aGetNoOfCaptures(unit->handle, &nCompletedCaptures);
+
+		printf("Rapid capture aborted. %lu complete blocks were captured\n", nCompletedCaptures);
+		printf("\nPress any key...\n\n");
+		_getch();
+
+		if (nCompletedCaptures == 0)
+		{
+			return;
+		}
+
+		// Only display the blocks that were captured
+		nCaptures = (uint16_t)nCompletedCaptures;
+	}
+
+	if (triage)
+	{
+		triageRapidBlock(unit, nCaptures, nSamples, timeIntervalNs, (PS5000A_CHANNEL) triageChannel[0], triagePredicate[triageTest - 1],
+			mv_to_adc((int16_t) triageLevel, unit->channelSettings[triageChannel[0]].range, unit));
+		status = ps5000aStop(unit->handle);
+		return;
+	}
+
+	// Allocate memory
+	rapidBuffers = (int16_t ***)calloc(unit->channelCount, sizeof(int16_t*));
+	overflow = (int16_t *)calloc(unit->channelCount * nCaptures, sizeof(int16_t));
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			rapidBuffers[channel] = (int16_t **)calloc(nCaptures, sizeof(int16_t*));
+		}
+	}
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				rapidBuffers[channel][capture] = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, nSamples, sizeof(int16_t));
+				allocationFailed |= (rapidBuffers[channel][capture] == NULL);
+			}
+		}
+	}
+
+	if (allocationFailed)
+	{
+		printf("collectRapidBlock: Capture buffers would exceed the memory budget (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+		status = ps5000aStop(unit->handle);
+		freeRapidBuffers(unit, rapidBuffers, nCaptures);
+		free(overflow);
+		return;
+	}
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL)channel, rapidBuffers[channel][capture], nSamples, capture, PS5000A_RATIO_MODE_NONE);
+			}
+		}
+	}
+
+	// Allocate memory for the trigger timestamping
+	triggerInfo = (PS5000A_TRIGGER_INFO *)malloc(nCaptures * sizeof(PS5000A_TRIGGER_INFO));
+	memset(triggerInfo, 0, nCaptures * sizeof(PS5000A_TRIGGER_INFO));
+
+	// Get data
+	stage = traceBegin();
+	PROBE2(get_values_start, nSamples, nCaptures);
+	status = ps5000aGetValuesBulk(unit->handle, &nSamples, 0, nCaptures - 1, 1, PS5000A_RATIO_MODE_NONE, overflow);
+	PROBE2(get_values_end, nSamples, status);
+	traceEnd("GetValuesBulk", stage, (int64_t) nCaptures * nSamples);
+
+	if (status == PICO_OK)
+	{
+		for (capture = 0; capture < nCaptures; capture++)
+		{
+			metricsAddSamples(unit, nSamples, overflow[capture]);
+		}
+
+		metricsAdd(&g_metrics.captures[1], nCaptures);
+	}
+
+	if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+				status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+	{
+		printf("\nPower Source Changed. Data collection aborted.\n");
+	}
+
+	// Retrieve trigger timestamping information
+	stage = traceBegin();
+	status = ps5000aGetTriggerInfoBulk(unit->handle, triggerInfo, 0, nCaptures - 1);
+	traceEnd("GetTriggerInfoBulk", stage, nCaptures);
+
+	if (status == PICO_OK)
+	{
+		for (channel = 0; channel < unit->channelCount; channel++)
+		{
+			conversionFactors(unit, channel, &scales[channel], &offsets[channel]);
+		}
+
+		//print first 10 samples from each capture
+		for (capture = 0; capture < nCaptures; capture++)
+		{
+			printf("\n");
+
+			printf("Capture index %d:-\n\n", capture);
+
+			// Trigger Info status & Timestamp 
+			printf("Trigger Info:- Status: %u  Trigger index: %u  Timestamp Counter: %I64u\n", triggerInfo[capture].status, triggerInfo[capture].triggerIndex, triggerInfo[capture].timeStampCounter);
+
+			// Calculate time between trigger events - the first timestamp is arbitrary so is only used to calculate offsets
+
+			// The structure containing the status code with bit flag PICO_DEVICE_TIME_STAMP_RESET will have an arbitrary timeStampCounter value. 
+			// This should be the first segment in each run, so in this case segment 0 will be ignored.
+
+			if (capture == 0)
+			{
+				// Nothing to display
+				printf("\n");
+			}
+			else if (capture > 0 && triggerInfo[capture].status == PICO_OK)
+			{
+				timeStampCounterDiff = triggerInfo[capture].timeStampCounter - triggerInfo[capture - 1].timeStampCounter;
+				printf("Time since trigger for last segment: %I64u ns\n\n", (timeStampCounterDiff * (uint64_t)timeIntervalNs));
+			}
+			else
+			{
+				// Do nothing
+			}
+
+			for (channel = 0; channel < unit->channelCount; channel++)
+			{
+				if (unit->channelSettings[channel].enabled)
+				{
+					printf("Channel %c:\t", 'A' + channel);
+				}
+			}
+
+			printf("\n\n");
+
+			for (i = 0; i < 10; i++)
+			{
+				for (channel = 0; channel < unit->channelCount; channel++)
+				{
+					if (unit->channelSettings[channel].enabled)
+					{
+						printf("   %6d       ", scaleVoltages ?
+							convertSample(rapidBuffers[channel][capture][i], scales[channel], offsets[channel])	// If scaleVoltages, print calibrated value
+							: rapidBuffers[channel][capture][i]);												// else print ADC Count
+					}
+				}
+
+				printf("\n");
+			}
+		}
+
+		// Save all captures and add them to the capture catalogue
+		catalogueBegin(unit, &record, (int8_t *) "Rapid block", (int8_t *) "rapid", rapidFile);
+		record.timebase = timebase;
+		record.sampleIntervalNs = timeIntervalNs;
+		record.sampleCount = nSamples;
+		record.segmentCount = nCaptures;
+		record.triggerEnabled = TRUE;
+		record.triggerChannel = (int16_t) g_lastTriggerChannel;
+		record.triggerThreshold = g_lastTriggerThreshold;
+
+		fopen_s(&fp, rapidFile, "w");
+
+		if (fp != NULL)
+		{
+			stage = traceBegin();
+			writeStartUs = timeNowUs();
+			writeStartBytes = _ftelli64(fp);
+
+			fprintf(fp, "Rapid Block Data log\n\n");
+			fprintf(fp, "Results shown for each of the %d captures are ADC Count & calibrated value for each enabled channel\n\n", nCaptures);
+
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				fprintf(fp, "Capture %lu Timestamp Counter %llu\n", capture, (unsigned long long) triggerInfo[capture].timeStampCounter);
+
+				for (i = 0; i < (int32_t) nSamples; i++)
+				{
+					for (channel = 0; channel < unit->channelCount; channel++)
+					{
+						if (unit->channelSettings[channel].enabled)
+						{
+							fprintf(fp, "Ch%C  %6d = %+6d%s   ", 'A' + channel, rapidBuffers[channel][capture][i],
+								convertSample(rapidBuffers[channel][capture][i], scales[channel], offsets[channel]), unit->probe[channel].units);
+						}
+					}
+
+					fprintf(fp, "\n");
+				}
+
+				for (channel = 0; channel < unit->channelCount; channel++)
+				{
+					if (unit->channelSettings[channel].enabled)
+					{
+						catalogueUpdate(&record, channel, rapidBuffers[channel][capture], nSamples);
+					}
+				}
+
+				overflowFlags |= overflow[capture];
+			}
+
+			metricsAdd(&g_metrics.writerBytes, _ftelli64(fp) - writeStartBytes);
+			fclose(fp);
+			metricsAdd(&g_metrics.writerUs, timeNowUs() - writeStartUs);
+
+			PROBE1(writer_flush, nCaptures * nSamples);
+			traceEnd("Write file", stage, (int64_t) nCaptures * nSamples);
+
+			catalogueCommit(&record, overflowFlags);
+			printf("Data written to %s\n", rapidFile);
+		}
+		else
+		{
+			printf("Cannot open the file %s for writing.\n", rapidFile);
+		}
+
+		stage = traceBegin();
+		i = (int32_t) eventStoreAppend(unit, rapidBuffers, overflow, triggerInfo, nCaptures, nSamples, timeIntervalNs, runStartUs);
+		traceEnd("Event store", stage, i);
+
+		printf("%lu events added to the event store\n", (uint32_t) i);
+	}
+
+	// Stop
+	status = ps5000aStop(unit->handle);
+
+	// Free memory
+	free(overflow);
+	freeRapidBuffers(unit, rapidBuffers, nCaptures);
+	free(triggerInfo);
+}
+
+/****************************************************************************
+* archiveRapidBlock
+*  this function demonstrates how to use repeated rapid block runs as a
+*  triggered streaming archive - every segment of every run is appended to
+*  the event store until a key is pressed
+****************************************************************************/
+void archiveRapidBlock(UNIT * unit)
+{
+	uint32_t	nCaptures = 100;
+	uint32_t	nSamples = 1000;
+	uint32_t	nCompletedCaptures;
+	uint32_t	capture;
+	uint32_t	maxSegments = 0;
+	uint32_t	maxCaptures;
+	uint32_t	nRuns = 0;
+	uint64_t	nEvents = 0;
+	int32_t		nMaxSamples;
+	int32_t		timeIndisposed;
+	int32_t		timeIntervalNs = 0;
+	int32_t		maxSamples = 0;
+	int16_t		channel;
+	int16_t		enabledChannels = 0;
+	int16_t		allocationFailed = FALSE;
+	int16_t		stop = FALSE;
+	int16_t***	rapidBuffers;
+	int16_t*	overflow;
+	int64_t		runStartUs;
+	int64_t		stage;
+	PICO_STATUS status;
+
+	int16_t		triggerVoltage = 1000; // mV
+	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
+	int16_t		voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
+	int16_t		triggerThreshold = 0;
+
+	PS5000A_TRIGGER_INFO * triggerInfo; // Struct to store trigger timestamping information
+
+	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
+	struct tPS5000ACondition conditions;
+	struct tPS5000ADirection directions;
+
+	// Struct to hold Pulse Width Qualifier information
+	struct tPwq pulseWidth;
+
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	// If the channel is not enabled, warn the User and return
+	if (unit->channelSettings[triggerChannel].enabled == 0)
+	{
+		printf("archiveRapidBlock: Channel not enabled.");
+		return;
+	}
+
+	// If the trigger voltage level is greater than the range selected, set the threshold to half
+	// of the range selected e.g. for 200 mV, set the threshold to 100 mV
+	if (triggerVoltage > voltageRange)
+	{
+		triggerVoltage = (voltageRange / 2);
+	}
+
+	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+
+	// Set trigger channel properties
+	triggerProperties.thresholdUpper = triggerThreshold;
+	triggerProperties.thresholdUpperHysteresis = 256 * 10;
+	triggerProperties.thresholdLower = triggerThreshold;
+	triggerProperties.thresholdLowerHysteresis = 256 * 10;
+	triggerProperties.channel = triggerChannel;
+
+	// Set trigger conditions
+	conditions.source = triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+
+	// Set trigger directions
+	directions.source = triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Archive rapid block captures to the event store...\n");
+	printf("Collects when value rises past %d ", scaleVoltages ?
+		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);																// else print ADC Count
+
+	printf(scaleVoltages ? "mV\n" : "ADC Counts\n");
+
+	printf("Captures per run: ");
+	fflush(stdin);
+	scanf_s("%u", &nCaptures);
+
+	printf("Samples per capture: ");
+	scanf_s("%u", &nSamples);
+
+	if (nCaptures == 0 || nSamples == 0)
+	{
+		printf("archiveRapidBlock: The number of captures and samples must be at least 1.\n");
+		return;
+	}
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		enabledChannels += unit->channelSettings[channel].enabled;
+	}
+
+	status = ps5000aGetMaxSegments(unit->handle, &maxSegments);
+	maxCaptures = (uint32_t) (memoryAvailable(MEMORY_ACQUISITION) / ((size_t) enabledChannels * nSamples * sizeof(int16_t)));
+	nCaptures = min(nCaptures, min(maxSegments, maxCaptures));
+
+	if (nCaptures == 0)
+	{
+		printf("archiveRapidBlock: Not enough memory within the budget for a single capture (%lu MB).\n", (uint32_t) (g_memory.budget / (1024 * 1024)));
+		return;
+	}
+
+	setDefaults(unit);
+
+	// Trigger enabled
+	status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+
+	status = ps5000aMemorySegments(unit->handle, nCaptures, &nMaxSamples);
+
+	// Each capture can only hold nMaxSamples
+	if (status == PICO_OK && nSamples > (uint32_t) nMaxSamples)
+	{
+		printf("archiveRapidBlock: %lu samples per capture do not fit in %lu segments (%ld samples each).\n", nSamples, nCaptures, nMaxSamples);
+		status = PICO_TOO_MANY_SAMPLES;
+	}
+
+	if (status == PICO_OK)
+	{
+		status = ps5000aSetNoOfCaptures(unit->handle, nCaptures);
+
+		timebase = 127;		// 1 MS/s at 8-bit resolution, ~504 kS/s at 12 & 16-bit resolution
+
+		while ((status = ps5000aGetTimebase(unit->handle, timebase, nSamples, &timeIntervalNs, &maxSamples, 0)) == PICO_INVALID_TIMEBASE)
+		{
+			timebase++;
+		}
+
+		if (status != PICO_OK)
+		{
+			printf("archiveRapidBlock:ps5000aGetTimebase ------ 0x%08lx \n", status);
+		}
+	}
+
+	// The same buffers are used for every run
+	rapidBuffers = (int16_t ***) calloc(unit->channelCount, sizeof(int16_t*));
+	overflow = (int16_t *) calloc(nCaptures, sizeof(int16_t));
+	triggerInfo = (PS5000A_TRIGGER_INFO *) calloc(nCaptures, sizeof(PS5000A_TRIGGER_INFO));
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			rapidBuffers[channel] = (int16_t **) calloc(nCaptures, sizeof(int16_t*));
+
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				rapidBuffers[channel][capture] = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, nSamples, sizeof(int16_t));
+				allocationFailed |= (rapidBuffers[channel][capture] == NULL);
+			}
+		}
+	}
+
+	if (allocationFailed || status != PICO_OK)
+	{
+		printf("archiveRapidBlock: Cannot set up %lu captures of %lu samples.\n", nCaptures, nSamples);
+		stop = TRUE;
+	}
+	else
+	{
+		printf("\nTimebase: %lu  SampleInterval: %ld ns\n", timebase, timeIntervalNs);
+		printf("%lu captures of %lu samples per run. Press any key to stop\n\n", nCaptures, nSamples);
+	}
+
+	while (!stop)
+	{
+		runStartUs = wallClockUs();
+		g_ready = FALSE;
+
+		stage = traceBegin();
+		PROBE2(run_block_arm, nSamples, timebase);
+		status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+		traceEnd("RunBlock", stage, nCaptures);
+
+		if (status != PICO_OK)
+		{
+			printf("archiveRapidBlock:ps5000aRunBlock ------ 0x%08lx \n", status);
+			break;
+		}
+
+		stage = traceBegin();
+
+		while (!g_ready && !_kbhit())
+		{
+			Sleep(0);
+		}
+
+		traceEnd("Wait for data", stage, 0);
+
+		nCompletedCaptures = nCaptures;
+
+		if (!g_ready)
+		{
+			// Keep the segments that were captured before the key was pressed
+			_getch();
+			status = ps5000aStop(unit->handle);
+			status = ps5000aGetNoOfCaptures(unit->handle, &nCompletedCaptures);
+			stop = TRUE;
+
+			if (nCompletedCaptures == 0)
+			{
+				break;
+			}
+		}
+
+		for (channel = 0; channel < unit->channelCount; channel++)
+		{
+			if (unit->channelSettings[channel].enabled)
+			{
+				for (capture = 0; capture < nCompletedCaptures; capture++)
+				{
+					status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) channel, rapidBuffers[channel][capture], nSamples, capture, PS5000A_RATIO_MODE_NONE);
+				}
+			}
+		}
+
+		stage = traceBegin();
+		PROBE2(get_values_start, nSamples, nCompletedCaptures);
+		status = ps5000aGetValuesBulk(unit->handle, &nSamples, 0, nCompletedCaptures - 1, 1, PS5000A_RATIO_MODE_NONE, overflow);
+		PROBE2(get_values_end, nSamples, status);
+		traceEnd("GetValuesBulk", stage, (int64_t) nCompletedCaptures * nSamples);
+
+		if (status == PICO_OK)
+		{
+			stage = traceBegin();
+			status = ps5000aGetTriggerInfoBulk(unit->handle, triggerInfo, 0, nCompletedCaptures - 1);
+			traceEnd("GetTriggerInfoBulk", stage, nCompletedCaptures);
+		}
+
+		if (status != PICO_OK)
+		{
+			printf("archiveRapidBlock: Data retrieval failed ------ 0x%08lx \n", status);
+			break;
+		}
+
+		for (capture = 0; capture < nCompletedCaptures; capture++)
+		{
+			metricsAddSamples(unit, nSamples, overflow[capture]);
+		}
+
+		metricsAdd(&g_metrics.captures[1], nCompletedCaptures);
+
+		stage = traceBegin();
+		nEvents += eventStoreAppend(unit, rapidBuffers, overflow, triggerInfo, nCompletedCaptures, nSamples, timeIntervalNs, runStartUs);
+		traceEnd("Event store", stage, nCompletedCaptures);
+		nRuns++;
+
+		printf("\rRuns: %lu  Events stored: %llu", nRuns, (unsigned long long) nEvents);
+
+		if (_kbhit())
+		{
+			_getch();
+			stop = TRUE;
+		}
+	}
+
+	printf("\n%llu events from %lu runs added to %s\n", (unsigned long long) nEvents, nRuns, EVENT_INDEX_FILE);
+
+	status = ps5000aStop(unit->handle);
+
+	for (channel = 0; channel < unit->channelCount; channel++)
+	{
+		if (unit->channelSettings[channel].enabled)
+		{
+			for (capture = 0; capture < nCaptures; capture++)
+			{
+				ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) channel, NULL, 0, capture, PS5000A_RATIO_MODE_NONE);
+			}
+		}
+	}
+
+	freeRapidBuffers(unit, rapidBuffers, nCaptures);
+	free(overflow);
+	free(triggerInfo);
+}
+
+/****************************************************************************
+* Repeated block capture
+*
+* A test bench with a repetitive trigger captures the same block over and
+* over. The usual sequence is RunBlock, wait for the callback and then
+* GetValues (or GetValuesBulk), so every capture costs an extra round trip
+* to the device before the next one can start.
+*
+* ps5000aGetValuesOverlapped and ps5000aGetValuesOverlappedBulk set up the
+* retrieval before RunBlock, and the driver copies the data into the
+* registered buffers as part of the capture. When the callback fires the
+* data is already in memory. A pool of REPEAT_POOL_SIZE buffer sets is
+* registered in turn, so one capture can be processed while the next one
+* is running.
+****************************************************************************/
+#define REPEAT_POOL_SIZE	2
+
+typedef struct tRepeatBufferSet
+{
+	int16_t *	buffers[PS5000A_MAX_CHANNELS];		// segments * samples values for each enabled channel
+	int16_t *	overflow;													// One set of flags per segment
+	uint32_t	samples;													// Updated by the driver when the data is retrieved
+}REPEAT_BUFFER_SET;
+
+typedef struct tRepeatStatistics
+{
+	uint32_t	captures;
+	int16_t		minimum[PS5000A_MAX_CHANNELS];
+	int16_t		maximum[PS5000A_MAX_CHANNELS];
+	double		sum[PS5000A_MAX_CHANNELS];
+	uint64_t	count;
+	int16_t		overflow;
+}REPEAT_STATISTICS;
+
+/****************************************************************************
+* registerRepeatBuffers
+*
+* Registers one buffer set for every segment and enabled channel
+****************************************************************************/
+PICO_STATUS registerRepeatBuffers(UNIT * unit, REPEAT_BUFFER_SET * set, uint32_t nSegments, uint32_t nSamples)
+{
+	int16_t ch;
+	uint32_t segment;
+	PICO_STATUS status = PICO_OK;
+
+	for (ch = 0; ch < unit->channelCount && status == PICO_OK; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			for (segment = 0; segment < nSegments && status == PICO_OK; segment++)
+			{
+				status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, set->buffers[ch] == NULL ? NULL : set->buffers[ch] + (size_t) segment * nSamples,
+					set->buffers[ch] == NULL ? 0 : nSamples, segment, PS5000A_RATIO_MODE_NONE);
+			}
+		}
+	}
+
+	if (status != PICO_OK)
+	{
+		printf("registerRepeatBuffers:ps5000aSetDataBuffer ------ 0x%08lx \n", status);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* processRepeatedCapture
+*
+* Stands in for the work a test bench does on each capture - here the
+* minimum, maximum and mean of each enabled channel
+****************************************************************************/
+void processRepeatedCapture(UNIT * unit, REPEAT_BUFFER_SET * set, uint32_t nSegments, uint32_t nSamples, REPEAT_STATISTICS * statistics)
+{
+	int16_t ch;
+	uint32_t segment;
+	uint32_t i;
+	int16_t * values;
+
+	for (segment = 0; segment < nSegments; segment++)
+	{
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (unit->channelSettings[ch].enabled)
+			{
+				values = set->buffers[ch] + (size_t) segment * nSamples;
+
+				for (i = 0; i < set->samples; i++)
+				{
+					statistics->minimum[ch] = min(statistics->minimum[ch], values[i]);
+					statistics->maximum[ch] = max(statistics->maximum[ch], values[i]);
+					statistics->sum[ch] += values[i];
+				}
+			}
+		}
+
+		statistics->overflow |= set->overflow[segment];
+		statistics->count += set->samples;
+		statistics->captures++;
+	}
+}
+
+/****************************************************************************
+* runRepeatedCaptures
+*
+* Runs nRuns captures of nSegments segments each, either with the usual
+* RunBlock then GetValues sequence or with overlapped retrieval, and returns
+* the time taken in microseconds, or -1 if the runs did not complete
+****************************************************************************/
+int64_t runRepeatedCaptures(UNIT * unit, int16_t overlapped, uint32_t nRuns, uint32_t nSegments, uint32_t nSamples,
+	REPEAT_BUFFER_SET * pool, REPEAT_STATISTICS * statistics)
+{
+	int16_t ch;
+	int32_t timeIndisposed;
+	uint32_t run;
+	REPEAT_BUFFER_SET * set;
+	REPEAT_BUFFER_SET * next;
+	int64_t startTime;
+	PICO_STATUS status = PICO_OK;
+
+	memset(statistics, 0, sizeof(REPEAT_STATISTICS));
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		statistics->minimum[ch] = 32767;
+		statistics->maximum[ch] = -32768;
+	}
+
+	startTime = timeNowUs();
+
+	if (overlapped)
+	{
+		// Set up the first retrieval before the first capture starts
+		set = &pool[0];
+		set->samples = nSamples;
+		status = registerRepeatBuffers(unit, set, nSegments, nSamples);
+
+		if (status == PICO_OK)
+		{
+			status = (nSegments == 1) ? ps5000aGetValuesOverlapped(unit->handle, 0, &set->samples, 1, PS5000A_RATIO_MODE_NONE, 0, set->overflow)
+				: ps5000aGetValuesOverlappedBulk(unit->handle, 0, &set->samples, 1, PS5000A_RATIO_MODE_NONE, 0, nSegments - 1, set->overflow);
+		}
+
+		g_ready = FALSE;
+
+		if (status == PICO_OK)
+		{
+			status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+		}
+
+		for (run = 0; run < nRuns && status == PICO_OK; run++)
+		{
+			set = &pool[run % REPEAT_POOL_SIZE];
+
+			while (!g_ready && !_kbhit())
+			{
+				Sleep(0);
+			}
+
+			if (!g_ready)
+			{
+				_getch();
+				status = PICO_CANCELLED;
+				break;
+			}
+
+			// The data is already in this set's buffers, so start the next capture into the next set before processing it
+			if (run + 1 < nRuns)
+			{
+				next = &pool[(run + 1) % REPEAT_POOL_SIZE];
+				next->samples = nSamples;
+				status = registerRepeatBuffers(unit, next, nSegments, nSamples);
+
+				if (status == PICO_OK)
+				{
+					status = (nSegments == 1) ? ps5000aGetValuesOverlapped(unit->handle, 0, &next->samples, 1, PS5000A_RATIO_MODE_NONE, 0, next->overflow)
+						: ps5000aGetValuesOverlappedBulk(unit->handle, 0, &next->samples, 1, PS5000A_RATIO_MODE_NONE, 0, nSegments - 1, next->overflow);
+				}
+
+				g_ready = FALSE;
+
+				if (status == PICO_OK)
+				{
+					status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+				}
+			}
+
+			processRepeatedCapture(unit, set, nSegments, nSamples, statistics);
+		}
+	}
+	else
+	{
+		set = &pool[0];
+
+		for (run = 0; run < nRuns && status == PICO_OK; run++)
+		{
+			g_ready = FALSE;
+			status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+
+			while (status == PICO_OK && !g_ready && !_kbhit())
+			{
+				Sleep(0);
+			}
+
+			if (status == PICO_OK && !g_ready)
+			{
+				_getch();
+				status = PICO_CANCELLED;
+				break;
+			}
+
+			if (status == PICO_OK)
+			{
+				status = registerRepeatBuffers(unit, set, nSegments, nSamples);
+			}
+
+			if (status == PICO_OK)
+			{
+				set->samples = nSamples;
+				status = (nSegments == 1) ? ps5000aGetValues(unit->handle, 0, &set->samples, 1, PS5000A_RATIO_MODE_NONE, 0, set->overflow)
+					: ps5000aGetValuesBulk(unit->handle, &set->samples, 0, nSegments - 1, 1, PS5000A_RATIO_MODE_NONE, set->overflow);
+			}
+
+			if (status == PICO_OK)
+			{
+				processRepeatedCapture(unit, set, nSegments, nSamples, statistics);
+			}
+		}
+	}
+
+	ps5000aStop(unit->handle);
+
+	if (status == PICO_CANCELLED)
+	{
+		printf("Repeated captures aborted after %lu captures\n", statistics->captures);
+		return -1;
+	}
+	else if (status != PICO_OK)
+	{
+		printf("runRepeatedCaptures: Capture %lu failed ------ 0x%08lx \n", statistics->captures, status);
+		return -1;
+	}
+
+	return timeNowUs() - startTime;
+}
+
+/****************************************************************************
+* displayRepeatStatistics
+****************************************************************************/
+void displayRepeatStatistics(UNIT * unit, int8_t * text, int64_t elapsedUs, REPEAT_STATISTICS * statistics)
+{
+	int16_t ch;
+
+	printf("%s %lu captures in %.1f ms, %.1f captures/s\n", text, statistics->captures, elapsedUs / 1000.0,
+		statistics->captures / max(elapsedUs / 1000000.0, 1e-6));
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled && statistics->count > 0)
+		{
+			printf("   Channel %c: min %+6dmV  max %+6dmV  mean %+8.1fmV%s\n", 'A' + ch,
+				adc_to_mv(statistics->minimum[ch], unit->channelSettings[ch].range, unit),
+				adc_to_mv(statistics->maximum[ch], unit->channelSettings[ch].range, unit),
+				(statistics->sum[ch] / statistics->count) * inputRanges[unit->channelSettings[ch].range] / unit->maxADCValue,
+				(statistics->overflow & (1 << ch)) ? "  (over range)" : "");
+		}
+	}
+}
+
+/****************************************************************************
+* collectRepeatedBlock
+*  this function demonstrates how to collect many triggered blocks using
+*  overlapped retrieval and compares the capture rate with the usual
+*  RunBlock then GetValues sequence
+****************************************************************************/
+void collectRepeatedBlock(UNIT * unit)
+{
+	int16_t triggerVoltage = 1000; // mV
+	PS5000A_CHANNEL triggerChannel = PS5000A_CHANNEL_A;
+	int16_t voltageRange = inputRanges[unit->channelSettings[triggerChannel].range];
+	int16_t triggerThreshold = 0;
+	int16_t ch;
+	int16_t allocationFailed = FALSE;
+	int32_t i;
+	int32_t timeIntervalNs = 0;
+	int32_t maxSamples = 0;
+	int32_t nMaxSamples = 0;
+	uint32_t nRuns = 100;
+	uint32_t nSegments = 1;
+	uint32_t nSamples = 1000;
+	uint32_t maxSegments = 0;
+	int64_t sequentialUs;
+	int64_t overlappedUs = -1;
+	PICO_STATUS status;
+	REPEAT_BUFFER_SET pool[REPEAT_POOL_SIZE];
+	REPEAT_STATISTICS statistics;
+
+	// Structures for setting up trigger - declare each as an array of multiple structures if using multiple channels
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
+	struct tPS5000ACondition conditions;
+	struct tPS5000ADirection directions;
+
+	// Struct to hold Pulse Width Qualifier information
+	struct tPwq pulseWidth;
+
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+	memset(pool, 0, sizeof(pool));
+
+	// If the channel is not enabled, warn the User and return
+	if (unit->channelSettings[triggerChannel].enabled == 0)
+	{
+		printf("collectRepeatedBlock: Channel not enabled.");
+		return;
+	}
+
+	// If the trigger voltage level is greater than the range selected, set the threshold to half
+	// of the range selected e.g. for 200 mV, set the threshold to 100 mV
+	if (triggerVoltage > voltageRange)
+	{
+		triggerVoltage = (voltageRange / 2);
+	}
+
+	triggerThreshold = mv_to_adc(triggerVoltage, unit->channelSettings[triggerChannel].range, unit);
+
+	// Set trigger channel properties
+	triggerProperties.thresholdUpper = triggerThreshold;
+	triggerProperties.thresholdUpperHysteresis = 256 * 10;
+	triggerProperties.thresholdLower = triggerThreshold;
+	triggerProperties.thresholdLowerHysteresis = 256 * 10;
+	triggerProperties.channel = triggerChannel;
+
+	// Set trigger conditions
+	conditions.source = triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+
+	// Set trigger directions
+	directions.source = triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Collect repeated blocks triggered...\n");
+	printf("Collects when value rises past %d ", scaleVoltages ?
+		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[PS5000A_CHANNEL_A].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);																// else print ADC Count
+
+	printf(scaleVoltages ? "mV\n" : "ADC Counts\n");
+
+	printf("Number of runs: ");
+	fflush(stdin);
+	scanf_s("%u", &nRuns);
+
+	printf("Captures per run (1 for block mode, more for rapid block mode): ");
+	scanf_s("%u", &nSegments);
+
+	printf("Samples per capture: ");
+	scanf_s("%u", &nSamples);
+
+	status = ps5000aGetMaxSegments(unit->handle, &maxSegments);
+	nSegments = min(nSegments, maxSegments);
+
+	if (nRuns == 0 || nSegments == 0 || nSamples == 0)
+	{
+		printf("collectRepeatedBlock: The number of runs, captures and samples must be at least 1.\n");
+		return;
+	}
+
+	// Each buffer set in the pool holds a whole run
+	for (i = 0; i < REPEAT_POOL_SIZE; i++)
+	{
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (unit->channelSettings[ch].enabled)
+			{
+				pool[i].buffers[ch] = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, (size_t) nSegments * nSamples, sizeof(int16_t));
+				allocationFailed |= (pool[i].buffers[ch] == NULL);
+			}
+		}
+
+		pool[i].overflow = (int16_t *) calloc(nSegments, sizeof(int16_t));
+	}
+
+	if (allocationFailed)
+	{
+		printf("collectRepeatedBlock: %d buffer sets would exceed the memory budget (%lu MB).\n", REPEAT_POOL_SIZE, (uint32_t) (g_memory.budget / (1024 * 1024)));
+	}
+	else
+	{
+		setDefaults(unit);
+
+		// Trigger enabled
+		status = setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+
+		status = ps5000aMemorySegments(unit->handle, nSegments, &nMaxSamples);
+
+		// Each capture can only hold nMaxSamples
+		if (status == PICO_OK && nSamples > (uint32_t) nMaxSamples)
+		{
+			printf("collectRepeatedBlock: %lu samples per capture do not fit in %lu segments (%ld samples each).\n", nSamples, nSegments, nMaxSamples);
+			status = PICO_TOO_MANY_SAMPLES;
+		}
+
+		if (status == PICO_OK)
+		{
+			status = ps5000aSetNoOfCaptures(unit->handle, nSegments);
+
+			while ((status = ps5000aGetTimebase(unit->handle, timebase, nSamples, &timeIntervalNs, &maxSamples, 0)) == PICO_INVALID_TIMEBASE)
+			{
+				timebase++;
+			}
+
+			if (status == PICO_INVALID_NUMBER_CHANNELS_FOR_RESOLUTION)
+			{
+				printf("collectRepeatedBlock: Error - Invalid number of channels for resolution.\n");
+			}
+			else if (status != PICO_OK)
+			{
+				printf("collectRepeatedBlock:ps5000aGetTimebase ------ 0x%08lx \n", status);
+			}
+		}
+
+		if (status == PICO_OK)
+		{
+			printf("\nTimebase: %lu  SampleInterval: %ld ns\n", timebase, timeIntervalNs);
+			printf("%lu runs of %lu x %lu samples. Press any key to abort\n\n", nRuns, nSegments, nSamples);
+
+			sequentialUs = runRepeatedCaptures(unit, FALSE, nRuns, nSegments, nSamples, pool, &statistics);
+
+			if (sequentialUs >= 0)
+			{
+				displayRepeatStatistics(unit, (int8_t *) "RunBlock then GetValues:", sequentialUs, &statistics);
+				overlappedUs = runRepeatedCaptures(unit, TRUE, nRuns, nSegments, nSamples, pool, &statistics);
+			}
+
+			if (overlappedUs >= 0)
+			{
+				displayRepeatStatistics(unit, (int8_t *) "Overlapped retrieval:   ", overlappedUs, &statistics);
+				printf("Overlapped retrieval gives %.2f times the capture rate of RunBlock then GetValues\n", (double) sequentialUs / max(overlappedUs, 1));
+			}
+		}
+
+		// Unregister the buffers before they are freed and go back to a single segment
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (unit->channelSettings[ch].enabled)
+			{
+				for (i = 0; i < (int32_t) nSegments; i++)
+				{
+					ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, NULL, 0, i, PS5000A_RATIO_MODE_NONE);
+				}
+			}
+		}
+
+		status = ps5000aSetNoOfCaptures(unit->handle, 1);
+		status = ps5000aMemorySegments(unit->handle, 1, &nMaxSamples);
+	}
+
+	for (i = 0; i < REPEAT_POOL_SIZE; i++)
+	{
+		for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+		{
+			memoryFree(pool[i].buffers[ch]);
+		}
+
+		free(pool[i].overflow);
+	}
+}
+
+/****************************************************************************
+* Test sequences
+*
+* A sequence file lists capture steps, one per line:
+*
+*   name bits ranges interval samples segments trigger level siggen frequency pkpk
+*
+*   name      : label used in the name of the step's data file
+*   bits      : resolution - 8, 12, 14, 15 or 16
+*   ranges    : comma separated input ranges in mV for channels A, B... (0 = off)
+*   interval  : longest acceptable sample interval in ns
+*   samples   : samples per capture
+*   segments  : number of rapid block captures (1 for a single block)
+*   trigger   : A..D for a rising edge trigger, or - for none
+*   level     : trigger level in mV
+*   siggen    : off, sine, square, triangle, dc or awg:<file of values>
+*   frequency : signal generator frequency in Hz
+*   pkpk      : signal generator peak to peak voltage in mV
+*
+* e.g.
+*
+*   # name  bits ranges     interval samples segments trigger level siggen frequency pkpk
+*   ref     8    5000,5000  100      10000   1        A       500   sine   1000      2000
+*   fine    12   2000,0     100      10000   10       A       200   sine   1000      2000
+*
+* Every step is parsed and its driver parameters (timebase, ranges, AWG
+* waveform and phase) worked out before the first capture.
+* Steps are then run grouped by resolution and segment count, because
+* changing either takes far longer than any other setting, and only the
+* settings that differ from the previous step are sent to the device.
+* While the scope captures one step, the previous step's data is written
+* to disk.
+****************************************************************************/
+#define SEQUENCE_MAX_STEPS				256
+#define SEQUENCE_MAX_AWG					8
+#define SEQUENCE_NAME_LENGTH			32
+#define SEQUENCE_AUTO_TRIGGER_US	1000000
+
+typedef struct tSequenceStep
+{
+	int8_t											name[SEQUENCE_NAME_LENGTH];
+	int16_t											line;							// Line of the sequence file
+	PS5000A_DEVICE_RESOLUTION		resolution;
+	int16_t											enabled[PS5000A_MAX_CHANNELS];
+	PS5000A_RANGE								range[PS5000A_MAX_CHANNELS];
+	uint32_t										intervalNs;
+	uint32_t										timebase;
+	uint32_t										samples;
+	uint32_t										segments;
+	int16_t											triggerEnabled;
+	PS5000A_CHANNEL							triggerChannel;
+	int16_t											triggerMv;
+	int16_t											sigGenEnabled;
+	PS5000A_WAVE_TYPE						waveform;
+	int16_t											awgIndex;					// -1 for the built in waveforms
+	double											frequency;
+	uint32_t										pkpk;							// Microvolts
+	uint32_t										deltaPhase;				// AWG only
+}SEQUENCE_STEP;
+
+typedef struct tSequenceAwg
+{
+	int8_t		fileName[CATALOGUE_FILE_NAME_LENGTH];
+	int16_t *	waveform;
+	int32_t		size;
+}SEQUENCE_AWG;
+
+typedef struct tSequence
+{
+	SEQUENCE_STEP		steps[SEQUENCE_MAX_STEPS];
+	int16_t					nSteps;
+	SEQUENCE_AWG		awg[SEQUENCE_MAX_AWG];
+	int16_t					nAwg;
+}SEQUENCE;
+
+// A step that has been captured, waiting to be written to disk
+typedef struct tSequenceCapture
+{
+	SEQUENCE_STEP *		step;
+	int16_t *					buffers[PS5000A_MAX_CHANNELS];		// segments * samples values for each enabled channel
+	int16_t *					overflow;													// One set of flags per segment
+	uint32_t					samples;													// Samples retrieved per segment
+	int32_t						sampleIntervalNs;
+	int16_t						triggerThreshold;
+	int16_t						maxADCValue;
+	FILE *						fp;
+	int8_t						fileName[CATALOGUE_FILE_NAME_LENGTH];
+	CATALOGUE_RECORD	record;
+}SEQUENCE_CAPTURE;
+
+typedef struct tSequenceStatistics
+{
+	int32_t resolutionChanges;
+	int32_t segmentChanges;
+	int32_t channelChanges;
+	int32_t triggerChanges;
+	int32_t sigGenChanges;
+}SEQUENCE_STATISTICS;
+
+/****************************************************************************
+* sequenceTimebase
+*
+* Returns the timebase giving the longest sample interval that is no longer
+* than intervalNs at the given resolution, using the timebase equations
+* from the ps5000a Programmer's Guide
+****************************************************************************/
+uint32_t sequenceTimebase(PS5000A_DEVICE_RESOLUTION resolution, uint32_t intervalNs)
+{
+	switch (resolution)
+	{
+		case PS5000A_DR_8BIT:
+			// 1, 2, 4 ns then (n - 2) * 8 ns
+			if (intervalNs < 8)
+			{
+				return (intervalNs >= 4) ? 2 : (intervalNs >= 2) ? 1 : 0;
+			}
+
+			return intervalNs / 8 + 2;
+
+		case PS5000A_DR_12BIT:
+			// 2, 4, 8 ns then (n - 3) * 16 ns
+			if (intervalNs < 16)
+			{
+				return (intervalNs >= 8) ? 3 : (intervalNs >= 4) ? 2 : 1;
+			}
+
+			return intervalNs / 16 + 3;
+
+		case PS5000A_DR_14BIT:
+		case PS5000A_DR_15BIT:
+			// 8 ns then (n - 2) * 8 ns
+			return max(intervalNs / 8, 1) + 2;
+
+		default:
+			// 16 ns then (n - 3) * 16 ns
+			return max(intervalNs / 16, 1) + 3;
+	}
+}
+
+/****************************************************************************
+* sequenceRange
+*
+* Returns the smallest input range of the unit that covers mv
+****************************************************************************/
+PS5000A_RANGE sequenceRange(UNIT * unit, int32_t mv)
+{
+	int16_t range;
+
+	for (range = unit->firstRange; range < unit->lastRange; range++)
+	{
+		if (inputRanges[range] >= mv)
+		{
+			break;
+		}
+	}
+
+	return (PS5000A_RANGE) range;
+}
+
+/****************************************************************************
+* loadSequenceAwg
+*
+* Loads an arbitrary waveform file, once however many steps use it
+****************************************************************************/
+int16_t loadSequenceAwg(UNIT * unit, SEQUENCE * sequence, int8_t * fileName)
+{
+	int16_t i;
+	FILE * fp = NULL;
+	SEQUENCE_AWG * awg;
+
+	for (i = 0; i < sequence->nAwg; i++)
+	{
+		if (strcmp((char *) sequence->awg[i].fileName, (char *) fileName) == 0)
+		{
+			return i;
+		}
+	}
+
+	if (sequence->nAwg == SEQUENCE_MAX_AWG)
+	{
+		printf("Too many arbitrary waveforms (maximum %d).\n", SEQUENCE_MAX_AWG);
+		return -1;
+	}
+
+	fopen_s(&fp, fileName, "r");
+
+	if (fp == NULL)
+	{
+		printf("Cannot open the waveform file %s.\n", fileName);
+		return -1;
+	}
+
+	awg = &sequence->awg[sequence->nAwg];
+	strncpy((char *) awg->fileName, (char *) fileName, sizeof(awg->fileName) - 1);
+	awg->waveform = (int16_t *) calloc(unit->awgBufferSize, sizeof(int16_t));
+	awg->size = 0;
+
+	while (awg->size < unit->awgBufferSize && fscanf_s(fp, "%hi", &awg->waveform[awg->size]) == 1)
+	{
+		awg->size++;
+	}
+
+	fclose(fp);
+
+	if (awg->size < MIN_SIG_GEN_BUFFER_SIZE)
+	{
+		printf("The waveform file %s needs at least %d values.\n", fileName, MIN_SIG_GEN_BUFFER_SIZE);
+		free(awg->waveform);
+		return -1;
+	}
+
+	return sequence->nAwg++;
+}
+
+/****************************************************************************
+* loadSequence
+*
+* Reads a sequence file and works out the driver parameters of every step
+* Returns TRUE if every step is valid
+****************************************************************************/
+int16_t loadSequence(UNIT * unit, SEQUENCE * sequence, int8_t * fileName)
+{
+	int8_t line[256];
+	int8_t ranges[64];
+	int8_t trigger[8];
+	int8_t sigGen[CATALOGUE_FILE_NAME_LENGTH + 8];
+	int8_t * range;
+	int16_t lineNumber = 0;
+	int16_t enabledChannels;
+	int16_t availableChannels;
+	int16_t ch;
+	int32_t bits;
+	int32_t mv;
+	int32_t triggerMv;
+	int32_t pkpkMv;
+	int16_t valid = TRUE;
+	FILE * fp = NULL;
+	SEQUENCE_STEP * step;
+	PICO_STATUS status;
+
+	memset(sequence, 0, sizeof(SEQUENCE));
+
+	fopen_s(&fp, fileName, "r");
+
+	if (fp == NULL)
+	{
+		printf("Cannot open the sequence file %s.\n", fileName);
+		return FALSE;
+	}
+
+	// Channels C and D cannot be used on a 4-channel scope without its power supply
+	availableChannels = unit->channelCount;
+
+	if (unit->channelCount == QUAD_SCOPE && ps5000aCurrentPowerSource(unit->handle) == PICO_POWER_SUPPLY_NOT_CONNECTED)
+	{
+		availableChannels = DUAL_SCOPE;
+	}
+
+	while (fgets((char *) line, sizeof(line), fp) != NULL)
+	{
+		lineNumber++;
+
+		if (line[0] == '#' || line[0] == '\r' || line[0] == '\n')
+		{
+			continue;
+		}
+
+		if (sequence->nSteps == SEQUENCE_MAX_STEPS)
+		{
+			printf("Line %d: Too many steps (maximum %d).\n", lineNumber, SEQUENCE_MAX_STEPS);
+			valid = FALSE;
+			break;
+		}
+
+		step = &sequence->steps[sequence->nSteps];
+		memset(step, 0, sizeof(SEQUENCE_STEP));
+		step->line = lineNumber;
+
+		if (sscanf((char *) line, "%31s %d %63s %u %u %u %7s %d %87s %lf %d", step->name, &bits, ranges, &step->intervalNs,
+			&step->samples, &step->segments, trigger, &triggerMv, sigGen, &step->frequency, &pkpkMv) != 11)
+		{
+			printf("Line %d: Expected 11 fields.\n", lineNumber);
+			valid = FALSE;
+			continue;
+		}
+
+		switch (bits)
+		{
+			case 8:
+				step->resolution = PS5000A_DR_8BIT;
+				break;
+
+			case 12:
+				step->resolution = PS5000A_DR_12BIT;
+				break;
+
+			case 14:
+				step->resolution = PS5000A_DR_14BIT;
+				break;
+
+			case 15:
+				step->resolution = PS5000A_DR_15BIT;
+				break;
+
+			case 16:
+				step->resolution = PS5000A_DR_16BIT;
+				break;
+
+			default:
+				printf("Line %d: Invalid resolution %d bits.\n", lineNumber, bits);
+				valid = FALSE;
+				continue;
+		}
+
+		// Input ranges
+		enabledChannels = 0;
+		range = (int8_t *) strtok((char *) ranges, ",");
+
+		for (ch = 0; ch < unit->channelCount && range != NULL; ch++)
+		{
+			mv = atoi((char *) range);
+
+			if (mv > 0)
+			{
+				if (ch >= availableChannels)
+				{
+					printf("Line %d: Channel %c cannot be used without the power supply.\n", lineNumber, 'A' + ch);
+					valid = FALSE;
+				}
+
+				step->enabled[ch] = TRUE;
+				step->range[ch] = sequenceRange(unit, mv);
+				enabledChannels++;
+			}
+
+			range = (int8_t *) strtok(NULL, ",");
+		}
+
+		if (enabledChannels == 0)
+		{
+			printf("Line %d: No channels enabled.\n", lineNumber);
+			valid = FALSE;
+		}
+		else if ((step->resolution == PS5000A_DR_16BIT && enabledChannels > 1) || (step->resolution == PS5000A_DR_15BIT && enabledChannels > 2))
+		{
+			printf("Line %d: Too many channels enabled for %d bit resolution.\n", lineNumber, bits);
+			valid = FALSE;
+		}
+
+		if (step->samples == 0 || step->segments == 0)
+		{
+			printf("Line %d: Samples and segments must be at least 1.\n", lineNumber);
+			valid = FALSE;
+		}
+
+		step->timebase = sequenceTimebase(step->resolution, step->intervalNs);
+
+		// Trigger
+		if (trigger[0] != '-')
+		{
+			step->triggerEnabled = TRUE;
+			step->triggerChannel = (PS5000A_CHANNEL) (toupper(trigger[0]) - 'A');
+			step->triggerMv = (int16_t) triggerMv;
+
+			if (step->triggerChannel < PS5000A_CHANNEL_A || step->triggerChannel >= unit->channelCount || !step->enabled[step->triggerChannel])
+			{
+				printf("Line %d: Trigger channel %s is not enabled.\n", lineNumber, trigger);
+				valid = FALSE;
+			}
+			else if (abs(triggerMv) > inputRanges[step->range[step->triggerChannel]])
+			{
+				printf("Line %d: Trigger level %d mV is outside the channel's range.\n", lineNumber, triggerMv);
+				valid = FALSE;
+			}
+		}
+
+		// Signal generator
+		step->awgIndex = -1;
+		step->pkpk = (uint32_t) pkpkMv * 1000;
+		step->sigGenEnabled = (strcmp((char *) sigGen, "off") != 0);
+
+		if (step->sigGenEnabled && unit->sigGen == SIGGEN_NONE)
+		{
+			printf("Line %d: This model does not have a signal generator.\n", lineNumber);
+			valid = FALSE;
+		}
+		else if (strcmp((char *) sigGen, "sine") == 0)
+		{
+			step->waveform = PS5000A_SINE;
+		}
+		else if (strcmp((char *) sigGen, "square") == 0)
+		{
+			step->waveform = PS5000A_SQUARE;
+		}
+		else if (strcmp((char *) sigGen, "triangle") == 0)
+		{
+			step->waveform = PS5000A_TRIANGLE;
+		}
+		else if (strcmp((char *) sigGen, "dc") == 0)
+		{
+			step->waveform = PS5000A_DC_VOLTAGE;
+		}
+		else if (strncmp((char *) sigGen, "awg:", 4) == 0 && unit->sigGen == SIGGEN_AWG)
+		{
+			step->awgIndex = loadSequenceAwg(unit, sequence, sigGen + 4);
+
+			if (step->awgIndex < 0)
+			{
+				valid = FALSE;
+			}
+			else
+			{
+				status = ps5000aSigGenFrequencyToPhase(unit->handle, step->frequency, PS5000A_SINGLE, (uint32_t) sequence->awg[step->awgIndex].size, &step->deltaPhase);
+
+				if (status != PICO_OK)
+				{
+					printf("Line %d: ps5000aSigGenFrequencyToPhase ------ 0x%08lx \n", lineNumber, status);
+					valid = FALSE;
+				}
+			}
+		}
+		else if (step->sigGenEnabled)
+		{
+			printf("Line %d: Unknown signal generator setting %s.\n", lineNumber, sigGen);
+			valid = FALSE;
+		}
+
+		sequence->nSteps++;
+	}
+
+	fclose(fp);
+
+	if (sequence->nSteps == 0)
+	{
+		printf("The sequence file %s has no steps.\n", fileName);
+		valid = FALSE;
+	}
+
+	return valid;
+}
+
+/****************************************************************************
+* compareSequenceSteps
+*
+* Orders steps by resolution then segment count, keeping the file order
+* otherwise
+****************************************************************************/
+int compareSequenceSteps(const void * a, const void * b)
+{
+	const SEQUENCE_STEP * stepA = (const SEQUENCE_STEP *) a;
+	const SEQUENCE_STEP * stepB = (const SEQUENCE_STEP *) b;
+
+	if (stepA->resolution != stepB->resolution)
+	{
+		return (int) stepA->resolution - (int) stepB->resolution;
+	}
+
+	if (stepA->segments != stepB->segments)
+	{
+		return (stepA->segments < stepB->segments) ? -1 : 1;
+	}
+
+	return stepA->line - stepB->line;
+}
+
+/****************************************************************************
+* countSequenceChanges
+*
+* Counts the resolution and segment changes needed to run the steps in the
+* given order
+****************************************************************************/
+void countSequenceChanges(SEQUENCE * sequence, int32_t * resolutionChanges, int32_t * segmentChanges)
+{
+	int16_t i;
+
+	*resolutionChanges = 1;
+	*segmentChanges = 1;
+
+	for (i = 1; i < sequence->nSteps; i++)
+	{
+		*resolutionChanges += (sequence->steps[i].resolution != sequence->steps[i - 1].resolution);
+		*segmentChanges += (sequence->steps[i].segments != sequence->steps[i - 1].segments);
+	}
+}
+
+/****************************************************************************
+* applySequenceStep
+*
+* Sends the settings of a step that differ from those of the previous step
+* (NULL for the first step) to the device
+****************************************************************************/
+PICO_STATUS applySequenceStep(UNIT * unit, SEQUENCE * sequence, SEQUENCE_STEP * step, SEQUENCE_STEP * previous, SEQUENCE_STATISTICS * statistics)
+{
+	int16_t ch;
+	int16_t value;
+	int16_t threshold;
+	int32_t maxSamples;
+	PICO_STATUS status = PICO_OK;
+
+	// Disable channels first so that the new resolution is valid for the number of channels enabled
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (!step->enabled[ch] && (previous == NULL || previous->enabled[ch]))
+		{
+			status = ps5000aSetChannel(unit->handle, (PS5000A_CHANNEL) ch, FALSE, PS5000A_DC, step->range[ch], 0);
+			unit->channelSettings[ch].enabled = FALSE;
+			statistics->channelChanges++;
+		}
+	}
+
+	if (previous == NULL || step->resolution != previous->resolution)
+	{
+		status = ps5000aSetDeviceResolution(unit->handle, step->resolution);
+
+		if (status != PICO_OK)
+		{
+			printf("applySequenceStep:ps5000aSetDeviceResolution ------ 0x%08lx \n", status);
+			return status;
+		}
+
+		// The maximum ADC value changes between 8 bit and the higher resolutions
+		unit->resolution = step->resolution;
+		ps5000aMaximumValue(unit->handle, &value);
+		unit->maxADCValue = value;
+		statistics->resolutionChanges++;
+	}
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (step->enabled[ch] && (previous == NULL || !previous->enabled[ch] || step->range[ch] != previous->range[ch]))
+		{
+			status = ps5000aSetChannel(unit->handle, (PS5000A_CHANNEL) ch, TRUE, PS5000A_DC, step->range[ch], 0);
+
+			if (status != PICO_OK)
+			{
+				printf("applySequenceStep:ps5000aSetChannel(channel %d) ------ 0x%08lx \n", ch, status);
+				return status;
+			}
+
+			unit->channelSettings[ch].enabled = TRUE;
+			unit->channelSettings[ch].DCcoupled = TRUE;
+			unit->channelSettings[ch].range = step->range[ch];
+			unit->channelSettings[ch].analogueOffset = 0;
+			statistics->channelChanges++;
+		}
+	}
+
+	if (previous == NULL || step->segments != previous->segments)
+	{
+		status = ps5000aMemorySegments(unit->handle, step->segments, &maxSamples);
+
+		if (status != PICO_OK || (uint32_t) maxSamples < step->samples)
+		{
+			printf("applySequenceStep:ps5000aMemorySegments(%lu) ------ 0x%08lx \n", step->segments, status);
+			return (status != PICO_OK) ? status : PICO_TOO_MANY_SAMPLES;
+		}
+
+		status = ps5000aSetNoOfCaptures(unit->handle, step->segments);
+		statistics->segmentChanges++;
+	}
+
+	if (previous == NULL || step->triggerEnabled != previous->triggerEnabled || step->triggerChannel != previous->triggerChannel ||
+		step->triggerMv != previous->triggerMv || step->range[step->triggerChannel] != previous->range[step->triggerChannel] ||
+		step->resolution != previous->resolution)
+	{
+		threshold = step->triggerEnabled ? mv_to_adc(step->triggerMv, step->range[step->triggerChannel], unit) : 0;
+		status = ps5000aSetSimpleTrigger(unit->handle, step->triggerEnabled, step->triggerChannel, threshold, PS5000A_RISING, 0, SEQUENCE_AUTO_TRIGGER_US / 1000);
+
+		if (status != PICO_OK)
+		{
+			printf("applySequenceStep:ps5000aSetSimpleTrigger ------ 0x%08lx \n", status);
+			return status;
+		}
+
+		g_lastTriggerChannel = step->triggerChannel;
+		g_lastTriggerThreshold = threshold;
+		statistics->triggerChanges++;
+	}
+
+	if (step->sigGenEnabled && (previous == NULL || !previous->sigGenEnabled || step->waveform != previous->waveform ||
+		step->awgIndex != previous->awgIndex || step->frequency != previous->frequency || step->pkpk != previous->pkpk))
+	{
+		if (step->awgIndex >= 0)
+		{
+			status = ps5000aSetSigGenArbitrary(unit->handle, 0, step->pkpk, step->deltaPhase, step->deltaPhase, 0, 0,
+				sequence->awg[step->awgIndex].waveform, sequence->awg[step->awgIndex].size, (PS5000A_SWEEP_TYPE) 0, (PS5000A_EXTRA_OPERATIONS) 0,
+				PS5000A_SINGLE, 0, 0, PS5000A_SIGGEN_RISING, PS5000A_SIGGEN_NONE, 0);
+		}
+		else
+		{
+			status = ps5000aSetSigGenBuiltInV2(unit->handle, 0, step->pkpk, step->waveform, step->frequency, step->frequency, 0, 0,
+				(PS5000A_SWEEP_TYPE) 0, (PS5000A_EXTRA_OPERATIONS) 0, 0, 0, (PS5000A_SIGGEN_TRIG_TYPE) 0, (PS5000A_SIGGEN_TRIG_SOURCE) 0, 0);
+		}
+
+		printf(status ? "applySequenceStep: Signal generator error 0x%08lx \n" : "", status);
+		statistics->sigGenChanges++;
+	}
+	else if (!step->sigGenEnabled && previous != NULL && previous->sigGenEnabled)
+	{
+		// Switch the output off by generating 0 V DC
+		status = ps5000aSetSigGenBuiltInV2(unit->handle, 0, 0, PS5000A_DC_VOLTAGE, 0, 0, 0, 0,
+			(PS5000A_SWEEP_TYPE) 0, (PS5000A_EXTRA_OPERATIONS) 0, 0, 0, (PS5000A_SIGGEN_TRIG_TYPE) 0, (PS5000A_SIGGEN_TRIG_SOURCE) 0, 0);
+		statistics->sigGenChanges++;
+	}
+
+	return PICO_OK;
+}
+
+/****************************************************************************
+* freeSequenceCapture
+****************************************************************************/
+void freeSequenceCapture(SEQUENCE_CAPTURE * capture)
+{
+	int16_t ch;
+
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
+	{
+		memoryFree(capture->buffers[ch]);
+	}
+
+	memoryFree(capture->overflow);
+
+	if (capture->fp != NULL)
+	{
+		fclose(capture->fp);
+	}
+
+	memset(capture, 0, sizeof(SEQUENCE_CAPTURE));
+}
+
+/****************************************************************************
+* startSequenceCapture
+*
+* Allocates the buffers for a step, reserves its data file and starts the
+* capture
+****************************************************************************/
+PICO_STATUS startSequenceCapture(UNIT * unit, SEQUENCE_STEP * step, SEQUENCE_CAPTURE * capture)
+{
+	int16_t ch;
+	int32_t timeIndisposed;
+	int32_t maxSamples;
+	PICO_STATUS status;
+
+	memset(capture, 0, sizeof(SEQUENCE_CAPTURE));
+	capture->step = step;
+	capture->samples = step->samples;
+	capture->maxADCValue = unit->maxADCValue;
+	capture->triggerThreshold = g_lastTriggerThreshold;
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (step->enabled[ch])
+		{
+			capture->buffers[ch] = (int16_t *) memoryAlloc(MEMORY_APPLICATION, (size_t) step->segments * step->samples, sizeof(int16_t));
+
+			if (capture->buffers[ch] == NULL)
+			{
+				printf("Step %s: Capture would exceed the memory budget (%lu MB).\n", step->name, (uint32_t) (g_memory.budget / (1024 * 1024)));
+				freeSequenceCapture(capture);
+				return PICO_MEMORY_FAIL;
+			}
+		}
+	}
+
+	capture->overflow = (int16_t *) memoryAlloc(MEMORY_APPLICATION, step->segments, sizeof(int16_t));
+
+	if (capture->overflow == NULL)
+	{
+		printf("Step %s: Capture would exceed the memory budget (%lu MB).\n", step->name, (uint32_t) (g_memory.budget / (1024 * 1024)));
+		freeSequenceCapture(capture);
+		return PICO_MEMORY_FAIL;
+	}
+
+	// The timebase was worked out from the resolution alone, so step it on if too fast for the number of channels enabled
+	while ((status = ps5000aGetTimebase(unit->handle, step->timebase, step->samples, &capture->sampleIntervalNs, &maxSamples, 0)) == PICO_INVALID_TIMEBASE)
+	{
+		step->timebase++;
+	}
+
+	if (status != PICO_OK)
+	{
+		printf("startSequenceCapture:ps5000aGetTimebase ------ 0x%08lx \n", status);
+		freeSequenceCapture(capture);
+		return status;
+	}
+
+	// Reserve a unique file name now, the data is written once the next step is under way
+	catalogueBegin(unit, &capture->record, (int8_t *) "Sequence", step->name, capture->fileName);
+	fopen_s(&capture->fp, capture->fileName, "w");
+
+	g_ready = FALSE;
+	status = ps5000aRunBlock(unit->handle, 0, step->samples, step->timebase, &timeIndisposed, 0, callBackBlock, NULL);
+
+	if (status != PICO_OK)
+	{
+		printf("startSequenceCapture:ps5000aRunBlock ------ 0x%08lx \n", status);
+		freeSequenceCapture(capture);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* retrieveSequenceCapture
+*
+* Waits for a capture to complete and copies every segment to the host
+****************************************************************************/
+PICO_STATUS retrieveSequenceCapture(UNIT * unit, SEQUENCE_CAPTURE * capture)
+{
+	int16_t ch;
+	uint32_t segment;
+	SEQUENCE_STEP * step = capture->step;
+	PICO_STATUS status = PICO_OK;
+
+	while (!g_ready && !_kbhit())
+	{
+		Sleep(0);
+	}
+
+	if (!g_ready)
+	{
+		_getch();
+		ps5000aStop(unit->handle);
+		printf("Sequence aborted.\n");
+		return PICO_CANCELLED;
+	}
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (step->enabled[ch])
+		{
+			for (segment = 0; segment < step->segments && status == PICO_OK; segment++)
+			{
+				status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, capture->buffers[ch] + (size_t) segment * step->samples,
+					step->samples, segment, PS5000A_RATIO_MODE_NONE);
+			}
+		}
+	}
+
+	if (status == PICO_OK)
+	{
+		status = ps5000aGetValuesBulk(unit->handle, &capture->samples, 0, step->segments - 1, 1, PS5000A_RATIO_MODE_NONE, capture->overflow);
+	}
+
+	if (status != PICO_OK)
+	{
+		printf("retrieveSequenceCapture:ps5000aGetValuesBulk ------ 0x%08lx \n", status);
+	}
+
+	// The buffers are released once the data has been written, so unregister them
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (step->enabled[ch])
+		{
+			for (segment = 0; segment < step->segments; segment++)
+			{
+				ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, NULL, 0, segment, PS5000A_RATIO_MODE_NONE);
+			}
+		}
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* writeSequenceCapture
+*
+* Writes a retrieved step to its data file, adds it to the capture
+* catalogue and frees its buffers
+****************************************************************************/
+void writeSequenceCapture(UNIT * unit, SEQUENCE_CAPTURE * capture)
+{
+	int16_t ch;
+	int16_t overflowFlags = 0;
+	uint32_t segment;
+	uint32_t i;
+	int16_t * values;
+	SEQUENCE_STEP * step = capture->step;
+	CATALOGUE_RECORD * record = &capture->record;
+
+	if (capture->fp == NULL)
+	{
+		printf("Cannot open the file %s for writing.\n", capture->fileName);
+		freeSequenceCapture(capture);
+		return;
+	}
+
+	record->timebase = step->timebase;
+	record->sampleIntervalNs = capture->sampleIntervalNs;
+	record->sampleCount = capture->samples;
+	record->segmentCount = step->segments;
+	record->triggerEnabled = step->triggerEnabled;
+	record->triggerChannel = (int16_t) step->triggerChannel;
+	record->triggerThreshold = capture->triggerThreshold;
+
+	fprintf(capture->fp, "Sequence step %s (line %d)\n\n", step->name, step->line);
+	fprintf(capture->fp, "Timebase %lu (%ld ns), %lu samples, %lu segment(s)\n", step->timebase, capture->sampleIntervalNs, capture->samples, step->segments);
+	fprintf(capture->fp, "Results shown for each segment are ADC Count & mV for each enabled channel\n\n");
+
+	for (segment = 0; segment < step->segments; segment++)
+	{
+		fprintf(capture->fp, "Segment %lu\n", segment);
+
+		for (i = 0; i < capture->samples; i++)
+		{
+			for (ch = 0; ch < unit->channelCount; ch++)
+			{
+				if (step->enabled[ch])
+				{
+					values = capture->buffers[ch] + (size_t) segment * step->samples;
+					fprintf(capture->fp, "Ch%C  %6d = %+6dmV   ", 'A' + ch, values[i], (values[i] * inputRanges[step->range[ch]]) / capture->maxADCValue);
+				}
+			}
+
+			fprintf(capture->fp, "\n");
+		}
+
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (step->enabled[ch])
+			{
+				catalogueUpdate(record, ch, capture->buffers[ch] + (size_t) segment * step->samples, capture->samples);
+			}
+		}
+
+		overflowFlags |= capture->overflow[segment];
+	}
+
+	fclose(capture->fp);
+	capture->fp = NULL;
+
+	catalogueCommit(record, overflowFlags);
+	printf("Step %-16s written to %s%s\n", step->name, capture->fileName, overflowFlags ? " (over range)" : "");
+
+	freeSequenceCapture(capture);
+}
+
+/****************************************************************************
+* runSequence
+*
+* Runs every step of a sequence file, reconfiguring the device as little as
+* possible and writing each step's data while the next step is captured
+****************************************************************************/
+void runSequence(UNIT * unit)
+{
+	int8_t fileName[CATALOGUE_FILE_NAME_LENGTH];
+	int16_t i;
+	int16_t current = 0;
+	int16_t pending = FALSE;
+	int16_t completed = 0;
+	int16_t sigGenUsed = FALSE;
+	int32_t fileResolutionChanges;
+	int32_t fileSegmentChanges;
+	int32_t resolutionChanges;
+	int32_t segmentChanges;
+	int64_t startTime;
+	int64_t planTime;
+	int32_t maxSamples;
+	PS5000A_DEVICE_RESOLUTION resolution = unit->resolution;
+	SEQUENCE * sequence;
+	SEQUENCE_CAPTURE captures[2];
+	SEQUENCE_STATISTICS statistics;
+	CHANNEL_SETTINGS channelSettings[PS5000A_MAX_CHANNELS];
+	PICO_STATUS status = PICO_OK;
+
+	printf("Sequence file name: ");
+	fflush(stdin);
+	scanf_s("%79s", fileName, (unsigned) sizeof(fileName));
+
+	startTime = timeNowUs();
+	sequence = (SEQUENCE *) calloc(1, sizeof(SEQUENCE));
+
+	if (!loadSequence(unit, sequence, fileName))
+	{
+		for (i = 0; i < sequence->nAwg; i++)
+		{
+			free(sequence->awg[i].waveform);
+		}
+
+		free(sequence);
+		return;
+	}
+
+	countSequenceChanges(sequence, &fileResolutionChanges, &fileSegmentChanges);
+	qsort(sequence->steps, sequence->nSteps, sizeof(SEQUENCE_STEP), compareSequenceSteps);
+	countSequenceChanges(sequence, &resolutionChanges, &segmentChanges);
+
+	planTime = timeNowUs() - startTime;
+
+	printf("\n%d steps, %d resolution and %d segment changes (%d and %d in file order)\n", sequence->nSteps,
+		resolutionChanges, segmentChanges, fileResolutionChanges, fileSegmentChanges);
+	printf("Press any key to abort\n\n");
+
+	memset(&statistics, 0, sizeof(SEQUENCE_STATISTICS));
+	memset(captures, 0, sizeof(captures));
+	memcpy(channelSettings, unit->channelSettings, sizeof(channelSettings));
+
+	status = ps5000aSetEts(unit->handle, PS5000A_ETS_OFF, 0, 0, NULL);
+
+	for (i = 0; i < sequence->nSteps && status == PICO_OK; i++)
+	{
+		status = applySequenceStep(unit, sequence, &sequence->steps[i], (i > 0) ? &sequence->steps[i - 1] : NULL, &statistics);
+		sigGenUsed |= sequence->steps[i].sigGenEnabled;
+
+		if (status == PICO_OK)
+		{
+			status = startSequenceCapture(unit, &sequence->steps[i], &captures[current]);
+		}
+
+		// Write the previous step to disk while this one is being captured
+		if (pending)
+		{
+			writeSequenceCapture(unit, &captures[1 - current]);
+			completed++;
+			pending = FALSE;
+		}
+
+		if (status == PICO_OK)
+		{
+			status = retrieveSequenceCapture(unit, &captures[current]);
+
+			if (status == PICO_OK)
+			{
+				pending = TRUE;
+				current = 1 - current;
+			}
+			else
+			{
+				freeSequenceCapture(&captures[current]);
+			}
+		}
+	}
+
+	if (pending)
+	{
+		writeSequenceCapture(unit, &captures[1 - current]);
+		completed++;
+	}
+
+	printf("\n%d of %d steps completed in %.1f ms (%.1f ms planning)\n", completed, sequence->nSteps,
+		(timeNowUs() - startTime) / 1000.0, planTime / 1000.0);
+	printf("Settings sent: %d resolution, %d segment, %d channel, %d trigger, %d signal generator\n\n", statistics.resolutionChanges,
+		statistics.segmentChanges, statistics.channelChanges, statistics.triggerChanges, statistics.sigGenChanges);
+
+	if (sigGenUsed && unit->sigGen != SIGGEN_NONE)
+	{
+		ps5000aSetSigGenBuiltInV2(unit->handle, 0, 0, PS5000A_DC_VOLTAGE, 0, 0, 0, 0,
+			(PS5000A_SWEEP_TYPE) 0, (PS5000A_EXTRA_OPERATIONS) 0, 0, 0, (PS5000A_SIGGEN_TRIG_TYPE) 0, (PS5000A_SIGGEN_TRIG_SOURCE) 0, 0);
+	}
+
+	// Put the device back as it was before the sequence
+	ps5000aMemorySegments(unit->handle, 1, &maxSamples);
+	ps5000aSetNoOfCaptures(unit->handle, 1);
+
+	if (unit->resolution != resolution)
+	{
+		for (i = 0; i < unit->channelCount; i++)
+		{
+			ps5000aSetChannel(unit->handle, (PS5000A_CHANNEL) i, FALSE, PS5000A_DC, PS5000A_5V, 0);
+		}
+
+		if (ps5000aSetDeviceResolution(unit->handle, resolution) == PICO_OK)
+		{
+			unit->resolution = resolution;
+			ps5000aMaximumValue(unit->handle, &unit->maxADCValue);
+		}
+	}
+
+	memcpy(unit->channelSettings, channelSettings, sizeof(channelSettings));
+	setDefaults(unit);
+
+	for (i = 0; i < sequence->nAwg; i++)
+	{
+		free(sequence->awg[i].waveform);
+	}
+
+	free(sequence);
+}
+
+/****************************************************************************
+* Initialise unit' structure with Variant specific defaults
+****************************************************************************/
+void set_info(UNIT * unit)
+{
+	int8_t description [11][25]= { "Driver Version",
+		"USB Version",
+		"Hardware Version",
+		"Variant Info",
+		"Serial",
+		"Cal Date",
+		"Kernel Version",
+		"Digital HW Version",
+		"Analogue HW Version",
+		"Firmware 1",
+		"Firmware 2"};
+
+	int16_t i = 0;
+	int16_t requiredSize = 0;
+	int8_t line [80];
+	int32_t variant;
+	PICO_STATUS status = PICO_OK;
+
+	// Variables used for arbitrary waveform parameters
+	int16_t			minArbitraryWaveformValue = 0;
+	int16_t			maxArbitraryWaveformValue = 0;
+	uint32_t		minArbitraryWaveformSize = 0;
+	uint32_t		maxArbitraryWaveformSize = 0;
+
+	//Initialise default unit properties and change when required
+	unit->sigGen = SIGGEN_FUNCTGEN;
+	unit->firstRange = PS5000A_10MV;
+	unit->lastRange = PS5000A_20V;
+	unit->channelCount = DUAL_SCOPE;
+	unit->awgBufferSize = MIN_SIG_GEN_BUFFER_SIZE;
+	unit->digitalPortCount = 0;
+
+	if (unit->handle) 
+	{
+		printf("Device information:-\n\n");
+
+		for (i = 0; i < 11; i++) 
+		{
+			status = ps5000aGetUnitInfo(unit->handle, line, sizeof (line), &requiredSize, i);
+
+			// info = 3 - PICO_VARIANT_INFO
+			if (i == PICO_VARIANT_INFO) 
+			{
+				variant = atoi(line);
+				memcpy(&(unit->modelString), line, sizeof(unit->modelString)==5?5:sizeof(unit->modelString));
+
+				unit->channelCount = (int16_t)line[1];
+				unit->channelCount = unit->channelCount - 48; // Subtract ASCII 0 (48)
+
+				// Determine if the device is an MSO
+				if (strstr(line, "MSO") != NULL)
+				{
+					unit->digitalPortCount = 2;
+				}
+				else
+				{
+					unit->digitalPortCount = 0;
+				}
+				
+			}
+			else if (i == PICO_BATCH_AND_SERIAL)	// info = 4 - PICO_BATCH_AND_SERIAL
+			{
+				memcpy(&(unit->serial), line, requiredSize);
+			}
+
+			printf("%s: %s\n", description[i], line);
+		}
 
-	// Run
-	timebase = 127;		// 1 MS/s at 8-bit resolution, ~504 kS/s at 12 & 16-bit resolution
+		printf("\n");
 
-	// Verify timebase and number of samples per channel for segment 0
-	do
+		// Set sig gen parameters
+		// If device has Arbitrary Waveform Generator, find the maximum AWG buffer size
+		status = ps5000aSigGenArbitraryMinMaxValues(unit->handle, &minArbitraryWaveformValue, &maxArbitraryWaveformValue, &minArbitraryWaveformSize, &maxArbitraryWaveformSize);
+		unit->awgBufferSize = maxArbitraryWaveformSize;
+
+		if (unit->awgBufferSize > 0)
+		{
+			unit->sigGen = SIGGEN_AWG;
+		}
+		else
+		{
+			unit->sigGen = SIGGEN_FUNCTGEN;
+		}
+	}
+}
+
+/****************************************************************************
+* Select input voltage ranges for channels
+****************************************************************************/
+void setVoltages(UNIT * unit)
+{
+	PICO_STATUS powerStatus = PICO_OK;
+	PICO_STATUS status = PICO_OK;
+	PS5000A_DEVICE_RESOLUTION resolution = PS5000A_DR_8BIT;
+
+	int32_t i, ch;
+	int32_t count = 0;
+	int16_t numValidChannels = unit->channelCount; // Dependent on power setting - i.e. channel A & B if USB powered on 4-channel device
+	int16_t numEnabledChannels = 0;
+	int16_t retry = FALSE;
+
+	if (unit->channelCount == QUAD_SCOPE)
 	{
-		status = ps5000aGetTimebase(unit->handle, timebase, nSamples, &timeIntervalNs, &maxSamples, 0);
+		powerStatus = ps5000aCurrentPowerSource(unit->handle); 
 
-		if (status == PICO_INVALID_TIMEBASE)
+		if (powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
 		{
-			timebase++;
+			numValidChannels = DUAL_SCOPE;
 		}
-	} while (status != PICO_OK);
+	}
+
+	// See what ranges are available... 
+	for (i = unit->firstRange; i <= unit->lastRange; i++) 
+	{
+		printf("%d -> %d mV\n", i, inputRanges[i]);
+	}
 
 	do
 	{
-		retry = 0;
-		status = ps5000aRunBlock(unit->handle, 0, nSamples, timebase, &timeIndisposed, 0, callBackBlock, NULL);
+		count = 0;
 
-		if (status != PICO_OK)
+		do
 		{
-			// PicoScope 5X4XA/B/D devices...+5 V PSU connected or removed or
-			// PicoScope 524XD devices on non-USB 3.0 port
-			if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED || status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT)
-			{
-				status = changePowerSource(unit->handle, status, unit);
-				retry = 1;
-			}
-			else
+			// Ask the user to select a range
+			printf("Specify voltage range (%d..%d)\n", unit->firstRange, unit->lastRange);
+			printf("99 - switches channel off\n");
+		
+			for (ch = 0; ch < numValidChannels; ch++) 
 			{
-				printf("collectRapidBlock:ps5000aRunBlock ------ 0x%08lx \n", status);
+				printf("\n");
+
+				do 
+				{
+					printf("Channel %c: ", 'A' + ch);
+					fflush(stdin);
+					scanf_s("%hd", &(unit->channelSettings[ch].range));
+			
+				} while (unit->channelSettings[ch].range != 99 && (unit->channelSettings[ch].range < unit->firstRange || unit->channelSettings[ch].range > unit->lastRange));
+
+				if (unit->channelSettings[ch].range != 99) 
+				{
+					printf(" - %d mV\n", inputRanges[unit->channelSettings[ch].range]);
+					unit->channelSettings[ch].enabled = TRUE;
+					count++;
+				} 
+				else 
+				{
+					printf("Channel Switched off\n");
+					unit->channelSettings[ch].enabled = FALSE;
+					unit->channelSettings[ch].range = PS5000A_MAX_RANGES-1;
+				}
 			}
+			printf(count == 0? "\n** At least 1 channel must be enabled **\n\n":"");
 		}
-	} while (retry);
+		while (count == 0);	// must have at least one channel enabled
 
-	// Wait until data ready
-	g_ready = 0;
+		status = ps5000aGetDeviceResolution(unit->handle, &resolution);
 
-	while (!g_ready && !_kbhit())
+		// Verify that the number of enabled channels is valid for the resolution set.
+
+		switch (resolution)
+		{
+			case PS5000A_DR_15BIT:
+
+				if (count > 2)
+				{
+					printf("\nError: Only 2 channels may be enabled with 15-bit resolution set.\n");
+					printf("Please switch off %d channel(s).\n", numValidChannels - 2);
+					retry = TRUE;
+				}
+				else
+				{
+					retry = FALSE;
+				}
+				break;
+
+			case PS5000A_DR_16BIT:
+
+				if (count > 1)
+				{
+					printf("\nError: Only one channes may be enabled with 16-bit resolution set.\n");
+					printf("Please switch off %d channel(s).\n", numValidChannels - 1);
+					retry = TRUE;
+				}
+				else
+				{
+					retry = FALSE;
+				}
+				
+				break;
+
+			default:
+
+				retry = FALSE;
+				break;
+		}
+
+		printf("\n");
+	}
+	while (retry == TRUE);
+
+	setDefaults(unit);	// Put these changes into effect
+}
+
+/****************************************************************************
+* setTimebase
+* Select timebase, set time units as nano seconds
+*
+****************************************************************************/
+void setTimebase(UNIT * unit)
+{
+	PICO_STATUS status = PICO_OK;
+	PICO_STATUS powerStatus = PICO_OK;
+	int32_t timeInterval;
+	int32_t maxSamples;
+	int32_t ch;
+
+	uint32_t shortestTimebase;
+	double timeIntervalSeconds;
+	
+	PS5000A_CHANNEL_FLAGS enabledChannelOrPortFlags = (PS5000A_CHANNEL_FLAGS)0;
+	
+	int16_t numValidChannels = unit->channelCount; // Dependent on power setting - i.e. channel A & B if USB powered on 4-channel device
+	
+	if (unit->channelCount == QUAD_SCOPE)
 	{
-		Sleep(0);
+		powerStatus = ps5000aCurrentPowerSource(unit->handle);
+		
+		if (powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
+		{
+			numValidChannels = DUAL_SCOPE;
+		}
+	}
+	
+	// Find the analogue channels that are enabled - if an MSO model is being used, this will need to be
+	// modified to add channel flags for enabled digital ports
+	for (ch = 0; ch < numValidChannels; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			enabledChannelOrPortFlags = enabledChannelOrPortFlags | (PS5000A_CHANNEL_FLAGS)(1 << ch);
+		}
 	}
+	
+	// Find the shortest possible timebase and inform the user.
+	status = ps5000aGetMinimumTimebaseStateless(unit->handle, enabledChannelOrPortFlags, &shortestTimebase, &timeIntervalSeconds, unit->resolution);
 
-	if (!g_ready)
+	if (status != PICO_OK)
 	{
-		_getch();
-		status = ps5000aStop(unit->handle);
-		status = ps5000aGetNoOfCaptures(unit->handle, &nCompletedCaptures);
+		printf("setTimebase:ps5000aGetMinimumTimebaseStateless ------ 0x%08lx \n", status);
+		return;
+	}
 
-		printf("Rapid capture aborted. %lu complete blocks were captured\n", nCompletedCaptures);
-		printf("\nPress any key...\n\n");
-		_getch();
+	printf("Shortest timebase index available %d (%.9f seconds).\n", shortestTimebase, timeIntervalSeconds);
+	
+	printf("Specify desired timebase: ");
+	fflush(stdin);
+	scanf_s("%lud", &timebase);
+
+	do 
+	{
+		status = ps5000aGetTimebase(unit->handle, timebase, BUFFER_SIZE, &timeInterval, &maxSamples, 0);
+
+		if (status == PICO_INVALID_NUMBER_CHANNELS_FOR_RESOLUTION)
+		{
+			printf("SetTimebase: Error - Invalid number of channels for resolution.\n");
+			return;
+		}
+		else if (status == PICO_OK)
+		{
+			// Do nothing
+		}
+		else
+		{
+			timebase++; // Increase timebase if the one specified can't be used. 
+		}
+
+	}
+	while (status != PICO_OK);
+
+	printf("Timebase used %lu = %ld ns sample interval\n", timebase, timeInterval);
+}
+
+/****************************************************************************
+* Autoset
+*
+* Picks the input range of every enabled channel, the timebase and a
+* trigger level from a few short probe captures instead of asking for them.
+*
+* Ranges are found with a bisection over firstRange..lastRange: a range
+* that overflowed is a lower bound and a range that did not is an upper
+* bound, and in between the next range is the one that fits the measured
+* peak with AUTOSET_HEADROOM to spare. Starting at the largest range, a
+* clean signal usually converges in two or three captures.
+*
+* The timebase is found from the rising crossings of the mid level on the
+* channel with the largest signal. The probe interval is multiplied or
+* divided by AUTOSET_STEP until the probe holds at least AUTOSET_MIN_CYCLES
+* cycles of AUTOSET_MIN_SAMPLES_PER_CYCLE samples or more, then the final
+* timebase is chosen to show AUTOSET_CYCLES cycles in BUFFER_SIZE samples.
+* A signal above half the probe sample rate aliases to a lower frequency,
+* so the frequency is confirmed by one more probe at 3/4 of the interval:
+* an alias moves when the sample rate changes and a real frequency does not.
+* The probes are only AUTOSET_SAMPLES long, so each one costs little more
+* than a round trip to the device.
+****************************************************************************/
+#define AUTOSET_SAMPLES					2000
+#define AUTOSET_MAX_PROBES				16
+#define AUTOSET_HEADROOM				1.2
+#define AUTOSET_START_INTERVAL_NS		1600	// 3.2 ms probe
+#define AUTOSET_MAX_INTERVAL_NS			400000	// 0.8 s probe
+#define AUTOSET_STEP					16
+#define AUTOSET_MIN_CYCLES				3
+#define AUTOSET_MIN_SAMPLES_PER_CYCLE	10
+#define AUTOSET_CYCLES					4
+#define AUTOSET_MIN_SIGNAL				8		// Peak to peak, in LSBs at 8-bit resolution
+#define AUTOSET_TOLERANCE				0.05
+
+typedef struct
+{
+	int16_t		range;			// Range of the last probe
+	int16_t		lowest;			// Lowest range not known to overflow
+	int16_t		highest;		// Lowest range known not to overflow
+	int16_t		minValue;
+	int16_t		maxValue;
+	int16_t		overflow;
+	int16_t		settled;
+}AUTOSET_CHANNEL;
+
+/****************************************************************************
+* autosetProbe
+*
+* Runs one untriggered capture of AUTOSET_SAMPLES samples on the current
+* ranges and returns the sample interval and, per channel, the extremes and
+* whether the input overflowed
+****************************************************************************/
+PICO_STATUS autosetProbe(UNIT * unit, uint32_t probeTimebase, int16_t * buffers[], AUTOSET_CHANNEL * channels, int32_t * intervalNs)
+{
+	int16_t ch;
+	int16_t overflow = 0;
+	int32_t maxSamples;
+	int32_t timeIndisposed;
+	uint32_t nSamples = AUTOSET_SAMPLES;
+	uint32_t i;
+	PICO_STATUS status;
 
-		if (nCompletedCaptures == 0)
-		{
-			return;
-		}
+	status = ps5000aGetTimebase(unit->handle, probeTimebase, AUTOSET_SAMPLES, intervalNs, &maxSamples, 0);
 
-		// Only display the blocks that were captured
-		nCaptures = (uint16_t)nCompletedCaptures;
+	if (status != PICO_OK)
+	{
+		return status;
 	}
 
-	// Allocate memory
-	rapidBuffers = (int16_t ***)calloc(unit->channelCount, sizeof(int16_t*));
-	overflow = (int16_t *)calloc(unit->channelCount * nCaptures, sizeof(int16_t));
-
-	for (channel = 0; channel < unit->channelCount; channel++)
+	for (ch = 0; ch < unit->channelCount; ch++)
 	{
-		if (unit->channelSettings[channel].enabled)
+		if (unit->channelSettings[ch].enabled)
 		{
-			rapidBuffers[channel] = (int16_t **)calloc(nCaptures, sizeof(int16_t*));
+			ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL) ch, buffers[ch], AUTOSET_SAMPLES, 0, PS5000A_RATIO_MODE_NONE);
 		}
 	}
 
-	for (channel = 0; channel < unit->channelCount; channel++)
+	g_ready = FALSE;
+	status = ps5000aRunBlock(unit->handle, 0, AUTOSET_SAMPLES, probeTimebase, &timeIndisposed, 0, callBackBlock, NULL);
+
+	if (status != PICO_OK)
 	{
-		if (unit->channelSettings[channel].enabled)
-		{
-			for (capture = 0; capture < nCaptures; capture++)
-			{
-				rapidBuffers[channel][capture] = (int16_t *)calloc(nSamples, sizeof(int16_t));
-			}
-		}
+		return status;
 	}
 
-	for (channel = 0; channel < unit->channelCount; channel++)
+	while (!g_ready && !_kbhit())
 	{
-		if (unit->channelSettings[channel].enabled)
-		{
-			for (capture = 0; capture < nCaptures; capture++)
-			{
-				status = ps5000aSetDataBuffer(unit->handle, (PS5000A_CHANNEL)channel, rapidBuffers[channel][capture], nSamples, capture, PS5000A_RATIO_MODE_NONE);
-			}
-		}
+		Sleep(0);
 	}
 
-	// Allocate memory for the trigger timestamping
-	triggerInfo = (PS5000A_TRIGGER_INFO *)malloc(nCaptures * sizeof(PS5000A_TRIGGER_INFO));
-	memset(triggerInfo, 0, nCaptures * sizeof(PS5000A_TRIGGER_INFO));
-
-	// Get data
-	status = ps5000aGetValuesBulk(unit->handle, &nSamples, 0, nCaptures - 1, 1, PS5000A_RATIO_MODE_NONE, overflow);
-
-	if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
-				status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE)
+	if (!g_ready)
 	{
-		printf("\nPower Source Changed. Data collection aborted.\n");
+		_getch();
+		ps5000aStop(unit->handle);
+		return PICO_CANCELLED;
 	}
 
-	// Retrieve trigger timestamping information
-	status = ps5000aGetTriggerInfoBulk(unit->handle, triggerInfo, 0, nCaptures - 1);
+	status = ps5000aGetValues(unit->handle, 0, &nSamples, 1, PS5000A_RATIO_MODE_NONE, 0, &overflow);
+	ps5000aStop(unit->handle);
 
-	if (status == PICO_OK)
+	if (status != PICO_OK)
 	{
-		//print first 10 samples from each capture
-		for (capture = 0; capture < nCaptures; capture++)
-		{
-			printf("\n");
-
-			printf("Capture index %d:-\n\n", capture);
-
-			// Trigger Info status & Timestamp 
-			printf("Trigger Info:- Status: %u  Trigger index: %u  Timestamp Counter: %I64u\n", triggerInfo[capture].status, triggerInfo[capture].triggerIndex, triggerInfo[capture].timeStampCounter);
-
-			// Calculate time between trigger events - the first timestamp is arbitrary so is only used to calculate offsets
-
-			// The structure containing the status code with bit flag PICO_DEVICE_TIME_STAMP_RESET will have an arbitrary timeStampCounter value. 
-			// This should be the first segment in each run, so in this case segment 0 will be ignored.
-
-			if (capture == 0)
-			{
-				// Nothing to display
-				printf("\n");
-			}
-			else if (capture > 0 && triggerInfo[capture].status == PICO_OK)
-			{
-				timeStampCounterDiff = triggerInfo[capture].timeStampCounter - triggerInfo[capture - 1].timeStampCounter;
-				printf("Time since trigger for last segment: %I64u ns\n\n", (timeStampCounterDiff * (uint64_t)timeIntervalNs));
-			}
-			else
-			{
-				// Do nothing
-			}
-
-			for (channel = 0; channel < unit->channelCount; channel++)
-			{
-				if (unit->channelSettings[channel].enabled)
-				{
-					printf("Channel %c:\t", 'A' + channel);
-				}
-			}
-
-			printf("\n\n");
-
-			for (i = 0; i < 10; i++)
-			{
-				for (channel = 0; channel < unit->channelCount; channel++)
-				{
-					if (unit->channelSettings[channel].enabled)
-					{
-						printf("   %6d       ", scaleVoltages ?
-							adc_to_mv(rapidBuffers[channel][capture][i], unit->channelSettings[PS5000A_CHANNEL_A + channel].range, unit)	// If scaleVoltages, print mV value
-							: rapidBuffers[channel][capture][i]);																	// else print ADC Count
-					}
-				}
-
-				printf("\n");
-			}
-		}
+		return status;
 	}
 
-	// Stop
-	status = ps5000aStop(unit->handle);
-
-	// Free memory
-	free(overflow);
-
-	for (channel = 0; channel < unit->channelCount; channel++)
+	for (ch = 0; ch < unit->channelCount; ch++)
 	{
-		if (unit->channelSettings[channel].enabled)
+		if (unit->channelSettings[ch].enabled)
 		{
-			for (capture = 0; capture < nCaptures; capture++)
+			channels[ch].minValue = buffers[ch][0];
+			channels[ch].maxValue = buffers[ch][0];
+
+			for (i = 1; i < nSamples; i++)
 			{
-				free(rapidBuffers[channel][capture]);
+				channels[ch].minValue = min(channels[ch].minValue, buffers[ch][i]);
+				channels[ch].maxValue = max(channels[ch].maxValue, buffers[ch][i]);
 			}
-		}
-	}
 
-	for (channel = 0; channel < unit->channelCount; channel++)
-	{
-		if (unit->channelSettings[channel].enabled)
-		{
-			free(rapidBuffers[channel]);
+			channels[ch].overflow = (overflow & (1 << ch)) != 0;
 		}
 	}
 
-	free(rapidBuffers);
-	free(triggerInfo);
+	return PICO_OK;
 }
 
 /****************************************************************************
-* Initialise unit' structure with Variant specific defaults
+* autosetNextRange
+*
+* Updates the range bounds of a channel from the last probe and returns the
+* range for the next one. The channel is settled when the range it fits is
+* the range it was measured on.
 ****************************************************************************/
-void set_info(UNIT * unit)
+int16_t autosetNextRange(UNIT * unit, AUTOSET_CHANNEL * channel, int16_t range)
 {
-	int8_t description [11][25]= { "Driver Version",
-		"USB Version",
-		"Hardware Version",
-		"Variant Info",
-		"Serial",
-		"Cal Date",
-		"Kernel Version",
-		"Digital HW Version",
-		"Analogue HW Version",
-		"Firmware 1",
-		"Firmware 2"};
-
-	int16_t i = 0;
-	int16_t requiredSize = 0;
-	int8_t line [80];
-	int32_t variant;
-	PICO_STATUS status = PICO_OK;
+	int32_t peak;
+	int16_t fit;
 
-	// Variables used for arbitrary waveform parameters
-	int16_t			minArbitraryWaveformValue = 0;
-	int16_t			maxArbitraryWaveformValue = 0;
-	uint32_t		minArbitraryWaveformSize = 0;
-	uint32_t		maxArbitraryWaveformSize = 0;
-
-	//Initialise default unit properties and change when required
-	unit->sigGen = SIGGEN_FUNCTGEN;
-	unit->firstRange = PS5000A_10MV;
-	unit->lastRange = PS5000A_20V;
-	unit->channelCount = DUAL_SCOPE;
-	unit->awgBufferSize = MIN_SIG_GEN_BUFFER_SIZE;
-	unit->digitalPortCount = 0;
+	channel->range = range;
 
-	if (unit->handle) 
+	if (channel->overflow)
 	{
-		printf("Device information:-\n\n");
+		channel->lowest = range + 1;
+		channel->settled = (range == unit->lastRange);	// Nothing larger to try
 
-		for (i = 0; i < 11; i++) 
-		{
-			status = ps5000aGetUnitInfo(unit->handle, line, sizeof (line), &requiredSize, i);
+		// Bisect between the bounds so a large step down is undone quickly
+		return (channel->lowest >= channel->highest) ? channel->highest : (channel->lowest + channel->highest) / 2;
+	}
 
-			// info = 3 - PICO_VARIANT_INFO
-			if (i == PICO_VARIANT_INFO) 
-			{
-				variant = atoi(line);
-				memcpy(&(unit->modelString), line, sizeof(unit->modelString)==5?5:sizeof(unit->modelString));
+	channel->highest = range;
 
-				unit->channelCount = (int16_t)line[1];
-				unit->channelCount = unit->channelCount - 48; // Subtract ASCII 0 (48)
+	peak = max(abs(channel->maxValue), abs(channel->minValue));
+	peak = (int32_t) ((double) peak * inputRanges[range] / unit->maxADCValue * AUTOSET_HEADROOM);
 
-				// Determine if the device is an MSO
-				if (strstr(line, "MSO") != NULL)
-				{
-					unit->digitalPortCount = 2;
-				}
-				else
-				{
-					unit->digitalPortCount = 0;
-				}
-				
-			}
-			else if (i == PICO_BATCH_AND_SERIAL)	// info = 4 - PICO_BATCH_AND_SERIAL
-			{
-				memcpy(&(unit->serial), line, requiredSize);
-			}
+	fit = (int16_t) sequenceRange(unit, peak);
+	fit = max(fit, channel->lowest);
+	fit = min(fit, channel->highest);
 
-			printf("%s: %s\n", description[i], line);
-		}
+	channel->settled = (fit == range);
 
-		printf("\n");
+	return fit;
+}
 
-		// Set sig gen parameters
-		// If device has Arbitrary Waveform Generator, find the maximum AWG buffer size
-		status = ps5000aSigGenArbitraryMinMaxValues(unit->handle, &minArbitraryWaveformValue, &maxArbitraryWaveformValue, &minArbitraryWaveformSize, &maxArbitraryWaveformSize);
-		unit->awgBufferSize = maxArbitraryWaveformSize;
+/****************************************************************************
+* autosetCrossings
+*
+* Counts the rising crossings of the mid level with 10% hysteresis and
+* returns the mean period in samples, or 0 if there are too few crossings
+****************************************************************************/
+double autosetCrossings(int16_t * buffer, uint32_t nSamples, int16_t minValue, int16_t maxValue, int32_t * nCrossings)
+{
+	int32_t level = ((int32_t) maxValue + minValue) / 2;
+	int32_t hysteresis = ((int32_t) maxValue - minValue) / 10;
+	int16_t armed = FALSE;
+	uint32_t i;
+	double position;
+	double first = 0.0;
+	double last = 0.0;
 
-		if (unit->awgBufferSize > 0)
+	*nCrossings = 0;
+
+	for (i = 1; i < nSamples; i++)
+	{
+		if (buffer[i] < level - hysteresis)
 		{
-			unit->sigGen = SIGGEN_AWG;
+			armed = TRUE;
 		}
-		else
+		else if (armed && buffer[i] >= level && buffer[i - 1] < level)
 		{
-			unit->sigGen = SIGGEN_FUNCTGEN;
+			// Interpolate between the samples either side of the level
+			position = (i - 1) + (double) (level - buffer[i - 1]) / (buffer[i] - buffer[i - 1]);
+
+			if (*nCrossings == 0)
+			{
+				first = position;
+			}
+
+			last = position;
+			(*nCrossings)++;
+			armed = FALSE;
 		}
 	}
+
+	return (*nCrossings >= 2) ? (last - first) / (*nCrossings - 1) : 0.0;
 }
 
 /****************************************************************************
-* Select input voltage ranges for channels
+* autoset
+*
+* Finds the ranges, timebase and trigger level and then collects a block
+* with the trigger found
 ****************************************************************************/
-void setVoltages(UNIT * unit)
+void autoset(UNIT * unit)
 {
-	PICO_STATUS powerStatus = PICO_OK;
+	int16_t ch;
+	int16_t triggerChannel = -1;
+	int16_t allocationFailed = FALSE;
+	int16_t rangesSettled;
+	int16_t timebaseSettled = FALSE;
+	int16_t nextRange;
+	int16_t * buffers[PS5000A_MAX_CHANNELS];
+	int32_t nProbes = 0;
+	int32_t nCrossings = 0;
+	int32_t intervalNs = 0;
+	int32_t probeIntervalNs = AUTOSET_START_INTERVAL_NS;
+	int32_t timeInterval;
+	int32_t maxSamples;
+	uint32_t probeTimebase;
+	uint32_t shortestTimebase;
+	double shortestInterval;
+	double periodSamples = 0.0;
+	double periodNs = 0.0;
+	double candidateNs = 0.0;
+	double bestSignal = 0.0;
+	int64_t startTime = timeNowUs();
+	AUTOSET_CHANNEL channels[PS5000A_MAX_CHANNELS];
+	PS5000A_CHANNEL_FLAGS enabledFlags = (PS5000A_CHANNEL_FLAGS) 0;
 	PICO_STATUS status = PICO_OK;
-	PS5000A_DEVICE_RESOLUTION resolution = PS5000A_DR_8BIT;
 
-	int32_t i, ch;
-	int32_t count = 0;
-	int16_t numValidChannels = unit->channelCount; // Dependent on power setting - i.e. channel A & B if USB powered on 4-channel device
-	int16_t numEnabledChannels = 0;
-	int16_t retry = FALSE;
+	struct tPS5000ATriggerChannelPropertiesV2 triggerProperties;
+	struct tPS5000ACondition conditions;
+	struct tPS5000ADirection directions;
+	struct tPwq pulseWidth;
 
-	if (unit->channelCount == QUAD_SCOPE)
-	{
-		powerStatus = ps5000aCurrentPowerSource(unit->handle); 
+	memset(buffers, 0, sizeof(buffers));
+	memset(channels, 0, sizeof(channels));
 
-		if (powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
+	printf("Autoset...\n");
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
 		{
-			numValidChannels = DUAL_SCOPE;
+			// Start on the largest range, where nothing should overflow
+			channels[ch].lowest = unit->firstRange;
+			channels[ch].highest = unit->lastRange;
+			unit->channelSettings[ch].range = unit->lastRange;
+			enabledFlags = enabledFlags | (PS5000A_CHANNEL_FLAGS) (1 << ch);
+
+			buffers[ch] = (int16_t *) memoryAlloc(MEMORY_ACQUISITION, AUTOSET_SAMPLES, sizeof(int16_t));
+			allocationFailed |= (buffers[ch] == NULL);
 		}
 	}
 
-	// See what ranges are available... 
-	for (i = unit->firstRange; i <= unit->lastRange; i++) 
+	status = ps5000aGetMinimumTimebaseStateless(unit->handle, enabledFlags, &shortestTimebase, &shortestInterval, unit->resolution);
+
+	if (allocationFailed || status != PICO_OK)
 	{
-		printf("%d -> %d mV\n", i, inputRanges[i]);
+		printf(allocationFailed ? "autoset: Probe buffers would exceed the memory budget.\n" : "autoset:ps5000aGetMinimumTimebaseStateless ------ 0x%08lx \n", status);
+		status = PICO_MEMORY_FAIL;
 	}
 
-	do
-	{
-		count = 0;
+	setDefaults(unit);
+
+	// Probes are untriggered
+	ps5000aSetSimpleTrigger(unit->handle, 0, PS5000A_CHANNEL_A, 0, PS5000A_RISING, 0, 0);
+
+	while (status == PICO_OK && nProbes < AUTOSET_MAX_PROBES)
+	{
+		probeTimebase = max(sequenceTimebase(unit->resolution, probeIntervalNs), shortestTimebase);
+
+		status = autosetProbe(unit, probeTimebase, buffers, channels, &intervalNs);
+		nProbes++;
+
+		if (status != PICO_OK)
+		{
+			break;
+		}
+
+		// Ranges
+		rangesSettled = TRUE;
 
-		do
+		for (ch = 0; ch < unit->channelCount; ch++)
 		{
-			// Ask the user to select a range
-			printf("Specify voltage range (%d..%d)\n", unit->firstRange, unit->lastRange);
-			printf("99 - switches channel off\n");
-		
-			for (ch = 0; ch < numValidChannels; ch++) 
+			if (unit->channelSettings[ch].enabled)
 			{
-				printf("\n");
+				nextRange = autosetNextRange(unit, &channels[ch], unit->channelSettings[ch].range);
+				rangesSettled &= channels[ch].settled;
+				unit->channelSettings[ch].range = nextRange;
+			}
+		}
 
-				do 
-				{
-					printf("Channel %c: ", 'A' + ch);
-					fflush(stdin);
-					scanf_s("%hd", &(unit->channelSettings[ch].range));
-			
-				} while (unit->channelSettings[ch].range != 99 && (unit->channelSettings[ch].range < unit->firstRange || unit->channelSettings[ch].range > unit->lastRange));
+		// The channel with the largest signal relative to its range gives the timebase and trigger
+		triggerChannel = -1;
+		bestSignal = 0.0;
 
-				if (unit->channelSettings[ch].range != 99) 
-				{
-					printf(" - %d mV\n", inputRanges[unit->channelSettings[ch].range]);
-					unit->channelSettings[ch].enabled = TRUE;
-					count++;
-				} 
-				else 
-				{
-					printf("Channel Switched off\n");
-					unit->channelSettings[ch].enabled = FALSE;
-					unit->channelSettings[ch].range = PS5000A_MAX_RANGES-1;
-				}
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (unit->channelSettings[ch].enabled && !channels[ch].overflow &&
+				(double) channels[ch].maxValue - channels[ch].minValue > bestSignal)
+			{
+				bestSignal = (double) channels[ch].maxValue - channels[ch].minValue;
+				triggerChannel = ch;
 			}
-			printf(count == 0? "\n** At least 1 channel must be enabled **\n\n":"");
 		}
-		while (count == 0);	// must have at least one channel enabled
 
-		status = ps5000aGetDeviceResolution(unit->handle, &resolution);
+		// Timebase - a slow signal looks like a small or DC one in a short probe, so both lengthen the probe
+		nCrossings = 0;
+		periodSamples = 0.0;
 
-		// Verify that the number of enabled channels is valid for the resolution set.
+		if (triggerChannel >= 0 && bestSignal >= AUTOSET_MIN_SIGNAL * (unit->maxADCValue / 128))
+		{
+			periodSamples = autosetCrossings(buffers[triggerChannel], AUTOSET_SAMPLES, channels[triggerChannel].minValue,
+				channels[triggerChannel].maxValue, &nCrossings);
+		}
 
-		switch (resolution)
+		if (timebaseSettled)
 		{
-			case PS5000A_DR_15BIT:
+			// Only the ranges are still moving
+		}
+		else if (candidateNs > 0.0)
+		{
+			// Confirmation probe
+			if (periodSamples * intervalNs > candidateNs * (1.0 - AUTOSET_TOLERANCE) && periodSamples * intervalNs < candidateNs * (1.0 + AUTOSET_TOLERANCE))
+			{
+				periodNs = periodSamples * intervalNs;
+				timebaseSettled = TRUE;
+			}
+			else
+			{
+				// Aliased, sample faster
+				probeIntervalNs = max(probeIntervalNs / AUTOSET_STEP, 1);
+			}
 
-				if (count > 2)
-				{
-					printf("\nError: Only 2 channels may be enabled with 15-bit resolution set.\n");
-					printf("Please switch off %d channel(s).\n", numValidChannels - 2);
-					retry = TRUE;
-				}
-				else
-				{
-					retry = FALSE;
-				}
-				break;
+			candidateNs = 0.0;
+		}
+		else if (nCrossings < AUTOSET_MIN_CYCLES && probeIntervalNs < AUTOSET_MAX_INTERVAL_NS)
+		{
+			probeIntervalNs *= AUTOSET_STEP;
 
-			case PS5000A_DR_16BIT:
+			// A longer probe may find a larger peak, so the upper bounds no longer hold
+			for (ch = 0; ch < unit->channelCount; ch++)
+			{
+				channels[ch].highest = unit->lastRange;
+			}
 
-				if (count > 1)
-				{
-					printf("\nError: Only one channes may be enabled with 16-bit resolution set.\n");
-					printf("Please switch off %d channel(s).\n", numValidChannels - 1);
-					retry = TRUE;
-				}
-				else
-				{
-					retry = FALSE;
-				}
-				
-				break;
+			rangesSettled = FALSE;
+		}
+		else if (nCrossings >= AUTOSET_MIN_CYCLES && periodSamples < AUTOSET_MIN_SAMPLES_PER_CYCLE && probeTimebase > shortestTimebase)
+		{
+			probeIntervalNs = max(probeIntervalNs / AUTOSET_STEP, 1);
+		}
+		else if (nCrossings >= AUTOSET_MIN_CYCLES && probeTimebase > shortestTimebase)
+		{
+			candidateNs = periodSamples * intervalNs;
+			probeIntervalNs = max(probeIntervalNs * 3 / 4, 1);
+		}
+		else if (nCrossings >= AUTOSET_MIN_CYCLES)
+		{
+			// Already sampling as fast as the unit can
+			periodNs = periodSamples * intervalNs;
+			timebaseSettled = TRUE;
+		}
 
-			default:
+		printf("Probe %d: %ld ns", nProbes, intervalNs);
 
-				retry = FALSE;
-				break;
+		for (ch = 0; ch < unit->channelCount; ch++)
+		{
+			if (unit->channelSettings[ch].enabled)
+			{
+				printf("  Ch%c %s%s", 'A' + ch, channels[ch].overflow ? "overflow" : "ok", channels[ch].settled ? "" : "*");
+			}
 		}
 
-		printf("\n");
-	}
-	while (retry == TRUE);
+		printf("  %ld crossings\n", nCrossings);
 
-	setDefaults(unit);	// Put these changes into effect
-}
+		if (rangesSettled && (timebaseSettled || probeIntervalNs >= AUTOSET_MAX_INTERVAL_NS))
+		{
+			break;
+		}
 
-/****************************************************************************
-* setTimebase
-* Select timebase, set time units as nano seconds
-*
-****************************************************************************/
-void setTimebase(UNIT * unit)
-{
-	PICO_STATUS status = PICO_OK;
-	PICO_STATUS powerStatus = PICO_OK;
-	int32_t timeInterval;
-	int32_t maxSamples;
-	int32_t ch;
+		setDefaults(unit);
+	}
 
-	uint32_t shortestTimebase;
-	double timeIntervalSeconds;
-	
-	PS5000A_CHANNEL_FLAGS enabledChannelOrPortFlags = (PS5000A_CHANNEL_FLAGS)0;
-	
-	int16_t numValidChannels = unit->channelCount; // Dependent on power setting - i.e. channel A & B if USB powered on 4-channel device
-	
-	if (unit->channelCount == QUAD_SCOPE)
+	for (ch = 0; ch < PS5000A_MAX_CHANNELS; ch++)
 	{
-		powerStatus = ps5000aCurrentPowerSource(unit->handle);
-		
-		if (powerStatus == PICO_POWER_SUPPLY_NOT_CONNECTED)
-		{
-			numValidChannels = DUAL_SCOPE;
-		}
+		memoryFree(buffers[ch]);
 	}
-	
-	// Find the analogue channels that are enabled - if an MSO model is being used, this will need to be
-	// modified to add channel flags for enabled digital ports
-	for (ch = 0; ch < numValidChannels; ch++)
+
+	clearDataBuffers(unit);
+
+	if (status == PICO_CANCELLED)
 	{
-		if (unit->channelSettings[ch].enabled)
-		{
-			enabledChannelOrPortFlags = enabledChannelOrPortFlags | (PS5000A_CHANNEL_FLAGS)(1 << ch);
-		}
+		printf("Autoset cancelled.\n");
+		setDefaults(unit);
+		return;
 	}
-	
-	// Find the shortest possible timebase and inform the user.
-	status = ps5000aGetMinimumTimebaseStateless(unit->handle, enabledChannelOrPortFlags, &shortestTimebase, &timeIntervalSeconds, unit->resolution);
 
 	if (status != PICO_OK)
 	{
-		printf("setTimebase:ps5000aGetMinimumTimebaseStateless ------ 0x%08lx \n", status);
+		printf("autoset: Probe capture failed ------ 0x%08lx \n", status);
+		setDefaults(unit);
 		return;
 	}
 
-	printf("Shortest timebase index available %d (%.9f seconds).\n", shortestTimebase, timeIntervalSeconds);
-	
-	printf("Specify desired timebase: ");
-	fflush(stdin);
-	scanf_s("%lud", &timebase);
+	setDefaults(unit);
 
-	do 
-	{
-		status = ps5000aGetTimebase(unit->handle, timebase, BUFFER_SIZE, &timeInterval, &maxSamples, 0);
+	printf("\nAutoset took %d probe captures in %.1f ms\n", nProbes, (timeNowUs() - startTime) / 1000.0);
 
-		if (status == PICO_INVALID_NUMBER_CHANNELS_FOR_RESOLUTION)
-		{
-			printf("SetTimebase: Error - Invalid number of channels for resolution.\n");
-			return;
-		}
-		else if (status == PICO_OK)
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
 		{
-			// Do nothing
+			printf("Channel %c: %d mV range%s\n", 'A' + ch, inputRanges[unit->channelSettings[ch].range],
+				channels[ch].overflow ? " (still overflows on the largest range)" : "");
 		}
-		else
+	}
+
+	if (timebaseSettled)
+	{
+		// Show AUTOSET_CYCLES cycles in the BUFFER_SIZE samples of a block capture
+		timebase = max(sequenceTimebase(unit->resolution, (uint32_t) (periodNs * AUTOSET_CYCLES / BUFFER_SIZE)), shortestTimebase);
+
+		while (ps5000aGetTimebase(unit->handle, timebase, BUFFER_SIZE, &timeInterval, &maxSamples, 0) != PICO_OK)
 		{
-			timebase++; // Increase timebase if the one specified can't be used. 
+			timebase++;
 		}
 
+		printf("Signal on channel %c: %.6g Hz\n", 'A' + triggerChannel, 1e9 / periodNs);
+		printf("Timebase %lu = %ld ns sample interval\n", timebase, timeInterval);
+	}
+	else
+	{
+		printf("No repetitive signal found, the timebase is unchanged\n");
 	}
-	while (status != PICO_OK);
 
-	printf("Timebase used %lu = %ld ns sample interval\n", timebase, timeInterval);
+	if (triggerChannel < 0 || bestSignal < AUTOSET_MIN_SIGNAL * (unit->maxADCValue / 128))
+	{
+		printf("No signal large enough to trigger on\n");
+		return;
+	}
+
+	// Trigger half way between the extremes measured on the final range
+	memset(&triggerProperties, 0, sizeof(struct tPS5000ATriggerChannelPropertiesV2));
+	memset(&conditions, 0, sizeof(struct tPS5000ACondition));
+	memset(&directions, 0, sizeof(struct tPS5000ADirection));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	triggerProperties.thresholdUpper = (int16_t) ((double) (channels[triggerChannel].maxValue + channels[triggerChannel].minValue) / 2 *
+		inputRanges[channels[triggerChannel].range] / inputRanges[unit->channelSettings[triggerChannel].range]);
+	triggerProperties.thresholdUpperHysteresis = (uint16_t) (bestSignal / 10 * inputRanges[channels[triggerChannel].range] /
+		inputRanges[unit->channelSettings[triggerChannel].range]);
+	triggerProperties.thresholdLower = triggerProperties.thresholdUpper;
+	triggerProperties.thresholdLowerHysteresis = triggerProperties.thresholdUpperHysteresis;
+	triggerProperties.channel = (PS5000A_CHANNEL) triggerChannel;
+
+	conditions.source = (PS5000A_CHANNEL) triggerChannel;
+	conditions.condition = PS5000A_CONDITION_TRUE;
+
+	directions.source = (PS5000A_CHANNEL) triggerChannel;
+	directions.direction = PS5000A_RISING;
+	directions.mode = PS5000A_LEVEL;
+
+	printf("Trigger: channel %c rising through %d", 'A' + triggerChannel, scaleVoltages ?
+		adc_to_mv(triggerProperties.thresholdUpper, unit->channelSettings[triggerChannel].range, unit)	// If scaleVoltages, print mV value
+		: triggerProperties.thresholdUpper);															// else print ADC Count
+
+	printf(scaleVoltages ? "mV\n\n" : "ADC Counts\n\n");
+
+	setTrigger(unit, &triggerProperties, 1, &conditions, 1, &directions, 1, &pulseWidth, 0, 0);
+
+	blockDataHandler(unit, (int8_t *) "Ten readings after trigger\n", 0, FALSE);
 }
 
 /****************************************************************************
@@ -2320,7 +10363,7 @@ void collectStreamingImmediate(UNIT * unit)
 	setDefaults(unit);
 
 	printf("Collect streaming...\n");
-	printf("Data is written to disk file (stream.txt)\n");
+	printf("Data is written to a new stream file listed in the capture catalogue (%s)\n", CATALOGUE_FILE);
 	printf("Press a key to start\n");
 	_getch();
 
@@ -2388,7 +10431,7 @@ void collectStreamingTriggered(UNIT * unit)
 	directions.mode = PS5000A_LEVEL;
 		
 	printf("Collect streaming triggered...\n");
-	printf("Data is written to disk file (stream.txt)\n");
+	printf("Data is written to a new stream file listed in the capture catalogue (%s)\n", CATALOGUE_FILE);
 	printf("Press a key to start\n");
 	_getch();
 	
@@ -2415,10 +10458,11 @@ void displaySettings(UNIT *unit)
 {
 	int32_t ch;
 	int32_t voltage;
+	CALIBRATION * calibration;
 	PICO_STATUS status = PICO_OK;
 	PS5000A_DEVICE_RESOLUTION resolution = PS5000A_DR_8BIT;
 
-	printf("\nReadings will be scaled in %s\n", (scaleVoltages)? ("millivolts") : ("ADC counts"));
+	printf("\nReadings will be scaled in %s\n", (scaleVoltages)? ("calibrated units") : ("ADC counts"));
 	printf("\n");
 
 	for (ch = 0; ch < unit->channelCount; ch++)
@@ -2430,16 +10474,29 @@ void displaySettings(UNIT *unit)
 		else
 		{
 			voltage = inputRanges[unit->channelSettings[ch].range];
+			calibration = &unit->calibration[ch][unit->channelSettings[ch].range];
 			printf("Channel %c Voltage Range = ", 'A' + ch);
 			
 			if (voltage < 1000)
 			{
-				printf("%dmV\n", voltage);
+				printf("%dmV", voltage);
 			}
 			else
 			{
-				printf("%dV\n", voltage / 1000);
+				printf("%dV", voltage / 1000);
 			}
+
+			if (calibration->gain != 1.0f || calibration->offset != 0.0f)
+			{
+				printf("  cal x%.4f %+.2fmV", calibration->gain, calibration->offset);
+			}
+
+			if (unit->probe[ch].scale != 1.0f || strcmp((char *) unit->probe[ch].units, "mV") != 0)
+			{
+				printf("  probe x%g %s", unit->probe[ch].scale, unit->probe[ch].units);
+			}
+
+			printf("\n");
 		}
 	}
 
@@ -2551,6 +10608,13 @@ PICO_STATUS handleDevice(UNIT * unit)
 
 	memset(&pulseWidth, 0, sizeof(struct tPwq));
 
+	i = calibrationLoad(unit);
+
+	if (i >= 0)
+	{
+		printf("Applied %d calibration lines from %s\n\n", i, CALIBRATION_FILE);
+	}
+
 	setDefaults(unit);
 
 	/* Trigger disabled	*/
@@ -2578,6 +10642,7 @@ void closeDevice(UNIT *unit)
 void mainMenu(UNIT *unit)
 {
 	int8_t ch = '.';
+	int32_t applied;
 	while (ch != 'X')
 	{
 		displaySettings(unit);
@@ -2588,17 +10653,31 @@ void mainMenu(UNIT *unit)
 		printf("B - Immediate block                           V - Set voltages\n");
 		printf("T - Triggered block                           I - Set timebase\n");
 		printf("E - Collect a block of data using ETS         A - ADC counts/mV\n");
-		printf("R - Collect set of rapid captures\n");
-		printf("S - Immediate streaming\n");
-		printf("W - Triggered streaming\n");
+		printf("R - Collect set of rapid captures             Q - Query capture catalogue\n");
+		printf("F - Rapid captures, read back selected ones   O - Repeated captures, overlapped retrieval\n");
+		printf("S - Immediate streaming                       M - Memory budget\n");
+		printf("W - Triggered streaming                       P - Run test sequence\n");
+		printf("H - Archive rapid captures as events          Y - Query event store\n");
 
 		if(unit->sigGen != SIGGEN_NONE)
 		{
 			printf("G - Signal generator\n");
 		}
 		
-		printf("D - Set resolution\n");
-		printf("                                              X - Exit\n");
+		printf("D - Set resolution                            U - Autoset\n");
+		printf("L - Reload calibration table                  J - Join a capture with logger files\n");
+		if (g_metrics.running)
+		{
+			printf("N - Metrics on http://127.0.0.1:%u/metrics (on)\n", g_metrics.port);
+		}
+		else
+		{
+			printf("N - Metrics endpoint (off)\n");
+		}
+
+		printf("Z - Trace events to %s (%-3s)          C - Compare two captures\n", TRACE_FILE, g_trace.enabled ? "on" : "off");
+		printf("K - Raw samples to stdout (%-11s)       X - Exit\n",
+			g_raw.format == RAW_INTERLEAVED ? "interleaved" : g_raw.format == RAW_PLANAR ? "planar" : "off");
 		printf("Operation:");
 
 		ch = toupper(_getch());
@@ -2616,7 +10695,23 @@ void mainMenu(UNIT *unit)
 				break;
 
 			case 'R':
-				collectRapidBlock(unit);
+				collectRapidBlock(unit, FALSE);
+				break;
+
+			case 'F':
+				collectRapidBlock(unit, TRUE);
+				break;
+
+			case 'O':
+				collectRepeatedBlock(unit);
+				break;
+
+			case 'H':
+				archiveRapidBlock(unit);
+				break;
+
+			case 'Y':
+				queryEvents(unit);
 				break;
 
 			case 'S':
@@ -2646,6 +10741,32 @@ void mainMenu(UNIT *unit)
 				setVoltages(unit);
 				break;
 
+			case 'U':
+				autoset(unit);
+				break;
+
+			case 'N':
+				if (g_metrics.running)
+				{
+					metricsStop();
+				}
+				else
+				{
+					metricsStart(unit);
+				}
+				break;
+
+			case 'Z':
+				if (g_trace.enabled)
+				{
+					traceStop();
+				}
+				else
+				{
+					traceStart();
+				}
+				break;
+
 			case 'I':
 				setTimebase(unit);
 				break;
@@ -2658,6 +10779,43 @@ void mainMenu(UNIT *unit)
 				setResolution(unit);
 				break;
 
+			case 'Q':
+				queryCatalogue(unit);
+				break;
+
+			case 'M':
+				setMemoryBudget();
+				break;
+
+			case 'P':
+				runSequence(unit);
+				break;
+
+			case 'K':
+				setRawOutput();
+				break;
+
+			case 'C':
+				compareCaptures(unit);
+				break;
+
+			case 'J':
+				joinCaptures(unit);
+				break;
+
+			case 'L':
+				applied = calibrationLoad(unit);
+
+				if (applied < 0)
+				{
+					printf("Cannot open %s, readings are uncorrected\n", CALIBRATION_FILE);
+				}
+				else
+				{
+					printf("Applied %d calibration lines from %s\n", applied, CALIBRATION_FILE);
+				}
+				break;
+
 			case 'X':
 				break;
 
@@ -2666,6 +10824,9 @@ void mainMenu(UNIT *unit)
 				break;
 		}
 	}
+
+	traceStop();
+	metricsStop();
 }
 
 
@@ -2683,6 +10844,8 @@ int32_t main(void)
 	PICO_STATUS status = PICO_OK;
 	UNIT allUnits[MAX_PICO_DEVICES];
 
+	rawInit();
+
 	printf("PicoScope 5000 Series (ps5000a) Driver Example Program\n");
 	printf("\nEnumerating Units...\n");
 
@@ -19,6 +19,7 @@
  *    Collect a block of samples when a trigger event occurs
  *	  Collect data using Equivalent Time Sampling
  *	  Collect data using rapid block mode (with trigger)
+ *    Collect a deep block and read back only the parts looked at
  *    Collect a stream of data immediately
  *    Collect a stream of data when a trigger event occurs
  *    Set Signal Generator, using standard or custom signals
@@ -905,6 +906,521 @@ void CollectBlockImmediate(UNIT * unit)
 	BlockDataHandler(unit, "First 10 readings\n", 0, FALSE);
 }
 
+/****************************************************************************
+* Lazy block view
+*
+* A deep block capture is left in the scope's memory. Only an aggregated
+* overview (LAZY_OVERVIEW_POINTS min/max pairs per channel) is read back
+* straight away. Full resolution data is read in tiles of LAZY_TILE_SIZE
+* samples when something asks for it (zoom, measurement or search), and
+* the most recently used LAZY_MAX_TILES tiles are kept so that looking at
+* the same region again does not go back to the device.
+****************************************************************************/
+#define LAZY_OVERVIEW_POINTS	1000
+#define LAZY_TILE_SIZE				65536
+#define LAZY_MAX_TILES				16
+#define LAZY_DISPLAY_ROWS			20
+
+typedef struct tLazyTile
+{
+	int64_t		index;		// Tile number within the capture, -1 if empty
+	uint32_t	count;		// Samples in the tile (the last tile may be short)
+	uint64_t	lastUsed;
+	int16_t *	buffers[PS6000_MAX_CHANNELS];
+}LAZY_TILE;
+
+typedef struct tLazyBlock
+{
+	UNIT *			unit;
+	uint32_t		sampleCount;
+	float				timeInterval;
+	uint32_t		ratio;					// Samples per overview point
+	uint32_t		overviewCount;
+	int16_t *		overviewMax[PS6000_MAX_CHANNELS];
+	int16_t *		overviewMin[PS6000_MAX_CHANNELS];
+	LAZY_TILE		tiles[LAZY_MAX_TILES];
+	uint64_t		useCounter;
+	uint32_t		hits;
+	uint32_t		misses;
+	uint64_t		samplesRead;		// Full resolution samples per channel read from the device
+}LAZY_BLOCK;
+
+/****************************************************************************
+* LazyBlockTile
+*
+* Returns the tile holding sample tileIndex * LAZY_TILE_SIZE, reading it
+* from the device into the least recently used slot if it is not cached
+****************************************************************************/
+LAZY_TILE * LazyBlockTile(LAZY_BLOCK * view, uint32_t tileIndex)
+{
+	int32_t i;
+	int32_t ch;
+	int16_t overflow;
+	uint32_t count;
+	LAZY_TILE * tile = &view->tiles[0];
+	PICO_STATUS status;
+
+	view->useCounter++;
+
+	for (i = 0; i < LAZY_MAX_TILES; i++)
+	{
+		if (view->tiles[i].index == (int64_t) tileIndex)
+		{
+			view->tiles[i].lastUsed = view->useCounter;
+			view->hits++;
+			return &view->tiles[i];
+		}
+
+		// Empty slots have lastUsed 0 so are always chosen first
+		if (view->tiles[i].lastUsed < tile->lastUsed)
+		{
+			tile = &view->tiles[i];
+		}
+	}
+
+	tile->index = -1;
+
+	for (ch = 0; ch < view->unit->channelCount; ch++)
+	{
+		if (view->unit->channelSettings[ch].enabled)
+		{
+			status = ps6000SetDataBuffer(view->unit->handle, (PS6000_CHANNEL) ch, tile->buffers[ch], LAZY_TILE_SIZE, PS6000_RATIO_MODE_NONE);
+		}
+	}
+
+	count = min(LAZY_TILE_SIZE, view->sampleCount - tileIndex * LAZY_TILE_SIZE);
+	status = ps6000GetValues(view->unit->handle, tileIndex * LAZY_TILE_SIZE, &count, 1, PS6000_RATIO_MODE_NONE, 0, &overflow);
+
+	if (status != PICO_OK)
+	{
+		printf("LazyBlockTile:ps6000GetValues ------ 0x%08lx \n", status);
+		return NULL;
+	}
+
+	tile->index = tileIndex;
+	tile->count = count;
+	tile->lastUsed = view->useCounter;
+	view->misses++;
+	view->samplesRead += count;
+
+	return tile;
+}
+
+/****************************************************************************
+* LazyBlockGetSamples
+*
+* Copies count samples of a channel starting at start into dest, reading
+* only the tiles that are not already cached.
+* Returns the number of samples copied.
+****************************************************************************/
+uint32_t LazyBlockGetSamples(LAZY_BLOCK * view, int32_t ch, uint32_t start, uint32_t count, int16_t * dest)
+{
+	uint32_t copied = 0;
+	uint32_t offset;
+	uint32_t n;
+	LAZY_TILE * tile;
+
+	count = min(count, view->sampleCount - min(start, view->sampleCount));
+
+	while (copied < count)
+	{
+		tile = LazyBlockTile(view, (start + copied) / LAZY_TILE_SIZE);
+		offset = (start + copied) % LAZY_TILE_SIZE;
+
+		// The device may return a short tile, which has nothing at this offset
+		if (tile == NULL || offset >= tile->count)
+		{
+			break;
+		}
+
+		n = min(count - copied, tile->count - offset);
+		memcpy(dest + copied, tile->buffers[ch] + offset, n * sizeof(int16_t));
+		copied += n;
+	}
+
+	return copied;
+}
+
+/****************************************************************************
+* LazyBlockOverview
+*
+* Displays the overview, combining points so that it fits on the screen
+****************************************************************************/
+void LazyBlockOverview(LAZY_BLOCK * view)
+{
+	uint32_t row;
+	uint32_t i;
+	uint32_t first;
+	uint32_t last;
+	int32_t ch;
+	int16_t highest;
+	int16_t lowest;
+	uint32_t pointsPerRow = (view->overviewCount + LAZY_DISPLAY_ROWS - 1) / LAZY_DISPLAY_ROWS;
+
+	printf("\n%12s  ", "Sample");
+
+	for (ch = 0; ch < view->unit->channelCount; ch++)
+	{
+		if (view->unit->channelSettings[ch].enabled)
+		{
+			printf("  Ch%c min     max  ", 'A' + ch);
+		}
+	}
+
+	printf("\n");
+
+	for (row = 0; row * pointsPerRow < view->overviewCount; row++)
+	{
+		first = row * pointsPerRow;
+		last = min(first + pointsPerRow, view->overviewCount);
+
+		printf("%12lu  ", first * view->ratio);
+
+		for (ch = 0; ch < view->unit->channelCount; ch++)
+		{
+			if (view->unit->channelSettings[ch].enabled)
+			{
+				highest = -32768;
+				lowest = 32767;
+
+				for (i = first; i < last; i++)
+				{
+					highest = max(highest, view->overviewMax[ch][i]);
+					lowest = min(lowest, view->overviewMin[ch][i]);
+				}
+
+				printf("  %6d  %6d  ", scaleVoltages ? adc_to_mv(lowest, view->unit->channelSettings[ch].range) : lowest,
+					scaleVoltages ? adc_to_mv(highest, view->unit->channelSettings[ch].range) : highest);
+			}
+		}
+
+		printf("\n");
+	}
+
+	printf("\nValues are in %s\n", (scaleVoltages) ? ("millivolts") : ("ADC Counts"));
+}
+
+/****************************************************************************
+* LazyBlockZoom
+*
+* Measures a range of samples at full resolution and displays the first
+* readings of the range
+****************************************************************************/
+void LazyBlockZoom(LAZY_BLOCK * view)
+{
+	uint32_t start = 0;
+	uint32_t count = 0;
+	uint32_t copied;
+	uint32_t i;
+	int32_t ch;
+	int16_t * samples;
+	int16_t highest;
+	int16_t lowest;
+	double sum;
+
+	printf("Start sample (0 to %lu): ", view->sampleCount - 1);
+	scanf_s("%u", &start);
+	printf("Number of samples: ");
+	scanf_s("%u", &count);
+
+	if (start >= view->sampleCount || count == 0)
+	{
+		printf("Range is outside the capture\n");
+		return;
+	}
+
+	count = min(count, view->sampleCount - start);
+	samples = (int16_t *) calloc(count, sizeof(int16_t));
+
+	if (samples == NULL)
+	{
+		printf("LazyBlockZoom: Cannot allocate %lu samples\n", count);
+		return;
+	}
+
+	printf("\nSamples %lu to %lu (%.2f ns to %.2f ns)\n\n", start, start + count - 1, start * view->timeInterval, (start + count - 1) * view->timeInterval);
+
+	for (ch = 0; ch < view->unit->channelCount; ch++)
+	{
+		if (view->unit->channelSettings[ch].enabled)
+		{
+			copied = LazyBlockGetSamples(view, ch, start, count, samples);
+
+			if (copied == 0)
+			{
+				printf("Channel %c: no samples read\n", 'A' + ch);
+				continue;
+			}
+
+			highest = -32768;
+			lowest = 32767;
+			sum = 0;
+
+			for (i = 0; i < copied; i++)
+			{
+				highest = max(highest, samples[i]);
+				lowest = min(lowest, samples[i]);
+				sum += samples[i];
+			}
+
+			printf("Channel %c: min %6d  max %6d  mean %8.1f %s\n          ", 'A' + ch,
+				scaleVoltages ? adc_to_mv(lowest, view->unit->channelSettings[ch].range) : lowest,
+				scaleVoltages ? adc_to_mv(highest, view->unit->channelSettings[ch].range) : highest,
+				scaleVoltages ? (sum / copied) * inputRanges[view->unit->channelSettings[ch].range] / PS6000_MAX_VALUE : sum / copied,
+				scaleVoltages ? "mV" : "ADC Counts");
+
+			for (i = 0; i < min(copied, 10); i++)
+			{
+				printf("%6d ", scaleVoltages ? adc_to_mv(samples[i], view->unit->channelSettings[ch].range) : samples[i]);
+			}
+
+			printf("\n");
+		}
+	}
+
+	free(samples);
+}
+
+/****************************************************************************
+* LazyBlockFind
+*
+* Finds the first rising crossing of a level on a channel after a given
+* sample. The overview is used to skip every region that cannot contain a
+* crossing, so only the tiles around candidate regions are read from the
+* device.
+****************************************************************************/
+void LazyBlockFind(LAZY_BLOCK * view)
+{
+	int8_t channel[4] = "A";
+	int32_t ch;
+	int32_t levelMv = 0;
+	int16_t level;
+	uint32_t from = 0;
+	uint32_t point;
+	uint32_t start;
+	uint32_t end;
+	uint32_t count;
+	uint32_t i;
+	int16_t * samples;
+
+	printf("Channel: ");
+	scanf_s("%3s", channel, (unsigned) sizeof(channel));
+	ch = toupper(channel[0]) - 'A';
+
+	if (ch < 0 || ch >= view->unit->channelCount || !view->unit->channelSettings[ch].enabled)
+	{
+		printf("Channel not enabled\n");
+		return;
+	}
+
+	printf("Rising through level (mV): ");
+	scanf_s("%d", &levelMv);
+	level = mv_to_adc((int16_t) levelMv, view->unit->channelSettings[ch].range);
+
+	printf("Search from sample: ");
+	scanf_s("%u", &from);
+
+	// The last point also covers any samples left over after the overview
+	samples = (int16_t *) calloc(2 * view->ratio + 1, sizeof(int16_t));
+
+	if (samples == NULL)
+	{
+		printf("LazyBlockFind: Cannot allocate %lu samples\n", 2 * view->ratio + 1);
+		return;
+	}
+
+	for (point = from / view->ratio; point < view->overviewCount; point++)
+	{
+		// A crossing needs a sample below the level followed by one at or above it,
+		// which may straddle the boundary with the previous point
+		if (view->overviewMax[ch][point] < level ||
+			(view->overviewMin[ch][point] >= level && (point == 0 || view->overviewMin[ch][point - 1] >= level)))
+		{
+			continue;
+		}
+
+		start = max(point * view->ratio, from + 1) - 1;
+		end = (point == view->overviewCount - 1) ? view->sampleCount : (point + 1) * view->ratio;
+		count = LazyBlockGetSamples(view, ch, start, end - start, samples);
+
+		for (i = 1; i < count; i++)
+		{
+			if (samples[i - 1] < level && samples[i] >= level)
+			{
+				printf("Crossing at sample %lu (%.2f ns)\n", start + i, (start + i) * view->timeInterval);
+				free(samples);
+				return;
+			}
+		}
+	}
+
+	printf("No crossing found\n");
+	free(samples);
+}
+
+/****************************************************************************
+* CollectBlockLazy
+*  this function demonstrates how to collect a deep block of data and
+*  only read back the parts of it that are looked at
+****************************************************************************/
+void CollectBlockLazy(UNIT * unit)
+{
+	int32_t i;
+	int32_t ch;
+	int32_t timeIndisposed;
+	int16_t overflow;
+	int8_t command = ' ';
+	int16_t allocationFailed = FALSE;
+	uint32_t maxSamples = 0;
+	uint32_t sampleCount = 0;
+	LAZY_BLOCK view;
+	PICO_STATUS status;
+	struct tPwq pulseWidth;
+	struct tTriggerDirections directions;
+
+	memset(&view, 0, sizeof(LAZY_BLOCK));
+	memset(&directions, 0, sizeof(struct tTriggerDirections));
+	memset(&pulseWidth, 0, sizeof(struct tPwq));
+
+	while ((status = ps6000GetTimebase2(unit->handle, timebase, BUFFER_SIZE, &view.timeInterval, oversample, &maxSamples, 0)) != PICO_OK)
+	{
+		timebase++;
+	}
+
+	printf("Collect deep block immediate...\n");
+	printf("Number of samples (up to %lu): ", maxSamples);
+	fflush(stdin);
+	scanf_s("%u", &sampleCount);
+
+	sampleCount = min(sampleCount, maxSamples);
+
+	if (sampleCount == 0)
+	{
+		return;
+	}
+
+	SetDefaults(unit);
+
+	/* Trigger disabled	*/
+	SetTrigger(unit->handle, NULL, 0, NULL, 0, &directions, &pulseWidth, 0, 0, 0);
+
+	g_ready = FALSE;
+
+	status = ps6000RunBlock(unit->handle, 0, sampleCount, timebase, oversample, &timeIndisposed, 0, CallBackBlock, NULL);
+
+	if (status != PICO_OK)
+	{
+		printf("CollectBlockLazy:ps6000RunBlock ------ 0x%08lx \n", status);
+		return;
+	}
+
+	printf("Timebase: %lu  SampleInterval: %.2f ns\n", timebase, view.timeInterval);
+	printf("Waiting for data...Press a key to abort\n");
+
+	while (!g_ready && !_kbhit())
+	{
+		Sleep(0);
+	}
+
+	if (!g_ready)
+	{
+		_getch();
+		ps6000Stop(unit->handle);
+		printf("Data collection aborted\n");
+		return;
+	}
+
+	// Read the aggregated overview only
+	view.unit = unit;
+	view.sampleCount = sampleCount;
+	view.ratio = max(sampleCount / LAZY_OVERVIEW_POINTS, 1);
+	view.overviewCount = (sampleCount + view.ratio - 1) / view.ratio;		// The last point may cover fewer samples
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		if (unit->channelSettings[ch].enabled)
+		{
+			view.overviewMax[ch] = (int16_t *) calloc(view.overviewCount, sizeof(int16_t));
+			view.overviewMin[ch] = (int16_t *) calloc(view.overviewCount, sizeof(int16_t));
+			allocationFailed |= view.overviewMax[ch] == NULL || view.overviewMin[ch] == NULL;
+
+			for (i = 0; i < LAZY_MAX_TILES; i++)
+			{
+				view.tiles[i].buffers[ch] = (int16_t *) calloc(LAZY_TILE_SIZE, sizeof(int16_t));
+				allocationFailed |= view.tiles[i].buffers[ch] == NULL;
+			}
+
+			if (!allocationFailed)
+			{
+				status = ps6000SetDataBuffers(unit->handle, (PS6000_CHANNEL) ch, view.overviewMax[ch], view.overviewMin[ch], view.overviewCount, PS6000_RATIO_MODE_AGGREGATE);
+			}
+		}
+	}
+
+	for (i = 0; i < LAZY_MAX_TILES; i++)
+	{
+		view.tiles[i].index = -1;
+	}
+
+	// Without its buffers the capture is only stopped and freed
+	if (allocationFailed)
+	{
+		printf("CollectBlockLazy: Cannot allocate the overview and tile buffers\n");
+		command = 'X';
+	}
+	else if ((status = ps6000GetValues(unit->handle, 0, &view.overviewCount, view.ratio, PS6000_RATIO_MODE_AGGREGATE, 0, &overflow)) != PICO_OK)
+	{
+		printf("CollectBlockLazy:ps6000GetValues ------ 0x%08lx \n", status);
+		command = 'X';
+	}
+	else
+	{
+		LazyBlockOverview(&view);
+	}
+
+	while (command != 'X')
+	{
+		printf("\nO - Overview   Z - Zoom to samples   F - Find crossing   C - Cache statistics   X - Exit\n");
+		command = toupper(_getch());
+
+		switch (command)
+		{
+			case 'O':
+				LazyBlockOverview(&view);
+				break;
+
+			case 'Z':
+				LazyBlockZoom(&view);
+				break;
+
+			case 'F':
+				LazyBlockFind(&view);
+				break;
+
+			case 'C':
+				printf("Tile cache: %lu hits, %lu misses, %llu of %lu samples per channel read at full resolution\n",
+					view.hits, view.misses, view.samplesRead, view.sampleCount);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	status = ps6000Stop(unit->handle);
+
+	for (ch = 0; ch < unit->channelCount; ch++)
+	{
+		free(view.overviewMax[ch]);
+		free(view.overviewMin[ch]);
+
+		for (i = 0; i < LAZY_MAX_TILES; i++)
+		{
+			free(view.tiles[i].buffers[ch]);
+		}
+	}
+}
+
 /****************************************************************************
 * CollectBlockEts
 *  this function demonstrates how to collect a block of
@@ -2053,6 +2569,7 @@ void MainMenu(UNIT *unit)
 		printf("T - Triggered block                           I - Set timebase\n");
 		printf("E - Collect a block of data using ETS         A - ADC counts/mV\n");
 		printf("R - Collect set of rapid captures\n");
+		printf("L - Deep block, read back on demand\n");
 		printf("S - Immediate streaming\n");
 		printf("W - Triggered streaming\n");
 		printf("G - Signal generator\n");
@@ -2076,6 +2593,10 @@ void MainMenu(UNIT *unit)
 			CollectRapidBlock(unit);
 			break;
 
+		case 'L':
+			CollectBlockLazy(unit);
+			break;
+
 		case 'S':
 			CollectStreamingImmediate(unit);
 			break;
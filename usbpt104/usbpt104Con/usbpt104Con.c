@@ -10,6 +10,8 @@
  * Examples:
  *    How to set up the channels
  *    How to collect data via both USB and ethernet connections
+ *    How to log the readings with their host time to a CSV file
+ *    How to raise threshold alarms on readings as they arrive
  *    How to enable ethernet and set the unit's IP address and port
  *
  *	To build this application:-
@@ -45,6 +47,7 @@
  ******************************************************************************/
 
 #include <stdio.h>
+#include <math.h>
 #ifdef WIN32
 #include <conio.h>
 #include <windows.h>
@@ -59,6 +62,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "libusbpt104-1.0/UsbPT104Api.h"
 
@@ -120,6 +124,7 @@ return (fp>0)?0:-1;
 #endif
 
 #define NUM_CHANNELS 4
+#define DATA_FILE "usbpt104_data.csv"
 
 typedef struct 
 {
@@ -252,11 +257,369 @@ double ApplyScaling(int32_t value, int16_t channel)
 	}
 }
 
+// Wall clock time in ms since the epoch, the common timeline of data from different programs
+int64_t HostTimeMs()
+{
+#ifdef WIN32
+	FILETIME now;
+	ULARGE_INTEGER time;
+
+	GetSystemTimeAsFileTime(&now);
+	time.LowPart = now.dwLowDateTime;
+	time.HighPart = now.dwHighDateTime;
+
+	return (int64_t) (time.QuadPart / 10000) - 11644473600000LL;	// 100 ns units since 1601
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+// Threshold alarms
+//
+// The rule format and how a rule is raised, held and cleared are described
+// under Threshold alarms in ps5000a/ps5000aCon/ps5000aCon.c, and the code
+// below follows it. The rules in usbpt104_alarms.txt are checked against
+// each new reading as soon as UsbPt104GetValue() has returned it, before it
+// is displayed or logged, e.g.
+//
+//   high 1 85.0 80.0 5000
+//   low  2 4.0 5.0
+//
+// Limits are in the units of the channel: degrees C, Ohms or millivolts
+// (per second for a rate). Changes are appended to usbpt104_alarms.log and
+// flushed before the next channel is read. The time from UsbPt104GetValue() returning to the flush
+// is shown when collection stops.
+#define ALARM_RULES_FILE "usbpt104_alarms.txt"
+#define ALARM_LOG_FILE "usbpt104_alarms.log"
+#define ALARM_MAX_RULES 16
+#define ALARM_MAX_LINE 256
+
+typedef enum enAlarmKind
+{
+	ALARM_HIGH,
+	ALARM_LOW,
+	ALARM_RATE
+} ALARM_KIND;
+
+typedef struct
+{
+	ALARM_KIND	kind;
+	int16_t		channel;
+	double		limit;
+	double		clear;
+	double		holdMs;
+	int16_t		raised;
+	int16_t		pending;		// Beyond the limit, waiting out the hold time
+	double		pendingMs;
+	int16_t		havePrevious;
+	double		previous;		// Last reading and its time, for rate rules
+	double		previousMs;
+}AlarmRule;
+
+typedef struct
+{
+	AlarmRule	rules[ALARM_MAX_RULES];
+	int16_t		count;
+	FILE *		log;
+	int64_t		hostStartMs;	// Wall clock at time 0 of the readings
+	uint32_t	raised;
+	uint32_t	cleared;
+	uint32_t	unflushed;		// Changes written since the last flush
+	int64_t		latencyTotalUs;
+	int64_t		latencyMaxUs;
+}AlarmState;
+
+const char * alarmKinds[] = {"high", "low", "rate"};
+AlarmState g_alarms;
+
+// Monotonic time in microseconds, to time alarms
+int64_t AlarmNowUs()
+{
+#ifdef WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (int64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 + (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+// Reads the rules and opens the alarm log, returns the number of rules
+int32_t AlarmLoad(int64_t hostStartMs)
+{
+	FILE * fp = NULL;
+	AlarmRule * rule;
+	char line[ALARM_MAX_LINE];
+	char kind[16];
+	int32_t channel;
+	double limit;
+	double clear;
+	double holdMs;
+	int32_t fields;
+	int32_t lineNumber = 0;
+
+	memset(&g_alarms, 0, sizeof(g_alarms));
+	g_alarms.hostStartMs = hostStartMs;
+
+	fopen_s(&fp, ALARM_RULES_FILE, "r");
+
+	if(fp == NULL)
+	{
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineNumber++;
+		holdMs = 0.0;
+
+		if(sscanf(line, "%15s", kind) != 1 || kind[0] == '#')
+		{
+			continue;
+		}
+
+		fields = sscanf(line, "%*s %d %lf %lf %lf", &channel, &limit, &clear, &holdMs);
+
+		if(fields < 3 || holdMs < 0.0)
+		{
+			printf("%s line %d: expected %s <channel> <limit> <clear> [hold ms]\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		if(channel < 1 || channel > NUM_CHANNELS)
+		{
+			printf("%s line %d: no channel %d\n", ALARM_RULES_FILE, lineNumber, channel);
+			continue;
+		}
+
+		if(g_alarms.count == ALARM_MAX_RULES)
+		{
+			printf("%s line %d: only %d rules are allowed\n", ALARM_RULES_FILE, lineNumber, ALARM_MAX_RULES);
+			break;
+		}
+
+		rule = &g_alarms.rules[g_alarms.count];
+
+		if(strcmp(kind, "high") == 0)
+		{
+			rule->kind = ALARM_HIGH;
+		}
+		else if(strcmp(kind, "low") == 0)
+		{
+			rule->kind = ALARM_LOW;
+		}
+		else if(strcmp(kind, "rate") == 0)
+		{
+			rule->kind = ALARM_RATE;
+		}
+		else
+		{
+			printf("%s line %d: unknown rule %s\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		// The clear level has to be on the safe side of the limit
+		if((rule->kind == ALARM_LOW) ? clear < limit : clear > limit)
+		{
+			printf("%s line %d: the clear level is beyond the limit\n", ALARM_RULES_FILE, lineNumber);
+			continue;
+		}
+
+		rule->channel = (int16_t) (channel - 1);
+		rule->limit = limit;
+		rule->clear = clear;
+		rule->holdMs = holdMs;
+		g_alarms.count++;
+	}
+
+	fclose(fp);
+
+	if(g_alarms.count == 0)
+	{
+		return 0;
+	}
+
+	fopen_s(&g_alarms.log, ALARM_LOG_FILE, "a");
+
+	if(g_alarms.log == NULL)
+	{
+		printf("Cannot open %s, alarms are off.\n", ALARM_LOG_FILE);
+		g_alarms.count = 0;
+		return 0;
+	}
+
+	fseek(g_alarms.log, 0, SEEK_END);
+
+	if(ftell(g_alarms.log) == 0)
+	{
+		fprintf(g_alarms.log, "Host time (ms),Channel,Rule,Change,Value,Level\n");
+		fflush(g_alarms.log);
+	}
+
+	printf("%d alarm rules from %s, alarms are appended to %s\n\n", g_alarms.count, ALARM_RULES_FILE, ALARM_LOG_FILE);
+
+	return g_alarms.count;
+}
+
+// Writes a change of state of a rule, to be flushed by AlarmFlush()
+void AlarmReport(AlarmRule * rule, const char * change, double value, double timeMs)
+{
+	fprintf(g_alarms.log, "%lld,%d,%s,%s,%.6g,%.6g\n",
+		(long long) (g_alarms.hostStartMs + (int64_t) timeMs),
+		rule->channel + 1,
+		alarmKinds[rule->kind],
+		change,
+		value,
+		rule->raised ? rule->limit : rule->clear);
+
+	if(rule->raised)
+	{
+		g_alarms.raised++;
+	}
+	else
+	{
+		g_alarms.cleared++;
+	}
+
+	g_alarms.unflushed++;
+}
+
+// Takes one reading of the channel of a rule, at timeMs, through the rule
+void AlarmEvaluate(AlarmRule * rule, double value, double timeMs)
+{
+	double measured = value;
+	int16_t beyond;
+	int16_t within;
+
+	if(rule->kind == ALARM_RATE)
+	{
+		if(!rule->havePrevious || timeMs <= rule->previousMs)
+		{
+			rule->havePrevious = TRUE;
+			rule->previous = value;
+			rule->previousMs = timeMs;
+			return;
+		}
+
+		measured = fabs(value - rule->previous) * 1000.0 / (timeMs - rule->previousMs);
+		rule->previous = value;
+		rule->previousMs = timeMs;
+	}
+
+	if(rule->kind == ALARM_LOW)
+	{
+		beyond = measured < rule->limit;
+		within = measured > rule->clear;
+	}
+	else
+	{
+		beyond = measured > rule->limit;
+		within = measured < rule->clear;
+	}
+
+	if(rule->raised)
+	{
+		if(within)
+		{
+			rule->raised = FALSE;
+			rule->pending = FALSE;
+			AlarmReport(rule, "cleared", measured, timeMs);
+		}
+	}
+	else if(!beyond)
+	{
+		rule->pending = FALSE;
+	}
+	else
+	{
+		if(!rule->pending)
+		{
+			rule->pending = TRUE;
+			rule->pendingMs = timeMs;
+		}
+
+		if(timeMs - rule->pendingMs >= rule->holdMs)
+		{
+			rule->raised = TRUE;
+			AlarmReport(rule, "raised", measured, timeMs);
+		}
+	}
+}
+
+// Takes a new reading of a channel through all of its rules and flushes any changes
+void AlarmReading(int16_t channel, double value, double timeMs, int64_t arrivalUs)
+{
+	int16_t r;
+	int64_t latencyUs;
+
+	for(r = 0; r < g_alarms.count; r++)
+	{
+		if(g_alarms.rules[r].channel == channel)
+		{
+			AlarmEvaluate(&g_alarms.rules[r], value, timeMs);
+		}
+	}
+
+	if(g_alarms.unflushed == 0)
+	{
+		return;
+	}
+
+	fflush(g_alarms.log);
+
+	latencyUs = AlarmNowUs() - arrivalUs;
+	g_alarms.latencyTotalUs += latencyUs * g_alarms.unflushed;
+	g_alarms.latencyMaxUs = max(g_alarms.latencyMaxUs, latencyUs);
+
+	printf("%u alarm changes written to %s\n", g_alarms.unflushed, ALARM_LOG_FILE);
+	g_alarms.unflushed = 0;
+}
+
+// Closes the alarm log and shows how quickly alarms were written
+void AlarmClose()
+{
+	uint32_t changes = g_alarms.raised + g_alarms.cleared;
+
+	if(g_alarms.count == 0)
+	{
+		return;
+	}
+
+	fclose(g_alarms.log);
+	g_alarms.count = 0;
+
+	if(changes)
+	{
+		printf("\n%u alarms raised and %u cleared, written %.0f us on average and at most %lld us after UsbPt104GetValue() returned\n",
+			g_alarms.raised, g_alarms.cleared, (double) g_alarms.latencyTotalUs / changes, (long long) g_alarms.latencyMaxUs);
+	}
+	else
+	{
+		printf("\nNo alarms raised\n");
+	}
+}
+
+// Readings are also written to DATA_FILE, each with the host time it was read at,
+// and checked against any alarm rules
 void CollectData()
 {
 	int16_t channel;
 	int32_t values[NUM_CHANNELS];
 	double scaledValues[NUM_CHANNELS];
+	int64_t hostTimeMs;
+	int64_t startMs;
+	int64_t arrivalUs;
+	FILE * fp = NULL;
 
 	g_status = PICO_OK;
 
@@ -292,6 +655,21 @@ void CollectData()
 	printf("Press any key to start.\n\n");
 	_getch();
 
+	fopen_s(&fp, DATA_FILE, "w");
+
+	if(fp == NULL)
+	{
+		printf("Cannot open %s, readings are not logged.\n\n", DATA_FILE);
+	}
+	else
+	{
+		fprintf(fp, "Host time (ms),Ch1,Ch2,Ch3,Ch4\n");
+		printf("Readings are logged to %s\n\n", DATA_FILE);
+	}
+
+	startMs = HostTimeMs();
+	AlarmLoad(startMs);
+
 	printf("Press any key to stop data collection...\n\n");
 
 	for(channel = 0; channel < NUM_CHANNELS; channel++)
@@ -306,9 +684,12 @@ void CollectData()
 
 	while(!_kbhit() && (g_status == PICO_OK || g_status == PICO_NO_SAMPLES_AVAILABLE || g_status == PICO_WARNING_REPEAT_VALUE))
 	{
+		hostTimeMs = HostTimeMs();
+
 		for(channel = 0; channel < NUM_CHANNELS && (g_status == PICO_OK || g_status == PICO_NO_SAMPLES_AVAILABLE); channel++)
 		{
 			g_status = UsbPt104GetValue(g_handle, (USBPT104_CHANNELS) (channel + 1), &values[channel], 0);
+			arrivalUs = AlarmNowUs();
 				
 			if(g_status == PICO_NO_SAMPLES_AVAILABLE) 
 			{
@@ -316,12 +697,32 @@ void CollectData()
 			}
 
 			scaledValues[channel] = ApplyScaling(values[channel], channel);
+
+			// Only a new reading can change an alarm
+			if(g_alarms.count && g_status == PICO_OK)
+			{
+				AlarmReading(channel, scaledValues[channel], (double) (hostTimeMs - startMs), arrivalUs);
+			}
 		}
 
 		printf("%.4f\t\t%.4f\t\t%.4f\t\t%.4f\n", scaledValues[0], scaledValues[1], scaledValues[2], scaledValues[3]);
+
+		if(fp != NULL)
+		{
+			fprintf(fp, "%lld,%.6f,%.6f,%.6f,%.6f\n", (long long) hostTimeMs, scaledValues[0], scaledValues[1], scaledValues[2], scaledValues[3]);
+			fflush(fp);
+		}
+
 		Sleep(2280); // Allow time for collection of data from all 4 channels
 	}
 		
+	if(fp != NULL)
+	{
+		fclose(fp);
+	}
+
+	AlarmClose();
+
 	if(g_status != PICO_OK && g_status != PICO_NO_SAMPLES_AVAILABLE)
 	{
 		printf("\n\nGetValue: Status = 0x%X\nPress any key", g_status);
@@ -10,6 +10,8 @@
  * Examples:
  *    Collect a single reading from each channel
  *    Collect readings continuously from each channel
+ *    Collect readings at an interval that follows the temperatures
+ *    Raise threshold alarms on readings as they arrive
  *
  * To build this application:-
  *
@@ -43,11 +45,13 @@
  *
  ******************************************************************************/
 #include <stdio.h>
+#include <math.h>
 
 /* Headers for Windows */
 #ifdef _WIN32
 #include "windows.h"
 #include <conio.h>
+#include <string.h>
 #include "usbtc08.h"
 #else
 #include <sys/types.h>
@@ -58,6 +62,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
 
 #include <libusbtc08-1.8/usbtc08.h>
 
@@ -126,6 +131,725 @@ int32_t fopen_s(FILE ** a, const char * b, const char * c)
 
 #define BUFFER_SIZE 1000	// Buffer size to be used for streaming mode captures
 
+/******************************************************************************
+ * Adaptive sampling
+ *
+ * For long unattended runs the sampling interval follows the temperatures.
+ * Each reading is compared with the one before it on every thermocouple. A
+ * step larger than the deadband sends the unit straight to its minimum
+ * interval, and once ADAPTIVE_CALM_READINGS readings in a row would have
+ * stayed within half the deadband even at the next slower interval it moves
+ * down one step.
+ *
+ * Changing the interval means stopping and restarting the unit, so a change
+ * is only made while the time spent on them stays below ADAPTIVE_MAX_OVERHEAD
+ * percent of the run.
+ ******************************************************************************/
+#define ADAPTIVE_LEVELS 8
+#define ADAPTIVE_CALM_READINGS 20
+#define ADAPTIVE_MAX_OVERHEAD 5		/* Percent of the time since collection started */
+#define ADAPTIVE_POLL_MS 1000
+
+typedef struct tAdaptiveState
+{
+	int32_t intervals[ADAPTIVE_LEVELS];		/* ms, the first is the unit's minimum */
+	int16_t levels;
+	int16_t level;
+	int16_t active;							/* A step beyond the deadband since the interval was last set */
+	uint32_t calmReadings;
+	uint32_t readings[ADAPTIVE_LEVELS];
+	uint32_t changes;
+	uint32_t deferred;						/* Changes held back by the overhead limit */
+	int64_t startMs;
+	int64_t runStartMs;
+	int64_t hostOffsetMs;					/* Wall clock less adaptive_now_ms() at the start */
+	int64_t reconfigureMs;					/* Total time spent changing the interval */
+	int64_t lastReconfigureMs;
+	FILE * history;
+} ADAPTIVE_STATE;
+
+int64_t adaptive_now_ms(void)
+{
+#ifdef _WIN32
+	return (int64_t) GetTickCount64();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/* Wall clock time in ms since the epoch, the common timeline of data from different programs */
+int64_t host_time_ms(void)
+{
+#ifdef _WIN32
+	FILETIME now;
+	ULARGE_INTEGER time;
+
+	GetSystemTimeAsFileTime(&now);
+	time.LowPart = now.dwLowDateTime;
+	time.HighPart = now.dwHighDateTime;
+
+	return (int64_t) (time.QuadPart / 10000) - 11644473600000LL;	/* 100 ns units since 1601 */
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/* Restarts the unit at the interval of a level and records the change in the rate history */
+int32_t adaptive_set_level(int16_t handle, ADAPTIVE_STATE * state, int16_t level, const char * reason)
+{
+	int64_t startMs = adaptive_now_ms();
+
+	if (state->runStartMs)
+	{
+		usb_tc08_stop(handle);
+	}
+
+	if (!usb_tc08_run(handle, state->intervals[level]))
+	{
+		return 0;
+	}
+
+	state->runStartMs = adaptive_now_ms();
+	state->lastReconfigureMs = state->runStartMs - startMs;
+	state->level = level;
+	state->active = FALSE;
+	state->calmReadings = 0;
+
+	if (strcmp(reason, "start") != 0)
+	{
+		state->reconfigureMs += state->lastReconfigureMs;
+		state->changes++;
+	}
+
+	fprintf(state->history, "%lld,%d,%s,%lld\n",
+		(long long) (state->runStartMs - state->startMs),
+		state->intervals[level],
+		reason,
+		(long long) state->lastReconfigureMs);
+	fflush(state->history);
+
+	printf("%8.1f s: %6d ms interval (%s)\n", (state->runStartMs - state->startMs) / 1000.0, state->intervals[level], reason);
+
+	return 1;
+}
+
+/******************************************************************************
+ * Threshold alarms
+ *
+ * The rule format and how a rule is raised, held and cleared are described
+ * under Threshold alarms in ps5000a/ps5000aCon/ps5000aCon.c, and the code
+ * below follows it. During adaptive collection, the rules in
+ * usbtc08_alarms.txt are checked against each reading as soon as
+ * usb_tc08_get_temp() has returned it, before it is written to the CSV
+ * file, e.g.
+ *
+ *   high 1 85.0 80.0 5000
+ *   low  2 4.0 5.0
+ *   rate 3 0.5 0.2 10000
+ *
+ * Channel 0 is the cold junction, and limits are in degrees C (per second
+ * for a rate). An open thermocouple reads as NaN, which never changes an
+ * alarm.
+ *
+ * Changes are appended to usbtc08_alarms.log and flushed together once the
+ * readings of a poll have been checked. While there are rules, the
+ * unit is polled at its sampling interval, up to ADAPTIVE_POLL_MS, so that a
+ * reading is never held in the driver for longer than that. The time from
+ * usb_tc08_get_temp() returning to the flush, and the age of the reading
+ * at the flush, are shown at the end of the run.
+ ******************************************************************************/
+#define ALARM_RULES_FILE "usbtc08_alarms.txt"
+#define ALARM_LOG_FILE "usbtc08_alarms.log"
+#define ALARM_MAX_RULES 16
+#define ALARM_MAX_LINE 256
+
+typedef enum enAlarmKind
+{
+	ALARM_HIGH,
+	ALARM_LOW,
+	ALARM_RATE
+} ALARM_KIND;
+
+const char * alarm_kinds[] = {"high", "low", "rate"};
+
+typedef struct tAlarmRule
+{
+	ALARM_KIND kind;
+	int16_t channel;
+	double limit;
+	double clear;
+	double holdMs;
+	int16_t raised;
+	int16_t pending;						/* Beyond the limit, waiting out the hold time */
+	double pendingMs;
+	int16_t havePrevious;
+	double previous;						/* Last reading and its time, for rate rules */
+	double previousMs;
+} ALARM_RULE;
+
+typedef struct tAlarmState
+{
+	ALARM_RULE rules[ALARM_MAX_RULES];
+	int16_t count;
+	FILE * log;
+	int64_t startMs;						/* adaptive_now_ms() at time 0 of the readings */
+	int64_t hostStartMs;					/* The same moment on the wall clock */
+	uint32_t raised;
+	uint32_t cleared;
+	uint32_t unflushed;						/* Changes written since the last flush */
+	double oldestMs;						/* Time of the oldest of them */
+	int64_t latencyTotalUs;
+	int64_t latencyMaxUs;
+	int64_t ageMaxMs;
+} ALARM_STATE;
+
+/* Monotonic time in microseconds, to time alarms */
+int64_t alarm_now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (int64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 + (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+/* Reads the rules and opens the alarm log, returns the number of rules */
+int32_t alarm_load(ALARM_STATE * alarms)
+{
+	FILE * fp = NULL;
+	ALARM_RULE * rule;
+	char line[ALARM_MAX_LINE];
+	char kind[16];
+	int32_t channel;
+	double limit;
+	double clear;
+	double holdMs;
+	int32_t fields;
+	int32_t lineNumber = 0;
+
+	memset(alarms, 0, sizeof(ALARM_STATE));
+
+	fopen_s(&fp, ALARM_RULES_FILE, "r");
+
+	if (fp == NULL)
+	{
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineNumber++;
+		holdMs = 0.0;
+
+		if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#')
+		{
+			continue;
+		}
+
+		fields = sscanf(line, "%*s %d %lf %lf %lf", &channel, &limit, &clear, &holdMs);
+
+		if (fields < 3 || holdMs < 0.0)
+		{
+			printf("%s line %d: expected %s <channel> <limit> <clear> [hold ms]\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		if (channel < USBTC08_CHANNEL_CJC || channel > USBTC08_MAX_CHANNELS)
+		{
+			printf("%s line %d: no channel %d\n", ALARM_RULES_FILE, lineNumber, channel);
+			continue;
+		}
+
+		if (alarms->count == ALARM_MAX_RULES)
+		{
+			printf("%s line %d: only %d rules are allowed\n", ALARM_RULES_FILE, lineNumber, ALARM_MAX_RULES);
+			break;
+		}
+
+		rule = &alarms->rules[alarms->count];
+
+		if (strcmp(kind, "high") == 0)
+		{
+			rule->kind = ALARM_HIGH;
+		}
+		else if (strcmp(kind, "low") == 0)
+		{
+			rule->kind = ALARM_LOW;
+		}
+		else if (strcmp(kind, "rate") == 0)
+		{
+			rule->kind = ALARM_RATE;
+		}
+		else
+		{
+			printf("%s line %d: unknown rule %s\n", ALARM_RULES_FILE, lineNumber, kind);
+			continue;
+		}
+
+		/* The clear level has to be on the safe side of the limit */
+		if ((rule->kind == ALARM_LOW) ? clear < limit : clear > limit)
+		{
+			printf("%s line %d: the clear level is beyond the limit\n", ALARM_RULES_FILE, lineNumber);
+			continue;
+		}
+
+		rule->channel = (int16_t) channel;
+		rule->limit = limit;
+		rule->clear = clear;
+		rule->holdMs = holdMs;
+		alarms->count++;
+	}
+
+	fclose(fp);
+
+	if (alarms->count == 0)
+	{
+		return 0;
+	}
+
+	fopen_s(&alarms->log, ALARM_LOG_FILE, "a");
+
+	if (alarms->log == NULL)
+	{
+		printf("Cannot open %s, alarms are off.\n", ALARM_LOG_FILE);
+		alarms->count = 0;
+		return 0;
+	}
+
+	fseek(alarms->log, 0, SEEK_END);
+
+	if (ftell(alarms->log) == 0)
+	{
+		fprintf(alarms->log, "Host time (ms),Channel,Rule,Change,Value,Level\n");
+		fflush(alarms->log);
+	}
+
+	printf("%d alarm rules from %s, alarms are appended to %s\n", alarms->count, ALARM_RULES_FILE, ALARM_LOG_FILE);
+
+	return alarms->count;
+}
+
+/* Writes a change of state of a rule, to be flushed by alarm_flush() */
+void alarm_report(ALARM_STATE * alarms, ALARM_RULE * rule, const char * change, double value, double timeMs)
+{
+	fprintf(alarms->log, "%lld,%d,%s,%s,%.6g,%.6g\n",
+		(long long) (alarms->hostStartMs + (int64_t) timeMs),
+		rule->channel,
+		alarm_kinds[rule->kind],
+		change,
+		value,
+		rule->raised ? rule->limit : rule->clear);
+
+	if (rule->raised)
+	{
+		alarms->raised++;
+	}
+	else
+	{
+		alarms->cleared++;
+	}
+
+	if (alarms->unflushed++ == 0)
+	{
+		alarms->oldestMs = timeMs;
+	}
+}
+
+/* Takes one reading of the channel of a rule, at timeMs, through the rule */
+void alarm_evaluate(ALARM_STATE * alarms, ALARM_RULE * rule, double value, double timeMs)
+{
+	double measured = value;
+	int16_t beyond;
+	int16_t within;
+
+	if (rule->kind == ALARM_RATE)
+	{
+		if (!rule->havePrevious || timeMs <= rule->previousMs)
+		{
+			rule->havePrevious = TRUE;
+			rule->previous = value;
+			rule->previousMs = timeMs;
+			return;
+		}
+
+		measured = fabs(value - rule->previous) * 1000.0 / (timeMs - rule->previousMs);
+		rule->previous = value;
+		rule->previousMs = timeMs;
+	}
+
+	if (rule->kind == ALARM_LOW)
+	{
+		beyond = measured < rule->limit;
+		within = measured > rule->clear;
+	}
+	else
+	{
+		beyond = measured > rule->limit;
+		within = measured < rule->clear;
+	}
+
+	if (rule->raised)
+	{
+		if (within)
+		{
+			rule->raised = FALSE;
+			rule->pending = FALSE;
+			alarm_report(alarms, rule, "cleared", measured, timeMs);
+		}
+	}
+	else if (!beyond)
+	{
+		rule->pending = FALSE;
+	}
+	else
+	{
+		if (!rule->pending)
+		{
+			rule->pending = TRUE;
+			rule->pendingMs = timeMs;
+		}
+
+		if (timeMs - rule->pendingMs >= rule->holdMs)
+		{
+			rule->raised = TRUE;
+			alarm_report(alarms, rule, "raised", measured, timeMs);
+		}
+	}
+}
+
+/* Flushes the changes written since the last call and times them */
+void alarm_flush(ALARM_STATE * alarms, int64_t arrivalUs)
+{
+	int64_t latencyUs;
+	int64_t ageMs;
+
+	if (alarms->unflushed == 0)
+	{
+		return;
+	}
+
+	fflush(alarms->log);
+
+	latencyUs = alarm_now_us() - arrivalUs;
+	ageMs = adaptive_now_ms() - alarms->startMs - (int64_t) alarms->oldestMs;
+	alarms->latencyTotalUs += latencyUs * alarms->unflushed;
+	alarms->latencyMaxUs = max(alarms->latencyMaxUs, latencyUs);
+	alarms->ageMaxMs = max(alarms->ageMaxMs, ageMs);
+
+	printf("%u alarm changes written to %s\n", alarms->unflushed, ALARM_LOG_FILE);
+	alarms->unflushed = 0;
+}
+
+/* Closes the alarm log and shows how quickly alarms were written */
+void alarm_close(ALARM_STATE * alarms)
+{
+	uint32_t changes = alarms->raised + alarms->cleared;
+
+	if (alarms->count == 0)
+	{
+		return;
+	}
+
+	fclose(alarms->log);
+	alarms->count = 0;
+
+	if (changes)
+	{
+		printf("%u alarms raised and %u cleared, written %.0f us on average and at most %lld us after usb_tc08_get_temp() returned,\n",
+			alarms->raised, alarms->cleared, (double) alarms->latencyTotalUs / changes, (long long) alarms->latencyMaxUs);
+		printf("and at most %lld ms after the reading was taken\n", (long long) alarms->ageMaxMs);
+	}
+	else
+	{
+		printf("No alarms raised\n");
+	}
+}
+
+/******************************************************************************
+ * collect_adaptive
+ *
+ * Streams all channels with a sampling interval that follows the activity of
+ * the temperatures. The readings are written to usbtc08_adaptive.csv, each
+ * with its time and the interval it was taken at, and every change of
+ * interval is written to usbtc08_rates.csv with its reason.
+ *
+ * The first column is the host time of each reading: its time on the unit
+ * from the start of the run, added to the wall clock at the start. Clock
+ * changes during a run do not move it, and it lines the readings up with
+ * captures from other programs on the same computer.
+ *
+ * Readings are checked against any alarm rules as they arrive.
+ ******************************************************************************/
+int32_t collect_adaptive(int16_t handle)
+{
+	static float temps[USBTC08_MAX_CHANNELS + 1][BUFFER_SIZE];
+	static int32_t times[BUFFER_SIZE];
+	static int32_t scratch[BUFFER_SIZE];
+	int32_t ladder[ADAPTIVE_LEVELS - 1] = {1000, 2000, 5000, 10000, 20000, 30000, 60000};	/* ms */
+	int16_t overflow = 0;
+	int32_t channel;
+	int32_t reading;
+	int32_t collected;
+	int32_t readings;
+	int32_t held[USBTC08_MAX_CHANNELS + 1];
+	int32_t minimumIntervalMs;
+	int32_t pollMs;
+	int16_t level;
+	int16_t havePrevious = FALSE;
+	float previous[USBTC08_MAX_CHANNELS + 1];
+	float deadband = 0.0f;
+	float step;
+	float largest;
+	int64_t elapsedMs;
+	uint32_t total = 0;
+	const char * reason;
+	ADAPTIVE_STATE state;
+	ALARM_STATE alarms;
+	int16_t rule;
+	int64_t arrivalUs;
+	FILE * fp;
+
+	printf("Deadband between successive readings (C):\n");
+	scanf_s("%f", &deadband);
+
+	memset(&state, 0, sizeof(state));
+	memset(held, 0, sizeof(held));
+
+	/* Slower intervals than the unit's minimum, in steps */
+	minimumIntervalMs = usb_tc08_get_minimum_interval_ms(handle);
+	state.intervals[state.levels++] = minimumIntervalMs;
+
+	for (level = 0; level < ADAPTIVE_LEVELS - 1; level++)
+	{
+		if (ladder[level] > minimumIntervalMs)
+		{
+			state.intervals[state.levels++] = ladder[level];
+		}
+	}
+
+	fopen_s(&fp, "usbtc08_adaptive.csv", "w");
+	fopen_s(&state.history, "usbtc08_rates.csv", "w");
+
+	if (fp == NULL || state.history == NULL)
+	{
+		printf("Error opening output files.\n");
+
+		if (fp != NULL)
+		{
+			fclose(fp);
+		}
+
+		if (state.history != NULL)
+		{
+			fclose(state.history);
+		}
+
+		return 0;
+	}
+
+	fprintf(fp, "Host time (ms),Time (ms),Interval (ms),CJC,Ch1,Ch2,Ch3,Ch4,Ch5,Ch6,Ch7,Ch8\n");
+	fprintf(state.history, "Time (ms),Interval (ms),Reason,Reconfiguration (ms)\n");
+
+	printf("Data is written to usbtc08_adaptive.csv and usbtc08_rates.csv\n");
+	alarm_load(&alarms);
+	printf("Press any key to stop data collection.\n\n");
+
+	state.startMs = adaptive_now_ms();
+	state.hostOffsetMs = host_time_ms() - state.startMs;
+	alarms.startMs = state.startMs;
+	alarms.hostStartMs = state.hostOffsetMs + state.startMs;
+
+	if (!adaptive_set_level(handle, &state, 0, "start"))
+	{
+		printf("\n\nError starting the unit.\n");
+		fclose(fp);
+		fclose(state.history);
+		alarm_close(&alarms);
+		return 0;
+	}
+
+	while (!_kbhit())
+	{
+		/* Alarms should not wait for readings held in the driver */
+		pollMs = alarms.count ? min(ADAPTIVE_POLL_MS, state.intervals[state.level]) : ADAPTIVE_POLL_MS;
+		Sleep(pollMs);
+
+		readings = BUFFER_SIZE;
+
+		/* A channel can return more readings than the others; they are held after its
+		 * earlier ones until the other channels catch up, so a row is always one sample */
+		for (channel = 0; channel < (USBTC08_MAX_CHANNELS + 1); channel++)
+		{
+			// Request temperature data, a negative value indicates an error
+			collected = usb_tc08_get_temp(handle, temps[channel] + held[channel], channel ? scratch : times + held[channel], BUFFER_SIZE - held[channel],
+				&overflow, channel, USBTC08_UNITS_CENTIGRADE, 1);
+
+			/* Must check for errors (e.g. device could be unplugged) */
+			if (collected < 0)
+			{
+				printf("\n\nError while streaming.\n");
+				usb_tc08_stop(handle);
+				fclose(fp);
+				fclose(state.history);
+				alarm_close(&alarms);
+				return 0;
+			}
+
+			held[channel] += collected;
+			readings = min(readings, held[channel]);
+		}
+
+		/* Alarms first, so that they do not wait for the readings to be written */
+		if (alarms.count)
+		{
+			arrivalUs = alarm_now_us();
+
+			for (reading = 0; reading < readings; reading++)
+			{
+				for (rule = 0; rule < alarms.count; rule++)
+				{
+					alarm_evaluate(&alarms, &alarms.rules[rule], temps[alarms.rules[rule].channel][reading],
+						(double) (state.runStartMs - state.startMs + times[reading]));
+				}
+			}
+
+			alarm_flush(&alarms, arrivalUs);
+		}
+
+		for (reading = 0; reading < readings; reading++)
+		{
+			fprintf(fp, "%lld,%lld,%d",
+				(long long) (state.hostOffsetMs + state.runStartMs + times[reading]),
+				(long long) (state.runStartMs - state.startMs) + times[reading],
+				state.intervals[state.level]);
+
+			largest = 0.0f;
+
+			for (channel = 0; channel < USBTC08_MAX_CHANNELS + 1; channel++)
+			{
+				fprintf(fp, ",%.2f", temps[channel][reading]);
+
+				/* An open thermocouple reads as NaN, which never counts as a step */
+				step = temps[channel][reading] - previous[channel];
+				step = step < 0.0f ? -step : step;
+
+				if (havePrevious && channel != USBTC08_CHANNEL_CJC && step > largest)
+				{
+					largest = step;
+				}
+
+				previous[channel] = temps[channel][reading];
+			}
+
+			fprintf(fp, "\n");
+			havePrevious = TRUE;
+
+			if (largest > deadband)
+			{
+				state.active = TRUE;
+				state.calmReadings = 0;
+			}
+			else if (state.level == state.levels - 1 ||
+				largest * state.intervals[state.level + 1] * 2 <= deadband * state.intervals[state.level])
+			{
+				state.calmReadings++;
+			}
+			else
+			{
+				state.calmReadings = 0;
+			}
+		}
+
+		fflush(fp);
+		state.readings[state.level] += (uint32_t) readings;
+
+		/* Keep the readings of channels that are ahead for the next poll */
+		for (channel = 0; channel < USBTC08_MAX_CHANNELS + 1; channel++)
+		{
+			held[channel] -= readings;
+			memmove(temps[channel], temps[channel] + readings, held[channel] * sizeof(float));
+		}
+
+		memmove(times, times + readings, held[USBTC08_CHANNEL_CJC] * sizeof(int32_t));
+
+		/* Straight to the minimum interval on activity, one step slower after a calm spell */
+		level = state.level;
+		reason = NULL;
+
+		if (state.active && state.level > 0)
+		{
+			level = 0;
+			reason = "activity";
+		}
+		else if (state.calmReadings >= ADAPTIVE_CALM_READINGS && state.level < state.levels - 1)
+		{
+			level = state.level + 1;
+			reason = "steady";
+		}
+		else
+		{
+			state.active = FALSE;
+		}
+
+		elapsedMs = adaptive_now_ms() - state.startMs;
+
+		if (reason != NULL && (state.reconfigureMs + state.lastReconfigureMs) * 100 > ADAPTIVE_MAX_OVERHEAD * elapsedMs)
+		{
+			state.deferred++;
+			reason = NULL;
+		}
+
+		if (reason != NULL && !adaptive_set_level(handle, &state, level, reason))
+		{
+			printf("\n\nError changing the interval.\n");
+			break;
+		}
+
+		/* A new run starts from an empty buffer, so readings held from the last one have no partners */
+		if (reason != NULL)
+		{
+			memset(held, 0, sizeof(held));
+		}
+	}
+
+	usb_tc08_stop(handle);
+	fclose(fp);
+	fclose(state.history);
+	alarm_close(&alarms);
+
+	elapsedMs = adaptive_now_ms() - state.startMs;
+
+	printf("\nInterval (ms)  Readings\n");
+
+	for (level = 0; level < state.levels; level++)
+	{
+		printf("%13d  %8u\n", state.intervals[level], state.readings[level]);
+		total += state.readings[level];
+	}
+
+	printf("\n%u readings in %.1f s, against %lld at a fixed %d ms interval\n",
+		total, elapsedMs / 1000.0, (long long) elapsedMs / state.intervals[0], state.intervals[0]);
+	printf("%u interval changes took %.1f%% of the time, %u were held back\n",
+		state.changes, elapsedMs ? state.reconfigureMs * 100.0 / elapsedMs : 0.0, state.deferred);
+
+	return 1;
+}
+
 int32_t main(void)
 {
 	int16_t handle = 0;									/* The handle to a TC-08 returned by usb_tc08_open_unit() or usb_tc08_open_unit_progress() */
@@ -229,6 +953,7 @@ int32_t main(void)
 		printf("------------------------------------------------------------\n\n");
 		printf("S - Single reading on all channels\n");
 		printf("C - Continuous reading on all channels\n");
+		printf("A - Adaptive continuous reading on all channels\n");
 		printf("X - Close the USB TC08 and exit \n");
 		
 		while (0 == scanf_s(" %c", &selection, 1))
@@ -326,6 +1051,12 @@ int32_t main(void)
 
 				usb_tc08_stop(handle);
 				break;
+
+			case 'A':
+			case 'a': /* Streaming with an adaptive interval */
+				printf("Entering adaptive streaming mode.\n");
+				collect_adaptive(handle);
+				break;
 		}
 		
 	} while (selection != 'X' && selection != 'x');